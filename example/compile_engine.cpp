@@ -0,0 +1,69 @@
+/*
+ * This compiles an ONNX model into an engine file, from which the examples
+ * load the model without parsing or transforming its weights (see
+ * `--engine_path`).
+ */
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "../external/cmdline.h"
+
+#include "../inference_engine/engine.hpp"
+#include "../inference_engine/onnx.hpp"
+#include "../inference_engine/session.hpp"
+
+int main(int argc, char **argv) {
+  cmdline::parser a;
+  a.add<std::string>("model_path", 'm',
+                     "The file path of the ONNX model to compile", true);
+  a.add<std::string>("engine_path", 'e',
+                     "The file path of the engine file to write", true);
+  a.add<std::string>("layout", 'l',
+                     "The layout of activations between Conv, Relu and "
+                     "MaxPool layers",
+                     false, "nchw",
+                     cmdline::oneof<std::string>("nchw", "nchwc"));
+  a.parse_check(argc, argv);
+
+  const std::string model_path = a.get<std::string>("model_path");
+  const std::string engine_path = a.get<std::string>("engine_path");
+  inference_engine::inferer::session_options options;
+  options.layout = a.get<std::string>("layout") == "nchwc"
+                       ? inference_engine::inferer::LAYOUT::NCHWc
+                       : inference_engine::inferer::LAYOUT::NCHW;
+
+  try {
+    auto start = std::chrono::steady_clock::now();
+    inference_engine::onnx::mapped_model model =
+        inference_engine::onnx::map_onnx_model_from_file(model_path);
+    inference_engine::inferer::session session(model, options);
+    session.save(engine_path, model_path);
+    auto compiled = std::chrono::steady_clock::now();
+
+    // Loading the engine file is what a later process does instead.
+    inference_engine::inferer::engine_model engine =
+        inference_engine::inferer::map_engine_file(engine_path);
+    inference_engine::inferer::session loaded(engine, options);
+    auto loaded_at = std::chrono::steady_clock::now();
+
+    std::cout << "compiled " << model_path << " into " << engine_path << " ("
+              << engine.model.file->size() / 1024 << " KiB)" << std::endl;
+    std::cout << "compiling and writing: "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     compiled - start)
+                     .count()
+              << " ms, loading: "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     loaded_at - compiled)
+                     .count()
+              << " ms" << std::endl;
+  } catch (std::runtime_error &e) {
+    std::cout << "ERROR: " << e.what() << std::endl;
+    return -1;
+  }
+  return 0;
+}
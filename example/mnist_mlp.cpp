@@ -2,19 +2,19 @@
  * This is an example for MNIST + 3 MLP (Gemm + Relu) model.
  */
 
+#include <functional>
+#include <memory>
 #include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 #include "../external/cmdline.h"
 #include <onnx/onnx_pb.h>
 
-#include "../inference_engine/backend.hpp"
 #include "../inference_engine/image_util.hpp"
 #include "../inference_engine/onnx.hpp"
-
-std::shared_ptr<void> allocate_float_array(long long size) {
-  std::unique_ptr<float[]> u = std::make_unique<float[]>(size);
-  return std::shared_ptr<void>(u.release(), u.get_deleter());
-}
+#include "../inference_engine/session.hpp"
 
 int main(int argc, char **argv) {
   cmdline::parser a;
@@ -25,92 +25,95 @@ int main(int argc, char **argv) {
                      "The file path of the ONNX model which you want to use to "
                      "infer the image",
                      true);
+  a.add<std::string>("engine_path", 'e',
+                     "The file path of an engine file to load the model from, "
+                     "which is written from the ONNX model if it is stale",
+                     false, "");
+  a.footer("[more image paths ...]");
   a.parse_check(argc, argv);
 
-  const std::string image_path = a.get<std::string>("image_path");
+  // The images after the options are inferred in the same batch as
+  // image_path.
+  std::vector<std::string> image_paths = {a.get<std::string>("image_path")};
+  image_paths.insert(image_paths.end(), a.rest().begin(), a.rest().end());
   const std::string model_path = a.get<std::string>("model_path");
+  const std::string engine_path = a.get<std::string>("engine_path");
 
-  cv::Mat image_mat = cv::imread(image_path, cv::IMREAD_COLOR);
-  if (!image_mat.data) {
-    std::cout << "Invalid image: " << image_path << std::endl;
-    return -1;
+  std::vector<cv::Mat> image_mats;
+  for (std::string const &image_path : image_paths) {
+    image_mats.push_back(cv::imread(image_path, cv::IMREAD_COLOR));
+    if (!image_mats.back().data) {
+      std::cout << "Invalid image: " << image_path << std::endl;
+      return -1;
+    }
   }
-
-  ::onnx::ModelProto model;
-  try {
-    model = inference_engine::onnx::load_onnx_model_from_file(model_path);
-  } catch (std::runtime_error e) {
-    std::cout << "ONNX LOAD ERROR: " << e.what() << std::endl;
-    return -1;
+  const long batch = static_cast<long>(image_mats.size());
+
+  // The weights are read from a mapping of the file, not copied. With an
+  // engine file, they are read from its mapping in the layouts of the kernels.
+  inference_engine::onnx::mapped_model model;
+  if (engine_path.empty()) {
+    try {
+      model = inference_engine::onnx::map_onnx_model_from_file(model_path);
+    } catch (std::runtime_error const &e) {
+      std::cout << "ONNX LOAD ERROR: " << e.what() << std::endl;
+      return -1;
+    }
   }
 
-  ::onnx::GraphProto graph = model.graph();
-  std::vector<inference_engine::onnx::node> nodes =
-      inference_engine::onnx::abstract_all_nodes(graph);
-  std::map<std::string, inference_engine::onnx::parameter> table;
-  inference_engine::onnx::abstract_parameter_table(graph, table);
-
+  // The graph is compiled once into an execution plan.
+  inference_engine::inferer::session_options options;
+  options.batch = batch;
+  std::unique_ptr<inference_engine::inferer::session> session;
   try {
-    inference_engine::onnx::initialize_parameter_table(graph, table);
+    if (engine_path.empty()) {
+      session.reset(new inference_engine::inferer::session(model, options));
+    } else {
+      session = inference_engine::inferer::load_session(model_path,
+                                                        engine_path, options);
+    }
   } catch (std::out_of_range e) {
-    std::cout << "out_of_range at initialize_parameter_table: " << e.what()
+    std::cout << "out_of_range at compiling the model: " << e.what()
               << std::endl;
     return -1;
+  } catch (std::runtime_error const &e) {
+    std::cout << "ERROR at compiling the model: " << e.what() << std::endl;
+    return -1;
   }
 
   // convert to 32bit
-  image_mat.convertTo(image_mat, CV_32FC3);
-  std::shared_ptr<void> data =
-      allocate_float_array(image_mat.rows * image_mat.cols);
-  float *image = static_cast<float *>(data.get());
-  inference_engine::image_util::gray_image_to_hw(image_mat, image);
-  table.at(nodes[0].input[0]).data = image;
-
-  long m, n, k;
-  for (inference_engine::onnx::node const &node : nodes) {
-    if (node.op_type == inference_engine::onnx::OP_TYPE::Gemm) {
-      m = table.at(node.input[1]).dims[0];
-      k = table.at(node.input[1]).dims[1];
-      n = table.at(node.input[0]).dims[0];
-
-      if (table.find(node.output[0]) == table.end()) {
-        inference_engine::onnx::add_new_parameter(
-            node.output[0], {n, m}, table.at(node.input[0]).data_type, table);
-      } else {
-        inference_engine::onnx::reset_parameter_data(node.output[0], table);
-      }
-
-      inference_engine::backend::gemm(
-          m, n, k,
-          static_cast<float *>(table.at(node.input[1]).data),  // A
-          static_cast<float *>(table.at(node.input[0]).data),  // B
-          static_cast<float *>(table.at(node.output[0]).data), // C
-          static_cast<float *>(table.at(node.input[2]).data)   // D
-      );
-    } else if (node.op_type == inference_engine::onnx::OP_TYPE::Relu) {
-      m = table.at(node.input[0]).dims[0];
-      n = table.at(node.input[0]).dims[1];
-
-      if (table.find(node.output[0]) == table.end()) {
-        inference_engine::onnx::add_new_parameter(
-            node.output[0], {m, n}, table.at(node.input[0]).data_type, table);
-      } else {
-        inference_engine::onnx::reset_parameter_data(node.output[0], table);
-      }
-
-      inference_engine::backend::relu(
-          m * n, static_cast<float *>(table.at(node.input[0]).data),
-          static_cast<float *>(table.at(node.output[0]).data));
-    } else {
-      std::cout << "not supported operator: " << node.op_type << std::endl;
+  // The images of the batch are the rows of the input.
+  long input = session->tensor_index(session->input_names()[0]);
+  std::vector<long> const &input_dims = session->dims(input);
+  const long pixels = static_cast<long>(
+      std::accumulate(input_dims.begin() + 1, input_dims.end(), 1l,
+                      std::multiplies<long>()));
+  for (long i = 0; i < batch; ++i) {
+    if (image_mats[i].rows * image_mats[i].cols != pixels) {
+      std::cout << "Invalid image size: " << image_paths[i] << std::endl;
       return -1;
     }
+    image_mats[i].convertTo(image_mats[i], CV_32FC3);
+    inference_engine::image_util::gray_image_to_hw(
+        image_mats[i], session->data(input) + i * pixels);
   }
 
-  for (int i = 0; i < 10; ++i) {
-    std::cout << static_cast<float *>(
-                     table.at(graph.output()[0].name()).data)[i]
-              << std::endl;
+  try {
+    session->run();
+  } catch (std::runtime_error const &e) {
+    std::cout << "INFERENCE ERROR: " << e.what() << std::endl;
+    return -1;
+  }
+
+  long output = session->tensor_index(session->output_names()[0]);
+  long classes = session->dims(output).back();
+  for (long n = 0; n < batch; ++n) {
+    if (batch > 1) {
+      std::cout << image_paths[n] << std::endl;
+    }
+    for (long i = 0; i < classes; ++i) {
+      std::cout << session->data(output)[n * classes + i] << std::endl;
+    }
   }
 
   return 0;
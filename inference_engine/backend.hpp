@@ -1,12 +1,106 @@
 #ifndef BACKEND_HPP
 #define BACKEND_HPP
 
+#include <memory>
+
 namespace inference_engine {
 namespace backend {
 
+// The element-wise operations `gemm` applies to C as each output tile is
+// written back, while it is still in registers, instead of in further
+// passes over C:
+//   C = alpha * A * B + beta * C (+ D) + row_bias + column_bias,
+//   then C = max(C, 0) if relu is set
+// float alpha: the scale of the product
+// float beta: the scale of what C holds before. With beta = 0, the default,
+//   C is overwritten and not read, so it needs no zeroing beforehand and
+//   may hold anything, NaN included. beta = 1 accumulates onto C.
+// float *row_bias: one value per row of C, broadcast across its n columns.
+//   It may be null.
+// float *column_bias: one value per column of C, broadcast across its m rows,
+//   like the bias of a fully connected layer whose rows are the batch. It may
+//   be null.
+// bool relu: clamp C at zero
+// The default epilogue writes the product as it is.
+struct gemm_epilogue {
+  float alpha = 1.0f;
+  float beta = 0.0f;
+  const float *row_bias = nullptr;
+  const float *column_bias = nullptr;
+  bool relu = false;
+};
+
+// A GEMM operand packed once into the micro-panels the gemm kernels read, by
+// `pack_gemm_a` or `pack_gemm_b`, so that `gemm_packed` only packs the other
+// operand. Weights are packed this way when a model is loaded.
+// The panels depend on the kernels bound when packing: `gemm_packed` throws
+// std::runtime_error if other kernels are bound by then.
+// long rows/columns: the size of the packed matrix
+// long panel_width: the rows (for A) or columns (for B) of a micro-panel
+// long long size: the number of floats of data
+// data: 64-byte aligned, shared by the copies of this packed_matrix
+struct packed_matrix {
+  long rows = 0;
+  long columns = 0;
+  long panel_width = 0;
+  long long size = 0;
+  std::shared_ptr<float> data;
+};
+
 // Calculate C[m * n] = A[m x k] * B[k * n] + D[m * n]
 void gemm(long m, long n, long k, float *a, float *b, float *c, float *d);
 
+// Calculate C[m * n] = epilogue(A[m x k] * B[k * n])
+// The fully connected layers use this with the bias and Relu of the layer in
+// the epilogue, which makes one pass over the output rather than three.
+void gemm(long m, long n, long k, const float *a, const float *b, float *c,
+          inference_engine::backend::gemm_epilogue const &epilogue);
+
+// Calculate C[m * n] = A[m x k] * B[k * n] + D[m * n] on sub-matrices
+// long lda/ldb/ldc: the distance between two rows of A, B and C
+// float *d: shares the leading dimension ldc with C. It may be null.
+void gemm_strided(long m, long n, long k, const float *a, long lda,
+                  const float *b, long ldb, float *c, long ldc,
+                  const float *d);
+
+// Calculate C[m * n] = epilogue(A[m x k] * B[k * n] + D[m * n]) on
+// sub-matrices. The other arguments are the same as above.
+void gemm_strided(long m, long n, long k, const float *a, long lda,
+                  const float *b, long ldb, float *c, long ldc,
+                  const float *d,
+                  inference_engine::backend::gemm_epilogue const &epilogue);
+
+// Pack A[m x k] as the left operand of `gemm_packed`
+// long lda: the distance between two rows of a
+// bool transpose: a holds the k x m matrix A^T instead
+inference_engine::backend::packed_matrix
+pack_gemm_a(long m, long k, const float *a, long lda, bool transpose);
+
+// Pack B[k x n] as the right operand of `gemm_packed`
+// long ldb: the distance between two rows of b
+// bool transpose: b holds the n x k matrix B^T instead, such as the weights
+//   of a Gemm with transB
+inference_engine::backend::packed_matrix
+pack_gemm_b(long k, long n, const float *b, long ldb, bool transpose);
+
+// Calculate C[m * n] = epilogue(op(A)[m x k] * B[k * n]) with a packed B
+// long lda: the distance between two rows of a
+// bool transpose_a: a holds the k x m matrix A^T and op(A) transposes it back
+void gemm_packed(long m, long n, long k, const float *a, long lda,
+                 bool transpose_a,
+                 inference_engine::backend::packed_matrix const &b, float *c,
+                 long ldc,
+                 inference_engine::backend::gemm_epilogue const &epilogue);
+
+// Calculate C[m * n] = epilogue(A[m x k] * op(B)[k * n]) with a packed A
+// long ldb: the distance between two rows of b
+// bool transpose_b: b holds the n x k matrix B^T and op(B) transposes it back
+void gemm_packed(long m, long n, long k,
+                 inference_engine::backend::packed_matrix const &a,
+                 const float *b, long ldb, bool transpose_b, float *c,
+                 long ldc,
+                 inference_engine::backend::gemm_epilogue const &epilogue);
+
 // Apply Conv
 // long x_h/x_w: the size of height and width of input x
 // long c_in: the size of channel size of input x
@@ -23,9 +117,241 @@ void gemm(long m, long n, long k, float *a, float *b, float *c, float *d);
 // float *b: the bias array with c_out
 // float *y: the output array with c_o * y_h * y_w
 //   where y_h is `floor((x_h - k + 2 * pad) / float(stride)) + 1`
-//   and y_w is `floor((x_w - k + 2 * pad) / float(stride)) + 1`
+//   and y_w is `floor((x_w - k + 2 * pad) / float(stride)) + 1`.
+//   pad is the padding before x, and y_h/y_w imply the padding after it:
+//   they may be computed with another padding after x, as the asymmetric
+//   pads of ONNX give (see `inferer::calculate_conv_matrix_dims`).
+// float beta: y = conv(x) + b + beta * y. With beta = 0, the default, y is
+//   overwritten, with the bias, and not read. beta = 1 accumulates onto y.
 void conv(long c_in, long c_out, long x_h, long x_w, long y_h, long y_w, long k,
-          long pad, long stride, float *x, float *w, float *b, float *y);
+          long pad, long stride, float *x, float *w, float *b, float *y,
+          float beta = 0.0f);
+
+// Apply Conv, Relu and optionally MaxPool in one pass
+// The arguments are the same as `conv`, except:
+// long pool_k/pool_pad/pool_stride: the kernel size, padding and stride of
+//   the MaxPool, or pool_k = 0 for Conv and Relu only
+// long p_h/p_w: the size of height and width of the output, the pooled
+//   y_h/y_w, or y_h/y_w without MaxPool
+// float *y: the output array with c_out * p_h * p_w, which is overwritten
+// The convolution is computed a band of rows at a time into a buffer that
+// stays in cache, and relu'd and pooled from there, so the unpooled output
+// is never written to memory.
+void conv_relu_max_pool(long c_in, long c_out, long x_h, long x_w, long y_h,
+                        long y_w, long k, long pad, long stride, long pool_k,
+                        long pool_pad, long pool_stride, long p_h, long p_w,
+                        float *x, float *w, float *b, float *y);
+
+// The algorithms behind `conv`. Each of them gives the same result up to
+// floating point rounding.
+//   Direct: one dot product per output element
+//   Im2col: lower x into a column matrix and multiply it with `gemm`
+//   Winograd: F(m x m, 3 x 3) minimal filtering, only for 3x3 kernels with
+//     stride 1
+enum CONV_ALGORITHM { Direct, Im2col, Winograd };
+
+// Return the algorithm `conv` uses for a layer of this shape.
+inference_engine::backend::CONV_ALGORITHM
+select_conv_algorithm(long c_in, long c_out, long y_h, long y_w, long k,
+                      long stride);
+
+// The kernel of a conv layer bound to the algorithm `select_conv_algorithm`
+// gives for its shape, such as when a model is compiled, so that the layer
+// runs without looking the algorithm or its kernel up.
+// algorithm: the algorithm of the layer
+// long m: the Winograd tile size
+// const float *w: the kernel as `conv` takes it
+// const float *u: the transformed kernel of Winograd layers, or null
+// packed_w: the packed kernel of Im2col layers, or null
+struct conv_kernel {
+  inference_engine::backend::CONV_ALGORITHM algorithm;
+  long m;
+  const float *w;
+  const float *u;
+  const inference_engine::backend::packed_matrix *packed_w;
+};
+
+// Select the algorithm of a layer and transform or pack w for it through the
+// kernel caches. The kernel refers to the cached one, so it is only valid
+// until w leaves the caches.
+inference_engine::backend::conv_kernel
+bind_conv_kernel(long c_in, long c_out, long y_h, long y_w, long k,
+                 long stride, const float *w);
+
+// Apply `conv` and `conv_relu_max_pool` with a kernel from
+// `bind_conv_kernel` for the same shape
+void conv(long c_in, long c_out, long x_h, long x_w, long y_h, long y_w, long k,
+          long pad, long stride, const float *x,
+          inference_engine::backend::conv_kernel const &kernel,
+          const float *b, float *y, float beta = 0.0f);
+void conv_relu_max_pool(long c_in, long c_out, long x_h, long x_w, long y_h,
+                        long y_w, long k, long pad, long stride, long pool_k,
+                        long pool_pad, long pool_stride, long p_h, long p_w,
+                        const float *x,
+                        inference_engine::backend::conv_kernel const &kernel,
+                        const float *b, float *y);
+
+void conv_direct(long c_in, long c_out, long x_h, long x_w, long y_h,
+                 long y_w, long k, long pad, long stride, const float *x,
+                 const float *w, const float *b, float *y, float beta = 0.0f);
+
+// The column matrix is bounded in size: large layers are lowered a band of
+// output rows at a time into a buffer which is reused across calls.
+void conv_im2col(long c_in, long c_out, long x_h, long x_w, long y_h,
+                 long y_w, long k, long pad, long stride, const float *x,
+                 const float *w, const float *b, float *y, float beta = 0.0f);
+
+// Return w with c_out * c_in * k * k packed as the left operand of the
+// GEMM of `conv_im2col`, packing it on the first call only.
+// Unlike the Winograd and NCHWc kernels, which `conv` transforms on first
+// use, `conv_im2col` only uses a packed kernel once this was called for w,
+// such as when a model is loaded, and packs w on every call otherwise.
+// As for `cached_winograd_kernel`, w must not be modified or freed before
+// `clear_im2col_kernel_cache` or `erase_im2col_kernels` is called.
+const inference_engine::backend::packed_matrix *
+cached_im2col_kernel(long c_in, long c_out, long k, const float *w);
+
+// Make packed the kernel `cached_im2col_kernel` returns for w, such as one
+// read from an engine file, rather than packing w. packed is only used while
+// the gemm kernels bound have its panel width.
+void insert_im2col_kernel(
+    long c_in, long c_out, long k, const float *w,
+    inference_engine::backend::packed_matrix const &packed);
+
+void clear_im2col_kernel_cache();
+
+// Remove the kernels packed for w from the cache, such as before w is freed,
+// leaving those of other weights in place.
+void erase_im2col_kernels(const float *w);
+
+// Apply Conv with the Winograd algorithm F(m x m, 3 x 3)
+// The kernel must be 3x3 and the stride must be 1. Other arguments are the
+// same as `conv`, except:
+// long m: the output tile size, 2 for F(2x2,3x3) or 4 for F(4x4,3x3).
+//   F(2x2,3x3) does 2.25x and F(4x4,3x3) 4x fewer multiplications than the
+//   direct algorithm, and F(4x4,3x3) is slightly less accurate.
+// float *u: the transformed kernel from `winograd_transform_kernel`
+void conv_winograd(long c_in, long c_out, long x_h, long x_w, long y_h,
+                   long y_w, long pad, long m, const float *x, const float *u,
+                   const float *b, float *y, float beta = 0.0f);
+
+// Compute the output rows [y_h_begin, y_h_end) of `conv_winograd` only
+// float *y_rows: the output array with c_out * (y_h_end - y_h_begin) * y_w
+void conv_winograd_rows(long c_in, long c_out, long x_h, long x_w, long y_w,
+                        long pad, long m, long y_h_begin, long y_h_end,
+                        const float *x, const float *u, const float *b,
+                        float *y_rows, float beta = 0.0f);
+
+// Return the number of floats of a transformed kernel
+long long winograd_kernel_size(long c_in, long c_out, long m);
+
+// Transform the kernel w with c_out * c_in * 3 * 3 into the Winograd domain
+// float *u: the output array with `winograd_kernel_size(c_in, c_out, m)`
+void winograd_transform_kernel(long c_in, long c_out, long m, const float *w,
+                               float *u);
+
+// Return the transformed kernel of w, transforming it on the first call only.
+// `conv` uses this so that each kernel of a loaded model is transformed once.
+// The transformed kernel is looked up by the address of w, so w must not be
+// modified or freed before `clear_winograd_kernel_cache` or
+// `erase_winograd_kernels` is called.
+const float *cached_winograd_kernel(long c_in, long c_out, long m,
+                                    const float *w);
+
+// Make u the transformed kernel `cached_winograd_kernel` returns for w, such
+// as one read from an engine file, rather than transforming w.
+// As w, u must not be modified or freed before the kernel leaves the cache.
+void insert_winograd_kernel(long c_in, long c_out, long m, const float *w,
+                            const float *u);
+
+void clear_winograd_kernel_cache();
+
+// Remove the kernels transformed from w from the cache, as
+// `erase_im2col_kernels` does.
+void erase_winograd_kernels(const float *w);
+
+// Return the tile size `conv` uses for Winograd layers: 4 unless the
+// environment variable INFERENCE_ENGINE_WINOGRAD_TILE selects 2.
+long winograd_tile_size();
+
+// The channel block of the NCHWc layout.
+// NCHW keeps the pixels of one channel contiguous, so kernels can only
+// vectorize along a row. NCHWc keeps NCHWC_BLOCK channels of one pixel
+// contiguous instead: a c x h x w tensor is stored as ceil(c / NCHWC_BLOCK)
+// blocks of h x w x NCHWC_BLOCK, and element (cc, hh, ww) is at
+//   ((cc / NCHWC_BLOCK * h + hh) * w + ww) * NCHWC_BLOCK + cc % NCHWC_BLOCK
+// The channels of the last block beyond c are zero.
+constexpr long NCHWC_BLOCK = 16;
+
+// Return the number of floats of a c x h x w tensor in NCHWc
+long long nchwc_size(long c, long h, long w);
+
+// Reorder x with c * h * w in NCHW into y with `nchwc_size(c, h, w)` in NCHWc
+void reorder_nchw_to_nchwc(long c, long h, long w, const float *x, float *y);
+
+// Reorder x with `nchwc_size(c, h, w)` in NCHWc into y with c * h * w in NCHW
+void reorder_nchwc_to_nchw(long c, long h, long w, const float *x, float *y);
+
+// Return the number of floats of a kernel reordered for `conv_nchwc`
+long long nchwc_kernel_size(long c_in, long c_out, long k);
+
+// Reorder the kernel w with c_out * c_in * k * k for `conv_nchwc`.
+// The blocks of w_nchwc are ordered by output channel block, input channel
+// block, k_h and k_w, and each holds NCHWC_BLOCK x NCHWC_BLOCK elements
+// indexed by (input channel, output channel).
+// float *w_nchwc: the output array with `nchwc_kernel_size(c_in, c_out, k)`
+void reorder_kernel_to_nchwc(long c_in, long c_out, long k, const float *w,
+                             float *w_nchwc);
+
+// Return the reordered kernel of w, reordering it on the first call only.
+// As for `cached_winograd_kernel`, w must not be modified or freed before
+// `clear_nchwc_kernel_cache` or `erase_nchwc_kernels` is called.
+const float *cached_nchwc_kernel(long c_in, long c_out, long k,
+                                 const float *w);
+
+// Make w_nchwc the reordered kernel `cached_nchwc_kernel` returns for w, as
+// `insert_winograd_kernel` does.
+void insert_nchwc_kernel(long c_in, long c_out, long k, const float *w,
+                         const float *w_nchwc);
+
+void clear_nchwc_kernel_cache();
+
+// Remove the kernels reordered from w from the cache, as
+// `erase_im2col_kernels` does.
+void erase_nchwc_kernels(const float *w);
+
+// Apply Conv on NCHWc tensors
+// The arguments are the same as `conv`, except:
+// float *x: the input array with `nchwc_size(c_in, x_h, x_w)`
+// float *w_nchwc: the kernel from `reorder_kernel_to_nchwc`
+// float *y: the output array with `nchwc_size(c_out, y_h, y_w)`
+void conv_nchwc(long c_in, long c_out, long x_h, long x_w, long y_h, long y_w,
+                long k, long pad, long stride, const float *x,
+                const float *w_nchwc, const float *b, float *y,
+                float beta = 0.0f);
+
+// Apply `conv_relu_max_pool` on NCHWc tensors
+// The arguments are the same as `conv_nchwc`, and pool_k/pool_pad/
+// pool_stride/p_h/p_w as for `conv_relu_max_pool`.
+// float *y: the output array with `nchwc_size(c_out, p_h, p_w)`, which is
+//   overwritten
+// Relu is applied in registers. With MaxPool, the conv rows under each
+// pooled row are pooled from a per-thread buffer of pool_k rows.
+void conv_relu_max_pool_nchwc(long c_in, long c_out, long x_h, long x_w,
+                              long y_h, long y_w, long k, long pad,
+                              long stride, long pool_k, long pool_pad,
+                              long pool_stride, long p_h, long p_w,
+                              const float *x, const float *w_nchwc,
+                              const float *b, float *y);
+
+// Apply MaxPool on NCHWc tensors
+// The arguments are the same as `max_pool`, except:
+// float *x: the input array with `nchwc_size(c, x_h, x_w)`
+// float *y: the output array with `nchwc_size(c, y_h, y_w)`
+// As for `max_pool`, a batch of n NCHWc tensors with c' channels is pooled in
+// one call, with c being n * `nchwc_size(c', 1, 1)`.
+void max_pool_nchwc(long c, long x_h, long x_w, long y_h, long y_w, long k,
+                    long pad, long stride, const float *x, float *y);
 
 // Apply MaxPool
 // long x_h/x_w: the size of height and width of input x
@@ -39,7 +365,12 @@ void conv(long c_in, long c_out, long x_h, long x_w, long y_h, long y_w, long k,
 // float *x: the input float array with c * x_h * x_w
 // float *y: the output array with c * y_h * y_w
 //   where y_h is `floor((x_h - k + 2 * pad) / float(stride)) + 1`
-//   and y_w is `floor((x_w - k + 2 * pad) / float(stride)) + 1`
+//   and y_w is `floor((x_w - k + 2 * pad) / float(stride)) + 1`.
+//   pad is the padding before x, and y_h/y_w imply the padding after it:
+//   they may be computed with another padding after x, as the asymmetric
+//   pads of ONNX give (see `inferer::calculate_conv_matrix_dims`).
+// Channels are pooled independently, so a batch of n NCHW tensors is pooled
+// in one call with c being n times their channels.
 void max_pool(long c, long x_h, long x_w, long y_h, long y_w, long k, long pad,
               long stride, float *x, float *y);
 
@@ -52,10 +383,14 @@ void max_pool(long c, long x_h, long x_w, long y_h, long y_w, long k, long pad,
 // float *x: the input array with n
 // float *y: the output array with n
 // float *mask: the output array with n
+// This is Dropout as in training. At inference Dropout is the identity, and
+// `inferer::eliminate_dropouts` removes it from the graph instead.
 void drop_out(long long n, float ratio, float *x, float *y, float *mask);
 
 // Apply relu function to all elements of matrix a
 // long long n: the size of input x and output y
+//   Relu is elementwise, so it applies to NCHWc tensors as they are with n
+//   being `nchwc_size(c, h, w)`.
 // float *x: the input vector with n
 // float *y: the output vector with n
 void relu(long long n, float *x, float *y);
@@ -65,6 +400,14 @@ void relu(long long n, float *x, float *y);
 // float *x: the input vector with n
 // float *y: the output vector with n
 void softmax(long long n, float *x, float *y);
+
+// Apply Softmax to each row of a matrix independently, such as the class
+// scores of a batch with one image per row
+// long rows: the number of rows of input x and output y
+// long long columns: the size of each row
+// float *x: the input array with rows * columns
+// float *y: the output array with rows * columns
+void softmax(long rows, long long columns, float *x, float *y);
 } // namespace backend
 } // namespace inference_engine
 
@@ -0,0 +1,233 @@
+#include "batcher.hpp"
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <string>
+
+namespace inference_engine {
+namespace inferer {
+namespace {
+
+long long product(std::vector<long> const &dims) {
+  long long result = 1;
+  for (long dim : dims) {
+    result *= dim;
+  }
+  return result;
+}
+
+} // namespace
+
+batcher::batcher(inference_engine::inferer::session const &session,
+                 inference_engine::inferer::batcher_options const &options)
+    : session(session), context(session),
+      max_wait(std::chrono::microseconds(std::max(0l, options.max_wait_us))) {
+  long batch = 0;
+  auto add_tensors = [&](std::vector<std::string> const &names,
+                         std::vector<long> &tensors,
+                         std::vector<long long> &sizes) {
+    for (std::string const &name : names) {
+      long tensor = session.tensor_index(name);
+      std::vector<long> const &dims = session.dims(tensor);
+      if (dims.empty() || (batch != 0 && dims[0] != batch)) {
+        throw std::runtime_error(name + " has not the batch as its leading "
+                                        "dim, so it cannot be batched");
+      }
+      batch = dims[0];
+      tensors.push_back(tensor);
+      sizes.push_back(product(dims) / batch);
+    }
+  };
+  add_tensors(session.input_names(), input_tensors, input_sizes);
+  add_tensors(session.output_names(), output_tensors, output_sizes);
+  max_batch = options.max_batch > 0 ? options.max_batch : batch;
+  if (max_batch > batch) {
+    throw std::runtime_error("max_batch " + std::to_string(max_batch) +
+                             " is larger than the batch of the session " +
+                             std::to_string(batch));
+  }
+
+  // A first run warms up the arena and the caches, and gives the estimate
+  // of how long a batch runs.
+  clock::time_point start = clock::now();
+  session.run(context);
+  run_time = clock::now() - start;
+
+  tail = new node();
+  head = tail;
+  server = std::thread([this] { serve(); });
+}
+
+batcher::~batcher() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  server.join();
+  delete tail;
+}
+
+std::future<std::vector<std::vector<float>>>
+batcher::submit(std::vector<std::vector<float>> inputs,
+                clock::time_point deadline) {
+  if (inputs.size() != input_sizes.size()) {
+    throw std::runtime_error("a request takes " +
+                             std::to_string(input_sizes.size()) +
+                             " inputs, but has " +
+                             std::to_string(inputs.size()));
+  }
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (static_cast<long long>(inputs[i].size()) != input_sizes[i]) {
+      throw std::runtime_error(
+          session.input_names()[i] + ": an image has " +
+          std::to_string(input_sizes[i]) + " floats, but the request has " +
+          std::to_string(inputs[i].size()));
+    }
+  }
+
+  node *n = new node();
+  n->value.inputs = std::move(inputs);
+  n->value.queued = clock::now();
+  n->value.deadline = deadline;
+  std::future<std::vector<std::vector<float>>> result =
+      n->value.result.get_future();
+  push(n);
+  return result;
+}
+
+inference_engine::inferer::batcher_stats batcher::stats() const {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  return counts;
+}
+
+void batcher::push(node *n) {
+  node *previous = head.exchange(n);
+  previous->next.store(n);
+  // Either the serving thread sees n before it sleeps, or this sees it
+  // sleeping and wakes it: both sides store, then load, sequentially
+  // consistently.
+  if (sleeping.load()) {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    wake.notify_one();
+  }
+}
+
+std::unique_ptr<batcher::request> batcher::pop() {
+  node *next = tail->next.load();
+  if (next == nullptr) {
+    return nullptr;
+  }
+  // next becomes the node whose request has been taken.
+  std::unique_ptr<request> taken(new request(std::move(next->value)));
+  delete tail;
+  tail = next;
+  return taken;
+}
+
+std::unique_ptr<batcher::request>
+batcher::wait_pop(clock::time_point until) {
+  while (true) {
+    std::unique_ptr<request> taken = pop();
+    if (taken || stopping) {
+      return taken;
+    }
+    std::unique_lock<std::mutex> lock(sleep_mutex);
+    sleeping = true;
+    // A producer which linked its node before sleeping was set may not have
+    // notified, so the queue is looked at once more.
+    bool timed_out = false;
+    if (tail->next.load() == nullptr && !stopping) {
+      if (until == clock::time_point::max()) {
+        wake.wait(lock);
+      } else {
+        timed_out = wake.wait_until(lock, until) == std::cv_status::timeout;
+      }
+    }
+    sleeping = false;
+    if (timed_out) {
+      return pop();
+    }
+  }
+}
+
+void batcher::serve() {
+  std::vector<std::unique_ptr<request>> batch;
+  clock::time_point close = clock::time_point::max();
+  while (true) {
+    std::unique_ptr<request> next = wait_pop(close);
+    if (next && next->deadline < clock::now()) {
+      // Late already, say after waiting behind other batches
+      {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        ++counts.expired;
+      }
+      next->result.set_exception(std::make_exception_ptr(std::runtime_error(
+          "the deadline of the request passed before it could run")));
+      continue;
+    }
+    if (next) {
+      // The batch closes max_wait after its first request was queued, or in
+      // time to finish by the earliest deadline in it.
+      if (batch.empty()) {
+        close = next->queued + max_wait;
+      }
+      close = std::min(close, latest_start(next->deadline));
+      batch.push_back(std::move(next));
+      if (static_cast<long>(batch.size()) < max_batch) {
+        continue;
+      }
+    }
+    if (batch.empty()) {
+      // Stopped, with nothing left to run
+      return;
+    }
+    run_batch(batch);
+    batch.clear();
+    close = clock::time_point::max();
+  }
+}
+
+batcher::clock::time_point
+batcher::latest_start(clock::time_point deadline) const {
+  return deadline == clock::time_point::max() ? deadline
+                                              : deadline - run_time;
+}
+
+void batcher::run_batch(std::vector<std::unique_ptr<request>> &batch) {
+  for (size_t i = 0; i < batch.size(); ++i) {
+    for (size_t j = 0; j < input_tensors.size(); ++j) {
+      std::copy(batch[i]->inputs[j].begin(), batch[i]->inputs[j].end(),
+                context.data(input_tensors[j]) + i * input_sizes[j]);
+    }
+  }
+  // The counts are up to date by the time a future is ready.
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    ++counts.batches;
+    counts.requests += static_cast<long long>(batch.size());
+  }
+  try {
+    clock::time_point start = clock::now();
+    session.run(context, static_cast<long>(batch.size()));
+    // The estimate follows slower runs at once and faster ones slowly, so
+    // that a deadline is rather met early than missed.
+    run_time = std::max(clock::now() - start, run_time - run_time / 8);
+  } catch (...) {
+    for (std::unique_ptr<request> &r : batch) {
+      r->result.set_exception(std::current_exception());
+    }
+    return;
+  }
+  for (size_t i = 0; i < batch.size(); ++i) {
+    std::vector<std::vector<float>> outputs;
+    for (size_t j = 0; j < output_tensors.size(); ++j) {
+      const float *output =
+          context.data(output_tensors[j]) + i * output_sizes[j];
+      outputs.emplace_back(output, output + output_sizes[j]);
+    }
+    batch[i]->result.set_value(std::move(outputs));
+  }
+}
+} // namespace inferer
+} // namespace inference_engine
@@ -0,0 +1,140 @@
+#ifndef BATCHER_HPP
+#define BATCHER_HPP
+
+#include "session.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace inference_engine {
+namespace inferer {
+
+// The options of a `batcher`
+// long max_batch: the most requests run as one batch, at most the batch the
+//   session was compiled with. 0 takes that batch.
+// long max_wait_us: the longest the first request of a batch waits for
+//   others to join it, in microseconds. 0 runs what is queued at once.
+struct batcher_options {
+  long max_batch = 0;
+  long max_wait_us = 1000;
+};
+
+// What a `batcher` has run so far
+// batches: the batched runs of the session
+// requests: the requests answered by those runs
+// expired: the requests failed for their deadline, without running
+struct batcher_stats {
+  long long batches = 0;
+  long long requests = 0;
+  long long expired = 0;
+};
+
+// Serves requests of single images by running them in batches, since the
+// GEMMs of the fully connected layers only get efficient with several rows.
+// Requests are queued by any number of threads on a lock-free queue. One
+// thread takes them off, and runs a batch once it holds max_batch requests,
+// or once the first of them has waited max_wait_us, whichever comes first.
+// The results are handed back through futures.
+// A request may carry a deadline, the time its result is due. A batch
+// closes early enough to finish by the earliest deadline in it, going by how
+// long recent batches ran, and a request whose deadline has passed by the
+// time it is taken off the queue, such as behind a slow batch, fails with
+// std::runtime_error rather than running late.
+// A batch of fewer images than the session's batch costs about as much as
+// its images if the session `splits_batch`, and a whole batch otherwise.
+// The images of a batch must not affect each other's results: every graph
+// input and output has the batch as its leading dim.
+// The session is shared with other users, and must outlive the batcher. The
+// requests queued when the batcher is destroyed are run first.
+class batcher {
+public:
+  typedef std::chrono::steady_clock clock;
+
+  // The session is run once on a whole batch first, to time it.
+  // Throw std::runtime_error if a graph input or output of session has not
+  // the batch as its leading dim, or options.max_batch is larger than it.
+  batcher(inference_engine::inferer::session const &session,
+          inference_engine::inferer::batcher_options const &options);
+  ~batcher();
+
+  batcher(batcher const &) = delete;
+  batcher &operator=(batcher const &) = delete;
+
+  // Queue a request, and return the future of its result.
+  // inputs: an image of each of `session::input_names`, in NCHW
+  // deadline: the time the result is due
+  // The result holds an image of each of `session::output_names`.
+  // Throw std::runtime_error if an input has another size than an image of
+  // the session.
+  std::future<std::vector<std::vector<float>>>
+  submit(std::vector<std::vector<float>> inputs,
+         clock::time_point deadline = clock::time_point::max());
+
+  inference_engine::inferer::batcher_stats stats() const;
+
+private:
+  struct request {
+    std::vector<std::vector<float>> inputs;
+    std::promise<std::vector<std::vector<float>>> result;
+    clock::time_point queued;
+    clock::time_point deadline;
+  };
+
+  // A node of the queue. The queue is a singly linked list, which producers
+  // append to by swapping head and linking the previous head to the new
+  // node, and which the consumer reads from tail. tail is a node whose
+  // request has been taken, so the list is never empty.
+  struct node {
+    std::atomic<node *> next{nullptr};
+    request value;
+  };
+
+  void push(node *n);
+  // Take the oldest request off the queue, or return nullptr if it is
+  // empty. Only called by the serving thread.
+  std::unique_ptr<request> pop();
+  // Take the oldest request off the queue, waiting for one until until.
+  // Return nullptr if there is none by then, or if there is none and the
+  // batcher stops.
+  std::unique_ptr<request> wait_pop(clock::time_point until);
+  // Return the latest time a batch finishing by deadline may start at.
+  clock::time_point latest_start(clock::time_point deadline) const;
+  void serve();
+  void run_batch(std::vector<std::unique_ptr<request>> &batch);
+
+  inference_engine::inferer::session const &session;
+  inference_engine::inferer::session_context context;
+  long max_batch;
+  clock::duration max_wait;
+  // How long a batch is expected to run. Only the serving thread uses it
+  // once it runs.
+  clock::duration run_time;
+  std::vector<long> input_tensors;
+  std::vector<long long> input_sizes;
+  std::vector<long> output_tensors;
+  std::vector<long long> output_sizes;
+
+  std::atomic<node *> head;
+  node *tail;
+
+  // The serving thread sleeps on wake while the queue is empty, with
+  // sleeping set so that producers know to notify it.
+  std::mutex sleep_mutex;
+  std::condition_variable wake;
+  std::atomic<bool> sleeping{false};
+  std::atomic<bool> stopping{false};
+
+  mutable std::mutex stats_mutex;
+  inference_engine::inferer::batcher_stats counts;
+
+  std::thread server;
+};
+} // namespace inferer
+} // namespace inference_engine
+
+#endif
@@ -0,0 +1,456 @@
+#include "backend.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+namespace inference_engine {
+namespace backend {
+namespace {
+
+// The minimum work of a chunk given to a thread, in multiply-adds or in
+// elements for the memory bound loops. Smaller layers run on fewer threads
+// since waking the pool would cost more than it saves.
+constexpr long long PARALLEL_MIN_CHUNK_WORK = 1ll << 16;
+
+// The maximum number of floats of the conv rows `conv_relu_max_pool` keeps
+// between the convolution and its epilogue (1 MiB), so that they are still
+// in L2 when they are pooled.
+constexpr long long FUSED_MAX_BAND_SIZE = 1ll << 18;
+
+// The maximum number of floats in the im2col column buffer (16 MiB).
+// Larger layers are lowered and multiplied a band of output rows at a time.
+constexpr long long IM2COL_MAX_BUFFER_SIZE = 1ll << 22;
+
+// Packed kernels are keyed by the address and shape of the original kernel,
+// and by the panel width of the gemm kernels they were packed for.
+typedef std::tuple<const float *, long, long, long, long> im2col_kernel_key;
+
+std::mutex im2col_kernel_cache_mutex;
+std::map<im2col_kernel_key, inference_engine::backend::packed_matrix>
+    im2col_kernel_cache;
+
+// Return the kernel `cached_im2col_kernel` packed for w and the bound gemm
+// kernels, or null if there is none, in which case w is packed on every call.
+const inference_engine::backend::packed_matrix *
+find_im2col_kernel(long c_in, long c_out, long k, const float *w) {
+  std::lock_guard<std::mutex> lock(im2col_kernel_cache_mutex);
+  auto it = im2col_kernel_cache.find(im2col_kernel_key(
+      w, c_in, c_out, k,
+      inference_engine::backend::kernels::active().gemm_mr));
+  return it == im2col_kernel_cache.end() ? nullptr : &it->second;
+}
+
+// Lower the output rows [y_h_begin, y_h_end) of a convolution into a column
+// matrix col[(c_in * k * k) x ((y_h_end - y_h_begin) * y_w)].
+// Row (cc_in * k * k + k_h * k + k_w) of col holds, for every output pixel,
+// the input element that kernel tap multiplies. Taps which fall into the
+// padding are written as zero, so x itself is never padded.
+void im2col(long c_in, long x_h, long x_w, long y_w, long k, long pad,
+            long stride, long y_h_begin, long y_h_end, const float *x,
+            float *col) {
+  long col_width = (y_h_end - y_h_begin) * y_w;
+
+  for (long cc_in = 0; cc_in < c_in; ++cc_in) {
+    const float *x_c = x + cc_in * x_h * x_w;
+
+    for (long k_h = 0; k_h < k; ++k_h) {
+      for (long k_w = 0; k_w < k; ++k_w) {
+        float *col_row = col + ((cc_in * k + k_h) * k + k_w) * col_width;
+
+        // The output columns whose tap lies inside the input horizontally:
+        // 0 <= yy_w * stride - pad + k_w < x_w
+        long yy_w_begin =
+            std::min(y_w, std::max(0l, (pad - k_w + stride - 1) / stride));
+        long yy_w_end = std::max(
+            yy_w_begin, std::min(y_w, (x_w + pad - k_w + stride - 1) / stride));
+
+        for (long yy_h = y_h_begin; yy_h < y_h_end; ++yy_h) {
+          float *col_out = col_row + (yy_h - y_h_begin) * y_w;
+          long xx_h = yy_h * stride - pad + k_h;
+
+          if (xx_h < 0 || xx_h >= x_h) {
+            std::memset(col_out, 0, sizeof(float) * y_w);
+            continue;
+          }
+
+          const float *x_row = x_c + xx_h * x_w - pad + k_w;
+          std::fill(col_out, col_out + yy_w_begin, 0.0f);
+          if (stride == 1) {
+            std::memcpy(col_out + yy_w_begin, x_row + yy_w_begin,
+                        sizeof(float) * (yy_w_end - yy_w_begin));
+          } else {
+            for (long yy_w = yy_w_begin; yy_w < yy_w_end; ++yy_w) {
+              col_out[yy_w] = x_row[yy_w * stride];
+            }
+          }
+          std::fill(col_out + yy_w_end, col_out + y_w, 0.0f);
+        }
+      }
+    }
+  }
+}
+
+// Multiply w with the lowered output rows [y_h_begin, y_h_end) and write the
+// product with the bias b and beta * y_rows to y_rows, which points to row
+// y_h_begin of the first output channel and whose channels are
+// y_channel_size apart.
+// float *col: the column buffer, large enough for the rows
+// packed_w: w packed by `cached_im2col_kernel`, or null to pack it here
+void im2col_gemm_rows(long c_in, long c_out, long x_h, long x_w, long y_w,
+                      long k, long pad, long stride, long y_h_begin,
+                      long y_h_end, const float *x, const float *w,
+                      const inference_engine::backend::packed_matrix *packed_w,
+                      const float *b, float beta, float *col, float *y_rows,
+                      long y_channel_size) {
+  long band_width = (y_h_end - y_h_begin) * y_w;
+  long col_height = c_in * k * k;
+
+  // The bias of an output channel is the bias of a row of the product.
+  inference_engine::backend::gemm_epilogue epilogue;
+  epilogue.beta = beta;
+  epilogue.row_bias = b;
+  auto multiply = [&](const float *lowered, long ldb) {
+    if (packed_w != nullptr) {
+      gemm_packed(c_out, band_width, col_height, *packed_w, lowered, ldb,
+                  false, y_rows, y_channel_size, epilogue);
+    } else {
+      gemm_strided(c_out, band_width, col_height, w, col_height, lowered, ldb,
+                   y_rows, y_channel_size, nullptr, epilogue);
+    }
+  };
+
+  // A 1x1 kernel with stride 1 and no padding reads x as it is.
+  if (k == 1 && stride == 1 && pad == 0) {
+    return multiply(x + y_h_begin * x_w, x_h * x_w);
+  }
+
+  // Each input channel fills its own k * k rows of col.
+  inference_engine::parallel::parallel_for(
+      c_in,
+      [&](long begin, long end) {
+        im2col(end - begin, x_h, x_w, y_w, k, pad, stride, y_h_begin, y_h_end,
+               x + begin * x_h * x_w, col + begin * k * k * band_width);
+      },
+      inference_engine::parallel::SCHEDULE::Static,
+      std::max(1l, static_cast<long>(PARALLEL_MIN_CHUNK_WORK /
+                                     (k * k * band_width))));
+  multiply(col, band_width);
+}
+
+// Apply `conv_im2col` with the kernel packed_w, or packing w if it is null
+void conv_im2col_packed(
+    long c_in, long c_out, long x_h, long x_w, long y_h, long y_w, long k,
+    long pad, long stride, const float *x, const float *w,
+    const inference_engine::backend::packed_matrix *packed_w, const float *b,
+    float *y, float beta) {
+  long y_size = y_h * y_w;
+  long col_height = c_in * k * k;
+
+  // A 1x1 kernel with stride 1 and no padding needs no column buffer.
+  if (k == 1 && stride == 1 && pad == 0) {
+    return im2col_gemm_rows(c_in, c_out, x_h, x_w, y_w, k, pad, stride, 0, y_h,
+                            x, w, packed_w, b, beta, nullptr, y, y_size);
+  }
+
+  // W[c_out x (c_in * k * k)] * col[(c_in * k * k) x (rows * y_w)] is
+  // computed for bands of output rows so that col stays bounded.
+  long rows_per_band = std::max(
+      1l, std::min(y_h, static_cast<long>(IM2COL_MAX_BUFFER_SIZE /
+                                          (col_height * y_w))));
+
+  // The column buffer is reused across calls and layers.
+  static thread_local std::vector<float> col;
+  size_t col_size = static_cast<size_t>(col_height) * rows_per_band * y_w;
+  if (col.size() < col_size) {
+    col.resize(col_size);
+  }
+
+  for (long y_h_begin = 0; y_h_begin < y_h; y_h_begin += rows_per_band) {
+    long y_h_end = std::min(y_h, y_h_begin + rows_per_band);
+    im2col_gemm_rows(c_in, c_out, x_h, x_w, y_w, k, pad, stride, y_h_begin,
+                     y_h_end, x, w, packed_w, b, beta, col.data(),
+                     y + y_h_begin * y_w, y_size);
+  }
+}
+
+} // namespace
+
+const inference_engine::backend::packed_matrix *
+cached_im2col_kernel(long c_in, long c_out, long k, const float *w) {
+  im2col_kernel_key key(w, c_in, c_out, k,
+                        inference_engine::backend::kernels::active().gemm_mr);
+  {
+    std::lock_guard<std::mutex> lock(im2col_kernel_cache_mutex);
+    auto it = im2col_kernel_cache.find(key);
+    if (it != im2col_kernel_cache.end()) {
+      return &it->second;
+    }
+  }
+
+  // Packed without the lock, as in `cached_winograd_kernel`
+  inference_engine::backend::packed_matrix packed =
+      pack_gemm_a(c_out, c_in * k * k, w, c_in * k * k, false);
+  std::lock_guard<std::mutex> lock(im2col_kernel_cache_mutex);
+  return &im2col_kernel_cache.insert(std::make_pair(key, packed)).first->second;
+}
+
+void insert_im2col_kernel(
+    long c_in, long c_out, long k, const float *w,
+    inference_engine::backend::packed_matrix const &packed) {
+  std::lock_guard<std::mutex> lock(im2col_kernel_cache_mutex);
+  im2col_kernel_cache[im2col_kernel_key(w, c_in, c_out, k,
+                                        packed.panel_width)] = packed;
+}
+
+void clear_im2col_kernel_cache() {
+  std::lock_guard<std::mutex> lock(im2col_kernel_cache_mutex);
+  im2col_kernel_cache.clear();
+}
+
+void erase_im2col_kernels(const float *w) {
+  std::lock_guard<std::mutex> lock(im2col_kernel_cache_mutex);
+  auto it = im2col_kernel_cache.begin();
+  while (it != im2col_kernel_cache.end()) {
+    if (std::get<0>(it->first) == w) {
+      it = im2col_kernel_cache.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void conv_direct(long c_in, long c_out, long x_h, long x_w, long y_h,
+                 long y_w, long k, long pad, long stride, const float *x,
+                 const float *w, const float *b, float *y, float beta) {
+  const inference_engine::backend::kernels::kernel_table &kernels =
+      inference_engine::backend::kernels::active();
+  long long channel_macs = static_cast<long long>(c_in) * k * k * y_h * y_w;
+
+  // Output channels are independent.
+  inference_engine::parallel::parallel_for(
+      c_out,
+      [&](long begin, long end) {
+        kernels.conv(c_in, end - begin, x_h, x_w, y_h, y_w, k, pad, stride, x,
+                     w + begin * c_in * k * k, b + begin,
+                     y + begin * y_h * y_w, beta);
+      },
+      inference_engine::parallel::SCHEDULE::Static,
+      static_cast<long>(std::max(1ll, PARALLEL_MIN_CHUNK_WORK / channel_macs)));
+}
+
+void conv_im2col(long c_in, long c_out, long x_h, long x_w, long y_h,
+                 long y_w, long k, long pad, long stride, const float *x,
+                 const float *w, const float *b, float *y, float beta) {
+  conv_im2col_packed(c_in, c_out, x_h, x_w, y_h, y_w, k, pad, stride, x, w,
+                     find_im2col_kernel(c_in, c_out, k, w), b, y, beta);
+}
+
+void conv(long c_in, long c_out, long x_h, long x_w, long y_h, long y_w, long k,
+          long pad, long stride, const float *x,
+          inference_engine::backend::conv_kernel const &kernel,
+          const float *b, float *y, float beta) {
+  assert(k <= x_h && k <= x_w);
+  assert((y_h - 1) * stride <= x_h + 2 * pad);
+  assert((y_w - 1) * stride <= x_w + 2 * pad);
+
+  switch (kernel.algorithm) {
+  case inference_engine::backend::CONV_ALGORITHM::Winograd:
+    return conv_winograd(c_in, c_out, x_h, x_w, y_h, y_w, pad, kernel.m, x,
+                         kernel.u, b, y, beta);
+  case inference_engine::backend::CONV_ALGORITHM::Im2col:
+    return conv_im2col_packed(c_in, c_out, x_h, x_w, y_h, y_w, k, pad, stride,
+                              x, kernel.w, kernel.packed_w, b, y, beta);
+  default:
+    return conv_direct(c_in, c_out, x_h, x_w, y_h, y_w, k, pad, stride, x,
+                       kernel.w, b, y, beta);
+  }
+}
+
+void conv_relu_max_pool(long c_in, long c_out, long x_h, long x_w, long y_h,
+                        long y_w, long k, long pad, long stride, long pool_k,
+                        long pool_pad, long pool_stride, long p_h, long p_w,
+                        float *x, float *w, float *b, float *y) {
+  // Only the kernels transformed or packed already are used, as in `conv`.
+  inference_engine::backend::conv_kernel kernel;
+  kernel.algorithm = select_conv_algorithm(c_in, c_out, y_h, y_w, k, stride);
+  kernel.m = winograd_tile_size();
+  kernel.w = w;
+  kernel.u =
+      kernel.algorithm == inference_engine::backend::CONV_ALGORITHM::Winograd
+          ? cached_winograd_kernel(c_in, c_out, kernel.m, w)
+          : nullptr;
+  kernel.packed_w =
+      kernel.algorithm == inference_engine::backend::CONV_ALGORITHM::Im2col
+          ? find_im2col_kernel(c_in, c_out, k, w)
+          : nullptr;
+  conv_relu_max_pool(c_in, c_out, x_h, x_w, y_h, y_w, k, pad, stride, pool_k,
+                     pool_pad, pool_stride, p_h, p_w, x, kernel, b, y);
+}
+
+void conv_relu_max_pool(long c_in, long c_out, long x_h, long x_w, long y_h,
+                        long y_w, long k, long pad, long stride, long pool_k,
+                        long pool_pad, long pool_stride, long p_h, long p_w,
+                        const float *x,
+                        inference_engine::backend::conv_kernel const &kernel,
+                        const float *b, float *y) {
+  assert(k <= x_h && k <= x_w);
+  assert((y_h - 1) * stride <= x_h + 2 * pad);
+  assert((y_w - 1) * stride <= x_w + 2 * pad);
+
+  // Without pooling every conv pixel is a window of its own.
+  if (pool_k == 0) {
+    pool_k = 1;
+    pool_pad = 0;
+    pool_stride = 1;
+  }
+  assert((p_h - 1) * pool_stride <= y_h + 2 * pool_pad);
+  assert((p_w - 1) * pool_stride <= y_w + 2 * pool_pad);
+
+  const inference_engine::backend::CONV_ALGORITHM algorithm =
+      kernel.algorithm;
+  const float *w = kernel.w;
+
+  // The pooled rows are produced a band at a time: the conv rows under the
+  // band are computed into a buffer, and relu'd and pooled from there into
+  // y. The direct kernel computes whole layers, which are tiny.
+  long p_rows_per_band = p_h;
+  if (algorithm != inference_engine::backend::CONV_ALGORITHM::Direct) {
+    p_rows_per_band = std::max(
+        1l, std::min(p_h, static_cast<long>(FUSED_MAX_BAND_SIZE /
+                                            (c_out * y_w * pool_stride))));
+    // Bands of a multiple of 4 conv rows keep Winograd tiles whole.
+    if (p_rows_per_band * pool_stride >= 4 && p_rows_per_band < p_h) {
+      p_rows_per_band = std::max(1l, p_rows_per_band * pool_stride / 4 * 4 /
+                                         pool_stride);
+    }
+  }
+
+  // The buffers are reused across calls and layers.
+  static thread_local std::vector<float> rows;
+  static thread_local std::vector<float> col;
+
+  for (long p_h_begin = 0; p_h_begin < p_h; p_h_begin += p_rows_per_band) {
+    long p_h_end = std::min(p_h, p_h_begin + p_rows_per_band);
+    long yy_h_begin = std::max(0l, p_h_begin * pool_stride - pool_pad);
+    long yy_h_end =
+        std::min(y_h, (p_h_end - 1) * pool_stride - pool_pad + pool_k);
+    if (algorithm == inference_engine::backend::CONV_ALGORITHM::Direct) {
+      yy_h_begin = 0;
+      yy_h_end = y_h;
+    }
+    long band_size = (yy_h_end - yy_h_begin) * y_w;
+
+    size_t rows_size = static_cast<size_t>(c_out) * band_size;
+    if (rows.size() < rows_size) {
+      rows.resize(rows_size);
+    }
+    // rows is thread_local, so the other threads reach it through this
+    // pointer. Every algorithm overwrites it, bias included.
+    float *rows_data = rows.data();
+
+    switch (algorithm) {
+    case inference_engine::backend::CONV_ALGORITHM::Winograd:
+      conv_winograd_rows(c_in, c_out, x_h, x_w, y_w, pad, kernel.m, yy_h_begin,
+                         yy_h_end, x, kernel.u, b, rows_data);
+      break;
+    case inference_engine::backend::CONV_ALGORITHM::Im2col: {
+      size_t col_size = static_cast<size_t>(c_in) * k * k * band_size;
+      if (col.size() < col_size) {
+        col.resize(col_size);
+      }
+      im2col_gemm_rows(c_in, c_out, x_h, x_w, y_w, k, pad, stride, yy_h_begin,
+                       yy_h_end, x, w, kernel.packed_w, b, 0.0f, col.data(),
+                       rows_data, band_size);
+      break;
+    }
+    default:
+      conv_direct(c_in, c_out, x_h, x_w, y_h, y_w, k, pad, stride, x, w, b,
+                  rows_data);
+      break;
+    }
+
+    // Relu and MaxPool in one pass. Starting every window from zero applies
+    // relu, and is the same as counting the padding of MaxPool as zero.
+    inference_engine::parallel::parallel_for(
+        c_out,
+        [&](long begin, long end) {
+          for (long cc_out = begin; cc_out < end; ++cc_out) {
+            const float *rows_c = rows_data + cc_out * band_size;
+            float *p_c = y + cc_out * p_h * p_w;
+
+            for (long pp_h = p_h_begin; pp_h < p_h_end; ++pp_h) {
+              long r_begin = std::max(0l, pp_h * pool_stride - pool_pad);
+              long r_end =
+                  std::min(y_h, pp_h * pool_stride - pool_pad + pool_k);
+              for (long pp_w = 0; pp_w < p_w; ++pp_w) {
+                long c_begin = std::max(0l, pp_w * pool_stride - pool_pad);
+                long c_end =
+                    std::min(y_w, pp_w * pool_stride - pool_pad + pool_k);
+                float max_element = 0.0f;
+                for (long r = r_begin; r < r_end; ++r) {
+                  const float *row = rows_c + (r - yy_h_begin) * y_w;
+                  for (long c = c_begin; c < c_end; ++c) {
+                    max_element = std::max(max_element, row[c]);
+                  }
+                }
+                p_c[pp_h * p_w + pp_w] = max_element;
+              }
+            }
+          }
+        },
+        inference_engine::parallel::SCHEDULE::Static,
+        std::max(1l, static_cast<long>(PARALLEL_MIN_CHUNK_WORK / band_size)));
+  }
+}
+
+inference_engine::backend::CONV_ALGORITHM
+select_conv_algorithm(long c_in, long c_out, long y_h, long y_w, long k,
+                      long stride) {
+  // Lowering into the packed GEMM wins by an order of magnitude on any real
+  // layer. Only for tiny layers do the buffer and packing setup cost more
+  // than the direct loops.
+  long long macs = static_cast<long long>(c_out) * c_in * k * k * y_h * y_w;
+  if (macs < 4096) {
+    return inference_engine::backend::CONV_ALGORITHM::Direct;
+  }
+  // Winograd trades multiplications for input and output transforms, which
+  // are only amortized over enough channels. On small feature maps the
+  // partial tiles at the edges waste too much of the saving.
+  if (k == 3 && stride == 1 && c_in >= 16 && c_out >= 16 &&
+      y_h * y_w >= 28 * 28) {
+    return inference_engine::backend::CONV_ALGORITHM::Winograd;
+  }
+  return inference_engine::backend::CONV_ALGORITHM::Im2col;
+}
+
+inference_engine::backend::conv_kernel
+bind_conv_kernel(long c_in, long c_out, long y_h, long y_w, long k,
+                 long stride, const float *w) {
+  inference_engine::backend::conv_kernel kernel;
+  kernel.algorithm = select_conv_algorithm(c_in, c_out, y_h, y_w, k, stride);
+  kernel.m = winograd_tile_size();
+  kernel.w = w;
+  kernel.u = nullptr;
+  kernel.packed_w = nullptr;
+  switch (kernel.algorithm) {
+  case inference_engine::backend::CONV_ALGORITHM::Winograd:
+    kernel.u = cached_winograd_kernel(c_in, c_out, kernel.m, w);
+    break;
+  case inference_engine::backend::CONV_ALGORITHM::Im2col:
+    kernel.packed_w = cached_im2col_kernel(c_in, c_out, k, w);
+    break;
+  default:
+    break;
+  }
+  return kernel;
+}
+
+} // namespace backend
+} // namespace inference_engine
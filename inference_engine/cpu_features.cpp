@@ -0,0 +1,84 @@
+#include "cpu_features.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+
+namespace inference_engine {
+namespace cpu_features {
+
+inference_engine::cpu_features::ISA query_cpuid() {
+#if defined(INFERENCE_ENGINE_X86_KERNELS) &&                                   \
+    (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  // __builtin_cpu_supports also checks that the OS saves the wider register
+  // state (XGETBV), so a level reported here is safe to execute.
+  if (__builtin_cpu_supports("avx512f")) {
+    return inference_engine::cpu_features::ISA::AVX512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return inference_engine::cpu_features::ISA::AVX2;
+  }
+  if (__builtin_cpu_supports("sse4.2")) {
+    return inference_engine::cpu_features::ISA::SSE;
+  }
+#endif
+  return inference_engine::cpu_features::ISA::Generic;
+}
+
+inference_engine::cpu_features::ISA detect_isa() {
+  static const inference_engine::cpu_features::ISA isa = query_cpuid();
+  return isa;
+}
+
+inference_engine::cpu_features::ISA requested_isa() {
+  inference_engine::cpu_features::ISA isa = detect_isa();
+
+  const char *forced = std::getenv(ISA_ENV_NAME);
+  if (forced == nullptr || *forced == '\0') {
+    return isa;
+  }
+
+  inference_engine::cpu_features::ISA forced_isa = parse_isa(forced);
+  if (forced_isa > isa) {
+    std::cerr << ISA_ENV_NAME << "=" << forced
+              << " is not supported on this CPU, using " << isa_name(isa)
+              << std::endl;
+    return isa;
+  }
+  return forced_isa;
+}
+
+std::string isa_name(inference_engine::cpu_features::ISA isa) {
+  switch (isa) {
+  case inference_engine::cpu_features::ISA::Generic:
+    return "generic";
+  case inference_engine::cpu_features::ISA::SSE:
+    return "sse";
+  case inference_engine::cpu_features::ISA::AVX2:
+    return "avx2";
+  case inference_engine::cpu_features::ISA::AVX512:
+    return "avx512";
+  }
+  throw std::runtime_error("unknown ISA: " + std::to_string(isa));
+}
+
+inference_engine::cpu_features::ISA parse_isa(std::string const &name) {
+  std::string lower_name(name);
+  std::transform(lower_name.begin(), lower_name.end(), lower_name.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+
+  for (inference_engine::cpu_features::ISA isa :
+       {inference_engine::cpu_features::ISA::Generic,
+        inference_engine::cpu_features::ISA::SSE,
+        inference_engine::cpu_features::ISA::AVX2,
+        inference_engine::cpu_features::ISA::AVX512}) {
+    if (isa_name(isa) == lower_name) {
+      return isa;
+    }
+  }
+  throw std::runtime_error("unknown ISA: " + name);
+}
+} // namespace cpu_features
+} // namespace inference_engine
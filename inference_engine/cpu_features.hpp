@@ -0,0 +1,38 @@
+#ifndef CPU_FEATURES_HPP
+#define CPU_FEATURES_HPP
+
+#include <string>
+
+namespace inference_engine {
+namespace cpu_features {
+
+// The instruction set levels the backend kernels are compiled for.
+// They are ordered so that a higher level implies every lower one.
+//   Generic: the compiler's baseline target (SSE2 on x86-64)
+//   SSE: SSE4.2
+//   AVX2: AVX2 + FMA (Haswell and later)
+//   AVX512: AVX-512F (Skylake-SP, Ice Lake and later)
+enum ISA { Generic, SSE, AVX2, AVX512 };
+
+// The environment variable which forces an ISA level,
+// e.g. `INFERENCE_ENGINE_ISA=avx2`. Accepted values are the ones returned by
+// `isa_name`. A level which the CPU does not support is lowered to the best
+// supported one.
+constexpr const char *ISA_ENV_NAME = "INFERENCE_ENGINE_ISA";
+
+// Return the highest ISA level which both this CPU and this build support.
+// CPUID is queried only on the first call.
+inference_engine::cpu_features::ISA detect_isa();
+
+// Return the ISA level the backend should use: `detect_isa()` unless it is
+// lowered by `ISA_ENV_NAME`.
+inference_engine::cpu_features::ISA requested_isa();
+
+std::string isa_name(inference_engine::cpu_features::ISA isa);
+
+// Throw std::runtime_error if the name is not one of `isa_name`'s values.
+inference_engine::cpu_features::ISA parse_isa(std::string const &name);
+} // namespace cpu_features
+} // namespace inference_engine
+
+#endif
@@ -0,0 +1,396 @@
+#include "engine.hpp"
+#include "kernels.hpp"
+#include "memory.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <sys/stat.h>
+
+namespace inference_engine {
+namespace inferer {
+namespace {
+
+constexpr char ENGINE_MAGIC[8] = {'I', 'E', 'E', 'N', 'G', 'I', 'N', 'E'};
+
+// The header at the start of an engine file. The graph and the index follow
+// it, and the weights start at weights_offset, a multiple of
+// `ENGINE_PAGE_SIZE`. Every field is aligned to its size, so the struct has
+// no padding and is written as it is.
+struct engine_header {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t isa;
+  std::uint32_t gemm_mr;
+  std::uint32_t gemm_nr;
+  std::uint32_t winograd_tile;
+  std::uint32_t nchwc_block;
+  std::uint32_t layout;
+  std::uint32_t reserved;
+  std::int64_t model_size;
+  std::int64_t model_mtime;
+  std::uint64_t model_hash;
+  std::uint64_t graph_size;
+  std::uint64_t index_size;
+  std::uint64_t weights_offset;
+};
+
+// The records of the index
+//   InitializerRecord: name, offset and bytes of an initializer
+//   PackedRecord: the name of a B stored packed in a GemmRecord
+//   GemmRecord: the output of a Gemm and its `gemm_weights`
+//   KernelRecord: a `kernel_transform` and its transformed kernel
+// Offsets are from weights_offset.
+enum RECORD { InitializerRecord, PackedRecord, GemmRecord, KernelRecord };
+
+// Fill the fields of header which the weights depend on for this build.
+void set_build(engine_header &header) {
+  const inference_engine::backend::kernels::kernel_table &kernels =
+      inference_engine::backend::kernels::active();
+  std::memcpy(header.magic, ENGINE_MAGIC, sizeof(ENGINE_MAGIC));
+  header.version = ENGINE_FORMAT_VERSION;
+  header.isa = static_cast<std::uint32_t>(kernels.isa);
+  header.gemm_mr = static_cast<std::uint32_t>(kernels.gemm_mr);
+  header.gemm_nr = static_cast<std::uint32_t>(kernels.gemm_nr);
+  header.winograd_tile = static_cast<std::uint32_t>(
+      inference_engine::backend::winograd_tile_size());
+  header.nchwc_block =
+      static_cast<std::uint32_t>(inference_engine::backend::NCHWC_BLOCK);
+}
+
+bool matches_build(engine_header const &header) {
+  engine_header build;
+  set_build(build);
+  return std::memcmp(header.magic, build.magic, sizeof(build.magic)) == 0 &&
+         header.version == build.version && header.isa == build.isa &&
+         header.gemm_mr == build.gemm_mr && header.gemm_nr == build.gemm_nr &&
+         header.winograd_tile == build.winograd_tile &&
+         header.nchwc_block == build.nchwc_block;
+}
+
+std::uint64_t page_aligned(std::uint64_t bytes) {
+  return (bytes + ENGINE_PAGE_SIZE - 1) / ENGINE_PAGE_SIZE * ENGINE_PAGE_SIZE;
+}
+
+template <typename T> void append(std::string &out, T value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+void append_string(std::string &out, std::string const &value) {
+  append<std::uint64_t>(out, value.size());
+  out.append(value);
+}
+
+// Read the fields of the index of an engine file in the order they were
+// appended.
+struct index_reader {
+  const char *data;
+  size_t size;
+  std::string const &path;
+  size_t position = 0;
+
+  void require(size_t bytes) const {
+    if (bytes > size - position) {
+      throw std::runtime_error("the engine file is truncated: " + path);
+    }
+  }
+
+  template <typename T> T read() {
+    require(sizeof(T));
+    T value;
+    std::memcpy(&value, data + position, sizeof(T));
+    position += sizeof(T);
+    return value;
+  }
+
+  std::string read_string() {
+    std::uint64_t length = read<std::uint64_t>();
+    require(length);
+    std::string value(data + position, length);
+    position += length;
+    return value;
+  }
+};
+
+} // namespace
+
+inference_engine::inferer::model_key
+read_model_key(std::string const &model_path, bool hash) {
+  struct stat status;
+  if (stat(model_path.c_str(), &status) != 0) {
+    throw std::runtime_error("cannot read the model file: " + model_path);
+  }
+  inference_engine::inferer::model_key key;
+  key.size = static_cast<long long>(status.st_size);
+  key.mtime = static_cast<long long>(status.st_mtim.tv_sec) * 1000000000ll +
+              status.st_mtim.tv_nsec;
+  key.hash = 0;
+  if (hash) {
+    key.hash = 14695981039346656037ull;
+    if (key.size > 0) {
+      inference_engine::memory::mapped_file file(model_path);
+      const unsigned char *bytes =
+          reinterpret_cast<const unsigned char *>(file.data());
+      for (size_t i = 0; i < file.size(); ++i) {
+        key.hash = (key.hash ^ bytes[i]) * 1099511628211ull;
+      }
+    }
+  }
+  return key;
+}
+
+bool engine_file_matches(std::string const &engine_path,
+                         std::string const &model_path,
+                         inference_engine::inferer::LAYOUT layout) {
+  std::ifstream file(engine_path, std::ios::binary);
+  engine_header header;
+  if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      !matches_build(header) ||
+      header.layout != static_cast<std::uint32_t>(layout)) {
+    return false;
+  }
+
+  inference_engine::inferer::model_key key = read_model_key(model_path, false);
+  if (key.size != header.model_size) {
+    return false;
+  }
+  // A file which was only touched, or copied, is the same model.
+  return key.mtime == header.model_mtime ||
+         read_model_key(model_path, true).hash == header.model_hash;
+}
+
+inference_engine::inferer::engine_model
+map_engine_file(std::string const &engine_path) {
+  inference_engine::inferer::engine_model result;
+  std::shared_ptr<const inference_engine::memory::mapped_file> file =
+      std::make_shared<const inference_engine::memory::mapped_file>(
+          engine_path);
+  result.model.file = file;
+
+  engine_header header;
+  if (file->size() < sizeof(header)) {
+    throw std::runtime_error("the engine file is truncated: " + engine_path);
+  }
+  std::memcpy(&header, file->data(), sizeof(header));
+  if (!matches_build(header)) {
+    throw std::runtime_error("not an engine file of this build: " +
+                             engine_path);
+  }
+  if (header.graph_size + header.index_size >
+          file->size() - sizeof(header) ||
+      header.weights_offset > file->size()) {
+    throw std::runtime_error("the engine file is truncated: " + engine_path);
+  }
+  result.layout = static_cast<inference_engine::inferer::LAYOUT>(header.layout);
+
+  const char *graph = file->data() + sizeof(header);
+  if (!result.model.model.ParseFromArray(graph,
+                                         static_cast<int>(header.graph_size))) {
+    throw std::runtime_error("engine file parse error: " + engine_path);
+  }
+
+  // The weights are shared with the mapping, which they keep alive.
+  const size_t weights_size = file->size() - header.weights_offset;
+  auto weights = [&](std::uint64_t offset,
+                     std::uint64_t bytes) -> std::shared_ptr<float> {
+    if (offset > weights_size || bytes > weights_size - offset) {
+      throw std::runtime_error("the engine file is truncated: " + engine_path);
+    }
+    return std::shared_ptr<float>(
+        file, reinterpret_cast<float *>(const_cast<char *>(file->data()) +
+                                        header.weights_offset + offset));
+  };
+
+  index_reader index{graph + header.graph_size, header.index_size,
+                     engine_path};
+  while (index.position < index.size) {
+    switch (index.read<std::uint32_t>()) {
+    case InitializerRecord: {
+      std::string name = index.read_string();
+      std::uint64_t offset = index.read<std::uint64_t>();
+      std::uint64_t bytes = index.read<std::uint64_t>();
+      weights(offset, bytes);
+      result.model.raw_data[name] = {header.weights_offset + offset, bytes};
+      break;
+    }
+    case PackedRecord:
+      result.packed.insert(index.read_string());
+      break;
+    case GemmRecord: {
+      std::string output = index.read_string();
+      inference_engine::inferer::gemm_weights gemm;
+      gemm.packed_b.rows = index.read<std::int64_t>();
+      gemm.packed_b.columns = index.read<std::int64_t>();
+      gemm.packed_b.panel_width = index.read<std::int64_t>();
+      gemm.packed_b.size = index.read<std::int64_t>();
+      gemm.packed_b.data = weights(index.read<std::uint64_t>(),
+                                   gemm.packed_b.size * sizeof(float));
+      gemm.alpha = index.read<float>();
+      gemm.transpose_a = index.read<std::uint8_t>() != 0;
+      gemm.column_bias.resize(index.read<std::uint64_t>());
+      for (float &bias : gemm.column_bias) {
+        bias = index.read<float>();
+      }
+      result.gemm_weights[output] = gemm;
+      break;
+    }
+    case KernelRecord: {
+      inference_engine::inferer::kernel_transform transform;
+      transform.layout = static_cast<inference_engine::inferer::KERNEL_LAYOUT>(
+          index.read<std::uint32_t>());
+      transform.weight = index.read_string();
+      transform.c_in = index.read<std::int64_t>();
+      transform.c_out = index.read<std::int64_t>();
+      transform.size = index.read<std::int64_t>();
+      inference_engine::backend::packed_matrix kernel;
+      kernel.rows = index.read<std::int64_t>();
+      kernel.columns = index.read<std::int64_t>();
+      kernel.panel_width = index.read<std::int64_t>();
+      kernel.size = index.read<std::int64_t>();
+      kernel.data =
+          weights(index.read<std::uint64_t>(), kernel.size * sizeof(float));
+      result.kernels.push_back(std::make_pair(transform, kernel));
+      break;
+    }
+    default:
+      throw std::runtime_error("unknown record in the engine file: " +
+                               engine_path);
+    }
+  }
+  return result;
+}
+
+void write_engine_file(
+    std::string const &engine_path,
+    inference_engine::inferer::model_key const &key,
+    inference_engine::inferer::LAYOUT layout, ::onnx::GraphProto const &graph,
+    std::map<std::string, inference_engine::onnx::parameter> const &table,
+    std::map<std::string, inference_engine::inferer::gemm_weights> const
+        &gemm_weights,
+    std::vector<std::pair<inference_engine::inferer::kernel_transform,
+                          inference_engine::backend::packed_matrix>> const
+        &kernels) {
+  // The graph is copied without its initializers, which are added back
+  // without their data.
+  ::onnx::ModelProto model;
+  ::onnx::GraphProto &skeleton = *model.mutable_graph();
+  skeleton.set_name(graph.name());
+  *skeleton.mutable_node() = graph.node();
+  *skeleton.mutable_input() = graph.input();
+  *skeleton.mutable_output() = graph.output();
+  *skeleton.mutable_value_info() = graph.value_info();
+
+  std::string index;
+  std::vector<std::pair<const char *, size_t>> blobs;
+  std::uint64_t weights_size = 0;
+  // Append a weight, and return its offset from the start of the weights.
+  auto add_weight = [&](const void *data, size_t bytes) {
+    std::uint64_t offset = weights_size;
+    blobs.push_back(std::make_pair(static_cast<const char *>(data), bytes));
+    weights_size += page_aligned(bytes);
+    return offset;
+  };
+
+  for (::onnx::TensorProto const &initializer : graph.initializer()) {
+    inference_engine::onnx::parameter const &parameter =
+        table.at(initializer.name());
+    if (!parameter.has_data()) {
+      append<std::uint32_t>(index, PackedRecord);
+      append_string(index, initializer.name());
+      continue;
+    }
+    ::onnx::TensorProto *tensor = skeleton.add_initializer();
+    tensor->set_name(initializer.name());
+    *tensor->mutable_dims() = initializer.dims();
+    tensor->set_data_type(initializer.data_type());
+
+    size_t bytes = parameter.total_size *
+                   inference_engine::onnx::element_size(parameter.data_type);
+    append<std::uint32_t>(index, InitializerRecord);
+    append_string(index, initializer.name());
+    append<std::uint64_t>(index, add_weight(parameter.bytes(), bytes));
+    append<std::uint64_t>(index, bytes);
+  }
+
+  for (auto const &entry : gemm_weights) {
+    inference_engine::backend::packed_matrix const &b = entry.second.packed_b;
+    append<std::uint32_t>(index, GemmRecord);
+    append_string(index, entry.first);
+    append<std::int64_t>(index, b.rows);
+    append<std::int64_t>(index, b.columns);
+    append<std::int64_t>(index, b.panel_width);
+    append<std::int64_t>(index, b.size);
+    append<std::uint64_t>(index,
+                          add_weight(b.data.get(), b.size * sizeof(float)));
+    append<float>(index, entry.second.alpha);
+    append<std::uint8_t>(index, entry.second.transpose_a);
+    append<std::uint64_t>(index, entry.second.column_bias.size());
+    for (float bias : entry.second.column_bias) {
+      append<float>(index, bias);
+    }
+  }
+
+  for (auto const &entry : kernels) {
+    inference_engine::inferer::kernel_transform const &transform =
+        entry.first;
+    inference_engine::backend::packed_matrix const &kernel = entry.second;
+    append<std::uint32_t>(index, KernelRecord);
+    append<std::uint32_t>(index, transform.layout);
+    append_string(index, transform.weight);
+    append<std::int64_t>(index, transform.c_in);
+    append<std::int64_t>(index, transform.c_out);
+    append<std::int64_t>(index, transform.size);
+    append<std::int64_t>(index, kernel.rows);
+    append<std::int64_t>(index, kernel.columns);
+    append<std::int64_t>(index, kernel.panel_width);
+    append<std::int64_t>(index, kernel.size);
+    append<std::uint64_t>(
+        index, add_weight(kernel.data.get(), kernel.size * sizeof(float)));
+  }
+
+  std::string serialized;
+  if (!model.SerializeToString(&serialized)) {
+    throw std::runtime_error("cannot serialize the graph for " + engine_path);
+  }
+
+  engine_header header;
+  set_build(header);
+  header.layout = static_cast<std::uint32_t>(layout);
+  header.reserved = 0;
+  header.model_size = key.size;
+  header.model_mtime = key.mtime;
+  header.model_hash = key.hash;
+  header.graph_size = serialized.size();
+  header.index_size = index.size();
+  header.weights_offset =
+      page_aligned(sizeof(header) + serialized.size() + index.size());
+
+  std::string temporary_path = engine_path + ".tmp";
+  {
+    std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+    const std::vector<char> padding(ENGINE_PAGE_SIZE, 0);
+    auto pad = [&](size_t bytes) {
+      file.write(padding.data(), page_aligned(bytes) - bytes);
+    };
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(serialized.data(), serialized.size());
+    file.write(index.data(), index.size());
+    pad(sizeof(header) + serialized.size() + index.size());
+    for (auto const &blob : blobs) {
+      file.write(blob.first, blob.second);
+      pad(blob.second);
+    }
+    if (!file.flush()) {
+      std::remove(temporary_path.c_str());
+      throw std::runtime_error("cannot write the engine file: " +
+                               engine_path);
+    }
+  }
+  if (std::rename(temporary_path.c_str(), engine_path.c_str()) != 0) {
+    std::remove(temporary_path.c_str());
+    throw std::runtime_error("cannot write the engine file: " + engine_path);
+  }
+}
+} // namespace inferer
+} // namespace inference_engine
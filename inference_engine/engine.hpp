@@ -0,0 +1,110 @@
+#ifndef ENGINE_HPP
+#define ENGINE_HPP
+
+#include "backend.hpp"
+#include "inferer.hpp"
+#include "onnx.hpp"
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace inference_engine {
+namespace inferer {
+
+// An engine file holds a model as a session compiled it, so that a later
+// process loads it without parsing the weights of the ONNX file or
+// transforming them again. It is laid out as
+//   a header: the format version, the build the weights were laid out for
+//     (ISA level, gemm panel widths, Winograd tile, NCHWc block), the layout
+//     of the session and the `model_key` of the ONNX file
+//   the graph of the model without the data of its initializers, which the
+//     session compiles as it would the ONNX graph
+//   an index locating each weight
+//   the weights, each starting on a page (`ENGINE_PAGE_SIZE` bytes): the
+//     initializers the kernels read as they are, the B of the Gemm nodes
+//     packed for `backend::gemm_packed` and the Conv kernels transformed as
+//     `plan_kernel_transforms` plans
+// Numbers are in the byte order of the host, and the weights in the layouts
+// of its kernels, so an engine file only loads on the build which wrote it.
+
+// The version of the engine file format, raised on every change to it
+constexpr std::uint32_t ENGINE_FORMAT_VERSION = 1;
+
+constexpr long ENGINE_PAGE_SIZE = 4096;
+
+// The ONNX file an engine file was compiled from
+// long long size/mtime: the size and modification time (in nanoseconds) of
+//   the file, which tell an unchanged file without reading it
+// uint64_t hash: the FNV-1a hash of the bytes of the file
+struct model_key {
+  long long size;
+  long long mtime;
+  std::uint64_t hash;
+};
+
+// Return the key of the ONNX file at model_path. The file is read to hash it
+// only if hash is set, and the hash is 0 otherwise.
+// Throw std::runtime_error if the file cannot be read.
+inference_engine::inferer::model_key
+read_model_key(std::string const &model_path, bool hash);
+
+// A model read from an engine file by `map_engine_file`
+// model: the graph with its weights in the mapping of the engine file, as
+//   from `onnx::map_onnx_model_from_file`. The B of the packed Gemm nodes are
+//   not among its initializers.
+// packed: the names of those B
+// gemm_weights: the weights of `prepack_weights` by the name of the Gemm
+//   output, packed in the mapping
+// kernels: the transformed Conv kernels. data holds `size` floats in the
+//   mapping, and for Im2colKernel is the whole packed matrix.
+// layout: the layout of the session which wrote the file
+struct engine_model {
+  inference_engine::onnx::mapped_model model;
+  std::set<std::string> packed;
+  std::map<std::string, inference_engine::inferer::gemm_weights> gemm_weights;
+  std::vector<std::pair<inference_engine::inferer::kernel_transform,
+                        inference_engine::backend::packed_matrix>>
+      kernels;
+  inference_engine::inferer::LAYOUT layout;
+};
+
+// Return whether the engine file at engine_path was written by this build
+// for the ONNX file at model_path and layout. The ONNX file is only hashed
+// when its size is unchanged but its modification time is not.
+// It is false if the engine file cannot be read.
+// Throw std::runtime_error if the ONNX file cannot be read.
+bool engine_file_matches(std::string const &engine_path,
+                         std::string const &model_path,
+                         inference_engine::inferer::LAYOUT layout);
+
+// Map the engine file at engine_path into memory and locate its weights.
+// Throw std::runtime_error if the file cannot be mapped, is not an engine
+// file of this build, or is truncated.
+inference_engine::inferer::engine_model
+map_engine_file(std::string const &engine_path);
+
+// Write an engine file to engine_path.
+// graph: the graph of the model. The data of its initializers is not read.
+// table: the weights of the initializers of graph. Those without data are
+//   the B of gemm_weights, which are stored packed instead.
+// kernels: as in `engine_model`
+// The file is written beside engine_path and renamed over it, so that a
+// reader never maps a partly written file.
+// Throw std::runtime_error if the file cannot be written.
+void write_engine_file(
+    std::string const &engine_path,
+    inference_engine::inferer::model_key const &key,
+    inference_engine::inferer::LAYOUT layout, ::onnx::GraphProto const &graph,
+    std::map<std::string, inference_engine::onnx::parameter> const &table,
+    std::map<std::string, inference_engine::inferer::gemm_weights> const
+        &gemm_weights,
+    std::vector<std::pair<inference_engine::inferer::kernel_transform,
+                          inference_engine::backend::packed_matrix>> const
+        &kernels);
+} // namespace inferer
+} // namespace inference_engine
+
+#endif
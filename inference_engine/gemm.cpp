@@ -0,0 +1,397 @@
+#include "backend.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace inference_engine {
+namespace backend {
+namespace {
+
+// Cache blocking. The register block (MR x NR) depends on the ISA and comes
+// from the kernel table.
+//   KC: depth of a packed micro-panel pair, sized so that one MR x KC panel of
+//       A and one KC x NR panel of B stay in L1.
+//   MC: rows of the packed A block, sized so that MC x KC stays in L2.
+//       A multiple of every MR.
+//   NC: columns of the packed B block, sized so that KC x NC stays in L3.
+//       A multiple of every NR.
+constexpr long GEMM_KC = 256;
+constexpr long GEMM_MC = 96;
+constexpr long GEMM_NC = 4096;
+
+// Products smaller than this many multiply-adds run on the calling thread,
+// where waking the pool would cost more than it saves.
+constexpr long long GEMM_PARALLEL_MIN_MACS = 1ll << 20;
+
+// The alignment of packed matrices, a cache line and a zmm register.
+constexpr size_t PACKED_MATRIX_ALIGNMENT = 64;
+
+// An operand of the product: a matrix in memory whose element (i, j) is at
+// data[i * row_stride + j * column_stride], or, if packed is not null, the
+// same matrix packed by `pack_gemm_a` or `pack_gemm_b`.
+struct operand {
+  const float *data;
+  long row_stride;
+  long column_stride;
+  const inference_engine::backend::packed_matrix *packed;
+};
+
+// Pack an mc x kc block of A into micro-panels of mr rows. Each micro-panel
+// is stored as kc columns of mr contiguous elements. Rows beyond mc are padded
+// with zero.
+void pack_a(long mc, long kc, long mr, const float *a, long row_stride,
+            long column_stride, float *packed_a) {
+  for (long i = 0; i < mc; i += mr) {
+    long m_r = std::min(mr, mc - i);
+    for (long p = 0; p < kc; ++p) {
+      const float *a_column = a + i * row_stride + p * column_stride;
+      for (long ii = 0; ii < m_r; ++ii) {
+        packed_a[ii] = a_column[ii * row_stride];
+      }
+      for (long ii = m_r; ii < mr; ++ii) {
+        packed_a[ii] = 0.0f;
+      }
+      packed_a += mr;
+    }
+  }
+}
+
+// Pack a kc x nc block of B into micro-panels of nr columns. Each micro-panel
+// is stored as kc rows of nr contiguous elements. Columns beyond nc are padded
+// with zero.
+void pack_b(long kc, long nc, long nr, const float *b, long row_stride,
+            long column_stride, float *packed_b) {
+  for (long j = 0; j < nc; j += nr) {
+    long n_r = std::min(nr, nc - j);
+    for (long p = 0; p < kc; ++p) {
+      const float *b_row = b + p * row_stride + j * column_stride;
+      for (long jj = 0; jj < n_r; ++jj) {
+        packed_b[jj] = b_row[jj * column_stride];
+      }
+      for (long jj = n_r; jj < nr; ++jj) {
+        packed_b[jj] = 0.0f;
+      }
+      packed_b += nr;
+    }
+  }
+}
+
+std::shared_ptr<float> allocate_packed(size_t size) {
+  void *data = nullptr;
+  if (posix_memalign(&data, PACKED_MATRIX_ALIGNMENT,
+                     std::max<size_t>(1, size) * sizeof(float)) != 0) {
+    throw std::bad_alloc();
+  }
+  return std::shared_ptr<float>(static_cast<float *>(data), std::free);
+}
+
+// Pack a whole rows x columns matrix whose element (i, j) is at
+// x[i * row_stride + j * column_stride] for the kernels bound now.
+// The panels run along the rows (as A) if is_a is set, and along the
+// columns (as B) otherwise. Every KC block of the depth is stored whole: the
+// panel starting at row or column r of the block at depth pc is at
+// pc * padded + r * kc, where padded is the panelled dimension rounded up to
+// the panel width. The gemm driver reads its blocks from there.
+inference_engine::backend::packed_matrix
+pack_matrix(long rows, long columns, const float *x, long row_stride,
+            long column_stride, bool is_a) {
+  const inference_engine::backend::kernels::kernel_table &kernels =
+      inference_engine::backend::kernels::active();
+
+  inference_engine::backend::packed_matrix result;
+  result.rows = rows;
+  result.columns = columns;
+  result.panel_width = is_a ? kernels.gemm_mr : kernels.gemm_nr;
+  long panelled = is_a ? rows : columns;
+  long depth = is_a ? columns : rows;
+  long padded = (panelled + result.panel_width - 1) / result.panel_width *
+                result.panel_width;
+  result.size = static_cast<long long>(padded) * depth;
+  result.data = allocate_packed(static_cast<size_t>(result.size));
+  float *data = result.data.get();
+
+  // Packing the weights of a large layer is worth the pool.
+  inference_engine::parallel::parallel_for(
+      (depth + GEMM_KC - 1) / GEMM_KC, [&](long begin, long end) {
+        for (long block = begin; block < end; ++block) {
+          long pc = block * GEMM_KC;
+          long kc = std::min(GEMM_KC, depth - pc);
+          if (is_a) {
+            pack_a(rows, kc, result.panel_width, x + pc * column_stride,
+                   row_stride, column_stride, data + pc * padded);
+          } else {
+            pack_b(kc, columns, result.panel_width, x + pc * row_stride,
+                   row_stride, column_stride, data + pc * padded);
+          }
+        }
+      });
+  return result;
+}
+
+void check_packed(inference_engine::backend::packed_matrix const &packed,
+                  long rows, long columns, long panel_width) {
+  if (packed.rows != rows || packed.columns != columns) {
+    throw std::runtime_error(
+        "the packed matrix is " + std::to_string(packed.rows) + " x " +
+        std::to_string(packed.columns) + ", but the product needs " +
+        std::to_string(rows) + " x " + std::to_string(columns));
+  }
+  if (packed.panel_width != panel_width) {
+    throw std::runtime_error("the matrix was packed for other kernels than "
+                             "the bound ones, pack it again");
+  }
+}
+
+// Calculate C[m * n] = epilogue(A[m x k] * B[k * n] + D[m * n]), where either
+// operand may be packed.
+void gemm_blocked(long m, long n, long k, operand const &a, operand const &b,
+                  float *c, long ldc, const float *d,
+                  inference_engine::backend::gemm_epilogue const &epilogue) {
+  const inference_engine::backend::kernels::kernel_table &kernels =
+      inference_engine::backend::kernels::active();
+  const long mr = kernels.gemm_mr;
+  const long nr = kernels.gemm_nr;
+  if (a.packed != nullptr) {
+    check_packed(*a.packed, m, k, mr);
+  }
+  if (b.packed != nullptr) {
+    check_packed(*b.packed, k, n, nr);
+  }
+
+  if (k <= 0) {
+    // The product is empty, but D and the epilogue still apply.
+    for (long i = 0; i < m; ++i) {
+      for (long j = 0; j < n; ++j) {
+        float value =
+            epilogue.beta != 0.0f ? epilogue.beta * c[i * ldc + j] : 0.0f;
+        if (d != nullptr) {
+          value += d[i * ldc + j];
+        }
+        if (epilogue.row_bias != nullptr) {
+          value += epilogue.row_bias[i];
+        }
+        if (epilogue.column_bias != nullptr) {
+          value += epilogue.column_bias[j];
+        }
+        c[i * ldc + j] = epilogue.relu && value < 0.0f ? 0.0f : value;
+      }
+    }
+    return;
+  }
+
+  if (n == 1 && a.packed == nullptr && b.packed == nullptr &&
+      a.row_stride == k && a.column_stride == 1 && b.row_stride == 1 &&
+      ldc == 1) {
+    // Rows of A are independent and streamed once, so they are split
+    // evenly. A grain of 64 rows keeps small products on one thread.
+    return inference_engine::parallel::parallel_for(
+        m,
+        [&](long begin, long end) {
+          kernels.gemv(end - begin, k, a.data + begin * k, b.data,
+                       c + begin, d == nullptr ? nullptr : d + begin,
+                       epilogue.alpha, epilogue.beta,
+                       epilogue.row_bias == nullptr
+                           ? nullptr
+                           : epilogue.row_bias + begin,
+                       epilogue.column_bias, epilogue.relu);
+        },
+        inference_engine::parallel::SCHEDULE::Static, 64);
+  }
+
+  // Each k block of A and B is packed once into buffers which every thread
+  // reads, unless the operand was packed beforehand. The buffers belong to
+  // the calling thread and are reused across calls so that the hot path does
+  // not allocate.
+  static thread_local std::vector<float> packed_a;
+  static thread_local std::vector<float> packed_b;
+
+  long kc_max = std::min(GEMM_KC, k);
+  long nc_max = std::min(GEMM_NC, n);
+  long m_blocks = (m + GEMM_MC - 1) / GEMM_MC;
+  size_t packed_a_size = m_blocks * ((GEMM_MC + mr - 1) / mr) * mr * kc_max;
+  size_t packed_b_size = ((nc_max + nr - 1) / nr) * nr * kc_max;
+  if (a.packed == nullptr && packed_a.size() < packed_a_size) {
+    packed_a.resize(packed_a_size);
+  }
+  if (b.packed == nullptr && packed_b.size() < packed_b_size) {
+    packed_b.resize(packed_b_size);
+  }
+  // The buffers are thread_local, so the other threads reach them through
+  // these pointers.
+  float *packed_a_data = packed_a.data();
+  float *packed_b_data = packed_b.data();
+  const long packed_a_block_size = ((GEMM_MC + mr - 1) / mr) * mr * kc_max;
+  // The rows and columns of a whole k block of a prepacked operand.
+  const long padded_m = (m + mr - 1) / mr * mr;
+  const long padded_n = (n + nr - 1) / nr * nr;
+  const bool is_parallel = static_cast<long long>(m) * n * k >=
+                           GEMM_PARALLEL_MIN_MACS;
+
+  for (long jc = 0; jc < n; jc += GEMM_NC) {
+    long nc = std::min(GEMM_NC, n - jc);
+    long n_panels = (nc + nr - 1) / nr;
+
+    // Work items are pairs of an MC block of rows and a group of NR panels.
+    // The groups are sized for a few items per thread, so that the dynamic
+    // schedule can balance them, but not smaller than needed.
+    long panels_per_item = std::max(
+        1l, m_blocks * n_panels /
+                (4 * inference_engine::parallel::num_threads()));
+    panels_per_item = std::min(panels_per_item, n_panels);
+    long n_groups = (n_panels + panels_per_item - 1) / panels_per_item;
+
+    for (long pc = 0; pc < k; pc += GEMM_KC) {
+      long kc = std::min(GEMM_KC, k - pc);
+      // Every k block is scaled by alpha, but D and the rest of the epilogue
+      // are applied exactly once, in the write-back of the last k block. The
+      // first k block scales C by beta, and the others add to it.
+      bool is_last_k_block = pc + kc == k;
+      float block_beta = pc == 0 ? epilogue.beta : 1.0f;
+      const float *block_row_bias =
+          is_last_k_block ? epilogue.row_bias : nullptr;
+      const float *block_column_bias =
+          is_last_k_block ? epilogue.column_bias : nullptr;
+      bool block_relu = is_last_k_block && epilogue.relu;
+
+      // The start of the k block of each operand. The panel of B starting at
+      // column jr of the block is at b_block + jr * kc, and the MC block of A
+      // starting at row ic is at a_block(ic), with its panels kc * mr apart.
+      const float *b_block = b.packed == nullptr
+                                 ? packed_b_data
+                                 : b.packed->data.get() + pc * padded_n +
+                                       jc * kc;
+      auto a_block = [&](long ic) -> const float * {
+        return a.packed == nullptr
+                   ? packed_a_data + ic / GEMM_MC * packed_a_block_size
+                   : a.packed->data.get() + pc * padded_m + ic * kc;
+      };
+
+      // Pack B panel by panel and A block by block.
+      long b_items = b.packed == nullptr ? n_panels : 0;
+      long a_items = a.packed == nullptr ? m_blocks : 0;
+      inference_engine::parallel::parallel_for(
+          b_items + a_items,
+          [&](long begin, long end) {
+            for (long item = begin; item < end; ++item) {
+              if (item < b_items) {
+                long jr = item * nr;
+                pack_b(kc, std::min(nr, nc - jr), nr,
+                       b.data + pc * b.row_stride + (jc + jr) * b.column_stride,
+                       b.row_stride, b.column_stride, packed_b_data + jr * kc);
+              } else {
+                long ic = (item - b_items) * GEMM_MC;
+                pack_a(std::min(GEMM_MC, m - ic), kc, mr,
+                       a.data + ic * a.row_stride + pc * a.column_stride,
+                       a.row_stride, a.column_stride,
+                       packed_a_data +
+                           (item - b_items) * packed_a_block_size);
+              }
+            }
+          },
+          inference_engine::parallel::SCHEDULE::Static,
+          is_parallel ? 1 : std::max(1l, b_items + a_items));
+
+      inference_engine::parallel::parallel_for(
+          m_blocks * n_groups,
+          [&](long begin, long end) {
+            for (long item = begin; item < end; ++item) {
+              long ic = (item / n_groups) * GEMM_MC;
+              long mc = std::min(GEMM_MC, m - ic);
+              long jr_begin = (item % n_groups) * panels_per_item * nr;
+              long jr_end = std::min(nc, jr_begin + panels_per_item * nr);
+              const float *a_panels = a_block(ic);
+
+              for (long jr = jr_begin; jr < jr_end; jr += nr) {
+                long n_r = std::min(nr, nc - jr);
+                const float *b_panel = b_block + jr * kc;
+
+                for (long ir = 0; ir < mc; ir += mr) {
+                  long m_r = std::min(mr, mc - ir);
+                  const float *a_panel = a_panels + ir * kc;
+                  long c_offset = (ic + ir) * ldc + jc + jr;
+
+                  kernels.gemm_micro_kernel(
+                      kc, a_panel, b_panel, c + c_offset, ldc, m_r, n_r,
+                      is_last_k_block && d != nullptr ? d + c_offset : nullptr,
+                      epilogue.alpha, block_beta,
+                      block_row_bias == nullptr ? nullptr
+                                                : block_row_bias + ic + ir,
+                      block_column_bias == nullptr
+                          ? nullptr
+                          : block_column_bias + jc + jr,
+                      block_relu);
+                }
+              }
+            }
+          },
+          inference_engine::parallel::SCHEDULE::Dynamic,
+          is_parallel ? 1 : m_blocks * n_groups);
+    }
+  }
+}
+
+} // namespace
+
+void gemm(long m, long n, long k, float *a, float *b, float *c, float *d) {
+  gemm_strided(m, n, k, a, k, b, n, c, n, d);
+}
+
+void gemm(long m, long n, long k, const float *a, const float *b, float *c,
+          inference_engine::backend::gemm_epilogue const &epilogue) {
+  gemm_strided(m, n, k, a, k, b, n, c, n, nullptr, epilogue);
+}
+
+void gemm_strided(long m, long n, long k, const float *a, long lda,
+                  const float *b, long ldb, float *c, long ldc,
+                  const float *d) {
+  gemm_strided(m, n, k, a, lda, b, ldb, c, ldc, d,
+               inference_engine::backend::gemm_epilogue());
+}
+
+void gemm_strided(long m, long n, long k, const float *a, long lda,
+                  const float *b, long ldb, float *c, long ldc,
+                  const float *d,
+                  inference_engine::backend::gemm_epilogue const &epilogue) {
+  gemm_blocked(m, n, k, {a, lda, 1, nullptr}, {b, ldb, 1, nullptr}, c, ldc, d,
+               epilogue);
+}
+
+inference_engine::backend::packed_matrix
+pack_gemm_a(long m, long k, const float *a, long lda, bool transpose) {
+  return transpose ? pack_matrix(m, k, a, 1, lda, true)
+                   : pack_matrix(m, k, a, lda, 1, true);
+}
+
+inference_engine::backend::packed_matrix
+pack_gemm_b(long k, long n, const float *b, long ldb, bool transpose) {
+  return transpose ? pack_matrix(k, n, b, 1, ldb, false)
+                   : pack_matrix(k, n, b, ldb, 1, false);
+}
+
+void gemm_packed(long m, long n, long k, const float *a, long lda,
+                 bool transpose_a,
+                 inference_engine::backend::packed_matrix const &b, float *c,
+                 long ldc,
+                 inference_engine::backend::gemm_epilogue const &epilogue) {
+  gemm_blocked(m, n, k,
+               {a, transpose_a ? 1 : lda, transpose_a ? lda : 1, nullptr},
+               {nullptr, 0, 0, &b}, c, ldc, nullptr, epilogue);
+}
+
+void gemm_packed(long m, long n, long k,
+                 inference_engine::backend::packed_matrix const &a,
+                 const float *b, long ldb, bool transpose_b, float *c,
+                 long ldc,
+                 inference_engine::backend::gemm_epilogue const &epilogue) {
+  gemm_blocked(m, n, k, {nullptr, 0, 0, &a},
+               {b, transpose_b ? 1 : ldb, transpose_b ? ldb : 1, nullptr}, c,
+               ldc, nullptr, epilogue);
+}
+
+} // namespace backend
+} // namespace inference_engine
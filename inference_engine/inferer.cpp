@@ -1,8 +1,85 @@
+#include "inferer.hpp"
+#include "parallel.hpp"
+#include <algorithm>
 #include <cmath>
+#include <stdexcept>
+#include <string>
 #include <utility>
 
 namespace inference_engine {
 namespace inferer {
+namespace {
+
+bool is_conv(inference_engine::onnx::OP_TYPE op_type) {
+  return op_type == inference_engine::onnx::OP_TYPE::Conv ||
+         op_type == inference_engine::onnx::OP_TYPE::ConvRelu ||
+         op_type == inference_engine::onnx::OP_TYPE::ConvReluMaxPool;
+}
+
+// Return the values of the INTS attribute name of node or, as later opsets
+// take them, of its INT64 initializer at input, or default_value if it has
+// neither.
+std::vector<long> ints_argument(
+    inference_engine::onnx::node const &node,
+    std::map<std::string, inference_engine::onnx::parameter> const &table,
+    std::string const &name, long input,
+    std::vector<long> const &default_value) {
+  if (node.attributes.count(name) != 0 || input >= node.input.size() ||
+      node.input[input].empty()) {
+    return ints_attribute(node, name, default_value);
+  }
+  auto it = table.find(node.input[input]);
+  if (it == table.end() ||
+      it->second.data_type !=
+          ::onnx::TensorProto_DataType::TensorProto_DataType_INT64 ||
+      it->second.data<long>() == nullptr) {
+    throw std::runtime_error(node.name + ": " + name +
+                             " must be an INT64 initializer");
+  }
+  const long *data = it->second.data<long>();
+  return std::vector<long>(data, data + it->second.total_size);
+}
+
+// Return axis counted from the front of rank dims.
+// Throw std::runtime_error if it is out of range.
+long normalize_axis(long axis, long rank) {
+  if (axis < -rank || axis >= rank) {
+    throw std::runtime_error("axis " + std::to_string(axis) +
+                             " is out of range for " + std::to_string(rank) +
+                             " dims");
+  }
+  return axis < 0 ? axis + rank : axis;
+}
+
+} // namespace
+
+long int_attribute(inference_engine::onnx::node const &node,
+                   std::string const &name, long default_value) {
+  auto it = node.attributes.find(name);
+  return it == node.attributes.end() || it->second.size == 0
+             ? default_value
+             : static_cast<long *>(it->second.data)[0];
+}
+
+std::vector<long> ints_attribute(inference_engine::onnx::node const &node,
+                                 std::string const &name,
+                                 std::vector<long> const &default_value) {
+  auto it = node.attributes.find(name);
+  if (it == node.attributes.end()) {
+    return default_value;
+  }
+  const long *data = static_cast<long *>(it->second.data);
+  return std::vector<long>(data, data + it->second.size);
+}
+
+float float_attribute(inference_engine::onnx::node const &node,
+                      std::string const &name, float default_value) {
+  auto it = node.attributes.find(name);
+  return it == node.attributes.end()
+             ? default_value
+             : static_cast<float *>(it->second.data)[0];
+}
+
 std::pair<long, long> calculate_conv_matrix_dims(long h, long w, long k,
                                                  long pad, long stride) {
   std::pair<long, long> result;
@@ -13,5 +90,668 @@ std::pair<long, long> calculate_conv_matrix_dims(long h, long w, long k,
 
   return result;
 }
+
+inference_engine::inferer::window
+window_attributes(inference_engine::onnx::node const &node,
+                  std::string const &prefix, long default_k_h,
+                  long default_k_w) {
+  // Return the values of an attribute with one value per dim of the window
+  // and per side, expanding a single value to all of them.
+  auto values = [&](std::string const &name,
+                    std::vector<long> const &default_value) {
+    std::vector<long> result = ints_attribute(node, prefix + name,
+                                              default_value);
+    if (result.size() == 1) {
+      result.assign(default_value.size(), result[0]);
+    }
+    if (result.size() != default_value.size()) {
+      throw std::runtime_error(
+          node.name + ": " + prefix + name + " has " +
+          std::to_string(result.size()) + " values, but " +
+          std::to_string(default_value.size()) + " are needed for 2 dims");
+    }
+    return result;
+  };
+  std::vector<long> k = values("kernel_shape", {default_k_h, default_k_w});
+  std::vector<long> strides = values("strides", {1, 1});
+  std::vector<long> pads = values("pads", {0, 0, 0, 0});
+
+  inference_engine::inferer::window window;
+  window.k_h = k[0];
+  window.k_w = k[1];
+  window.stride_h = strides[0];
+  window.stride_w = strides[1];
+  window.pad_top = pads[0];
+  window.pad_left = pads[1];
+  window.pad_bottom = pads[2];
+  window.pad_right = pads[3];
+  return window;
+}
+
+std::pair<long, long>
+calculate_conv_matrix_dims(long h, long w,
+                           inference_engine::inferer::window const &window) {
+  long padded_h = h + window.pad_top + window.pad_bottom;
+  long padded_w = w + window.pad_left + window.pad_right;
+  if (window.k_h <= 0 || window.k_w <= 0 || window.stride_h <= 0 ||
+      window.stride_w <= 0 || padded_h < window.k_h ||
+      padded_w < window.k_w) {
+    throw std::runtime_error(
+        "a " + std::to_string(window.k_h) + "x" + std::to_string(window.k_w) +
+        " window with strides " + std::to_string(window.stride_h) + "x" +
+        std::to_string(window.stride_w) + " does not fit into the padded " +
+        std::to_string(padded_h) + "x" + std::to_string(padded_w) + " input");
+  }
+  return std::make_pair((padded_h - window.k_h) / window.stride_h + 1,
+                        (padded_w - window.k_w) / window.stride_w + 1);
+}
+
+std::vector<long> reshape_dims(std::vector<long> const &input_dims,
+                               std::vector<long> const &shape,
+                               bool batch_override) {
+  long long total_size = 1;
+  for (long dim : input_dims) {
+    total_size *= dim;
+  }
+  std::vector<long> dims = shape;
+  if (batch_override && !dims.empty() && dims[0] == 1 &&
+      !input_dims.empty()) {
+    dims[0] = input_dims[0];
+  }
+
+  long inferred = -1;
+  long long known_size = 1;
+  for (long i = 0; i < static_cast<long>(dims.size()); ++i) {
+    if (dims[i] == 0 && i < static_cast<long>(input_dims.size())) {
+      dims[i] = input_dims[i];
+    }
+    if (dims[i] == -1 && inferred < 0) {
+      inferred = i;
+    } else if (dims[i] > 0) {
+      known_size *= dims[i];
+    } else {
+      throw std::runtime_error("Reshape: invalid dim " +
+                               std::to_string(shape[i]) + " at " +
+                               std::to_string(i));
+    }
+  }
+  if (inferred >= 0 && known_size > 0 && total_size % known_size == 0) {
+    dims[inferred] = static_cast<long>(total_size / known_size);
+    known_size = total_size;
+  }
+  if (known_size != total_size) {
+    throw std::runtime_error("Reshape: cannot reshape " +
+                             std::to_string(total_size) + " elements into " +
+                             std::to_string(known_size));
+  }
+  return dims;
+}
+
+std::vector<long> flatten_dims(std::vector<long> const &input_dims,
+                               long axis) {
+  long rank = static_cast<long>(input_dims.size());
+  axis = axis == rank ? rank : normalize_axis(axis, rank);
+  std::vector<long> dims = {1, 1};
+  for (long i = 0; i < rank; ++i) {
+    dims[i < axis ? 0 : 1] *= input_dims[i];
+  }
+  return dims;
+}
+
+std::vector<long> squeeze_dims(std::vector<long> const &input_dims,
+                               std::vector<long> const &axes) {
+  long rank = static_cast<long>(input_dims.size());
+  std::vector<bool> squeezed(rank, axes.empty());
+  for (long axis : axes) {
+    axis = normalize_axis(axis, rank);
+    if (input_dims[axis] != 1) {
+      throw std::runtime_error("Squeeze: dim " + std::to_string(axis) +
+                               " is " + std::to_string(input_dims[axis]) +
+                               ", not 1");
+    }
+    squeezed[axis] = true;
+  }
+  std::vector<long> dims;
+  for (long i = 0; i < rank; ++i) {
+    if (!squeezed[i] || input_dims[i] != 1) {
+      dims.push_back(input_dims[i]);
+    }
+  }
+  return dims;
+}
+
+std::vector<long> unsqueeze_dims(std::vector<long> const &input_dims,
+                                 std::vector<long> const &axes) {
+  long rank = static_cast<long>(input_dims.size() + axes.size());
+  std::vector<bool> inserted(rank, false);
+  for (long axis : axes) {
+    axis = normalize_axis(axis, rank);
+    if (inserted[axis]) {
+      throw std::runtime_error("Unsqueeze: axis " + std::to_string(axis) +
+                               " is given twice");
+    }
+    inserted[axis] = true;
+  }
+  std::vector<long> dims;
+  auto input_dim = input_dims.begin();
+  for (long i = 0; i < rank; ++i) {
+    dims.push_back(inserted[i] ? 1 : *input_dim++);
+  }
+  return dims;
+}
+
+std::vector<inference_engine::inferer::slice_range> slice_ranges(
+    inference_engine::onnx::node const &node,
+    std::map<std::string, inference_engine::onnx::parameter> const &table,
+    std::vector<long> const &input_dims) {
+  long rank = static_cast<long>(input_dims.size());
+  std::vector<long> starts = ints_argument(node, table, "starts", 1, {});
+  std::vector<long> ends = ints_argument(node, table, "ends", 2, {});
+  std::vector<long> axes = ints_argument(node, table, "axes", 3, {});
+  std::vector<long> steps = ints_argument(node, table, "steps", 4, {});
+  if (axes.empty()) {
+    for (long i = 0; i < static_cast<long>(starts.size()); ++i) {
+      axes.push_back(i);
+    }
+  }
+  if (steps.empty()) {
+    steps.assign(starts.size(), 1);
+  }
+  if (ends.size() != starts.size() || axes.size() != starts.size() ||
+      steps.size() != starts.size()) {
+    throw std::runtime_error(node.name +
+                             ": starts, ends, axes and steps differ in size");
+  }
+
+  std::vector<inference_engine::inferer::slice_range> ranges;
+  for (long dim : input_dims) {
+    ranges.push_back({0, 1, dim});
+  }
+  for (size_t i = 0; i < starts.size(); ++i) {
+    long axis = normalize_axis(axes[i], rank);
+    long dim = input_dims[axis];
+    if (steps[i] <= 0) {
+      throw std::runtime_error(node.name + ": only positive steps are "
+                                           "supported");
+    }
+    long start = starts[i] < 0 ? starts[i] + dim : starts[i];
+    long end = ends[i] < 0 ? ends[i] + dim : ends[i];
+    start = std::max(0l, std::min(start, dim));
+    end = std::max(0l, std::min(end, dim));
+    if (end <= start) {
+      throw std::runtime_error(node.name + ": the slice of dim " +
+                               std::to_string(axis) + " is empty");
+    }
+    ranges[axis] = {start, steps[i], (end - start + steps[i] - 1) / steps[i]};
+  }
+  return ranges;
+}
+
+std::map<std::string, inference_engine::inferer::tensor_shape>
+infer_shapes(
+    std::vector<inference_engine::onnx::node> const &nodes,
+    std::map<std::string, inference_engine::onnx::parameter> const &table,
+    bool batch_override) {
+  std::set<std::string> outputs;
+  for (inference_engine::onnx::node const &node : nodes) {
+    outputs.insert(node.output.begin(), node.output.end());
+  }
+  std::map<std::string, inference_engine::inferer::tensor_shape> shapes;
+  for (auto const &entry : table) {
+    if (outputs.count(entry.first) == 0) {
+      shapes[entry.first] = {entry.second.dims, entry.second.data_type};
+    }
+  }
+
+  for (inference_engine::onnx::node const &node : nodes) {
+    auto input =
+        [&](long i) -> inference_engine::inferer::tensor_shape const & {
+      auto it = i < node.input.size() ? shapes.find(node.input[i])
+                                      : shapes.end();
+      if (it == shapes.end()) {
+        throw std::runtime_error(node.name + ": the shape of input " +
+                                 std::to_string(i) + " is unknown");
+      }
+      return it->second;
+    };
+    auto require_dims = [&](std::vector<long> const &dims, size_t size,
+                            std::string const &what) {
+      if (dims.size() != size) {
+        throw std::runtime_error(node.name + ": " + what + " must have " +
+                                 std::to_string(size) + " dims, but has " +
+                                 std::to_string(dims.size()));
+      }
+    };
+
+    inference_engine::inferer::tensor_shape x = input(0);
+    inference_engine::inferer::tensor_shape y = x;
+    switch (node.op_type) {
+    case inference_engine::onnx::OP_TYPE::Conv:
+    case inference_engine::onnx::OP_TYPE::ConvRelu:
+    case inference_engine::onnx::OP_TYPE::ConvReluMaxPool: {
+      require_dims(x.dims, 4, "the input");
+      std::vector<long> const &w = input(1).dims;
+      require_dims(w, 4, "the kernel");
+      if (int_attribute(node, "group", 1) != 1) {
+        throw std::runtime_error(node.name +
+                                 ": grouped Conv is not supported");
+      }
+      if (w[1] != x.dims[1]) {
+        throw std::runtime_error(
+            node.name + ": the kernel has " + std::to_string(w[1]) +
+            " input channels, but the input " + std::to_string(x.dims[1]));
+      }
+      std::pair<long, long> y_dims = calculate_conv_matrix_dims(
+          x.dims[2], x.dims[3], window_attributes(node, "", w[2], w[3]));
+      if (node.op_type == inference_engine::onnx::OP_TYPE::ConvReluMaxPool) {
+        y_dims = calculate_conv_matrix_dims(
+            y_dims.first, y_dims.second,
+            window_attributes(node, "pool_", 1, 1));
+      }
+      y.dims = {x.dims[0], w[0], y_dims.first, y_dims.second};
+      break;
+    }
+
+    case inference_engine::onnx::OP_TYPE::MaxPool: {
+      require_dims(x.dims, 4, "the input");
+      std::pair<long, long> y_dims = calculate_conv_matrix_dims(
+          x.dims[2], x.dims[3], window_attributes(node, "", 1, 1));
+      y.dims = {x.dims[0], x.dims[1], y_dims.first, y_dims.second};
+      break;
+    }
+
+    case inference_engine::onnx::OP_TYPE::Gemm:
+    case inference_engine::onnx::OP_TYPE::GemmRelu: {
+      std::vector<long> const &b = input(1).dims;
+      require_dims(b, 2, "B");
+      bool transpose_b = int_attribute(node, "transB", 0) != 0;
+      long k = transpose_b ? b[1] : b[0];
+      long n = transpose_b ? b[0] : b[1];
+      long long a_size = 1;
+      for (long dim : x.dims) {
+        a_size *= dim;
+      }
+      if (int_attribute(node, "transA", 0) != 0) {
+        require_dims(x.dims, 2, "A with transA");
+      }
+      if (k <= 0 || a_size % k != 0) {
+        throw std::runtime_error(node.name + ": A has " +
+                                 std::to_string(a_size) +
+                                 " elements, which is no multiple of k = " +
+                                 std::to_string(k));
+      }
+      y.dims = {static_cast<long>(a_size / k), n};
+      break;
+    }
+
+    case inference_engine::onnx::OP_TYPE::Reshape: {
+      auto shape = table.find(node.input[1]);
+      if (shape == table.end() ||
+          shape->second.data_type !=
+              ::onnx::TensorProto_DataType::TensorProto_DataType_INT64 ||
+          shape->second.data<long>() == nullptr) {
+        throw std::runtime_error(node.name +
+                                 ": the shape must be an INT64 initializer");
+      }
+      const long *shape_data = shape->second.data<long>();
+      y.dims = reshape_dims(
+          x.dims,
+          std::vector<long>(shape_data,
+                            shape_data + shape->second.total_size),
+          batch_override);
+      break;
+    }
+
+    case inference_engine::onnx::OP_TYPE::Flatten:
+      y.dims = flatten_dims(x.dims, int_attribute(node, "axis", 1));
+      break;
+
+    case inference_engine::onnx::OP_TYPE::Squeeze:
+      y.dims = squeeze_dims(x.dims, ints_argument(node, table, "axes", 1, {}));
+      break;
+
+    case inference_engine::onnx::OP_TYPE::Unsqueeze:
+      y.dims =
+          unsqueeze_dims(x.dims, ints_argument(node, table, "axes", 1, {}));
+      break;
+
+    case inference_engine::onnx::OP_TYPE::Slice:
+      y.dims.clear();
+      for (inference_engine::inferer::slice_range const &range :
+           slice_ranges(node, table, x.dims)) {
+        y.dims.push_back(range.size);
+      }
+      break;
+
+    case inference_engine::onnx::OP_TYPE::Relu:
+    case inference_engine::onnx::OP_TYPE::Identity:
+    case inference_engine::onnx::OP_TYPE::Softmax:
+      break;
+
+    case inference_engine::onnx::OP_TYPE::Dropout:
+      if (node.output.size() > 1) {
+        shapes[node.output[1]] = {
+            x.dims, ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT};
+      }
+      break;
+
+    default:
+      throw std::runtime_error("not supported operator: " +
+                               std::to_string(node.op_type));
+    }
+    shapes[node.output[0]] = y;
+  }
+  return shapes;
+}
+
+std::map<std::string, inference_engine::inferer::LAYOUT>
+plan_nchwc_layouts(std::vector<inference_engine::onnx::node> const &nodes) {
+  std::map<std::string, inference_engine::inferer::LAYOUT> layouts;
+
+  for (inference_engine::onnx::node const &node : nodes) {
+    inference_engine::inferer::LAYOUT layout =
+        inference_engine::inferer::LAYOUT::NCHW;
+
+    if (node.op_type == inference_engine::onnx::OP_TYPE::Conv ||
+        node.op_type == inference_engine::onnx::OP_TYPE::ConvRelu ||
+        node.op_type == inference_engine::onnx::OP_TYPE::ConvReluMaxPool) {
+      layout = inference_engine::inferer::LAYOUT::NCHWc;
+    } else if (node.op_type == inference_engine::onnx::OP_TYPE::Relu ||
+               node.op_type == inference_engine::onnx::OP_TYPE::MaxPool ||
+               node.op_type == inference_engine::onnx::OP_TYPE::Identity) {
+      auto it = layouts.find(node.input[0]);
+      if (it != layouts.end()) {
+        layout = it->second;
+      }
+    }
+
+    for (std::string const &output : node.output) {
+      layouts[output] = layout;
+    }
+  }
+  return layouts;
+}
+
+std::vector<inference_engine::onnx::node>
+eliminate_dropouts(std::vector<inference_engine::onnx::node> const &nodes,
+                   std::set<std::string> const &graph_outputs) {
+  std::set<std::string> read;
+  for (inference_engine::onnx::node const &node : nodes) {
+    read.insert(node.input.begin(), node.input.end());
+  }
+  auto is_used = [&](std::string const &name) {
+    return read.count(name) != 0 || graph_outputs.count(name) != 0;
+  };
+
+  // The tensor each removed Dropout output stands for. A chain of Dropouts
+  // resolves to the input of the first one, since nodes are in topological
+  // order.
+  std::map<std::string, std::string> aliases;
+  std::vector<inference_engine::onnx::node> result;
+  for (inference_engine::onnx::node const &node : nodes) {
+    inference_engine::onnx::node rewritten = node;
+    for (std::string &input : rewritten.input) {
+      auto it = aliases.find(input);
+      if (it != aliases.end()) {
+        input = it->second;
+      }
+    }
+
+    if (rewritten.op_type != inference_engine::onnx::OP_TYPE::Dropout ||
+        (rewritten.output.size() > 1 && is_used(rewritten.output[1]))) {
+      result.push_back(rewritten);
+      continue;
+    }
+    if (graph_outputs.count(rewritten.output[0]) != 0) {
+      rewritten.op_type = inference_engine::onnx::OP_TYPE::Identity;
+      rewritten.input.DeleteSubrange(1, rewritten.input.size() - 1);
+      rewritten.output.DeleteSubrange(1, rewritten.output.size() - 1);
+      rewritten.attributes.clear();
+      result.push_back(rewritten);
+      continue;
+    }
+    aliases[rewritten.output[0]] = rewritten.input[0];
+  }
+  return result;
+}
+
+std::vector<inference_engine::onnx::node>
+fuse_nodes(std::vector<inference_engine::onnx::node> const &nodes,
+           std::set<std::string> const &graph_outputs) {
+  std::map<std::string, long> readers;
+  for (inference_engine::onnx::node const &node : nodes) {
+    for (std::string const &input : node.input) {
+      ++readers[input];
+    }
+  }
+  // Return the index of the node which alone reads the only output of
+  // nodes[i] if it is of op_type, or -1.
+  auto sole_reader = [&](long i, inference_engine::onnx::OP_TYPE op_type) {
+    inference_engine::onnx::node const &node = nodes[i];
+    if (node.output.size() != 1 || readers[node.output[0]] != 1 ||
+        graph_outputs.count(node.output[0]) != 0) {
+      return -1l;
+    }
+    for (long j = i + 1; j < static_cast<long>(nodes.size()); ++j) {
+      for (std::string const &input : nodes[j].input) {
+        if (input == node.output[0]) {
+          return nodes[j].op_type == op_type ? j : -1l;
+        }
+      }
+    }
+    return -1l;
+  };
+  std::vector<inference_engine::onnx::node> result;
+  std::vector<bool> is_fused(nodes.size(), false);
+  for (long i = 0; i < static_cast<long>(nodes.size()); ++i) {
+    if (is_fused[i]) {
+      continue;
+    }
+    inference_engine::onnx::node const &node = nodes[i];
+    bool is_conv = node.op_type == inference_engine::onnx::OP_TYPE::Conv;
+    bool is_gemm = node.op_type == inference_engine::onnx::OP_TYPE::Gemm;
+    long relu = is_conv || is_gemm
+                    ? sole_reader(i, inference_engine::onnx::OP_TYPE::Relu)
+                    : -1;
+    if (relu < 0) {
+      result.push_back(node);
+      continue;
+    }
+
+    inference_engine::onnx::node fused(
+        node.name,
+        is_conv ? inference_engine::onnx::OP_TYPE::ConvRelu
+                : inference_engine::onnx::OP_TYPE::GemmRelu,
+        node.input, nodes[relu].output, node.attributes);
+    is_fused[relu] = true;
+
+    long max_pool =
+        is_conv ? sole_reader(relu, inference_engine::onnx::OP_TYPE::MaxPool)
+                : -1;
+    if (max_pool >= 0) {
+      fused.op_type = inference_engine::onnx::OP_TYPE::ConvReluMaxPool;
+      fused.output = nodes[max_pool].output;
+      for (auto const &attribute : nodes[max_pool].attributes) {
+        fused.attributes.insert(
+            std::make_pair("pool_" + attribute.first, attribute.second));
+      }
+      is_fused[max_pool] = true;
+    }
+    result.push_back(fused);
+  }
+  return result;
+}
+
+std::vector<inference_engine::inferer::kernel_transform>
+plan_kernel_transforms(
+    std::vector<inference_engine::onnx::node> const &nodes,
+    std::map<std::string, inference_engine::onnx::parameter> const &table,
+    std::map<std::string, inference_engine::inferer::LAYOUT> const &layouts,
+    std::map<std::string, inference_engine::inferer::tensor_shape> const
+        &shapes) {
+  std::vector<inference_engine::inferer::kernel_transform> result;
+  std::set<std::pair<std::string, long>> planned;
+
+  for (inference_engine::onnx::node const &node : nodes) {
+    if (!is_conv(node.op_type)) {
+      continue;
+    }
+    inference_engine::onnx::parameter const &w = table.at(node.input[1]);
+    std::vector<long> const &x_dims = shapes.at(node.input[0]).dims;
+    inference_engine::inferer::kernel_transform transform;
+    transform.weight = node.input[1];
+    transform.c_out = w.dims[0];
+    transform.c_in = w.dims[1];
+    inference_engine::inferer::window window =
+        window_attributes(node, "", w.dims[2], w.dims[3]);
+
+    auto layout = layouts.find(node.output[0]);
+    if (layout != layouts.end() &&
+        layout->second == inference_engine::inferer::LAYOUT::NCHWc) {
+      transform.layout = inference_engine::inferer::KERNEL_LAYOUT::NchwcKernel;
+      transform.size = window.k_h;
+    } else {
+      std::pair<long, long> y_dims =
+          calculate_conv_matrix_dims(x_dims[2], x_dims[3], window);
+      switch (inference_engine::backend::select_conv_algorithm(
+          transform.c_in, transform.c_out, y_dims.first, y_dims.second,
+          window.k_h, window.stride_h)) {
+      case inference_engine::backend::CONV_ALGORITHM::Winograd:
+        transform.layout =
+            inference_engine::inferer::KERNEL_LAYOUT::WinogradKernel;
+        transform.size = inference_engine::backend::winograd_tile_size();
+        break;
+      case inference_engine::backend::CONV_ALGORITHM::Im2col:
+        transform.layout =
+            inference_engine::inferer::KERNEL_LAYOUT::Im2colKernel;
+        transform.size = window.k_h;
+        break;
+      default:
+        continue;
+      }
+    }
+    if (planned.insert(std::make_pair(transform.weight, transform.layout))
+            .second) {
+      result.push_back(transform);
+    }
+  }
+  return result;
+}
+
+std::map<std::string, inference_engine::inferer::gemm_weights> prepack_weights(
+    std::vector<inference_engine::onnx::node> const &nodes,
+    std::map<std::string, inference_engine::onnx::parameter> &table,
+    std::set<std::string> const &initializers,
+    std::map<std::string, inference_engine::inferer::LAYOUT> const &layouts,
+    std::map<std::string, inference_engine::inferer::tensor_shape> const
+        &shapes,
+    std::map<std::string, inference_engine::inferer::gemm_weights> const
+        &prepacked) {
+  std::map<std::string, inference_engine::inferer::gemm_weights> result;
+  std::set<std::string> packed_b_names;
+
+  for (inference_engine::onnx::node const &node : nodes) {
+    if (node.op_type != inference_engine::onnx::OP_TYPE::Gemm &&
+        node.op_type != inference_engine::onnx::OP_TYPE::GemmRelu) {
+      continue;
+    }
+    auto found = prepacked.find(node.output[0]);
+    if (found != prepacked.end()) {
+      result[node.output[0]] = found->second;
+      continue;
+    }
+    if (initializers.count(node.input[1]) == 0) {
+      throw std::runtime_error("Gemm " + node.name +
+                               ": B must be an initializer");
+    }
+    inference_engine::onnx::parameter const &b = table.at(node.input[1]);
+    bool transpose_b = int_attribute(node, "transB", 0) != 0;
+    long k = transpose_b ? b.dims[1] : b.dims[0];
+    long n = transpose_b ? b.dims[0] : b.dims[1];
+
+    inference_engine::inferer::gemm_weights weights;
+    weights.packed_b = inference_engine::backend::pack_gemm_b(
+        k, n, b.data<float>(), b.dims[1], transpose_b);
+    weights.alpha = float_attribute(node, "alpha", 1.0f);
+    weights.transpose_a = int_attribute(node, "transA", 0) != 0;
+    packed_b_names.insert(node.input[1]);
+
+    if (node.input.size() > 2 && !node.input[2].empty()) {
+      inference_engine::onnx::parameter const &c = table.at(node.input[2]);
+      if (c.total_size != n && c.total_size != 1) {
+        throw std::runtime_error("Gemm " + node.name +
+                                 ": C must broadcast along the rows");
+      }
+      float beta = float_attribute(node, "beta", 1.0f);
+      const float *c_data = c.data<float>();
+      weights.column_bias.resize(n);
+      for (long j = 0; j < n; ++j) {
+        weights.column_bias[j] = beta * c_data[c.total_size == 1 ? 0 : j];
+      }
+    }
+    result[node.output[0]] = weights;
+  }
+
+  // The kernels are transformed in parallel, one per task.
+  std::vector<inference_engine::inferer::kernel_transform> transforms =
+      plan_kernel_transforms(nodes, table, layouts, shapes);
+  inference_engine::parallel::parallel_for(
+      static_cast<long>(transforms.size()),
+      [&](long begin, long end) {
+        for (long i = begin; i < end; ++i) {
+          inference_engine::inferer::kernel_transform const &transform =
+              transforms[i];
+          const float *w = table.at(transform.weight).data<float>();
+          switch (transform.layout) {
+          case inference_engine::inferer::KERNEL_LAYOUT::NchwcKernel:
+            inference_engine::backend::cached_nchwc_kernel(
+                transform.c_in, transform.c_out, transform.size, w);
+            break;
+          case inference_engine::inferer::KERNEL_LAYOUT::WinogradKernel:
+            inference_engine::backend::cached_winograd_kernel(
+                transform.c_in, transform.c_out, transform.size, w);
+            break;
+          case inference_engine::inferer::KERNEL_LAYOUT::Im2colKernel:
+            inference_engine::backend::cached_im2col_kernel(
+                transform.c_in, transform.c_out, transform.size, w);
+            break;
+          }
+        }
+      },
+      inference_engine::parallel::SCHEDULE::Dynamic);
+
+  // Only the packed copies are kept.
+  for (std::string const &name : packed_b_names) {
+    table.at(name).release();
+  }
+  return result;
+}
+
+std::vector<std::vector<long>>
+build_node_successors(std::vector<inference_engine::onnx::node> const &nodes) {
+  std::map<std::string, long> producers;
+  for (long i = 0; i < static_cast<long>(nodes.size()); ++i) {
+    for (std::string const &output : nodes[i].output) {
+      producers[output] = i;
+    }
+  }
+
+  std::vector<std::vector<long>> successors(nodes.size());
+  for (long i = 0; i < static_cast<long>(nodes.size()); ++i) {
+    for (std::string const &input : nodes[i].input) {
+      auto it = producers.find(input);
+      if (it == producers.end() || it->second == i) {
+        continue;
+      }
+      std::vector<long> &producer_successors = successors[it->second];
+      // A node reading several outputs of one producer depends on it once.
+      if (std::find(producer_successors.begin(), producer_successors.end(),
+                    i) == producer_successors.end()) {
+        producer_successors.push_back(i);
+      }
+    }
+  }
+  return successors;
+}
 } // namespace inferer
-} // namespace inference_engine
\ No newline at end of file
+} // namespace inference_engine
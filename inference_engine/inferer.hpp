@@ -1,8 +1,265 @@
+#ifndef INFERER_HPP
+#define INFERER_HPP
+
+#include "backend.hpp"
+#include "onnx.hpp"
+#include <map>
+#include <set>
+#include <string>
 #include <utility>
+#include <vector>
 
 namespace inference_engine {
 namespace inferer {
 std::pair<long, long> calculate_conv_matrix_dims(long h, long w, long k,
                                                  long pad, long stride);
+
+// The sliding window of a Conv or MaxPool over the height and width of its
+// input, from the kernel_shape, strides and pads attributes. ONNX orders pads
+// as [top, left, bottom, right], and the padding after the input may differ
+// from the padding before it.
+struct window {
+  long k_h;
+  long k_w;
+  long stride_h;
+  long stride_w;
+  long pad_top;
+  long pad_left;
+  long pad_bottom;
+  long pad_right;
+};
+
+// Return the window of node from the attributes whose names start with
+// prefix, such as "pool_" for the MaxPool of a fused node.
+// default_k_h/default_k_w: the kernel size if there is no kernel_shape, such
+//   as the dims of the kernel of a Conv
+// Throw std::runtime_error if an attribute holds another number of values
+// than the 2 dims of the window need (or 1 for all of them).
+inference_engine::inferer::window
+window_attributes(inference_engine::onnx::node const &node,
+                  std::string const &prefix, long default_k_h,
+                  long default_k_w);
+
+// Return the height and width of the output of window sliding over h x w
+// Throw std::runtime_error if the window does not fit into the padded input.
+std::pair<long, long>
+calculate_conv_matrix_dims(long h, long w,
+                           inference_engine::inferer::window const &window);
+
+// Return the dims of the output of a Reshape of a tensor with input_dims into
+// shape, as in ONNX: a 0 keeps the dim of the input at the same index, and one
+// -1 takes the size that remains.
+// bool batch_override: whether the model runs with another batch than it
+//   declares, as a `session` does for `session_options::batch`. A model
+//   exported for one image often reshapes into a fixed batch of 1; with
+//   batch_override a shape whose first dim is 1 keeps the batch input_dims[0]
+//   instead, so that such a model runs on batches.
+// Throw std::runtime_error if shape does not hold the elements of the input.
+std::vector<long> reshape_dims(std::vector<long> const &input_dims,
+                               std::vector<long> const &shape,
+                               bool batch_override = false);
+
+// Return the dims of the output of a Flatten of a tensor with input_dims: the
+// dims before axis, and the dims from axis on, each multiplied into one.
+// Throw std::runtime_error if axis is out of range.
+std::vector<long> flatten_dims(std::vector<long> const &input_dims,
+                               long axis);
+
+// Return the dims of the output of a Squeeze of a tensor with input_dims:
+// without the dims of axes, or without every dim of 1 if axes is empty.
+// Throw std::runtime_error if a dim of axes is not 1.
+std::vector<long> squeeze_dims(std::vector<long> const &input_dims,
+                               std::vector<long> const &axes);
+
+// Return the dims of the output of an Unsqueeze of a tensor with input_dims,
+// with a dim of 1 at each of axes, which index the output dims.
+std::vector<long> unsqueeze_dims(std::vector<long> const &input_dims,
+                                 std::vector<long> const &axes);
+
+// The elements a Slice takes along one dim of its input: size elements from
+// start on, step apart
+struct slice_range {
+  long start;
+  long step;
+  long size;
+};
+
+// Return the range a Slice node takes along each dim of a tensor with
+// input_dims. starts, ends, axes and steps are attributes up to opset 9, and
+// INT64 initializers from the inputs 1 to 4 on later; indices below 0 count
+// from the end and indices past a dim are clamped to it, as in ONNX.
+// Throw std::runtime_error for a step below 1 or an empty slice.
+std::vector<inference_engine::inferer::slice_range> slice_ranges(
+    inference_engine::onnx::node const &node,
+    std::map<std::string, inference_engine::onnx::parameter> const &table,
+    std::vector<long> const &input_dims);
+
+// Return the first value of an INT or INTS attribute of node, or
+// default_value if it has none.
+long int_attribute(inference_engine::onnx::node const &node,
+                   std::string const &name, long default_value);
+
+// Return the values of an INT or INTS attribute of node, or default_value if
+// it has none.
+std::vector<long> ints_attribute(inference_engine::onnx::node const &node,
+                                 std::string const &name,
+                                 std::vector<long> const &default_value);
+
+// Return the value of a FLOAT attribute of node, or default_value if it has
+// none.
+float float_attribute(inference_engine::onnx::node const &node,
+                      std::string const &name, float default_value);
+
+// The dims and element type of a tensor, as inferred by `infer_shapes`
+struct tensor_shape {
+  std::vector<long> dims;
+  ::google::protobuf::int32 data_type;
+};
+
+// Propagate the dims and element types of the tensors of table through nodes
+// once when a model is loaded, so that nothing about shapes is computed while
+// it runs:
+//   Conv and the fused Conv nodes, MaxPool: NCHW, with the output size from
+//     `window_attributes`, asymmetric pads and strides included
+//   Gemm and GemmRelu: [rows, n], where rows are the elements of A over k,
+//     so that A may still have the dims of an image, and transA/transB apply
+//   Reshape: `reshape_dims`, with the shape read from its initializer
+//   Flatten, Squeeze, Unsqueeze: `flatten_dims`, `squeeze_dims` and
+//     `unsqueeze_dims`, with the axes of Squeeze and Unsqueeze read from their
+//     attribute or initializer
+//   Slice: the sizes of `slice_ranges`
+//   Relu, Identity, Dropout, Softmax: the dims of the input. The mask of a
+//     Dropout is FLOAT, as `backend::drop_out` writes it.
+// table: the graph inputs with the dims they are run with, and the
+//   initializers. The declared dims of tensors which a node outputs, such as
+//   the graph outputs, are ignored.
+// batch_override: whether the graph inputs are run with another batch than
+//   the model declares, as for `reshape_dims`
+// Return the shape of every tensor of table and every output of nodes.
+// Throw std::runtime_error for an unsupported operator or attribute, an input
+// of unknown shape, or shapes which do not fit, such as a kernel with other
+// input channels than its input.
+std::map<std::string, inference_engine::inferer::tensor_shape>
+infer_shapes(
+    std::vector<inference_engine::onnx::node> const &nodes,
+    std::map<std::string, inference_engine::onnx::parameter> const &table,
+    bool batch_override = false);
+
+// The memory layout of an activation tensor. See `backend::NCHWC_BLOCK`.
+enum LAYOUT { NCHW, NCHWc };
+
+// Assign a layout to the outputs of nodes so that Conv, Relu and MaxPool run
+// on NCHWc tensors: the output of Conv and of the fused Conv nodes is NCHWc,
+// the output of Relu, MaxPool and Identity has the layout of their input, and
+// everything else is NCHW.
+// A node whose input has another layout than the one it runs on reorders it,
+// so a chain of these layers is entered and left once rather than converting
+// back to NCHW between layers. Tensors which are not the output of a node,
+// such as graph inputs, are NCHW.
+std::map<std::string, inference_engine::inferer::LAYOUT>
+plan_nchwc_layouts(std::vector<inference_engine::onnx::node> const &nodes);
+
+// Return nodes without their Dropout nodes, which are the identity at
+// inference: the nodes reading the output of a Dropout read its input
+// instead, so no kernel runs, and neither the output nor the mask is
+// allocated or sampled.
+// A Dropout whose output is one of graph_outputs becomes an Identity node,
+// which aliases its input. A Dropout whose mask is read or is one of
+// graph_outputs is kept as it is.
+std::vector<inference_engine::onnx::node>
+eliminate_dropouts(std::vector<inference_engine::onnx::node> const &nodes,
+                   std::set<std::string> const &graph_outputs);
+
+// Return nodes with chains of operators replaced by fused nodes that run as
+// one kernel:
+//   Conv -> Relu            => ConvRelu
+//   Conv -> Relu -> MaxPool => ConvReluMaxPool
+//   Gemm -> Relu            => GemmRelu
+// A fused node takes the inputs of the Conv or Gemm, gives the output of the
+// last node of the chain, and has the attributes of the Conv or Gemm plus
+// those of the MaxPool prefixed with "pool_" (e.g. "pool_kernel_shape").
+// A chain is only fused if each intermediate output is read by the next node
+// alone and is not one of graph_outputs, since it is never materialized.
+std::vector<inference_engine::onnx::node>
+fuse_nodes(std::vector<inference_engine::onnx::node> const &nodes,
+           std::set<std::string> const &graph_outputs);
+
+// The weights of a Gemm node prepared by `prepack_weights`
+// packed_b: op(B), packed as the right operand of `backend::gemm_packed`
+// column_bias: beta * C, one value per output column. It is empty if the node
+//   has no C.
+// alpha/transpose_a: the alpha and transA attributes of the node
+struct gemm_weights {
+  inference_engine::backend::packed_matrix packed_b;
+  std::vector<float> column_bias;
+  float alpha;
+  bool transpose_a;
+};
+
+// The layout `prepack_weights` gives the kernel of a Conv node: reordered for
+// `conv_nchwc`, transformed for `conv_winograd` or packed for `conv_im2col`.
+// The kernels of the other algorithms are read as they are.
+enum KERNEL_LAYOUT { NchwcKernel, WinogradKernel, Im2colKernel };
+
+// A Conv kernel which `prepack_weights` transforms through the kernel caches
+// of `backend`
+// weight: the name of the kernel in the table
+// size: the k of `cached_nchwc_kernel` and `cached_im2col_kernel`, or the m of
+//   `cached_winograd_kernel`
+struct kernel_transform {
+  inference_engine::inferer::KERNEL_LAYOUT layout;
+  std::string weight;
+  long c_in;
+  long c_out;
+  long size;
+};
+
+// Return the transforms of the Conv kernels of nodes: the kernel is reordered
+// for `conv_nchwc` if the output is NCHWc in layouts, and otherwise
+// transformed or packed for the algorithm `backend::conv` selects for its
+// shape in shapes. A kernel read by several nodes is listed once per layout.
+// shapes: the shapes from `infer_shapes`
+std::vector<inference_engine::inferer::kernel_transform>
+plan_kernel_transforms(
+    std::vector<inference_engine::onnx::node> const &nodes,
+    std::map<std::string, inference_engine::onnx::parameter> const &table,
+    std::map<std::string, inference_engine::inferer::LAYOUT> const &layouts,
+    std::map<std::string, inference_engine::inferer::tensor_shape> const
+        &shapes);
+
+// Transform the weights of nodes into the layouts their kernels read, once
+// after `onnx::initialize_parameter_table`, so that inference reads no weight
+// in its ONNX layout:
+//   Gemm and GemmRelu: B is transposed if transB is set and packed for the
+//     bound gemm kernels, and C is scaled by beta. The unpacked B is released
+//     from table, whose data for it is null afterwards. The result holds the
+//     weights of each node by the name of its output.
+//   Conv and the fused Conv nodes: the kernels are transformed as
+//     `plan_kernel_transforms` plans, through the kernel caches of `backend`.
+// initializers: the names of the tensors of table which are weights
+// shapes: the shapes from `infer_shapes`
+// prepacked: weights packed already, such as read from an engine file, by
+//   the name of the Gemm output. They are used as they are, and the B of
+//   their nodes need not have data.
+// Throw std::runtime_error for a Gemm whose B is not an initializer, or whose
+// C is not a vector along the columns of the output.
+std::map<std::string, inference_engine::inferer::gemm_weights> prepack_weights(
+    std::vector<inference_engine::onnx::node> const &nodes,
+    std::map<std::string, inference_engine::onnx::parameter> &table,
+    std::set<std::string> const &initializers,
+    std::map<std::string, inference_engine::inferer::LAYOUT> const &layouts,
+    std::map<std::string, inference_engine::inferer::tensor_shape> const
+        &shapes,
+    std::map<std::string, inference_engine::inferer::gemm_weights> const
+        &prepacked);
+
+// Return the dependency graph of nodes as the successors of each node: node j
+// is a successor of node i if j reads an output of i. Tensors which no node
+// outputs, such as graph inputs and initializers, add no dependency.
+// The result is meant for `parallel::run_task_graph`.
+std::vector<std::vector<long>>
+build_node_successors(std::vector<inference_engine::onnx::node> const &nodes);
 } // namespace inferer
-} // namespace inference_engine
\ No newline at end of file
+} // namespace inference_engine
+
+#endif
@@ -0,0 +1,54 @@
+#include "kernels.hpp"
+#include <atomic>
+#include <stdexcept>
+
+namespace inference_engine {
+namespace backend {
+namespace kernels {
+
+const inference_engine::backend::kernels::kernel_table &
+table_for(inference_engine::cpu_features::ISA isa) {
+  // The tables of wider ISAs are compiled with those ISAs' flags, so even
+  // looking them up must not happen on a CPU which lacks the instructions.
+  if (isa > inference_engine::cpu_features::detect_isa()) {
+    throw std::runtime_error(
+        "kernels for " + inference_engine::cpu_features::isa_name(isa) +
+        " are not available on this CPU or in this build");
+  }
+
+  switch (isa) {
+#ifdef INFERENCE_ENGINE_X86_KERNELS
+  case inference_engine::cpu_features::ISA::AVX512:
+    return inference_engine::backend::kernels::avx512::table();
+  case inference_engine::cpu_features::ISA::AVX2:
+    return inference_engine::backend::kernels::avx2::table();
+  case inference_engine::cpu_features::ISA::SSE:
+    return inference_engine::backend::kernels::sse::table();
+#endif
+  default:
+    return inference_engine::backend::kernels::generic::table();
+  }
+}
+
+std::atomic<const inference_engine::backend::kernels::kernel_table *> &
+bound_table() {
+  static std::atomic<const inference_engine::backend::kernels::kernel_table *>
+      bound(&table_for(inference_engine::cpu_features::requested_isa()));
+  return bound;
+}
+
+const inference_engine::backend::kernels::kernel_table &active() {
+  return *bound_table().load(std::memory_order_acquire);
+}
+
+inference_engine::cpu_features::ISA
+select(inference_engine::cpu_features::ISA isa) {
+  if (isa > inference_engine::cpu_features::detect_isa()) {
+    isa = inference_engine::cpu_features::detect_isa();
+  }
+  bound_table().store(&table_for(isa), std::memory_order_release);
+  return isa;
+}
+} // namespace kernels
+} // namespace backend
+} // namespace inference_engine
@@ -0,0 +1,93 @@
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+#include "cpu_features.hpp"
+
+namespace inference_engine {
+namespace backend {
+namespace kernels {
+
+// A set of kernels compiled for one ISA level.
+// The functions in `backend.hpp` call through the table returned by
+// `active()`, so a single binary runs the best variant for the CPU it is on.
+struct kernel_table {
+  inference_engine::cpu_features::ISA isa;
+
+  // The register block of `gemm_micro_kernel`. The gemm driver packs A into
+  // micro-panels of gemm_mr rows and B into micro-panels of gemm_nr columns.
+  long gemm_mr;
+  long gemm_nr;
+
+  // C[m_r x n_r] = alpha * packed_a[kc x gemm_mr]^T * packed_b[kc x gemm_nr]
+  //   + beta * C (+ D) (+ row_bias) (+ column_bias), clamped at zero if relu
+  //   is set
+  // c and d share the leading dimension ldc. row_bias and column_bias hold
+  // one value per row and per column. d and the biases may be null, and c is
+  // not read if beta is zero. See `backend::gemm_epilogue`.
+  void (*gemm_micro_kernel)(long kc, const float *packed_a,
+                            const float *packed_b, float *c, long ldc,
+                            long m_r, long n_r, const float *d, float alpha,
+                            float beta, const float *row_bias,
+                            const float *column_bias, bool relu);
+
+  // c[m] = alpha * A[m x k] * b[k] + beta * c[m] + d[m] + row_bias[m] +
+  // column_bias[0], clamped at zero if relu is set. d and the biases may be
+  // null.
+  void (*gemv)(long m, long k, const float *a, const float *b, float *c,
+               const float *d, float alpha, float beta,
+               const float *row_bias, const float *column_bias, bool relu);
+
+  // See `backend.hpp` for the arguments of the following kernels.
+  void (*conv)(long c_in, long c_out, long x_h, long x_w, long y_h, long y_w,
+               long k, long pad, long stride, const float *x, const float *w,
+               const float *b, float *y, float beta);
+  void (*max_pool)(long c, long x_h, long x_w, long y_h, long y_w, long k,
+                   long pad, long stride, float *x, float *y);
+  void (*relu)(long long n, float *x, float *y);
+  void (*softmax)(long long n, float *x, float *y);
+  // conv_nchwc computes the output rows [yy_h_begin, yy_h_end) only, so that
+  // threads can split a layer by rows as well as by channel blocks. y points
+  // to row yy_h_begin, so the rows can go to a buffer of their own. With
+  // relu set the output is clamped at zero while it is still in registers.
+  void (*conv_nchwc)(long c_in, long c_out, long x_h, long x_w, long y_h,
+                     long y_w, long k, long pad, long stride, const float *x,
+                     const float *w, const float *b, float beta, bool relu,
+                     float *y, long yy_h_begin, long yy_h_end);
+  void (*max_pool_nchwc)(long c, long x_h, long x_w, long y_h, long y_w,
+                         long k, long pad, long stride, const float *x,
+                         float *y);
+};
+
+namespace generic {
+const inference_engine::backend::kernels::kernel_table &table();
+}
+namespace sse {
+const inference_engine::backend::kernels::kernel_table &table();
+}
+namespace avx2 {
+const inference_engine::backend::kernels::kernel_table &table();
+}
+namespace avx512 {
+const inference_engine::backend::kernels::kernel_table &table();
+}
+
+// Return the kernels compiled for `isa`.
+// Throw std::runtime_error if this build does not contain them.
+const inference_engine::backend::kernels::kernel_table &
+table_for(inference_engine::cpu_features::ISA isa);
+
+// Return the kernels bound for this process.
+// On the first call they are bound to `cpu_features::requested_isa()`.
+const inference_engine::backend::kernels::kernel_table &active();
+
+// Rebind the kernels to `isa`, which is lowered to `detect_isa()` if the CPU
+// does not support it. Return the bound ISA level.
+// This is meant for tests and benchmarks: it must not be called while
+// another thread is running a kernel.
+inference_engine::cpu_features::ISA
+select(inference_engine::cpu_features::ISA isa);
+} // namespace kernels
+} // namespace backend
+} // namespace inference_engine
+
+#endif
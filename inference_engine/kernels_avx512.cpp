@@ -0,0 +1,179 @@
+// Compiled with -mavx512f -mfma. See kernels_impl.hpp.
+#include "backend.hpp"
+#include "kernels.hpp"
+#include <cmath>
+#include <cstring>
+#include <immintrin.h>
+
+namespace inference_engine {
+namespace backend {
+namespace kernels {
+namespace avx512 {
+namespace {
+#include "kernels_impl.hpp"
+
+constexpr long GEMM_MR = 12;
+constexpr long GEMM_NR = 32;
+
+// 12 x 32 tile: 24 zmm accumulators, 2 for the row of B and 1 broadcast of A.
+void gemm_micro_kernel(long kc, const float *packed_a, const float *packed_b,
+                       float *c, long ldc, long m_r, long n_r, const float *d,
+                       float alpha, float beta, const float *row_bias,
+                       const float *column_bias, bool relu) {
+  __m512 acc[GEMM_MR][2];
+  for (long i = 0; i < GEMM_MR; ++i) {
+    acc[i][0] = _mm512_setzero_ps();
+    acc[i][1] = _mm512_setzero_ps();
+  }
+
+  for (long p = 0; p < kc; ++p) {
+    __m512 b_0 = _mm512_loadu_ps(packed_b);
+    __m512 b_1 = _mm512_loadu_ps(packed_b + 16);
+#pragma GCC unroll 12
+    for (long i = 0; i < GEMM_MR; ++i) {
+      __m512 a_i = _mm512_set1_ps(packed_a[i]);
+      acc[i][0] = _mm512_fmadd_ps(a_i, b_0, acc[i][0]);
+      acc[i][1] = _mm512_fmadd_ps(a_i, b_1, acc[i][1]);
+    }
+    packed_a += GEMM_MR;
+    packed_b += GEMM_NR;
+  }
+
+  if (m_r == GEMM_MR && n_r == GEMM_NR) {
+    __m512 alpha_v = _mm512_set1_ps(alpha);
+    __m512 beta_v = _mm512_set1_ps(beta);
+    const __m512 zero = _mm512_setzero_ps();
+    for (long i = 0; i < GEMM_MR; ++i) {
+      float *c_i = c + i * ldc;
+      __m512 c_0 = _mm512_mul_ps(alpha_v, acc[i][0]);
+      __m512 c_1 = _mm512_mul_ps(alpha_v, acc[i][1]);
+      if (beta != 0.0f) {
+        c_0 = _mm512_fmadd_ps(beta_v, _mm512_loadu_ps(c_i), c_0);
+        c_1 = _mm512_fmadd_ps(beta_v, _mm512_loadu_ps(c_i + 16), c_1);
+      }
+      if (d != nullptr) {
+        c_0 = _mm512_add_ps(c_0, _mm512_loadu_ps(d + i * ldc));
+        c_1 = _mm512_add_ps(c_1, _mm512_loadu_ps(d + i * ldc + 16));
+      }
+      if (row_bias != nullptr) {
+        __m512 bias_i = _mm512_set1_ps(row_bias[i]);
+        c_0 = _mm512_add_ps(c_0, bias_i);
+        c_1 = _mm512_add_ps(c_1, bias_i);
+      }
+      if (column_bias != nullptr) {
+        c_0 = _mm512_add_ps(c_0, _mm512_loadu_ps(column_bias));
+        c_1 = _mm512_add_ps(c_1, _mm512_loadu_ps(column_bias + 16));
+      }
+      if (relu) {
+        c_0 = _mm512_maskz_max_ps(0xffff, c_0, zero);
+        c_1 = _mm512_maskz_max_ps(0xffff, c_1, zero);
+      }
+      _mm512_storeu_ps(c_i, c_0);
+      _mm512_storeu_ps(c_i + 16, c_1);
+    }
+    return;
+  }
+
+  float ab[GEMM_MR * GEMM_NR];
+  for (long i = 0; i < GEMM_MR; ++i) {
+    _mm512_storeu_ps(ab + i * GEMM_NR, acc[i][0]);
+    _mm512_storeu_ps(ab + i * GEMM_NR + 16, acc[i][1]);
+  }
+  gemm_write_back_partial<GEMM_MR, GEMM_NR>(ab, c, ldc, m_r, n_r, d, alpha,
+                                            beta, row_bias, column_bias, relu);
+}
+
+// RW pixels x 16 channels: 14 zmm accumulators, 1 for the kernel row and 1
+// broadcast of x. 14 pixels divide the widths of the VGG feature maps.
+struct conv_nchwc_avx512 {
+  static constexpr long RW = 14;
+  static constexpr long RW_TAIL = 4;
+
+  template <long N>
+  static void pixels(long c_in, long x_h, long x_w, long k, long stride,
+                     long k_h_begin, long k_h_end, long k_w_begin,
+                     long k_w_end, const float *x_tap, const float *w,
+                     const float *bias, float beta, bool relu, float *y) {
+    constexpr long CB = inference_engine::backend::NCHWC_BLOCK;
+    constexpr long V = CB / 16;
+    const long c_in_blocks = (c_in + CB - 1) / CB;
+    const long x_step = stride * CB;
+    __m512 acc[N][V];
+
+    for (long r = 0; r < N; ++r) {
+      for (long v = 0; v < V; ++v) {
+        acc[r][v] = _mm512_loadu_ps(bias + v * 16);
+        if (beta != 0.0f) {
+          acc[r][v] = _mm512_fmadd_ps(_mm512_set1_ps(beta),
+                                      _mm512_loadu_ps(y + r * CB + v * 16),
+                                      acc[r][v]);
+        }
+      }
+    }
+
+    for (long icb = 0; icb < c_in_blocks; ++icb) {
+      long ci_count = c_in - icb * CB < CB ? c_in - icb * CB : CB;
+      const float *x_block = x_tap + icb * x_h * x_w * CB;
+      const float *w_block = w + icb * k * k * CB * CB;
+
+      for (long k_h = k_h_begin; k_h < k_h_end; ++k_h) {
+        for (long k_w = k_w_begin; k_w < k_w_end; ++k_w) {
+          const float *x_t =
+              x_block + ((k_h - k_h_begin) * x_w + (k_w - k_w_begin)) * CB;
+          const float *w_t = w_block + (k_h * k + k_w) * CB * CB;
+
+          for (long ci = 0; ci < ci_count; ++ci) {
+            __m512 w_v[V];
+            for (long v = 0; v < V; ++v) {
+              w_v[v] = _mm512_loadu_ps(w_t + ci * CB + v * 16);
+            }
+#pragma GCC unroll 14
+            for (long r = 0; r < N; ++r) {
+              __m512 x_v = _mm512_set1_ps(x_t[r * x_step + ci]);
+              for (long v = 0; v < V; ++v) {
+                acc[r][v] = _mm512_fmadd_ps(x_v, w_v[v], acc[r][v]);
+              }
+            }
+          }
+        }
+      }
+    }
+
+    if (relu) {
+      // The zero-masking form, since GCC warns about the undefined source
+      // operand _mm512_max_ps passes to its builtin.
+      const __m512 zero = _mm512_setzero_ps();
+      for (long r = 0; r < N; ++r) {
+        for (long v = 0; v < V; ++v) {
+          acc[r][v] = _mm512_maskz_max_ps(0xffff, acc[r][v], zero);
+        }
+      }
+    }
+    for (long r = 0; r < N; ++r) {
+      for (long v = 0; v < V; ++v) {
+        _mm512_storeu_ps(y + r * CB + v * 16, acc[r][v]);
+      }
+    }
+  }
+};
+} // namespace
+
+const inference_engine::backend::kernels::kernel_table &table() {
+  static const inference_engine::backend::kernels::kernel_table kernels = {
+      inference_engine::cpu_features::ISA::AVX512,
+      GEMM_MR,
+      GEMM_NR,
+      gemm_micro_kernel,
+      gemv,
+      conv,
+      max_pool,
+      relu,
+      softmax,
+      conv_nchwc<conv_nchwc_avx512>,
+      max_pool_nchwc};
+  return kernels;
+}
+} // namespace avx512
+} // namespace kernels
+} // namespace backend
+} // namespace inference_engine
@@ -0,0 +1,35 @@
+#include "backend.hpp"
+#include "kernels.hpp"
+#include <cmath>
+#include <cstring>
+
+namespace inference_engine {
+namespace backend {
+namespace kernels {
+namespace generic {
+namespace {
+#include "kernels_impl.hpp"
+
+constexpr long GEMM_MR = 4;
+constexpr long GEMM_NR = 8;
+} // namespace
+
+const inference_engine::backend::kernels::kernel_table &table() {
+  static const inference_engine::backend::kernels::kernel_table kernels = {
+      inference_engine::cpu_features::ISA::Generic,
+      GEMM_MR,
+      GEMM_NR,
+      gemm_micro_kernel_portable<GEMM_MR, GEMM_NR>,
+      gemv,
+      conv,
+      max_pool,
+      relu,
+      softmax,
+      conv_nchwc<conv_nchwc_portable<4, 2>>,
+      max_pool_nchwc};
+  return kernels;
+}
+} // namespace generic
+} // namespace kernels
+} // namespace backend
+} // namespace inference_engine
@@ -0,0 +1,482 @@
+// Portable kernel bodies shared by every ISA variant.
+//
+// This file is intentionally not self-contained: each kernels_<isa>.cpp
+// includes it inside its own anonymous namespace after including <cmath> and
+// <cstring>, so the same loops are compiled once per ISA with that file's
+// target flags and never leak into another variant.
+// For the same reason the bodies avoid std:: templates (std::max,
+// std::unique_ptr, ...): an out-of-line instantiation compiled with AVX
+// instructions could be picked by the linker for the generic variant.
+
+// Write back a tile which was computed into a dense MR x NR buffer:
+//   C = alpha * AB + beta * C (+ D) (+ row_bias) (+ column_bias), clamped at
+//   zero if relu is set. C is not read if beta is zero.
+// The SIMD kernels use it for the ragged edges of C where a full vector store
+// would run out of bounds. row_bias and column_bias hold one value per row
+// and per column of the tile, and may be null like d.
+template <long MR, long NR>
+void gemm_write_back_partial(const float *ab, float *c, long ldc, long m_r,
+                             long n_r, const float *d, float alpha,
+                             float beta, const float *row_bias,
+                             const float *column_bias, bool relu) {
+  for (long i = 0; i < m_r; ++i) {
+    for (long j = 0; j < n_r; ++j) {
+      float value = alpha * ab[i * NR + j];
+      if (beta != 0.0f) {
+        value += beta * c[i * ldc + j];
+      }
+      if (d != nullptr) {
+        value += d[i * ldc + j];
+      }
+      if (row_bias != nullptr) {
+        value += row_bias[i];
+      }
+      if (column_bias != nullptr) {
+        value += column_bias[j];
+      }
+      c[i * ldc + j] = relu && value < 0.0f ? 0.0f : value;
+    }
+  }
+}
+
+// Calculate C[m_r x n_r] with an MR x NR accumulator block and write it back
+// with `gemm_write_back_partial`. The fixed-size accumulators are kept in
+// registers and the NR loop is vectorized with whatever width the ISA
+// provides.
+template <long MR, long NR>
+void gemm_micro_kernel_portable(long kc, const float *packed_a,
+                                const float *packed_b, float *c, long ldc,
+                                long m_r, long n_r, const float *d,
+                                float alpha, float beta,
+                                const float *row_bias,
+                                const float *column_bias, bool relu) {
+  float ab[MR][NR] = {};
+
+  for (long p = 0; p < kc; ++p) {
+    for (long i = 0; i < MR; ++i) {
+      float a_i = packed_a[i];
+      for (long j = 0; j < NR; ++j) {
+        ab[i][j] += a_i * packed_b[j];
+      }
+    }
+    packed_a += MR;
+    packed_b += NR;
+  }
+
+  gemm_write_back_partial<MR, NR>(&ab[0][0], c, ldc, m_r, n_r, d, alpha,
+                                  beta, row_bias, column_bias, relu);
+}
+
+// Calculate c[m] = alpha * A[m x k] * b[k] + beta * c[m] + d[m] +
+// row_bias[m] + column_bias[0], and clamp c at zero if relu is set. d and the
+// biases may be null, and c is not read if beta is zero.
+// With a single column there is no reuse of A to exploit, and packing it
+// would only double the memory traffic, so rows of A are streamed directly.
+// Several partial sums are kept so that the reduction can be vectorized.
+void gemv(long m, long k, const float *a, const float *b, float *c,
+          const float *d, float alpha, float beta, const float *row_bias,
+          const float *column_bias, bool relu) {
+  constexpr long lanes = 16;
+
+  for (long i = 0; i < m; ++i) {
+    const float *a_row = a + i * k;
+    float partial[lanes] = {};
+    long p = 0;
+    for (; p + lanes <= k; p += lanes) {
+      for (long l = 0; l < lanes; ++l) {
+        partial[l] += a_row[p + l] * b[p + l];
+      }
+    }
+    float sum = 0.0f;
+    for (long l = 0; l < lanes; ++l) {
+      sum += partial[l];
+    }
+    for (; p < k; ++p) {
+      sum += a_row[p] * b[p];
+    }
+    float value = alpha * sum;
+    if (beta != 0.0f) {
+      value += beta * c[i];
+    }
+    if (d != nullptr) {
+      value += d[i];
+    }
+    if (row_bias != nullptr) {
+      value += row_bias[i];
+    }
+    if (column_bias != nullptr) {
+      value += column_bias[0];
+    }
+    c[i] = relu && value < 0.0f ? 0.0f : value;
+  }
+}
+
+// Padding is never materialized: the output columns whose window lies inside
+// x horizontally form the interior of a row, which runs without bounds
+// checks, and the columns before and after it are the borders, whose windows
+// are clipped to x. Windows are clipped vertically once per output row.
+
+// Return in [*yy_w_begin, *yy_w_end) the output columns whose window lies
+// inside x horizontally: 0 <= yy_w * stride - pad and
+// yy_w * stride - pad + k <= x_w.
+void interior_columns(long x_w, long y_w, long k, long pad, long stride,
+                      long *yy_w_begin, long *yy_w_end) {
+  long begin = (pad + stride - 1) / stride;
+  begin = begin < y_w ? begin : y_w;
+  long end = x_w + pad - k < 0 ? 0 : (x_w + pad - k) / stride + 1;
+  end = end < y_w ? end : y_w;
+  *yy_w_begin = begin;
+  *yy_w_end = end > begin ? end : begin;
+}
+
+// Return in [*k_begin, *k_end) the taps of a window starting at xx which lie
+// inside [0, x_size).
+inline void clip_window(long xx, long x_size, long k, long *k_begin,
+                        long *k_end) {
+  *k_begin = xx < 0 ? -xx : 0;
+  *k_end = x_size - xx < k ? x_size - xx : k;
+}
+
+// Add to sum the taps [k_h_begin, k_h_end) x [k_w_begin, k_w_end) of the
+// window whose origin is x[x_origin], which may lie in the padding.
+// w points to the kernel of the output channel.
+inline float conv_window(long c_in, long x_h, long x_w, long k,
+                         long k_h_begin, long k_h_end, long k_w_begin,
+                         long k_w_end, const float *x, long x_origin,
+                         const float *w, float sum) {
+  long width = k_w_end - k_w_begin;
+  for (long k_h = k_h_begin; k_h < k_h_end; ++k_h) {
+    for (long cc_in = 0; cc_in < c_in; ++cc_in) {
+      const float *x_row =
+          x + (cc_in * x_h * x_w + x_origin + k_h * x_w + k_w_begin);
+      const float *w_row = w + (cc_in * k + k_h) * k + k_w_begin;
+
+      for (long i = 0; i < width; ++i) {
+        sum += x_row[i] * w_row[i];
+      }
+    }
+  }
+  return sum;
+}
+
+// y = conv(x) + b + beta * y, where y is not read if beta is zero
+void conv(long c_in, long c_out, long x_h, long x_w, long y_h, long y_w, long k,
+          long pad, long stride, const float *x, const float *w,
+          const float *b, float *y, float beta) {
+  long yy_w_begin;
+  long yy_w_end;
+  interior_columns(x_w, y_w, k, pad, stride, &yy_w_begin, &yy_w_end);
+
+  for (long cc_out = 0; cc_out < c_out; ++cc_out) {
+    const float *w_c = w + cc_out * c_in * k * k;
+
+    for (long yy_h = 0; yy_h < y_h; ++yy_h) {
+      long xx_h = yy_h * stride - pad;
+      long k_h_begin;
+      long k_h_end;
+      clip_window(xx_h, x_h, k, &k_h_begin, &k_h_end);
+      float *y_row = y + (cc_out * y_h + yy_h) * y_w;
+
+      for (long yy_w = 0; yy_w < y_w; ++yy_w) {
+        long xx_w = yy_w * stride - pad;
+        if (yy_w == yy_w_begin) {
+          // Interior
+          for (; yy_w < yy_w_end; ++yy_w) {
+            xx_w = yy_w * stride - pad;
+            float initial =
+                beta != 0.0f ? beta * y_row[yy_w] + b[cc_out] : b[cc_out];
+            y_row[yy_w] = conv_window(c_in, x_h, x_w, k, k_h_begin, k_h_end, 0,
+                                      k, x, xx_h * x_w + xx_w, w_c, initial);
+          }
+          if (yy_w == y_w) {
+            break;
+          }
+          xx_w = yy_w * stride - pad;
+        }
+        long k_w_begin;
+        long k_w_end;
+        clip_window(xx_w, x_w, k, &k_w_begin, &k_w_end);
+        float initial =
+            beta != 0.0f ? beta * y_row[yy_w] + b[cc_out] : b[cc_out];
+        y_row[yy_w] = conv_window(c_in, x_h, x_w, k, k_h_begin, k_h_end,
+                                  k_w_begin, k_w_end, x, xx_h * x_w + xx_w,
+                                  w_c, initial);
+      }
+    }
+  }
+}
+
+constexpr float MAX_POOL_INITIAL_MAX_ELEMENT = 1 << 31;
+
+// Same semantics as std::max(a, b).
+inline float max_float(float a, float b) { return (a < b) ? b : a; }
+
+// Return the maximum of max_element and the taps
+// [k_h_begin, k_h_end) x [k_w_begin, k_w_end) of the window whose origin is
+// x[x_origin], which may lie in the padding.
+inline float max_pool_window(long x_w, long k_h_begin, long k_h_end,
+                             long k_w_begin, long k_w_end, const float *x,
+                             long x_origin, float max_element) {
+  for (long k_h = k_h_begin; k_h < k_h_end; ++k_h) {
+    const float *x_row = x + (x_origin + k_h * x_w + k_w_begin);
+    for (long i = 0; i < k_w_end - k_w_begin; ++i) {
+      max_element = max_float(x_row[i], max_element);
+    }
+  }
+  return max_element;
+}
+
+// Taps in the padding count as zero, as if x had been padded with zeros.
+void max_pool(long c, long x_h, long x_w, long y_h, long y_w, long k, long pad,
+              long stride, float *x, float *y) {
+  long yy_w_begin;
+  long yy_w_end;
+  interior_columns(x_w, y_w, k, pad, stride, &yy_w_begin, &yy_w_end);
+
+  for (long cc = 0; cc < c; ++cc) {
+    const float *x_c = x + cc * x_h * x_w;
+
+    for (long yy_h = 0; yy_h < y_h; ++yy_h) {
+      long xx_h = yy_h * stride - pad;
+      long k_h_begin;
+      long k_h_end;
+      clip_window(xx_h, x_h, k, &k_h_begin, &k_h_end);
+      bool row_clipped = k_h_end - k_h_begin < k;
+      float *y_row = y + (cc * y_h + yy_h) * y_w;
+
+      for (long yy_w = 0; yy_w < y_w; ++yy_w) {
+        long xx_w = yy_w * stride - pad;
+        if (yy_w == yy_w_begin && !row_clipped) {
+          // Interior
+          for (; yy_w < yy_w_end; ++yy_w) {
+            xx_w = yy_w * stride - pad;
+            y_row[yy_w] =
+                max_pool_window(x_w, 0, k, 0, k, x_c, xx_h * x_w + xx_w,
+                                MAX_POOL_INITIAL_MAX_ELEMENT);
+          }
+          if (yy_w == y_w) {
+            break;
+          }
+          xx_w = yy_w * stride - pad;
+        }
+        long k_w_begin;
+        long k_w_end;
+        clip_window(xx_w, x_w, k, &k_w_begin, &k_w_end);
+        float max_element = MAX_POOL_INITIAL_MAX_ELEMENT;
+        if (row_clipped || k_w_end - k_w_begin < k) {
+          max_element = 0.0f;
+        }
+        y_row[yy_w] =
+            max_pool_window(x_w, k_h_begin, k_h_end, k_w_begin, k_w_end, x_c,
+                            xx_h * x_w + xx_w, max_element);
+      }
+    }
+  }
+}
+
+void relu(long long n, float *x, float *y) {
+  for (long long i = 0; i < n; ++i) {
+    y[i] = max_float(0.0f, x[i]);
+  }
+}
+
+void softmax(long long n, float *x, float *y) {
+  float max_value = x[0];
+  for (long long i = 1; i < n; ++i) {
+    max_value = max_float(x[i], max_value);
+  }
+  for (long long i = 0; i < n; ++i) {
+    y[i] = expf(x[i] - max_value);
+  }
+  // The sum is accumulated in double so that long vectors do not lose the
+  // contribution of small probabilities.
+  double sum = 0.0;
+  for (long long i = 0; i < n; ++i) {
+    sum += y[i];
+  }
+  float sum_x = static_cast<float>(sum);
+  for (long long i = 0; i < n; ++i) {
+    y[i] = y[i] / sum_x;
+  }
+}
+
+// Calculate N horizontally adjacent output pixels of one NCHWc output block:
+// y[N x NCHWC_BLOCK] = bias + the taps of x weighted by w + beta * y, clamped
+// at zero before the store if relu is set. y is not read if beta is zero.
+// x_tap points to the tap (k_h_begin, k_w_begin) of the first pixel, w to the
+// kernel of the output block and y to the first pixel. Only the taps in
+// [k_h_begin, k_h_end) x [k_w_begin, k_w_end) are applied, so the caller
+// clips the window to x and no padded copy of x is needed.
+// Each ISA provides a struct like this one whose `pixels<N>` keeps the
+// N x NCHWC_BLOCK accumulators in vector registers, and which declares the
+// block widths `conv_nchwc` uses: RW for the bulk of a row and RW_TAIL for
+// what is left of it.
+template <long BLOCK_RW, long BLOCK_RW_TAIL> struct conv_nchwc_portable {
+  static constexpr long RW = BLOCK_RW;
+  static constexpr long RW_TAIL = BLOCK_RW_TAIL;
+
+  template <long N>
+  static void pixels(long c_in, long x_h, long x_w, long k, long stride,
+                     long k_h_begin, long k_h_end, long k_w_begin,
+                     long k_w_end, const float *x_tap, const float *w,
+                     const float *bias, float beta, bool relu, float *y) {
+    constexpr long CB = inference_engine::backend::NCHWC_BLOCK;
+    const long c_in_blocks = (c_in + CB - 1) / CB;
+    float acc[N][CB];
+
+    for (long r = 0; r < N; ++r) {
+      for (long j = 0; j < CB; ++j) {
+        acc[r][j] = beta != 0.0f ? beta * y[r * CB + j] + bias[j] : bias[j];
+      }
+    }
+
+    for (long icb = 0; icb < c_in_blocks; ++icb) {
+      // The channels of the last block beyond c_in are zero in x and w.
+      long ci_count = c_in - icb * CB < CB ? c_in - icb * CB : CB;
+      const float *x_block = x_tap + icb * x_h * x_w * CB;
+      const float *w_block = w + icb * k * k * CB * CB;
+
+      for (long k_h = k_h_begin; k_h < k_h_end; ++k_h) {
+        for (long k_w = k_w_begin; k_w < k_w_end; ++k_w) {
+          const float *x_t =
+              x_block + ((k_h - k_h_begin) * x_w + (k_w - k_w_begin)) * CB;
+          const float *w_t = w_block + (k_h * k + k_w) * CB * CB;
+
+          for (long ci = 0; ci < ci_count; ++ci) {
+            const float *w_ci = w_t + ci * CB;
+            for (long r = 0; r < N; ++r) {
+              float x_v = x_t[r * stride * CB + ci];
+              for (long j = 0; j < CB; ++j) {
+                acc[r][j] += x_v * w_ci[j];
+              }
+            }
+          }
+        }
+      }
+    }
+
+    for (long r = 0; r < N; ++r) {
+      for (long j = 0; j < CB; ++j) {
+        y[r * CB + j] = relu ? max_float(0.0f, acc[r][j]) : acc[r][j];
+      }
+    }
+  }
+};
+
+// Conv on NCHWc tensors. See `conv_nchwc` in backend.hpp for the layouts.
+// Output rows are split into the left border, an interior whose windows lie
+// inside x horizontally, and the right border. The interior is computed
+// PIXELS::RW and then PIXELS::RW_TAIL pixels at a time, and the rest one
+// clipped window at a time. Only the output rows [yy_h_begin, yy_h_end) are
+// computed, and y points to row yy_h_begin of the first output block.
+template <class PIXELS>
+void conv_nchwc(long c_in, long c_out, long x_h, long x_w, long y_h, long y_w,
+                long k, long pad, long stride, const float *x, const float *w,
+                const float *b, float beta, bool relu, float *y,
+                long yy_h_begin, long yy_h_end) {
+  constexpr long CB = inference_engine::backend::NCHWC_BLOCK;
+  constexpr long RW = PIXELS::RW;
+  constexpr long RW_TAIL = PIXELS::RW_TAIL;
+  const long c_in_blocks = (c_in + CB - 1) / CB;
+  const long c_out_blocks = (c_out + CB - 1) / CB;
+
+  long yy_w_begin;
+  long yy_w_end;
+  interior_columns(x_w, y_w, k, pad, stride, &yy_w_begin, &yy_w_end);
+
+  for (long ocb = 0; ocb < c_out_blocks; ++ocb) {
+    const float *w_block = w + ocb * c_in_blocks * k * k * CB * CB;
+    float bias[CB];
+    for (long j = 0; j < CB; ++j) {
+      bias[j] = ocb * CB + j < c_out ? b[ocb * CB + j] : 0.0f;
+    }
+
+    for (long yy_h = yy_h_begin; yy_h < yy_h_end; ++yy_h) {
+      long xx_h = yy_h * stride - pad;
+      long k_h_begin;
+      long k_h_end;
+      clip_window(xx_h, x_h, k, &k_h_begin, &k_h_end);
+      const float *x_row = x + (xx_h + k_h_begin) * x_w * CB;
+      float *y_row = y + (ocb * y_h + yy_h - yy_h_begin) * y_w * CB;
+
+      for (long yy_w = 0; yy_w < y_w; ++yy_w) {
+        if (yy_w == yy_w_begin) {
+          for (; yy_w + RW <= yy_w_end; yy_w += RW) {
+            PIXELS::template pixels<RW>(
+                c_in, x_h, x_w, k, stride, k_h_begin, k_h_end, 0, k,
+                x_row + (yy_w * stride - pad) * CB, w_block, bias, beta,
+                relu, y_row + yy_w * CB);
+          }
+          for (; yy_w + RW_TAIL <= yy_w_end; yy_w += RW_TAIL) {
+            PIXELS::template pixels<RW_TAIL>(
+                c_in, x_h, x_w, k, stride, k_h_begin, k_h_end, 0, k,
+                x_row + (yy_w * stride - pad) * CB, w_block, bias, beta,
+                relu, y_row + yy_w * CB);
+          }
+          if (yy_w == y_w) {
+            break;
+          }
+        }
+        long xx_w = yy_w * stride - pad;
+        long k_w_begin;
+        long k_w_end;
+        clip_window(xx_w, x_w, k, &k_w_begin, &k_w_end);
+        PIXELS::template pixels<1>(c_in, x_h, x_w, k, stride, k_h_begin,
+                                   k_h_end, k_w_begin, k_w_end,
+                                   x_row + (xx_w + k_w_begin) * CB, w_block,
+                                   bias, beta, relu, y_row + yy_w * CB);
+      }
+    }
+  }
+}
+
+// MaxPool on NCHWc tensors, vectorized over the NCHWC_BLOCK channels.
+// As in `max_pool`, taps in the padding count as zero. The cost of clipping a
+// window is shared by the NCHWC_BLOCK channels, so every pixel is clipped.
+void max_pool_nchwc(long c, long x_h, long x_w, long y_h, long y_w, long k,
+                    long pad, long stride, const float *x, float *y) {
+  constexpr long CB = inference_engine::backend::NCHWC_BLOCK;
+  const long c_blocks = (c + CB - 1) / CB;
+
+  for (long cb = 0; cb < c_blocks; ++cb) {
+    const float *x_block = x + cb * x_h * x_w * CB;
+    for (long yy_h = 0; yy_h < y_h; ++yy_h) {
+      long xx_h = yy_h * stride - pad;
+      long k_h_begin;
+      long k_h_end;
+      clip_window(xx_h, x_h, k, &k_h_begin, &k_h_end);
+
+      for (long yy_w = 0; yy_w < y_w; ++yy_w) {
+        long xx_w = yy_w * stride - pad;
+        long k_w_begin;
+        long k_w_end;
+        clip_window(xx_w, x_w, k, &k_w_begin, &k_w_end);
+
+        float initial = MAX_POOL_INITIAL_MAX_ELEMENT;
+        if (k_h_end - k_h_begin < k || k_w_end - k_w_begin < k) {
+          initial = 0.0f;
+        }
+        float max_element[CB];
+        for (long j = 0; j < CB; ++j) {
+          max_element[j] = initial;
+        }
+
+        for (long k_h = k_h_begin; k_h < k_h_end; ++k_h) {
+          const float *x_row =
+              x_block + ((xx_h + k_h) * x_w + xx_w + k_w_begin) * CB;
+          for (long i = 0; i < k_w_end - k_w_begin; ++i) {
+            const float *x_tap = x_row + i * CB;
+            for (long j = 0; j < CB; ++j) {
+              max_element[j] = max_float(x_tap[j], max_element[j]);
+            }
+          }
+        }
+
+        float *y_pixel = y + ((cb * y_h + yy_h) * y_w + yy_w) * CB;
+        for (long j = 0; j < CB; ++j) {
+          y_pixel[j] = max_element[j];
+        }
+      }
+    }
+  }
+}
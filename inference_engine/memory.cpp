@@ -0,0 +1,155 @@
+#include "memory.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace inference_engine {
+namespace memory {
+
+aligned_buffer::aligned_buffer(size_t bytes) : bytes(bytes) {
+  size_t padded = std::max<size_t>(ALIGNMENT, aligned_size(bytes));
+  void *data = nullptr;
+  if (posix_memalign(&data, ALIGNMENT, padded) != 0) {
+    throw std::bad_alloc();
+  }
+  std::memset(data, 0, padded);
+  memory.reset(data);
+}
+
+mapped_file::mapped_file(std::string const &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Invalid file name: " + path + ": " +
+                             std::strerror(errno));
+  }
+  struct stat status;
+  if (fstat(fd, &status) != 0) {
+    int error = errno;
+    close(fd);
+    throw std::runtime_error("cannot stat " + path + ": " +
+                             std::strerror(error));
+  }
+  bytes = static_cast<size_t>(status.st_size);
+  // An empty file cannot be mapped, and has nothing to map.
+  if (bytes > 0) {
+    address = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  int error = errno;
+  close(fd);
+  if (address == MAP_FAILED) {
+    address = nullptr;
+    throw std::runtime_error("cannot map " + path + ": " +
+                             std::strerror(error));
+  }
+}
+
+mapped_file::~mapped_file() {
+  if (address != nullptr) {
+    munmap(address, bytes);
+  }
+}
+
+namespace {
+
+// Apply advice to the whole pages within [data, data + size). The pages at
+// the ends are shared with the neighbours of the range, and left alone.
+void advise_pages(const char *data, size_t size, int advice) {
+  static const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  const uintptr_t address = reinterpret_cast<uintptr_t>(data);
+  const uintptr_t begin = (address + page - 1) / page * page;
+  const uintptr_t end = (address + size) / page * page;
+  if (begin < end) {
+    madvise(reinterpret_cast<void *>(begin), end - begin, advice);
+  }
+}
+
+} // namespace
+
+long weight_pager::add_region(
+    inference_engine::memory::mapped_file const &file, const void *data,
+    size_t size) {
+  // Only pages of the read-only mapping are dropped by `evict`.
+  assert(static_cast<const char *>(data) >= file.data() &&
+         static_cast<const char *>(data) + size <= file.data() + file.size());
+  static_cast<void>(file);
+  std::lock_guard<std::mutex> lock(mutex);
+  auto found = indices.find(data);
+  if (found != indices.end()) {
+    return found->second;
+  }
+  long index = static_cast<long>(regions.size());
+  regions.push_back(region{static_cast<const char *>(data), size, false, 0,
+                           lru.end()});
+  indices[data] = index;
+  return index;
+}
+
+void weight_pager::prefetch(long index) {
+  std::lock_guard<std::mutex> lock(mutex);
+  region const &r = regions.at(index);
+  if (!r.resident) {
+    advise_pages(r.data, r.size, MADV_WILLNEED);
+  }
+}
+
+void weight_pager::acquire(long index) {
+  std::lock_guard<std::mutex> lock(mutex);
+  region &r = regions.at(index);
+  if (r.users++ > 0) {
+    return;
+  }
+  if (r.resident) {
+    lru.erase(r.lru_position);
+    r.lru_position = lru.end();
+    return;
+  }
+  r.resident = true;
+  resident += r.size;
+  while (resident > budget && !lru.empty()) {
+    evict(lru.front());
+  }
+}
+
+void weight_pager::release(long index) {
+  std::lock_guard<std::mutex> lock(mutex);
+  region &r = regions.at(index);
+  if (--r.users == 0) {
+    r.lru_position = lru.insert(lru.end(), index);
+  }
+}
+
+void weight_pager::evict_unused() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (long index = 0; index < static_cast<long>(regions.size()); ++index) {
+    if (regions[index].users == 0) {
+      evict(index);
+    }
+  }
+}
+
+size_t weight_pager::resident_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return resident;
+}
+
+void weight_pager::evict(long index) {
+  region &r = regions[index];
+  advise_pages(r.data, r.size, MADV_DONTNEED);
+  if (r.resident) {
+    lru.erase(r.lru_position);
+    r.lru_position = lru.end();
+    r.resident = false;
+    resident -= r.size;
+  }
+}
+
+} // namespace memory
+} // namespace inference_engine
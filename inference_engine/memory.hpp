@@ -0,0 +1,135 @@
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace inference_engine {
+namespace memory {
+
+// The alignment of tensor data in bytes: a cache line, and the width of an
+// AVX-512 vector.
+constexpr size_t ALIGNMENT = 64;
+
+// Return size rounded up to a multiple of ALIGNMENT.
+constexpr size_t aligned_size(size_t size) {
+  return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+// Zeroed memory of the given bytes which starts at a multiple of ALIGNMENT
+// and is padded to one, so that the vector loads of the kernels never
+// straddle a cache line at its start, and no two buffers share a cache line
+// for threads to contend on. A buffer owns its memory and frees it when it
+// is destroyed; it can be moved, but not copied.
+class aligned_buffer {
+public:
+  aligned_buffer() = default;
+  // Throw std::bad_alloc if the memory cannot be allocated.
+  explicit aligned_buffer(size_t bytes);
+
+  void *get() const { return memory.get(); }
+
+  // Return the memory as elements of T.
+  template <typename T> T *as() const { return static_cast<T *>(get()); }
+
+  // The bytes asked for, without the padding
+  size_t size() const { return bytes; }
+
+private:
+  std::unique_ptr<void, void (*)(void *)> memory{nullptr, std::free};
+  size_t bytes = 0;
+};
+
+// The contents of a file mapped into memory read-only. Pages are read from
+// the file when first touched, and the kernel may drop them under memory
+// pressure, since they can be read again. A write to the mapping faults, so
+// that the pages always hold the file. The file is unmapped when the
+// mapped_file is destroyed.
+class mapped_file {
+public:
+  // Throw std::runtime_error if the file cannot be opened or mapped.
+  explicit mapped_file(std::string const &path);
+  ~mapped_file();
+
+  mapped_file(mapped_file const &) = delete;
+  mapped_file &operator=(mapped_file const &) = delete;
+
+  const char *data() const { return static_cast<const char *>(address); }
+  size_t size() const { return bytes; }
+
+private:
+  void *address = nullptr;
+  size_t bytes = 0;
+};
+
+// Keeps the resident weights read from a mapped file within a budget of
+// bytes, so that a model larger than the memory it may take still runs.
+// The weights are registered as regions of the mapping. A region is resident
+// from its `acquire` until it is evicted, and once released it is evicted
+// when other regions need its place, the least recently used first. Evicting
+// drops the pages of the region from the process; touching them again reads
+// them back from the file. Regions in use are never evicted, so the budget
+// is only exceeded by the regions in use at once.
+// The regions lie in a mapped_file, which is mapped read-only: its pages are
+// never dirty, so that dropping them loses nothing the file cannot give back.
+// The methods may be called from several threads.
+class weight_pager {
+public:
+  explicit weight_pager(size_t budget) : budget(budget) {}
+
+  weight_pager(weight_pager const &) = delete;
+  weight_pager &operator=(weight_pager const &) = delete;
+
+  // Register [data, data + size), which lies in file, as a region, and
+  // return its index. The index of a region registered before is returned
+  // again.
+  long add_region(inference_engine::memory::mapped_file const &file,
+                  const void *data, size_t size);
+
+  // Start reading the region from the file in the background, such as for
+  // the next layer while this one computes. This does not make it resident.
+  void prefetch(long region);
+
+  // Make the region resident and in use until `release`, and evict the
+  // least recently released regions while the resident ones exceed the
+  // budget.
+  void acquire(long region);
+  void release(long region);
+
+  // Evict every region which is not in use, such as the weights read while
+  // compiling.
+  void evict_unused();
+
+  size_t resident_bytes() const;
+
+private:
+  struct region {
+    const char *data;
+    size_t size;
+    bool resident;
+    long users;
+    // The position in lru of a resident region which is not in use
+    std::list<long>::iterator lru_position;
+  };
+
+  void evict(long region);
+
+  const size_t budget;
+  size_t resident = 0;
+  std::vector<region> regions;
+  std::map<const void *, long> indices;
+  // The resident regions not in use, the least recently released first
+  std::list<long> lru;
+  mutable std::mutex mutex;
+};
+
+} // namespace memory
+} // namespace inference_engine
+
+#endif
@@ -0,0 +1,293 @@
+#include "backend.hpp"
+#include "kernels.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+namespace inference_engine {
+namespace backend {
+namespace {
+
+// Reordered kernels are keyed by the address and shape of the original
+// kernel, so each model's kernels are reordered on their first use only.
+// The cache owns the kernels it reorders, but not those inserted.
+typedef std::tuple<const float *, long, long, long> nchwc_kernel_key;
+
+std::mutex nchwc_kernel_cache_mutex;
+std::map<nchwc_kernel_key, std::shared_ptr<const float>> nchwc_kernel_cache;
+
+long channel_blocks(long c) { return (c + NCHWC_BLOCK - 1) / NCHWC_BLOCK; }
+
+} // namespace
+
+long long nchwc_size(long c, long h, long w) {
+  return static_cast<long long>(channel_blocks(c)) * NCHWC_BLOCK * h * w;
+}
+
+void reorder_nchw_to_nchwc(long c, long h, long w, const float *x, float *y) {
+  long hw = h * w;
+  for (long cb = 0; cb < channel_blocks(c); ++cb) {
+    float *y_block = y + cb * hw * NCHWC_BLOCK;
+    long c_count = std::min(NCHWC_BLOCK, c - cb * NCHWC_BLOCK);
+    if (c_count < NCHWC_BLOCK) {
+      std::memset(y_block, 0, sizeof(float) * hw * NCHWC_BLOCK);
+    }
+    for (long j = 0; j < c_count; ++j) {
+      const float *x_c = x + (cb * NCHWC_BLOCK + j) * hw;
+      for (long i = 0; i < hw; ++i) {
+        y_block[i * NCHWC_BLOCK + j] = x_c[i];
+      }
+    }
+  }
+}
+
+void reorder_nchwc_to_nchw(long c, long h, long w, const float *x, float *y) {
+  long hw = h * w;
+  for (long cb = 0; cb < channel_blocks(c); ++cb) {
+    const float *x_block = x + cb * hw * NCHWC_BLOCK;
+    long c_count = std::min(NCHWC_BLOCK, c - cb * NCHWC_BLOCK);
+    for (long j = 0; j < c_count; ++j) {
+      float *y_c = y + (cb * NCHWC_BLOCK + j) * hw;
+      for (long i = 0; i < hw; ++i) {
+        y_c[i] = x_block[i * NCHWC_BLOCK + j];
+      }
+    }
+  }
+}
+
+long long nchwc_kernel_size(long c_in, long c_out, long k) {
+  return static_cast<long long>(channel_blocks(c_out)) * channel_blocks(c_in) *
+         k * k * NCHWC_BLOCK * NCHWC_BLOCK;
+}
+
+void reorder_kernel_to_nchwc(long c_in, long c_out, long k, const float *w,
+                             float *w_nchwc) {
+  std::memset(w_nchwc, 0, sizeof(float) * nchwc_kernel_size(c_in, c_out, k));
+  long c_in_blocks = channel_blocks(c_in);
+
+  for (long cc_out = 0; cc_out < c_out; ++cc_out) {
+    long ocb = cc_out / NCHWC_BLOCK;
+    for (long cc_in = 0; cc_in < c_in; ++cc_in) {
+      long icb = cc_in / NCHWC_BLOCK;
+      const float *w_c = w + (cc_out * c_in + cc_in) * k * k;
+      for (long k_hw = 0; k_hw < k * k; ++k_hw) {
+        float *block = w_nchwc + ((ocb * c_in_blocks + icb) * k * k + k_hw) *
+                                     NCHWC_BLOCK * NCHWC_BLOCK;
+        block[(cc_in % NCHWC_BLOCK) * NCHWC_BLOCK + cc_out % NCHWC_BLOCK] =
+            w_c[k_hw];
+      }
+    }
+  }
+}
+
+const float *cached_nchwc_kernel(long c_in, long c_out, long k,
+                                 const float *w) {
+  nchwc_kernel_key key(w, c_in, c_out, k);
+  {
+    std::lock_guard<std::mutex> lock(nchwc_kernel_cache_mutex);
+    auto it = nchwc_kernel_cache.find(key);
+    if (it != nchwc_kernel_cache.end()) {
+      return it->second.get();
+    }
+  }
+
+  // Reordered without the lock, as in `cached_winograd_kernel`
+  std::unique_ptr<float[]> w_nchwc =
+      std::make_unique<float[]>(nchwc_kernel_size(c_in, c_out, k));
+  reorder_kernel_to_nchwc(c_in, c_out, k, w, w_nchwc.get());
+  std::lock_guard<std::mutex> lock(nchwc_kernel_cache_mutex);
+  return nchwc_kernel_cache
+      .insert(std::make_pair(
+          key, std::shared_ptr<const float>(w_nchwc.release(),
+                                            std::default_delete<float[]>())))
+      .first->second.get();
+}
+
+void insert_nchwc_kernel(long c_in, long c_out, long k, const float *w,
+                         const float *w_nchwc) {
+  std::lock_guard<std::mutex> lock(nchwc_kernel_cache_mutex);
+  nchwc_kernel_cache[nchwc_kernel_key(w, c_in, c_out, k)] =
+      std::shared_ptr<const float>(w_nchwc, [](const float *) {});
+}
+
+void clear_nchwc_kernel_cache() {
+  std::lock_guard<std::mutex> lock(nchwc_kernel_cache_mutex);
+  nchwc_kernel_cache.clear();
+}
+
+void erase_nchwc_kernels(const float *w) {
+  std::lock_guard<std::mutex> lock(nchwc_kernel_cache_mutex);
+  auto it = nchwc_kernel_cache.begin();
+  while (it != nchwc_kernel_cache.end()) {
+    if (std::get<0>(it->first) == w) {
+      it = nchwc_kernel_cache.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void conv_nchwc(long c_in, long c_out, long x_h, long x_w, long y_h, long y_w,
+                long k, long pad, long stride, const float *x,
+                const float *w_nchwc, const float *b, float *y, float beta) {
+  assert(k <= x_h && k <= x_w);
+  assert((y_h - 1) * stride <= x_h + 2 * pad);
+  assert((y_w - 1) * stride <= x_w + 2 * pad);
+
+  const inference_engine::backend::kernels::kernel_table &kernels =
+      inference_engine::backend::kernels::active();
+  const long c_out_blocks = channel_blocks(c_out);
+  const long long w_block_size =
+      nchwc_kernel_size(c_in, NCHWC_BLOCK, k);
+  const long long y_block_size = static_cast<long long>(y_h) * y_w *
+                                 NCHWC_BLOCK;
+
+  // The work items are the output rows of every output channel block. The
+  // rows of a block share its kernel, so contiguous items are handed out.
+  inference_engine::parallel::parallel_for(
+      c_out_blocks * y_h,
+      [&](long begin, long end) {
+        for (long item = begin; item < end;) {
+          long ocb = item / y_h;
+          long yy_h_begin = item % y_h;
+          long yy_h_end = std::min(y_h, yy_h_begin + (end - item));
+          kernels.conv_nchwc(
+              c_in, std::min(NCHWC_BLOCK, c_out - ocb * NCHWC_BLOCK), x_h, x_w,
+              y_h, y_w, k, pad, stride, x, w_nchwc + ocb * w_block_size,
+              b + ocb * NCHWC_BLOCK, beta, false,
+              y + ocb * y_block_size + yy_h_begin * y_w * NCHWC_BLOCK,
+              yy_h_begin, yy_h_end);
+          item += yy_h_end - yy_h_begin;
+        }
+      },
+      inference_engine::parallel::SCHEDULE::Dynamic,
+      std::max(1l, y_h / 8));
+}
+
+void conv_relu_max_pool_nchwc(long c_in, long c_out, long x_h, long x_w,
+                              long y_h, long y_w, long k, long pad,
+                              long stride, long pool_k, long pool_pad,
+                              long pool_stride, long p_h, long p_w,
+                              const float *x, const float *w_nchwc,
+                              const float *b, float *y) {
+  assert(k <= x_h && k <= x_w);
+  assert((y_h - 1) * stride <= x_h + 2 * pad);
+  assert((y_w - 1) * stride <= x_w + 2 * pad);
+
+  const inference_engine::backend::kernels::kernel_table &kernels =
+      inference_engine::backend::kernels::active();
+  const long c_out_blocks = channel_blocks(c_out);
+  const long long w_block_size = nchwc_kernel_size(c_in, NCHWC_BLOCK, k);
+
+  if (pool_k == 0) {
+    // Relu is applied in registers as the rows are written.
+    const long long y_block_size = static_cast<long long>(y_h) * y_w *
+                                   NCHWC_BLOCK;
+    inference_engine::parallel::parallel_for(
+        c_out_blocks * y_h,
+        [&](long begin, long end) {
+          for (long item = begin; item < end;) {
+            long ocb = item / y_h;
+            long yy_h_begin = item % y_h;
+            long yy_h_end = std::min(y_h, yy_h_begin + (end - item));
+            float *y_rows =
+                y + ocb * y_block_size + yy_h_begin * y_w * NCHWC_BLOCK;
+            kernels.conv_nchwc(
+                c_in, std::min(NCHWC_BLOCK, c_out - ocb * NCHWC_BLOCK), x_h,
+                x_w, y_h, y_w, k, pad, stride, x, w_nchwc + ocb * w_block_size,
+                b + ocb * NCHWC_BLOCK, 0.0f, true, y_rows, yy_h_begin,
+                yy_h_end);
+            item += yy_h_end - yy_h_begin;
+          }
+        },
+        inference_engine::parallel::SCHEDULE::Dynamic,
+        std::max(1l, y_h / 8));
+    return;
+  }
+
+  assert((p_h - 1) * pool_stride <= y_h + 2 * pool_pad);
+  assert((p_w - 1) * pool_stride <= y_w + 2 * pool_pad);
+  const long long p_block_size = static_cast<long long>(p_h) * p_w *
+                                 NCHWC_BLOCK;
+
+  // The work items are the pooled rows of every output channel block. The
+  // conv rows under one pooled row are computed, relu'd in registers, into a
+  // buffer of a few rows which stays in L1, and pooled from there.
+  inference_engine::parallel::parallel_for(
+      c_out_blocks * p_h,
+      [&](long begin, long end) {
+        static thread_local std::vector<float> rows;
+        if (rows.size() <
+            static_cast<size_t>(pool_k) * y_w * NCHWC_BLOCK) {
+          rows.resize(static_cast<size_t>(pool_k) * y_w * NCHWC_BLOCK);
+        }
+
+        for (long item = begin; item < end; ++item) {
+          long ocb = item / p_h;
+          long pp_h = item % p_h;
+          long yy_h_begin = std::max(0l, pp_h * pool_stride - pool_pad);
+          long yy_h_end =
+              std::min(y_h, pp_h * pool_stride - pool_pad + pool_k);
+
+          kernels.conv_nchwc(
+              c_in, std::min(NCHWC_BLOCK, c_out - ocb * NCHWC_BLOCK), x_h, x_w,
+              y_h, y_w, k, pad, stride, x, w_nchwc + ocb * w_block_size,
+              b + ocb * NCHWC_BLOCK, 0.0f, true, rows.data(), yy_h_begin,
+              yy_h_end);
+
+          // The rows are relu'd, so starting from zero is the same as
+          // counting the padding as zero.
+          float *p_row = y + ocb * p_block_size + pp_h * p_w * NCHWC_BLOCK;
+          for (long pp_w = 0; pp_w < p_w; ++pp_w) {
+            long yy_w_begin = std::max(0l, pp_w * pool_stride - pool_pad);
+            long yy_w_end =
+                std::min(y_w, pp_w * pool_stride - pool_pad + pool_k);
+            float max_element[NCHWC_BLOCK] = {};
+            for (long r = 0; r < yy_h_end - yy_h_begin; ++r) {
+              for (long yy_w = yy_w_begin; yy_w < yy_w_end; ++yy_w) {
+                const float *tap = rows.data() + (r * y_w + yy_w) * NCHWC_BLOCK;
+                for (long j = 0; j < NCHWC_BLOCK; ++j) {
+                  max_element[j] = std::max(max_element[j], tap[j]);
+                }
+              }
+            }
+            std::memcpy(p_row + pp_w * NCHWC_BLOCK, max_element,
+                        sizeof(max_element));
+          }
+        }
+      },
+      inference_engine::parallel::SCHEDULE::Dynamic,
+      std::max(1l, p_h / 8));
+}
+
+void max_pool_nchwc(long c, long x_h, long x_w, long y_h, long y_w, long k,
+                    long pad, long stride, const float *x, float *y) {
+  assert(k <= x_h && k <= x_w);
+  assert((y_h - 1) * stride <= x_h + 2 * pad);
+  assert((y_w - 1) * stride <= x_w + 2 * pad);
+
+  const inference_engine::backend::kernels::kernel_table &kernels =
+      inference_engine::backend::kernels::active();
+  const long long x_block_size = static_cast<long long>(x_h) * x_w *
+                                 NCHWC_BLOCK;
+  const long long y_block_size = static_cast<long long>(y_h) * y_w *
+                                 NCHWC_BLOCK;
+
+  inference_engine::parallel::parallel_for(
+      channel_blocks(c), [&](long begin, long end) {
+        kernels.max_pool_nchwc(
+            std::min(c - begin * NCHWC_BLOCK, (end - begin) * NCHWC_BLOCK), x_h,
+            x_w, y_h, y_w, k, pad, stride, x + begin * x_block_size,
+            y + begin * y_block_size);
+      });
+}
+
+} // namespace backend
+} // namespace inference_engine
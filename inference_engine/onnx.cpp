@@ -1,15 +1,342 @@
+#include <algorithm>
+#include <cstdint>
 #include <fstream>
+#include <functional>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <map>
 #include <memory>
 #include <numeric>
 #include <stdexcept>
+#include <tuple>
 #include <vector>
 
 #include "onnx.hpp"
+#include "parallel.hpp"
 
 namespace inference_engine {
 namespace onnx {
+namespace {
+
+bool is_int(::google::protobuf::int32 data_type) {
+  return data_type == ::onnx::TensorProto_DataType::TensorProto_DataType_INT8 ||
+         data_type ==
+             ::onnx::TensorProto_DataType::TensorProto_DataType_INT16 ||
+         data_type == ::onnx::TensorProto_DataType::TensorProto_DataType_INT32;
+}
+
+void require_type(inference_engine::onnx::parameter const &parameter,
+                  bool matches, std::string const &type) {
+  if (!matches) {
+    throw std::runtime_error(parameter.name + ": the data of type " +
+                             std::to_string(parameter.data_type) +
+                             " is read as " + type);
+  }
+}
+
+// The field numbers of the messages `map_onnx_model_from_file` looks into,
+// from onnx.proto
+constexpr uint32_t MODEL_GRAPH = 7;
+constexpr uint32_t GRAPH_INITIALIZER = 5;
+constexpr uint32_t TENSOR_NAME = 8;
+constexpr uint32_t TENSOR_RAW_DATA = 9;
+
+// The wire types of protobuf
+enum WIRE_TYPE {
+  WIRE_VARINT = 0,
+  WIRE_FIXED64 = 1,
+  WIRE_LENGTH = 2,
+  WIRE_FIXED32 = 5
+};
+
+// A field of a serialized message: its tag starts at begin, its value at
+// value_begin, and it ends before end.
+struct wire_field {
+  uint32_t number;
+  uint32_t wire_type;
+  size_t begin;
+  size_t value_begin;
+  size_t end;
+};
+
+// Reads the fields of protobuf messages serialized in data, such as a mapped
+// file, without copying them.
+struct message_reader {
+  const char *data;
+  size_t size;
+  std::string path;
+
+  uint64_t read_varint(size_t &position, size_t end) const {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (position >= end) {
+        break;
+      }
+      unsigned char byte = static_cast<unsigned char>(data[position++]);
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+    throw std::runtime_error("ONNX file parse error: " + path);
+  }
+
+  // Read the field at position of a message ending at end, and move position
+  // past it.
+  wire_field read_field(size_t &position, size_t end) const {
+    wire_field field;
+    field.begin = position;
+    uint64_t tag = read_varint(position, end);
+    field.number = static_cast<uint32_t>(tag >> 3);
+    field.wire_type = static_cast<uint32_t>(tag & 7);
+    uint64_t length = 0;
+    switch (field.wire_type) {
+    case WIRE_VARINT:
+      read_varint(position, end);
+      break;
+    case WIRE_FIXED64:
+      length = 8;
+      break;
+    case WIRE_LENGTH:
+      length = read_varint(position, end);
+      break;
+    case WIRE_FIXED32:
+      length = 4;
+      break;
+    default:
+      throw std::runtime_error("ONNX file parse error: " + path);
+    }
+    if (length > end - position) {
+      throw std::runtime_error("ONNX file parse error: " + path);
+    }
+    field.value_begin = field.wire_type == WIRE_VARINT ? field.begin : position;
+    position += length;
+    field.end = position;
+    return field;
+  }
+
+  wire_field read_field(size_t &position) const {
+    return read_field(position, size);
+  }
+
+  // Append the field as it is serialized to out.
+  void copy(wire_field const &field, std::string &out) const {
+    out.append(data + field.begin, field.end - field.begin);
+  }
+};
+
+void append_varint(uint64_t value, std::string &out) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+// Append the serialized message as field number to out.
+void append_message(uint32_t number, std::string const &message,
+                    std::string &out) {
+  append_varint(static_cast<uint64_t>(number) << 3 | WIRE_LENGTH, out);
+  append_varint(message.size(), out);
+  out.append(message);
+}
+
+// Return the elements of parameter as bytes to write them.
+char *bytes_of(inference_engine::onnx::parameter &parameter) {
+  if (parameter.data_type ==
+      ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT) {
+    return reinterpret_cast<char *>(parameter.mutable_data<float>());
+  } else if (parameter.data_type ==
+             ::onnx::TensorProto_DataType::TensorProto_DataType_INT64) {
+    return reinterpret_cast<char *>(parameter.mutable_data<long>());
+  }
+  return reinterpret_cast<char *>(parameter.mutable_data<int>());
+}
+
+bool host_is_little_endian() {
+  const uint16_t one = 1;
+  return *reinterpret_cast<const char *>(&one) == 1;
+}
+
+// Return the bytes of an element of type data_type in raw_data, which are
+// fewer than `element_size` for the narrow integers.
+size_t raw_element_size(::google::protobuf::int32 data_type) {
+  if (data_type == ::onnx::TensorProto_DataType::TensorProto_DataType_INT8) {
+    return 1;
+  } else if (data_type ==
+             ::onnx::TensorProto_DataType::TensorProto_DataType_INT16) {
+    return 2;
+  }
+  return element_size(data_type);
+}
+
+// Initializers are decoded in chunks of this many elements, so that the
+// threads share a large initializer as well as many small ones.
+constexpr long long DECODE_CHUNK = 1 << 18;
+
+// Give each parameter of parameters its own elements, and call
+// decode(i, begin, end) for the elements [begin, end) of parameters[i] up to
+// sizes[i], in chunks on the thread pool.
+void decode_in_parallel(
+    std::vector<inference_engine::onnx::parameter *> const &parameters,
+    std::vector<long long> const &sizes,
+    std::function<void(long, long long, long long)> const &decode) {
+  // Allocating zeroes the memory, which is worth spreading as well.
+  inference_engine::parallel::parallel_for(
+      static_cast<long>(parameters.size()),
+      [&](long begin, long end) {
+        for (long i = begin; i < end; ++i) {
+          parameters[i]->allocate();
+        }
+      },
+      inference_engine::parallel::SCHEDULE::Dynamic);
+
+  std::vector<std::tuple<long, long long, long long>> chunks;
+  for (long i = 0; i < static_cast<long>(sizes.size()); ++i) {
+    for (long long begin = 0; begin < sizes[i]; begin += DECODE_CHUNK) {
+      chunks.push_back(std::make_tuple(
+          i, begin, std::min(sizes[i], begin + DECODE_CHUNK)));
+    }
+  }
+  inference_engine::parallel::parallel_for(
+      static_cast<long>(chunks.size()),
+      [&](long begin, long end) {
+        for (long i = begin; i < end; ++i) {
+          decode(std::get<0>(chunks[i]), std::get<1>(chunks[i]),
+                 std::get<2>(chunks[i]));
+        }
+      },
+      inference_engine::parallel::SCHEDULE::Dynamic);
+}
+
+// Decode the elements [begin, end) of parameter from raw, its little-endian
+// raw_data, widening INT8 and INT16 to int.
+void decode_raw_data(const char *raw,
+                     inference_engine::onnx::parameter &parameter,
+                     long long begin, long long end) {
+  if (parameter.data_type ==
+      ::onnx::TensorProto_DataType::TensorProto_DataType_INT8) {
+    int *elements = parameter.mutable_data<int>();
+    for (long long i = begin; i < end; ++i) {
+      elements[i] = static_cast<int8_t>(raw[i]);
+    }
+    return;
+  }
+  if (parameter.data_type ==
+      ::onnx::TensorProto_DataType::TensorProto_DataType_INT16) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(raw);
+    int *elements = parameter.mutable_data<int>();
+    for (long long i = begin; i < end; ++i) {
+      elements[i] = static_cast<int16_t>(
+          static_cast<uint16_t>(bytes[2 * i] | bytes[2 * i + 1] << 8));
+    }
+    return;
+  }
+
+  const size_t size = element_size(parameter.data_type);
+  char *elements = bytes_of(parameter);
+  std::copy(raw + begin * size, raw + end * size, elements + begin * size);
+  if (!host_is_little_endian()) {
+    for (long long i = begin; i < end; ++i) {
+      std::reverse(elements + i * size, elements + (i + 1) * size);
+    }
+  }
+}
+
+// Return the number of elements in the typed field of tensor for its type:
+// float_data, int64_data, or int32_data for the other integers.
+long long typed_data_size(::onnx::TensorProto const &tensor) {
+  if (tensor.data_type() ==
+      ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT) {
+    return tensor.float_data_size();
+  } else if (tensor.data_type() ==
+             ::onnx::TensorProto_DataType::TensorProto_DataType_INT64) {
+    return tensor.int64_data_size();
+  } else if (is_int(tensor.data_type())) {
+    return tensor.int32_data_size();
+  }
+  return 0;
+}
+
+// Decode the elements [begin, end) of parameter from the typed field of
+// tensor.
+void decode_typed_data(::onnx::TensorProto const &tensor,
+                       inference_engine::onnx::parameter &parameter,
+                       long long begin, long long end) {
+  if (parameter.data_type ==
+      ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT) {
+    std::copy(tensor.float_data().begin() + begin,
+              tensor.float_data().begin() + end,
+              parameter.mutable_data<float>() + begin);
+  } else if (parameter.data_type ==
+             ::onnx::TensorProto_DataType::TensorProto_DataType_INT64) {
+    std::copy(tensor.int64_data().begin() + begin,
+              tensor.int64_data().begin() + end,
+              parameter.mutable_data<long>() + begin);
+  } else {
+    std::copy(tensor.int32_data().begin() + begin,
+              tensor.int32_data().begin() + end,
+              parameter.mutable_data<int>() + begin);
+  }
+}
+
+} // namespace
+
+size_t element_size(::google::protobuf::int32 data_type) {
+  if (data_type == ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT) {
+    return sizeof(float);
+  } else if (is_int(data_type)) {
+    return sizeof(int);
+  } else if (data_type ==
+             ::onnx::TensorProto_DataType::TensorProto_DataType_INT64) {
+    return sizeof(long);
+  }
+  throw std::runtime_error("un supported type: " + std::to_string(data_type));
+}
+
+template <> const float *parameter::data<float>() const {
+  require_type(*this,
+               data_type ==
+                   ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT,
+               "float");
+  return static_cast<const float *>(get());
+}
+
+template <> const long *parameter::data<long>() const {
+  require_type(*this,
+               data_type ==
+                   ::onnx::TensorProto_DataType::TensorProto_DataType_INT64,
+               "long");
+  return static_cast<const long *>(get());
+}
+
+template <> const int *parameter::data<int>() const {
+  require_type(*this, is_int(data_type), "int");
+  return static_cast<const int *>(get());
+}
+
+void *parameter::own_elements() {
+  if (shared_elements != nullptr) {
+    throw std::runtime_error(name + ": the shared elements are read-only");
+  }
+  return elements.get();
+}
+
+// The type is checked by `data`.
+template <> float *parameter::mutable_data<float>() {
+  data<float>();
+  return static_cast<float *>(own_elements());
+}
+
+template <> long *parameter::mutable_data<long>() {
+  data<long>();
+  return static_cast<long *>(own_elements());
+}
+
+template <> int *parameter::mutable_data<int>() {
+  data<int>();
+  return static_cast<int *>(own_elements());
+}
+
 ::onnx::ModelProto load_onnx_model_from_file(std::string const &model_path) {
   std::ifstream ifs(model_path, std::ios::binary);
   if (!ifs) {
@@ -70,87 +397,166 @@ void add_new_parameter(
     std::string parameter_name, std::vector<long> dims,
     ::google::protobuf::int32 data_type,
     std::map<std::string, inference_engine::onnx::parameter> &table) {
-
-  void *data;
-  long long total_size =
-      std::accumulate(dims.begin(), dims.end(), 1, std::multiplies<long>());
-  if (data_type == ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT) {
-    data = static_cast<void *>(new float[total_size]);
-    memset(data, 0, sizeof(float) * total_size);
-  } else if (data_type ==
-                 ::onnx::TensorProto_DataType::TensorProto_DataType_INT8 ||
-             data_type ==
-                 ::onnx::TensorProto_DataType::TensorProto_DataType_INT16 ||
-             data_type ==
-                 ::onnx::TensorProto_DataType::TensorProto_DataType_INT32) {
-    data = static_cast<void *>(new int[total_size]);
-    memset(data, 0, sizeof(int) * total_size);
-  } else if (data_type ==
-             ::onnx::TensorProto_DataType::TensorProto_DataType_INT64) {
-    data = static_cast<void *>(new long[total_size]);
-    memset(data, 0, sizeof(long) * total_size);
-  } else {
-    throw std::runtime_error("un supported type: " + std::to_string(data_type));
-  }
-
-  table.insert(std::make_pair(
-      parameter_name, inference_engine::onnx::parameter(
-                          parameter_name, dims, data_type, data, total_size)));
+  add_new_parameter(
+      parameter_name, dims, data_type,
+      std::accumulate(dims.begin(), dims.end(), 1, std::multiplies<long>()),
+      table);
 }
 
-void reset_parameter_data(
-    std::string target_parameter_name,
+void add_new_parameter(
+    std::string parameter_name, std::vector<long> dims,
+    ::google::protobuf::int32 data_type, long long total_size,
     std::map<std::string, inference_engine::onnx::parameter> &table) {
-  if (table.at(target_parameter_name).data_type ==
-      ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT) {
-    memset(table.at(target_parameter_name).data, 0,
-           sizeof(float) * table.at(target_parameter_name).total_size);
-  } else if (table.at(target_parameter_name).data_type ==
-                 ::onnx::TensorProto_DataType::TensorProto_DataType_INT8 ||
-             table.at(target_parameter_name).data_type ==
-                 ::onnx::TensorProto_DataType::TensorProto_DataType_INT16 ||
-             table.at(target_parameter_name).data_type ==
-                 ::onnx::TensorProto_DataType::TensorProto_DataType_INT32) {
-    memset(table.at(target_parameter_name).data, 0,
-           sizeof(int) * table.at(target_parameter_name).total_size);
-  } else if (table.at(target_parameter_name).data_type ==
-             ::onnx::TensorProto_DataType::TensorProto_DataType_INT64) {
-    memset(table.at(target_parameter_name).data, 0,
-           sizeof(long) * table.at(target_parameter_name).total_size);
-  } else {
-    throw std::runtime_error(
-        "un supported type: " +
-        std::to_string(table.at(target_parameter_name).data_type));
-  }
+  // Throw for a type the parameters cannot hold.
+  element_size(data_type);
+  table.insert(std::make_pair(
+      parameter_name, inference_engine::onnx::parameter(
+                          parameter_name, dims, data_type, total_size)));
 }
 
 void initialize_parameter_table(
     ::onnx::GraphProto &graph,
     std::map<std::string, inference_engine::onnx::parameter> &table) {
+  std::vector<::onnx::TensorProto const *> tensors;
+  std::vector<inference_engine::onnx::parameter *> parameters;
+  std::vector<long long> sizes;
   for (::onnx::TensorProto const &tensor : graph.initializer()) {
+    inference_engine::onnx::parameter &parameter = table.at(tensor.name());
+    if (parameter.has_data()) {
+      continue;
+    }
+    // An initializer without data, such as one stored outside the model,
+    // is left zeroed.
+    long long size = 0;
     if (tensor.has_raw_data()) {
-      if (tensor.data_type() ==
-          ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT) {
-        unpack_data_from_raw_data(tensor, table.at(tensor.name()).total_size,
-                                  table.at(tensor.name()).data, sizeof(float));
-      } else if (tensor.data_type() ==
-                     ::onnx::TensorProto_DataType::TensorProto_DataType_INT8 ||
-                 tensor.data_type() ==
-                     ::onnx::TensorProto_DataType::TensorProto_DataType_INT16 ||
-                 tensor.data_type() ==
-                     ::onnx::TensorProto_DataType::TensorProto_DataType_INT32) {
-        unpack_data_from_raw_data(tensor, table.at(tensor.name()).total_size,
-                                  table.at(tensor.name()).data, sizeof(int));
-      } else if (tensor.data_type() ==
-                 ::onnx::TensorProto_DataType::TensorProto_DataType_INT64) {
-        unpack_data_from_raw_data(tensor, table.at(tensor.name()).total_size,
-                                  table.at(tensor.name()).data, sizeof(long));
-      } else {
-        throw std::runtime_error("un supported type: " +
-                                 std::to_string(tensor.data_type()));
+      size_t bytes =
+          parameter.total_size * raw_element_size(tensor.data_type());
+      if (tensor.raw_data().size() != bytes) {
+        throw std::runtime_error(
+            parameter.name + ": the raw_data has " +
+            std::to_string(tensor.raw_data().size()) + " bytes, but " +
+            std::to_string(bytes) + " are expected");
+      }
+      size = parameter.total_size;
+    } else if (typed_data_size(tensor) != 0) {
+      if (typed_data_size(tensor) != parameter.total_size) {
+        throw std::runtime_error(
+            parameter.name + ": the tensor has " +
+            std::to_string(typed_data_size(tensor)) + " elements, but " +
+            std::to_string(parameter.total_size) + " are expected");
+      }
+      size = parameter.total_size;
+    }
+    tensors.push_back(&tensor);
+    parameters.push_back(&parameter);
+    sizes.push_back(size);
+  }
+
+  decode_in_parallel(parameters, sizes,
+                     [&](long i, long long begin, long long end) {
+                       if (tensors[i]->has_raw_data()) {
+                         decode_raw_data(tensors[i]->raw_data().data(),
+                                         *parameters[i], begin, end);
+                       } else {
+                         decode_typed_data(*tensors[i], *parameters[i],
+                                           begin, end);
+                       }
+                     });
+}
+
+inference_engine::onnx::mapped_model
+map_onnx_model_from_file(std::string const &model_path) {
+  inference_engine::onnx::mapped_model result;
+  result.file = std::make_shared<const inference_engine::memory::mapped_file>(
+      model_path);
+  message_reader reader{result.file->data(), result.file->size(), model_path};
+
+  std::string model;
+  size_t position = 0;
+  while (position < reader.size) {
+    wire_field field = reader.read_field(position);
+    if (field.number != MODEL_GRAPH || field.wire_type != WIRE_LENGTH) {
+      reader.copy(field, model);
+      continue;
+    }
+    std::string graph;
+    for (size_t g = field.value_begin; g < field.end;) {
+      wire_field graph_field = reader.read_field(g, field.end);
+      if (graph_field.number != GRAPH_INITIALIZER ||
+          graph_field.wire_type != WIRE_LENGTH) {
+        reader.copy(graph_field, graph);
+        continue;
+      }
+      // The raw_data is left out, and located once the name is known, which
+      // may come after it.
+      std::string tensor;
+      std::string name;
+      wire_field raw_data{};
+      for (size_t t = graph_field.value_begin; t < graph_field.end;) {
+        wire_field tensor_field = reader.read_field(t, graph_field.end);
+        if (tensor_field.number == TENSOR_RAW_DATA &&
+            tensor_field.wire_type == WIRE_LENGTH) {
+          raw_data = tensor_field;
+          continue;
+        }
+        if (tensor_field.number == TENSOR_NAME &&
+            tensor_field.wire_type == WIRE_LENGTH) {
+          name.assign(reader.data + tensor_field.value_begin,
+                      tensor_field.end - tensor_field.value_begin);
+        }
+        reader.copy(tensor_field, tensor);
       }
+      if (raw_data.end != 0) {
+        result.raw_data[name] = {raw_data.value_begin,
+                                 raw_data.end - raw_data.value_begin};
+      }
+      append_message(graph_field.number, tensor, graph);
+    }
+    append_message(field.number, graph, model);
+  }
+
+  if (!result.model.ParseFromString(model)) {
+    throw std::runtime_error("ONNX file parse error: " + model_path);
+  }
+  return result;
+}
+
+void map_parameter_table(
+    inference_engine::onnx::mapped_model const &model,
+    std::map<std::string, inference_engine::onnx::parameter> &table) {
+  const bool little_endian = host_is_little_endian();
+
+  std::vector<const char *> copies;
+  std::vector<inference_engine::onnx::parameter *> parameters;
+  std::vector<long long> sizes;
+  for (auto const &entry : model.raw_data) {
+    auto found = table.find(entry.first);
+    if (found == table.end()) {
+      continue;
+    }
+    inference_engine::onnx::parameter &parameter = found->second;
+    const size_t size = raw_element_size(parameter.data_type);
+    if (entry.second.size != parameter.total_size * size) {
+      throw std::runtime_error(
+          parameter.name + ": the raw_data has " +
+          std::to_string(entry.second.size) + " bytes, but " +
+          std::to_string(parameter.total_size * size) + " are expected");
     }
+    const char *raw_data = model.file->data() + entry.second.offset;
+    if (little_endian && size == element_size(parameter.data_type) &&
+        reinterpret_cast<uintptr_t>(raw_data) % size == 0) {
+      parameter.share(raw_data, model.file);
+      continue;
+    }
+    copies.push_back(raw_data);
+    parameters.push_back(&parameter);
+    sizes.push_back(parameter.total_size);
   }
+
+  decode_in_parallel(parameters, sizes,
+                     [&](long i, long long begin, long long end) {
+                       decode_raw_data(copies[i], *parameters[i], begin, end);
+                     });
 }
 
 inference_engine::onnx::OP_TYPE convert_op_type(std::string op_type) {
@@ -182,29 +588,34 @@ abstract_attributes(::onnx::NodeProto node) {
 
   std::map<std::string, inference_engine::onnx::attribute> result;
   void *data;
+  long size = 1;
   for (::onnx::AttributeProto const &attribute : node.attribute()) {
     if (attribute.type() == ::onnx::AttributeProto_AttributeType::
                                 AttributeProto_AttributeType_FLOAT) {
       float *tmp_data = new float;
       *tmp_data = attribute.f();
       data = static_cast<void *>(tmp_data);
+      size = 1;
     } else if (attribute.type() == ::onnx::AttributeProto_AttributeType::
                                        AttributeProto_AttributeType_INT) {
       long *tmp_data = new long;
       *tmp_data = attribute.i();
       data = static_cast<void *>(tmp_data);
+      size = 1;
     } else if (attribute.type() == ::onnx::AttributeProto_AttributeType::
                                        AttributeProto_AttributeType_FLOATS) {
       data = static_cast<void *>(new float[attribute.floats_size()]);
       memset(data, 0, sizeof(float) * attribute.floats_size());
       std::copy(attribute.floats().begin(), attribute.floats().end(),
                 static_cast<float *>(data));
+      size = attribute.floats_size();
     } else if (attribute.type() == ::onnx::AttributeProto_AttributeType::
                                        AttributeProto_AttributeType_INTS) {
       data = static_cast<void *>(new long[attribute.ints_size()]);
       memset(data, 0, sizeof(long) * attribute.ints_size());
       std::copy(attribute.ints().begin(), attribute.ints().end(),
                 static_cast<long *>(data));
+      size = attribute.ints_size();
     } else {
       throw std::runtime_error("node supported attribute_type: " +
                                std::to_string(attribute.type()));
@@ -212,7 +623,8 @@ abstract_attributes(::onnx::NodeProto node) {
 
     result.insert(std::make_pair(
         attribute.name(), inference_engine::onnx::attribute(
-                              attribute.name(), attribute.type(), data)));
+                              attribute.name(), attribute.type(), data,
+                              size)));
   }
 
   return result;
@@ -1,14 +1,36 @@
 #ifndef ONNX_HPP
 #define ONNX_HPP
 
+#include "memory.hpp"
 #include <map>
+#include <memory>
 #include <onnx/onnx_pb.h>
+#include <string>
 #include <vector>
 
 namespace inference_engine {
 namespace onnx {
 
-enum OP_TYPE { Gemm, Relu, Conv, MaxPool, Reshape, Dropout, Softmax };
+// ConvRelu, ConvReluMaxPool and GemmRelu are not ONNX operators: they are
+// produced by `inferer::fuse_nodes` from a chain of Conv or Gemm, Relu and
+// MaxPool nodes.
+enum OP_TYPE {
+  Gemm,
+  Relu,
+  Conv,
+  MaxPool,
+  Reshape,
+  Dropout,
+  Softmax,
+  Identity,
+  Flatten,
+  Squeeze,
+  Unsqueeze,
+  Slice,
+  ConvRelu,
+  ConvReluMaxPool,
+  GemmRelu
+};
 
 const std::map<::google::protobuf::string, inference_engine::onnx::OP_TYPE>
     OP_TYPE_MAP = {{"Gemm", inference_engine::onnx::OP_TYPE::Gemm},
@@ -17,30 +39,101 @@ const std::map<::google::protobuf::string, inference_engine::onnx::OP_TYPE>
                    {"MaxPool", inference_engine::onnx::OP_TYPE::MaxPool},
                    {"Reshape", inference_engine::onnx::OP_TYPE::Reshape},
                    {"Dropout", inference_engine::onnx::OP_TYPE::Dropout},
-                   {"Softmax", inference_engine::onnx::OP_TYPE::Softmax}};
-
+                   {"Softmax", inference_engine::onnx::OP_TYPE::Softmax},
+                   {"Identity", inference_engine::onnx::OP_TYPE::Identity},
+                   {"Flatten", inference_engine::onnx::OP_TYPE::Flatten},
+                   {"Squeeze", inference_engine::onnx::OP_TYPE::Squeeze},
+                   {"Unsqueeze", inference_engine::onnx::OP_TYPE::Unsqueeze},
+                   {"Slice", inference_engine::onnx::OP_TYPE::Slice}};
+
+// Return the bytes of an element of a parameter of data_type: a float for
+// FLOAT, a long for INT64 and an int for INT8, INT16 and INT32.
+// Throw std::runtime_error for any other type.
+size_t element_size(::google::protobuf::int32 data_type);
+
+// A tensor of the graph. Its total_size elements of data_type are memory of
+// its own aligned to `memory::ALIGNMENT` once allocated, or memory it shares
+// with an owner, such as the mapped file of a model.
 struct parameter {
   std::string name;
   std::vector<long> dims;
   ::google::protobuf::int32 data_type;
-  void *data;
   long long total_size;
 
   parameter(std::string name, std::vector<long> dims,
-            ::google::protobuf::int32 data_type, void *data,
-            long long total_size)
-      : name(name), dims(dims), data_type(data_type), data(data),
-        total_size(total_size) {}
+            ::google::protobuf::int32 data_type, long long total_size)
+      : name(name), dims(dims), data_type(data_type), total_size(total_size) {}
+
+  // Return the elements as T, the type `element_size` gives for data_type,
+  // or nullptr if there are none.
+  // Throw std::runtime_error if T is another type.
+  template <typename T> const T *data() const;
+
+  // Return the elements of its own as T to write them, such as when they are
+  // decoded. Shared elements are read-only.
+  // Throw std::runtime_error if T is another type or the elements are shared.
+  template <typename T> T *mutable_data();
+
+  bool has_data() const { return get() != nullptr; }
+
+  // Return the elements as bytes, whatever their type, or nullptr if there
+  // are none.
+  const char *bytes() const { return static_cast<const char *>(get()); }
+
+  // Give the parameter zeroed elements of its own.
+  void allocate() {
+    release();
+    elements = inference_engine::memory::aligned_buffer(
+        total_size * element_size(data_type));
+  }
+
+  // Make the elements those at data, which stay valid as long as owner is
+  // held. They are only read, so that data may be read-only memory.
+  void share(const void *data, std::shared_ptr<const void> const &owner) {
+    release();
+    shared_elements = data;
+    shared_owner = owner;
+  }
+
+  // Drop the elements, such as weights which are only read in another
+  // layout from now on.
+  void release() {
+    elements = inference_engine::memory::aligned_buffer();
+    shared_elements = nullptr;
+    shared_owner.reset();
+  }
+
+private:
+  const void *get() const {
+    return shared_elements != nullptr ? shared_elements : elements.get();
+  }
+
+  // Return the elements of its own.
+  // Throw std::runtime_error if the elements are shared.
+  void *own_elements();
+
+  inference_engine::memory::aligned_buffer elements;
+  const void *shared_elements = nullptr;
+  std::shared_ptr<const void> shared_owner;
 };
 
+template <> const float *parameter::data<float>() const;
+template <> const long *parameter::data<long>() const;
+template <> const int *parameter::data<int>() const;
+template <> float *parameter::mutable_data<float>();
+template <> long *parameter::mutable_data<long>();
+template <> int *parameter::mutable_data<int>();
+
+// size: the number of values of data, 1 for FLOAT and INT
 struct attribute {
   std::string name;
   ::onnx::AttributeProto_AttributeType data_type;
   void *data;
+  long size;
 
   attribute(std::string name, ::onnx::AttributeProto_AttributeType data_type,
-            void *data)
-      : name(name), data_type(data_type), data(data) {}
+            void *data, long size)
+      : name(name), data_type(data_type), data(data), size(size) {}
 };
 
 struct node {
@@ -65,6 +158,41 @@ struct node {
 
 ::onnx::ModelProto load_onnx_model_from_file(std::string const &model_path);
 
+// The bytes of the raw_data of an initializer in the file of a mapped_model
+struct raw_data_range {
+  size_t offset;
+  size_t size;
+};
+
+// A model whose weights stay in a memory mapping of its file.
+// model: the model without the raw_data of its initializers
+// raw_data: where the raw_data of each initializer is in file, by name
+struct mapped_model {
+  ::onnx::ModelProto model;
+  std::shared_ptr<const inference_engine::memory::mapped_file> file;
+  std::map<std::string, inference_engine::onnx::raw_data_range> raw_data;
+};
+
+// Map the ONNX file at model_path into memory, and parse everything but the
+// raw_data of the initializers, which is only located. Parsing copies what it
+// keeps, so the weights of a model would otherwise be held twice, once in
+// the ModelProto and once in their parameters, before anything runs.
+// Throw std::runtime_error if the file cannot be mapped or parsed.
+inference_engine::onnx::mapped_model
+map_onnx_model_from_file(std::string const &model_path);
+
+// Point the parameters of table at the raw_data of their initializers in the
+// mapping of model, without copying it. Data is copied into memory of the
+// parameter only where it cannot be read in place: when the file does not
+// align it to its element type, when the host is big-endian, as raw_data is
+// little-endian, or when it is widened from INT8 or INT16 to int. The copies
+// are made in parallel, as in `initialize_parameter_table`.
+// Throw std::runtime_error if the raw_data of a parameter has another size
+// than its dims give.
+void map_parameter_table(
+    inference_engine::onnx::mapped_model const &model,
+    std::map<std::string, inference_engine::onnx::parameter> &table);
+
 void unpack_data_from_raw_data(const ::onnx::TensorProto &tensor,
                                ::google::protobuf::int32 total_size,
                                void *output, int data_unit_size);
@@ -82,10 +210,22 @@ void add_new_parameter(
     ::google::protobuf::int32 data_type,
     std::map<std::string, inference_engine::onnx::parameter> &table);
 
-void reset_parameter_data(
-    std::string target_parameter_name,
+// Add a parameter whose data holds total_size elements rather than the
+// product of dims, for layouts which pad the tensor such as NCHWc.
+void add_new_parameter(
+    std::string parameter_name, std::vector<long> dims,
+    ::google::protobuf::int32 data_type, long long total_size,
     std::map<std::string, inference_engine::onnx::parameter> &table);
 
+// Give the initializers of graph in table their elements, from their
+// raw_data, or from float_data, int64_data or int32_data for their type.
+// INT8 and INT16 elements are widened to int. Initializers which have
+// elements already, such as from `map_parameter_table`, are left as they
+// are, and those with no data at all are zeroed.
+// The elements are allocated and decoded on the thread pool, in chunks, so
+// that loading a large model scales with the cores.
+// Throw std::runtime_error if an initializer has another number of elements
+// than its dims give.
 void initialize_parameter_table(
     ::onnx::GraphProto &graph,
     std::map<std::string, inference_engine::onnx::parameter> &table);
@@ -0,0 +1,397 @@
+#include "parallel.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace inference_engine {
+namespace parallel {
+namespace {
+
+typedef std::function<void()> task;
+
+// Threads which run tasks from per-thread deques and which live as long as
+// the pool, so that a parallel region costs a wake-up rather than a thread
+// creation.
+// A thread pushes and pops the tasks it spawns at the back of its own deque,
+// which keeps the most recent (and cache-hot) work local, and steals from the
+// front of the other deques when its own is empty. Threads outside the pool
+// share deque 0.
+// Every task belongs to a region, the parallel_for or task graph which
+// queued it. A thread waiting for a region runs queued tasks of that region
+// meanwhile, so nested parallel regions share the same threads rather than
+// each adding their own. It runs no task of another region: one could
+// re-enter a kernel whose thread_local scratch buffers the waiting thread
+// is still using, such as the packed panels of a GEMM whose parts it waits
+// for while a graph node running side by side queues its own GEMM.
+class thread_pool {
+public:
+  explicit thread_pool(long num_threads) {
+    for (long i = 0; i < num_threads; ++i) {
+      queues.emplace_back(new task_queue());
+    }
+    for (long i = 1; i < num_threads; ++i) {
+      workers.emplace_back([this, i] { work(i); });
+    }
+  }
+
+  ~thread_pool() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+  }
+
+  long size() const { return static_cast<long>(queues.size()); }
+
+  // Queue t of region on the deque of the calling thread. Call `notify`
+  // once the tasks of a batch are queued.
+  // region: any address which tells the region apart from the others
+  //   running, such as an object on the stack of its caller
+  void push(const void *region, task t) {
+    task_queue &queue = *queues[queue_index()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(queued_task{region, std::move(t)});
+  }
+
+  // Wake the threads which sleep in `work` or `wait`, after a task was
+  // queued or a condition they wait for became true.
+  void notify() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      ++epoch;
+    }
+    wake.notify_all();
+  }
+
+  // Run queued tasks of region until done() returns true. done must become
+  // true only through a task which calls `notify` afterwards.
+  template <class DONE> void wait(const void *region, DONE const &done) {
+    long self = queue_index();
+    while (!done()) {
+      unsigned long long seen_epoch = current_epoch();
+      if (done()) {
+        return;
+      }
+      if (run_one(self, region)) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleep_mutex);
+      wake.wait(lock, [&] { return epoch != seen_epoch; });
+    }
+  }
+
+private:
+  struct queued_task {
+    const void *region;
+    task run;
+  };
+
+  struct task_queue {
+    std::mutex mutex;
+    std::deque<queued_task> tasks;
+  };
+
+  long queue_index() const {
+    return current_pool == this ? current_worker_index : 0;
+  }
+
+  unsigned long long current_epoch() {
+    std::lock_guard<std::mutex> lock(sleep_mutex);
+    return epoch;
+  }
+
+  // Pop the newest task of the own deque, or steal the oldest task of
+  // another one, and run it. Only tasks of region are taken, or any task if
+  // region is nullptr. Return false if there is none.
+  bool run_one(long self, const void *region) {
+    task t;
+    auto of_region = [region](queued_task const &queued) {
+      return region == nullptr || queued.region == region;
+    };
+    for (long i = 0; i < size() && !t; ++i) {
+      task_queue &queue = *queues[(self + i) % size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (i == 0) {
+        auto found = std::find_if(queue.tasks.rbegin(), queue.tasks.rend(),
+                                  of_region);
+        if (found != queue.tasks.rend()) {
+          t = std::move(found->run);
+          queue.tasks.erase(std::next(found).base());
+        }
+      } else {
+        auto found =
+            std::find_if(queue.tasks.begin(), queue.tasks.end(), of_region);
+        if (found != queue.tasks.end()) {
+          t = std::move(found->run);
+          queue.tasks.erase(found);
+        }
+      }
+    }
+    if (!t) {
+      return false;
+    }
+    t();
+    return true;
+  }
+
+  void work(long worker_index) {
+    current_pool = this;
+    current_worker_index = worker_index;
+    while (true) {
+      unsigned long long seen_epoch = current_epoch();
+      // A worker waits for no region, so it may take any task.
+      if (run_one(worker_index, nullptr)) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(sleep_mutex);
+      wake.wait(lock, [&] { return stopping || epoch != seen_epoch; });
+      if (stopping) {
+        return;
+      }
+    }
+  }
+
+  // The pool a worker thread belongs to and the index of its deque.
+  static thread_local const thread_pool *current_pool;
+  static thread_local long current_worker_index;
+
+  std::vector<std::unique_ptr<task_queue>> queues;
+  std::vector<std::thread> workers;
+  // Guards the members below.
+  std::mutex sleep_mutex;
+  std::condition_variable wake;
+  unsigned long long epoch = 0;
+  bool stopping = false;
+};
+
+thread_local const thread_pool *thread_pool::current_pool = nullptr;
+thread_local long thread_pool::current_worker_index = 0;
+
+long default_num_threads() {
+  const char *value = std::getenv(NUM_THREADS_ENV_NAME);
+  if (value != nullptr && *value != '\0') {
+    long num_threads = std::strtol(value, nullptr, 10);
+    if (num_threads > 0) {
+      return num_threads;
+    }
+    std::cerr << "inference_engine: ignoring " << NUM_THREADS_ENV_NAME << "="
+              << value << ": not a positive number" << std::endl;
+  }
+  return std::max(1l, static_cast<long>(std::thread::hardware_concurrency()));
+}
+
+std::mutex pool_mutex;
+std::unique_ptr<thread_pool> pool;
+
+thread_pool &get_pool() {
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  if (!pool) {
+    pool.reset(new thread_pool(default_num_threads()));
+  }
+  return *pool;
+}
+
+// Keep the first exception thrown by the tasks of one call.
+class first_error {
+public:
+  void capture() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error) {
+      error = std::current_exception();
+    }
+  }
+
+  bool has_error() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return static_cast<bool>(error);
+  }
+
+  void rethrow() {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+  std::mutex mutex;
+  std::exception_ptr error;
+};
+
+} // namespace
+
+long num_threads() { return get_pool().size(); }
+
+void set_num_threads(long num_threads) {
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  pool.reset();
+  pool.reset(new thread_pool(num_threads > 0 ? num_threads
+                                             : default_num_threads()));
+}
+
+void parallel_for(long n, std::function<void(long, long)> const &f,
+                  inference_engine::parallel::SCHEDULE schedule, long grain) {
+  if (n <= 0) {
+    return;
+  }
+  grain = std::max(1l, grain);
+  long chunks = (n + grain - 1) / grain;
+
+  if (chunks == 1) {
+    return f(0, n);
+  }
+  thread_pool &threads = get_pool();
+  if (threads.size() == 1) {
+    return f(0, n);
+  }
+
+  long num_parts = std::min(threads.size(), chunks);
+  std::atomic<long> next_chunk(0);
+  std::atomic<long> remaining_parts(num_parts - 1);
+  first_error error;
+
+  auto run_part = [&](long part) {
+    try {
+      if (schedule == inference_engine::parallel::SCHEDULE::Static) {
+        // Whole chunks, spread as evenly as possible over the parts.
+        long begin = chunks * part / num_parts * grain;
+        long end = std::min(n, chunks * (part + 1) / num_parts * grain);
+        if (begin < end) {
+          f(begin, end);
+        }
+      } else {
+        for (long chunk = next_chunk++; chunk < chunks; chunk = next_chunk++) {
+          f(chunk * grain, std::min(n, (chunk + 1) * grain));
+        }
+      }
+    } catch (...) {
+      error.capture();
+    }
+  };
+
+  // Parts 1.. are offered to the other threads, part 0 runs here. A part
+  // nobody has stolen by the time this thread waits is run here as well.
+  // The caller may return as soon as the last part is retired, so nothing
+  // on its stack is touched after that.
+  thread_pool *threads_ptr = &threads;
+  for (long part = num_parts - 1; part >= 1; --part) {
+    threads.push(&remaining_parts, [&run_part, &remaining_parts, threads_ptr,
+                                    part] {
+      run_part(part);
+      if (--remaining_parts == 0) {
+        threads_ptr->notify();
+      }
+    });
+  }
+  threads.notify();
+  run_part(0);
+  threads.wait(&remaining_parts, [&] { return remaining_parts == 0; });
+  error.rethrow();
+}
+
+void run_task_graph(std::vector<std::vector<long>> const &successors,
+                    std::function<void(long)> const &run) {
+  long num_tasks = static_cast<long>(successors.size());
+  std::unique_ptr<std::atomic<long>[]> pending_predecessors(
+      new std::atomic<long>[num_tasks]);
+  std::vector<long> in_degree(num_tasks, 0);
+  for (long task_index = 0; task_index < num_tasks; ++task_index) {
+    for (long successor : successors[task_index]) {
+      if (successor < 0 || successor >= num_tasks) {
+        throw std::runtime_error("task " + std::to_string(task_index) +
+                                 " has an out of range successor: " +
+                                 std::to_string(successor));
+      }
+      ++in_degree[successor];
+    }
+  }
+
+  // A cycle would never become ready, so it is rejected before anything
+  // runs.
+  {
+    std::vector<long> degree = in_degree;
+    std::vector<long> ready;
+    for (long task_index = 0; task_index < num_tasks; ++task_index) {
+      if (degree[task_index] == 0) {
+        ready.push_back(task_index);
+      }
+    }
+    long visited = 0;
+    while (!ready.empty()) {
+      long task_index = ready.back();
+      ready.pop_back();
+      ++visited;
+      for (long successor : successors[task_index]) {
+        if (--degree[successor] == 0) {
+          ready.push_back(successor);
+        }
+      }
+    }
+    if (visited != num_tasks) {
+      throw std::runtime_error("the task graph has a cycle");
+    }
+  }
+
+  for (long task_index = 0; task_index < num_tasks; ++task_index) {
+    pending_predecessors[task_index] = in_degree[task_index];
+  }
+
+  thread_pool &threads = get_pool();
+  std::atomic<long> remaining_tasks(num_tasks);
+  first_error error;
+
+  // Once a task has failed the rest are skipped, but still retired so that
+  // the wait below ends. The caller may return as soon as the last task is
+  // retired, so nothing on its stack, run_task included, is touched after
+  // that.
+  std::function<void(long)> run_task = [&](long task_index) {
+    thread_pool *task_threads = &threads;
+    if (!error.has_error()) {
+      try {
+        run(task_index);
+      } catch (...) {
+        error.capture();
+      }
+    }
+    bool pushed = false;
+    for (long successor : successors[task_index]) {
+      if (--pending_predecessors[successor] == 0) {
+        task_threads->push(&remaining_tasks,
+                           [&run_task, successor] { run_task(successor); });
+        pushed = true;
+      }
+    }
+    if (pushed) {
+      task_threads->notify();
+    }
+    if (--remaining_tasks == 0) {
+      task_threads->notify();
+    }
+  };
+
+  for (long task_index = num_tasks - 1; task_index >= 0; --task_index) {
+    if (in_degree[task_index] == 0) {
+      threads.push(&remaining_tasks,
+                   [&run_task, task_index] { run_task(task_index); });
+    }
+  }
+  threads.notify();
+  threads.wait(&remaining_tasks, [&] { return remaining_tasks == 0; });
+  error.rethrow();
+}
+} // namespace parallel
+} // namespace inference_engine
@@ -0,0 +1,60 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <functional>
+#include <vector>
+
+namespace inference_engine {
+namespace parallel {
+
+// The environment variable which sets the number of threads of the pool,
+// e.g. `INFERENCE_ENGINE_NUM_THREADS=16`. By default the pool has one thread
+// per hardware thread. On CPUs with SMT the physical core count is usually
+// faster for the compute bound kernels.
+constexpr const char *NUM_THREADS_ENV_NAME = "INFERENCE_ENGINE_NUM_THREADS";
+
+// How `parallel_for` hands out the iterations.
+//   Static: each thread gets one contiguous range of about the same size.
+//     Best for iterations of equal cost, as it keeps the ranges in order.
+//   Dynamic: threads take chunks of `grain` iterations from a shared counter
+//     until none is left. Best for iterations of uneven cost.
+enum SCHEDULE { Static, Dynamic };
+
+// Return the number of threads `parallel_for` runs on, the calling thread
+// included.
+long num_threads();
+
+// Replace the pool with one of num_threads threads, the calling thread
+// included. 0 restores the default.
+// It must not be called while `parallel_for` runs on another thread.
+void set_num_threads(long num_threads);
+
+// Call f(begin, end) on disjoint ranges which cover [0, n), in parallel on
+// the threads of a pool which is created on the first call and reused
+// afterwards. Return when every range has been processed.
+// long grain: the minimum number of iterations of a range (the last range may
+//   be shorter), to keep small iterations from being split too finely.
+// Calls made from inside f or from `run_task_graph` tasks share the same
+// threads: the ranges are queued as tasks which idle threads steal, and a
+// range nobody has taken runs on the calling thread.
+// The first exception thrown by f is rethrown after every range has finished.
+void parallel_for(long n, std::function<void(long, long)> const &f,
+                  inference_engine::parallel::SCHEDULE schedule =
+                      inference_engine::parallel::SCHEDULE::Static,
+                  long grain = 1);
+
+// Call run(i) for every task i of a dependency graph, after all of its
+// predecessors have returned, on the threads of the pool which
+// `parallel_for` uses. Independent tasks run concurrently, and each of them
+// can run `parallel_for` with the threads that are left idle.
+// Return when every task has finished.
+// successors[i]: the tasks which depend on task i
+// Throw std::runtime_error if the graph has a cycle or a successor is out of
+// range. After a task throws, the tasks which have not started are skipped
+// and the first exception is rethrown.
+void run_task_graph(std::vector<std::vector<long>> const &successors,
+                    std::function<void(long)> const &run);
+} // namespace parallel
+} // namespace inference_engine
+
+#endif
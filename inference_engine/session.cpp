@@ -0,0 +1,1021 @@
+#include "session.hpp"
+#include "backend.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <stdexcept>
+
+namespace inference_engine {
+namespace inferer {
+namespace {
+
+// The number of sessions using each Conv kernel, by its address. Sessions of
+// one mapped model share their weights, and so the kernels cached for them.
+std::mutex kernel_weight_users_mutex;
+std::map<const float *, long> kernel_weight_users;
+
+// Add the seconds since start to total, and restart start.
+void lap(std::chrono::steady_clock::time_point &start, double &total) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  total += std::chrono::duration<double>(now - start).count();
+  start = now;
+}
+
+long long product(std::vector<long> const &dims) {
+  return std::accumulate(dims.begin(), dims.end(), 1ll,
+                         std::multiplies<long long>());
+}
+
+// Return the strides of a dense row-major tensor with dims.
+std::vector<long> contiguous_strides(std::vector<long> const &dims) {
+  std::vector<long> strides(dims.size());
+  long stride = 1;
+  for (long i = static_cast<long>(dims.size()) - 1; i >= 0; --i) {
+    strides[i] = stride;
+    stride *= dims[i];
+  }
+  return strides;
+}
+
+bool is_contiguous(std::vector<long> const &dims,
+                   std::vector<long> const &strides) {
+  long stride = 1;
+  for (long i = static_cast<long>(dims.size()) - 1; i >= 0; --i) {
+    if (dims[i] != 1 && strides[i] != stride) {
+      return false;
+    }
+    stride *= dims[i];
+  }
+  return true;
+}
+
+// Copy the elements of the view of x with dims and strides into the dense
+// tensor y, the last dim in the innermost loop.
+void copy_strided(std::vector<long> const &dims,
+                  std::vector<long> const &strides, const float *x,
+                  float *y) {
+  if (dims.empty()) {
+    y[0] = x[0];
+    return;
+  }
+  const long rank = static_cast<long>(dims.size());
+  const long columns = dims[rank - 1];
+  const long column_stride = strides[rank - 1];
+  std::vector<long> index(rank, 0);
+  long long rows = product(dims) / columns;
+  for (long long row = 0; row < rows; ++row) {
+    const float *x_row = x;
+    for (long i = 0; i < rank - 1; ++i) {
+      x_row += index[i] * strides[i];
+    }
+    for (long j = 0; j < columns; ++j) {
+      y[j] = x_row[j * column_stride];
+    }
+    y += columns;
+    for (long i = rank - 2; i >= 0 && ++index[i] == dims[i]; --i) {
+      index[i] = 0;
+    }
+  }
+}
+
+// The kernels take one size, stride and leading pad for both dims of a
+// window; the trailing pads follow from the output dims.
+// Return the kernel of transform from the cache of `backend` holding it. The
+// data is not owned: the cache holds it until the session evicts it.
+inference_engine::backend::packed_matrix transformed_kernel(
+    inference_engine::inferer::kernel_transform const &transform,
+    std::map<std::string, inference_engine::onnx::parameter> const &table) {
+  const float *w = table.at(transform.weight).data<float>();
+  inference_engine::backend::packed_matrix kernel;
+  const float *data = nullptr;
+  switch (transform.layout) {
+  case inference_engine::inferer::KERNEL_LAYOUT::NchwcKernel:
+    data = inference_engine::backend::cached_nchwc_kernel(
+        transform.c_in, transform.c_out, transform.size, w);
+    kernel.size = inference_engine::backend::nchwc_kernel_size(
+        transform.c_in, transform.c_out, transform.size);
+    break;
+  case inference_engine::inferer::KERNEL_LAYOUT::WinogradKernel:
+    data = inference_engine::backend::cached_winograd_kernel(
+        transform.c_in, transform.c_out, transform.size, w);
+    kernel.size = inference_engine::backend::winograd_kernel_size(
+        transform.c_in, transform.c_out, transform.size);
+    break;
+  case inference_engine::inferer::KERNEL_LAYOUT::Im2colKernel:
+    return *inference_engine::backend::cached_im2col_kernel(
+        transform.c_in, transform.c_out, transform.size, w);
+  }
+  kernel.data =
+      std::shared_ptr<float>(const_cast<float *>(data), [](float *) {});
+  return kernel;
+}
+
+void require_square(inference_engine::onnx::node const &node,
+                    inference_engine::inferer::window const &window) {
+  if (window.k_h != window.k_w || window.stride_h != window.stride_w ||
+      window.pad_top != window.pad_left) {
+    throw std::runtime_error(
+        node.name + ": only windows with the same size, stride and leading "
+                    "pad in both dims are supported");
+  }
+}
+
+} // namespace
+
+session::session(::onnx::GraphProto &graph,
+                 inference_engine::inferer::session_options const &options) {
+  compile(graph, options, nullptr, nullptr);
+}
+
+session::session(inference_engine::onnx::mapped_model &model,
+                 inference_engine::inferer::session_options const &options) {
+  compile(*model.model.mutable_graph(), options, &model, nullptr);
+}
+
+session::session(inference_engine::inferer::engine_model &model,
+                 inference_engine::inferer::session_options const &options) {
+  compile(*model.model.model.mutable_graph(), options, &model.model, &model);
+}
+
+void session::compile(
+    ::onnx::GraphProto &graph,
+    inference_engine::inferer::session_options const &options,
+    inference_engine::onnx::mapped_model const *model,
+    inference_engine::inferer::engine_model const *engine) {
+  // The initializers are kept without their data, which is in table.
+  plan.set_name(graph.name());
+  *plan.mutable_node() = graph.node();
+  *plan.mutable_input() = graph.input();
+  *plan.mutable_output() = graph.output();
+  *plan.mutable_value_info() = graph.value_info();
+  for (::onnx::TensorProto const &initializer : graph.initializer()) {
+    ::onnx::TensorProto *tensor = plan.add_initializer();
+    tensor->set_name(initializer.name());
+    *tensor->mutable_dims() = initializer.dims();
+    tensor->set_data_type(initializer.data_type());
+  }
+  layout = options.layout;
+  batch = options.batch;
+  if (model != nullptr) {
+    mapping = model->file;
+  }
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  std::set<std::string> graph_outputs;
+  for (::onnx::ValueInfoProto const &output : graph.output()) {
+    graph_outputs.insert(output.name());
+    outputs.push_back(output.name());
+  }
+  std::vector<inference_engine::onnx::node> nodes =
+      inference_engine::onnx::abstract_all_nodes(graph);
+  if (!options.masked_dropout) {
+    nodes = inference_engine::inferer::eliminate_dropouts(nodes, graph_outputs);
+  }
+  nodes = inference_engine::inferer::fuse_nodes(nodes, graph_outputs);
+  lap(start, phase_times.passes);
+
+  inference_engine::onnx::abstract_parameter_table(graph, table);
+  if (model != nullptr) {
+    inference_engine::onnx::map_parameter_table(*model, table);
+  }
+  inference_engine::onnx::initialize_parameter_table(graph, table);
+  lap(start, phase_times.unpack);
+  std::set<std::string> initializers;
+  for (::onnx::TensorProto const &initializer : graph.initializer()) {
+    initializers.insert(initializer.name());
+  }
+  // The B of the Gemm nodes an engine file holds packed are weights as well,
+  // without data of their own.
+  std::map<std::string, inference_engine::inferer::gemm_weights> prepacked;
+  if (engine != nullptr) {
+    for (std::string const &name : engine->packed) {
+      initializers.insert(name);
+      ::onnx::TensorProto *tensor = plan.add_initializer();
+      tensor->set_name(name);
+    }
+    prepacked = engine->gemm_weights;
+    for (auto const &kernel : engine->kernels) {
+      inference_engine::inferer::kernel_transform const &transform =
+          kernel.first;
+      const float *w = table.at(transform.weight).data<float>();
+      const float *data = kernel.second.data.get();
+      use_kernel_weights(w);
+      switch (transform.layout) {
+      case inference_engine::inferer::KERNEL_LAYOUT::NchwcKernel:
+        inference_engine::backend::insert_nchwc_kernel(
+            transform.c_in, transform.c_out, transform.size, w, data);
+        break;
+      case inference_engine::inferer::KERNEL_LAYOUT::WinogradKernel:
+        inference_engine::backend::insert_winograd_kernel(
+            transform.c_in, transform.c_out, transform.size, w, data);
+        break;
+      case inference_engine::inferer::KERNEL_LAYOUT::Im2colKernel:
+        inference_engine::backend::insert_im2col_kernel(
+            transform.c_in, transform.c_out, transform.size, w,
+            kernel.second);
+        break;
+      }
+    }
+  }
+
+  // The graph inputs get the batch of the options, and their own data.
+  bool batch_override = false;
+  for (::onnx::ValueInfoProto const &input : graph.input()) {
+    if (initializers.count(input.name()) != 0) {
+      continue;
+    }
+    inference_engine::onnx::parameter &parameter = table.at(input.name());
+    if (!parameter.dims.empty()) {
+      batch_override = batch_override || parameter.dims[0] != options.batch;
+      parameter.dims[0] = options.batch;
+    }
+    parameter.total_size = product(parameter.dims);
+    inputs.push_back(input.name());
+    long x =
+        add_tensor(input.name(), parameter.dims, false, parameter.total_size);
+    tensors[x]->batch_major =
+        !parameter.dims.empty() && parameter.dims[0] == batch;
+  }
+
+  shapes =
+      inference_engine::inferer::infer_shapes(nodes, table, batch_override);
+  if (options.layout == inference_engine::inferer::LAYOUT::NCHWc) {
+    layouts = inference_engine::inferer::plan_nchwc_layouts(nodes);
+  }
+  kernel_transforms = inference_engine::inferer::plan_kernel_transforms(
+      nodes, table, layouts, shapes);
+  lap(start, phase_times.passes);
+  gemm_weights = inference_engine::inferer::prepack_weights(
+      nodes, table, initializers, layouts, shapes, prepacked);
+  lap(start, phase_times.prepack);
+
+  if (options.weight_budget > 0 && mapping) {
+    pager.reset(new inference_engine::memory::weight_pager(
+        static_cast<size_t>(options.weight_budget)));
+  }
+  for (inference_engine::onnx::node const &node : nodes) {
+    const size_t first_step = steps.size();
+    compile_node(node);
+    if (pager) {
+      std::vector<long> weights = page_weights(node);
+      for (size_t i = first_step; i < steps.size(); ++i) {
+        steps[i].weights = weights;
+      }
+    }
+  }
+  // The graph outputs are read in NCHW.
+  for (std::string const &name : outputs) {
+    tensor_indices[name] = in_layout(tensor_index(name), false);
+  }
+  // A part of the batch runs alone if every step and graph output splits it.
+  split_batch = true;
+  for (step const &s : steps) {
+    split_batch = split_batch && s.splits_batch;
+  }
+  for (std::string const &name : outputs) {
+    split_batch = split_batch && tensors[tensor_index(name)]->batch_major;
+  }
+  lap(start, phase_times.bind);
+  plan_memory();
+  own_context.reset(new inference_engine::inferer::session_context(*this));
+  // Only what runs is paged in from now on.
+  if (pager) {
+    pager->evict_unused();
+  }
+  lap(start, phase_times.plan);
+}
+
+session_context::session_context(
+    inference_engine::inferer::session const &session)
+    : arena(session.arena_size * sizeof(float)) {
+  tensor_data.reserve(session.tensors.size());
+  for (std::unique_ptr<session::tensor> const &t : session.tensors) {
+    session::buffer const &b = session.buffers[t->buffer];
+    tensor_data.push_back(
+        (b.constant ? b.storage.as<float>() : arena.as<float>() + b.offset) +
+        t->offset);
+  }
+}
+
+session::~session() {
+  // The weight caches may hold transforms of the weights freed below. Other
+  // sessions may still run with their own kernels, or with these if they
+  // share the weights.
+  std::lock_guard<std::mutex> lock(kernel_weight_users_mutex);
+  for (const float *w : kernel_weights) {
+    if (--kernel_weight_users[w] == 0) {
+      kernel_weight_users.erase(w);
+      inference_engine::backend::erase_winograd_kernels(w);
+      inference_engine::backend::erase_nchwc_kernels(w);
+      inference_engine::backend::erase_im2col_kernels(w);
+    }
+  }
+}
+
+void session::save(std::string const &engine_path,
+                   std::string const &model_path) const {
+  std::vector<std::pair<inference_engine::inferer::kernel_transform,
+                        inference_engine::backend::packed_matrix>>
+      kernels;
+  for (inference_engine::inferer::kernel_transform const &transform :
+       kernel_transforms) {
+    kernels.push_back(
+        std::make_pair(transform, transformed_kernel(transform, table)));
+  }
+  inference_engine::inferer::write_engine_file(
+      engine_path, inference_engine::inferer::read_model_key(model_path, true),
+      layout, plan, table, gemm_weights, kernels);
+}
+
+long session::tensor_index(std::string const &name) const {
+  return tensor_indices.at(name);
+}
+
+float *session::data(long tensor) { return own_context->data(tensor); }
+
+std::vector<long> const &session::dims(long tensor) const {
+  return tensors.at(tensor)->dims;
+}
+
+void session::run() { run(*own_context, batch); }
+
+void session::run(inference_engine::inferer::session_context &context) const {
+  run(context, batch);
+}
+
+void session::run(inference_engine::inferer::session_context &context,
+                  long images) const {
+  if (images < 1 || images > batch) {
+    throw std::runtime_error("cannot run " + std::to_string(images) +
+                             " images of a batch of " +
+                             std::to_string(batch));
+  }
+  if (!split_batch) {
+    images = batch;
+  }
+  float *const *data = context.tensor_data.data();
+  if (!pager) {
+    inference_engine::parallel::run_task_graph(
+        successors,
+        [this, data, images](long i) { steps[i].run(data, images); });
+    return;
+  }
+  // The weights of a step are paged in as it runs, while those of the steps
+  // after it are read ahead. A region in use by several contexts stays
+  // resident until the last of them releases it.
+  inference_engine::parallel::run_task_graph(
+      successors, [this, data, images](long i) {
+        for (long region : steps[i].weights) {
+          pager->acquire(region);
+        }
+        for (long next : successors[i]) {
+          for (long region : steps[next].weights) {
+            pager->prefetch(region);
+          }
+        }
+        steps[i].run(data, images);
+        for (long region : steps[i].weights) {
+          pager->release(region);
+        }
+      });
+}
+
+std::vector<long>
+session::page_weights(inference_engine::onnx::node const &node) {
+  std::vector<long> regions;
+  auto add = [&](const char *data, size_t size) {
+    if (data != nullptr && size > 0 && data >= mapping->data() &&
+        data + size <= mapping->data() + mapping->size()) {
+      regions.push_back(pager->add_region(*mapping, data, size));
+    }
+  };
+
+  // A Conv kernel with a transform is only read transformed.
+  std::set<std::string> transformed;
+  for (inference_engine::inferer::kernel_transform const &transform :
+       kernel_transforms) {
+    if (node.input.size() > 1 && transform.weight == node.input[1]) {
+      inference_engine::backend::packed_matrix kernel =
+          transformed_kernel(transform, table);
+      add(reinterpret_cast<const char *>(kernel.data.get()),
+          kernel.size * sizeof(float));
+      transformed.insert(transform.weight);
+    }
+  }
+  // A Gemm reads its weights from `prepack_weights` alone.
+  auto gemm = gemm_weights.find(node.output[0]);
+  if (gemm != gemm_weights.end()) {
+    add(reinterpret_cast<const char *>(gemm->second.packed_b.data.get()),
+        gemm->second.packed_b.size * sizeof(float));
+    return regions;
+  }
+  for (std::string const &name : node.input) {
+    auto parameter = table.find(name);
+    if (parameter != table.end() && transformed.count(name) == 0) {
+      add(parameter->second.bytes(),
+          parameter->second.total_size *
+              inference_engine::onnx::element_size(
+                  parameter->second.data_type));
+    }
+  }
+  return regions;
+}
+
+long session::add_tensor(std::string const &name,
+                         std::vector<long> const &dims, bool nchwc,
+                         long long size) {
+  std::unique_ptr<tensor> t(new tensor());
+  t->name = name;
+  t->dims = dims;
+  t->nchwc = nchwc;
+  t->strides = nchwc ? std::vector<long>() : contiguous_strides(dims);
+  t->offset = 0;
+  t->size = size;
+  t->buffer = static_cast<long>(buffers.size());
+  t->producer = -1;
+  t->batch_major = false;
+  buffers.push_back(buffer{size, false, {}, 0});
+  tensors.push_back(std::move(t));
+  tensor_indices[name] = static_cast<long>(tensors.size()) - 1;
+  return static_cast<long>(tensors.size()) - 1;
+}
+
+long session::add_constant(std::string const &name,
+                           std::vector<long> const &dims, long long size) {
+  long constant = add_tensor(name, dims, false, size);
+  buffer &b = buffers[tensors[constant]->buffer];
+  b.constant = true;
+  b.storage = inference_engine::memory::aligned_buffer(size * sizeof(float));
+  return constant;
+}
+
+long session::add_view(std::string const &name,
+                       std::vector<long> const &dims,
+                       std::vector<long> const &strides, long long offset,
+                       long source) {
+  tensor const &x = *tensors[source];
+  std::unique_ptr<tensor> t(new tensor());
+  t->name = name;
+  t->dims = dims;
+  t->nchwc = x.nchwc;
+  t->strides = strides;
+  t->offset = x.offset + offset;
+  t->size = x.nchwc ? x.size : product(dims);
+  t->buffer = x.buffer;
+  t->producer = x.producer;
+  t->batch_major = false;
+  tensors.push_back(std::move(t));
+  tensor_indices[name] = static_cast<long>(tensors.size()) - 1;
+  return static_cast<long>(tensors.size()) - 1;
+}
+
+void session::add_step(std::vector<long> const &inputs,
+                       std::vector<long> const &outputs,
+                       std::function<void(float *const *, long)> const &run,
+                       bool elementwise, bool splits_batch) {
+  // A step splits the batch if its kernel call does, and it reads and writes
+  // whole images.
+  for (long input : inputs) {
+    splits_batch = splits_batch && tensors[input]->batch_major;
+  }
+  for (long output : outputs) {
+    splits_batch = splits_batch && !tensors[output]->dims.empty() &&
+                   tensors[output]->dims[0] == batch;
+  }
+  for (long output : outputs) {
+    tensors[output]->producer = static_cast<long>(steps.size());
+    tensors[output]->batch_major = splits_batch;
+  }
+  steps.push_back(step{run, inputs, outputs, elementwise, splits_batch, {}});
+}
+
+void session::use_kernel_weights(const float *w) {
+  if (kernel_weights.insert(w).second) {
+    std::lock_guard<std::mutex> lock(kernel_weight_users_mutex);
+    ++kernel_weight_users[w];
+  }
+}
+
+long session::in_layout(long source, bool nchwc) {
+  if (tensors[source]->nchwc == nchwc) {
+    return source;
+  }
+  std::string name = tensors[source]->name + (nchwc ? "/nchwc" : "/nchw");
+  auto found = tensor_indices.find(name);
+  if (found != tensor_indices.end()) {
+    return found->second;
+  }
+
+  std::vector<long> const dims = tensors[source]->dims;
+  if (dims.size() != 4) {
+    throw std::runtime_error(tensors[source]->name +
+                             ": only NCHW tensors can be reordered");
+  }
+  long n = dims[0];
+  long c = dims[1];
+  long h = dims[2];
+  long w = dims[3];
+  long long nchw_image = static_cast<long long>(c) * h * w;
+  long long nchwc_image = inference_engine::backend::nchwc_size(c, h, w);
+  long reordered = add_tensor(name, dims, nchwc, n * (nchwc ? nchwc_image
+                                                            : nchw_image));
+  add_step({source}, {reordered}, [=](float *const *data, long images) {
+    for (long i = 0; i < n * images / batch; ++i) {
+      if (nchwc) {
+        inference_engine::backend::reorder_nchw_to_nchwc(
+            c, h, w, data[source] + i * nchw_image,
+            data[reordered] + i * nchwc_image);
+      } else {
+        inference_engine::backend::reorder_nchwc_to_nchw(
+            c, h, w, data[source] + i * nchwc_image,
+            data[reordered] + i * nchw_image);
+      }
+    }
+  });
+  return reordered;
+}
+
+void session::compile_node(inference_engine::onnx::node const &node) {
+  auto weight = [&](std::string const &name) {
+    return table.at(name).data<float>();
+  };
+  auto is_nchwc = [&](std::string const &name) {
+    auto it = layouts.find(name);
+    return it != layouts.end() &&
+           it->second == inference_engine::inferer::LAYOUT::NCHWc;
+  };
+
+  switch (node.op_type) {
+  case inference_engine::onnx::OP_TYPE::Conv:
+  case inference_engine::onnx::OP_TYPE::ConvRelu:
+  case inference_engine::onnx::OP_TYPE::ConvReluMaxPool: {
+    const bool nchwc = is_nchwc(node.output[0]);
+    long x = in_layout(tensor_index(node.input[0]), nchwc);
+    std::vector<long> const x_dims = tensors[x]->dims;
+    inference_engine::onnx::parameter const &w = table.at(node.input[1]);
+    const long n = x_dims[0];
+    const long c_in = x_dims[1];
+    const long x_h = x_dims[2];
+    const long x_w = x_dims[3];
+    const long c_out = w.dims[0];
+    const inference_engine::inferer::window window =
+        inference_engine::inferer::window_attributes(node, "", w.dims[2],
+                                                     w.dims[3]);
+    require_square(node, window);
+    const long k = window.k_h;
+    const long pad = window.pad_top;
+    const long stride = window.stride_h;
+    const std::pair<long, long> y_dims =
+        inference_engine::inferer::calculate_conv_matrix_dims(x_h, x_w,
+                                                              window);
+    const bool fused = node.op_type != inference_engine::onnx::OP_TYPE::Conv;
+    long pool_k = 0;
+    long pool_pad = 0;
+    long pool_stride = 1;
+    if (node.op_type == inference_engine::onnx::OP_TYPE::ConvReluMaxPool) {
+      const inference_engine::inferer::window pool_window =
+          inference_engine::inferer::window_attributes(node, "pool_", 1, 1);
+      require_square(node, pool_window);
+      pool_k = pool_window.k_h;
+      pool_pad = pool_window.pad_top;
+      pool_stride = pool_window.stride_h;
+    }
+    std::vector<long> const &y_shape = shapes.at(node.output[0]).dims;
+    const std::pair<long, long> p_dims(y_shape[2], y_shape[3]);
+
+    // A Conv without a bias gets a zero one.
+    const float *b_data =
+        node.input.size() > 2 && !node.input[2].empty()
+            ? weight(node.input[2])
+            : buffers[tensors[add_constant(node.name + "/bias", {c_out},
+                                           c_out)]
+                          ->buffer]
+                  .storage.as<float>();
+
+    const long long x_image = tensors[x]->size / n;
+    const long long y_image =
+        nchwc ? inference_engine::backend::nchwc_size(c_out, p_dims.first,
+                                                      p_dims.second)
+              : static_cast<long long>(c_out) * p_dims.first * p_dims.second;
+    long y = add_tensor(node.output[0], y_shape, nchwc, n * y_image);
+    const float *w_data = weight(node.input[1]);
+    use_kernel_weights(w_data);
+
+    // The images of the batch run one after another, each of them spread
+    // over the thread pool by the kernel. Every kernel overwrites y, so y is
+    // not cleared between runs.
+    if (nchwc) {
+      const float *w_nchwc = inference_engine::backend::cached_nchwc_kernel(
+          c_in, c_out, k, w_data);
+      add_step({x}, {y}, [=](float *const *data, long images) {
+        float *x_data = data[x];
+        float *y_data = data[y];
+        for (long i = 0; i < n * images / batch; ++i) {
+          if (fused) {
+            inference_engine::backend::conv_relu_max_pool_nchwc(
+                c_in, c_out, x_h, x_w, y_dims.first, y_dims.second, k, pad,
+                stride, pool_k, pool_pad, pool_stride, p_dims.first,
+                p_dims.second, x_data + i * x_image, w_nchwc, b_data,
+                y_data + i * y_image);
+          } else {
+            inference_engine::backend::conv_nchwc(
+                c_in, c_out, x_h, x_w, y_dims.first, y_dims.second, k, pad,
+                stride, x_data + i * x_image, w_nchwc, b_data,
+                y_data + i * y_image);
+          }
+        }
+      });
+      return;
+    }
+    // The algorithm and its transformed or packed kernel are bound here
+    // once, as the NCHWc kernel is above.
+    const inference_engine::backend::conv_kernel kernel =
+        inference_engine::backend::bind_conv_kernel(
+            c_in, c_out, y_dims.first, y_dims.second, k, stride, w_data);
+    add_step({x}, {y}, [=](float *const *data, long images) {
+      float *x_data = data[x];
+      float *y_data = data[y];
+      for (long i = 0; i < n * images / batch; ++i) {
+        if (fused) {
+          inference_engine::backend::conv_relu_max_pool(
+              c_in, c_out, x_h, x_w, y_dims.first, y_dims.second, k, pad,
+              stride, pool_k, pool_pad, pool_stride, p_dims.first,
+              p_dims.second, x_data + i * x_image, kernel, b_data,
+              y_data + i * y_image);
+        } else {
+          inference_engine::backend::conv(
+              c_in, c_out, x_h, x_w, y_dims.first, y_dims.second, k, pad,
+              stride, x_data + i * x_image, kernel, b_data,
+              y_data + i * y_image);
+        }
+      }
+    });
+    return;
+  }
+
+  case inference_engine::onnx::OP_TYPE::Gemm:
+  case inference_engine::onnx::OP_TYPE::GemmRelu: {
+    // The images of the batch are the rows of A, so the whole batch is one
+    // GEMM against the weights packed by prepack_weights.
+    long a = in_layout(tensor_index(node.input[0]), false);
+    const inference_engine::inferer::gemm_weights *weights =
+        &gemm_weights.at(node.output[0]);
+    const long k = weights->packed_b.rows;
+    const long columns = weights->packed_b.columns;
+    const long rows = shapes.at(node.output[0]).dims[0];
+    long y = add_tensor(node.output[0], {rows, columns}, false,
+                        static_cast<long long>(rows) * columns);
+
+    inference_engine::backend::gemm_epilogue epilogue;
+    epilogue.alpha = weights->alpha;
+    epilogue.column_bias =
+        weights->column_bias.empty() ? nullptr : weights->column_bias.data();
+    epilogue.relu = node.op_type == inference_engine::onnx::OP_TYPE::GemmRelu;
+    // Fewer images are fewer rows, of an A transposed or not.
+    add_step(
+        {a}, {y},
+        [=](float *const *data, long images) {
+          const float *a_data = data[a];
+          float *y_data = data[y];
+          inference_engine::backend::gemm_packed(
+              rows * images / batch, columns, k, a_data,
+              weights->transpose_a ? rows : k, weights->transpose_a,
+              weights->packed_b, y_data, columns, epilogue);
+        },
+        false, !weights->transpose_a);
+    return;
+  }
+
+  case inference_engine::onnx::OP_TYPE::Relu: {
+    // Relu is elementwise, so NCHWc tensors are relu'd as they are, padding
+    // channels included.
+    long x = tensor_index(node.input[0]);
+    long y = add_tensor(node.output[0], tensors[x]->dims, tensors[x]->nchwc,
+                        tensors[x]->size);
+    const long long size = tensors[x]->size;
+    add_step({x}, {y},
+             [=](float *const *data, long images) {
+               inference_engine::backend::relu(size * images / batch, data[x],
+                                               data[y]);
+             },
+             true);
+    return;
+  }
+
+  case inference_engine::onnx::OP_TYPE::MaxPool: {
+    const bool nchwc = is_nchwc(node.output[0]);
+    long x = in_layout(tensor_index(node.input[0]), nchwc);
+    std::vector<long> const x_dims = tensors[x]->dims;
+    const long n = x_dims[0];
+    const long c = x_dims[1];
+    const long x_h = x_dims[2];
+    const long x_w = x_dims[3];
+    const inference_engine::inferer::window window =
+        inference_engine::inferer::window_attributes(node, "", 1, 1);
+    require_square(node, window);
+    const long k = window.k_h;
+    const long pad = window.pad_top;
+    const long stride = window.stride_h;
+    std::vector<long> const &y_shape = shapes.at(node.output[0]).dims;
+    const std::pair<long, long> y_dims(y_shape[2], y_shape[3]);
+    // The channels of all images are pooled in one call.
+    const long channels =
+        nchwc ? n * inference_engine::backend::nchwc_size(c, 1, 1) : n * c;
+    long y = add_tensor(node.output[0], {n, c, y_dims.first, y_dims.second},
+                        nchwc,
+                        static_cast<long long>(channels) * y_dims.first *
+                            y_dims.second);
+    add_step({x}, {y}, [=](float *const *data, long images) {
+      const long part = channels * images / batch;
+      if (nchwc) {
+        inference_engine::backend::max_pool_nchwc(
+            part, x_h, x_w, y_dims.first, y_dims.second, k, pad, stride,
+            data[x], data[y]);
+      } else {
+        inference_engine::backend::max_pool(part, x_h, x_w, y_dims.first,
+                                            y_dims.second, k, pad, stride,
+                                            data[x], data[y]);
+      }
+    });
+    return;
+  }
+
+  case inference_engine::onnx::OP_TYPE::Reshape:
+  case inference_engine::onnx::OP_TYPE::Flatten:
+  case inference_engine::onnx::OP_TYPE::Squeeze:
+  case inference_engine::onnx::OP_TYPE::Unsqueeze: {
+    // Every tensor a node reads is dense, so only the dims change.
+    long x = in_layout(tensor_index(node.input[0]), false);
+    std::vector<long> const &y_dims = shapes.at(node.output[0]).dims;
+    long y = add_view(node.output[0], y_dims, contiguous_strides(y_dims), 0, x);
+    tensors[y]->batch_major =
+        tensors[x]->batch_major && !y_dims.empty() && y_dims[0] == batch;
+    return;
+  }
+
+  case inference_engine::onnx::OP_TYPE::Identity: {
+    long x = tensor_index(node.input[0]);
+    long y =
+        add_view(node.output[0], tensors[x]->dims, tensors[x]->strides, 0, x);
+    tensors[y]->batch_major = tensors[x]->batch_major;
+    return;
+  }
+
+  case inference_engine::onnx::OP_TYPE::Slice: {
+    // A slice is a view into its input. One which is not contiguous, such as
+    // some channels of a batch of images, is copied into a dense tensor, so
+    // that the kernels reading it need not know about strides.
+    long x = in_layout(tensor_index(node.input[0]), false);
+    std::vector<long> const x_strides = tensors[x]->strides;
+    std::vector<inference_engine::inferer::slice_range> const ranges =
+        inference_engine::inferer::slice_ranges(node, table, tensors[x]->dims);
+    std::vector<long> y_dims;
+    std::vector<long> y_strides;
+    long long offset = 0;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      y_dims.push_back(ranges[i].size);
+      y_strides.push_back(x_strides[i] * ranges[i].step);
+      offset += static_cast<long long>(ranges[i].start) * x_strides[i];
+    }
+    // A slice keeping every image keeps them in order.
+    const bool whole_batch = tensors[x]->batch_major && !ranges.empty() &&
+                             ranges[0].start == 0 && ranges[0].step == 1 &&
+                             ranges[0].size == batch;
+    if (is_contiguous(y_dims, y_strides)) {
+      long y = add_view(node.output[0], y_dims, contiguous_strides(y_dims),
+                        offset, x);
+      tensors[y]->batch_major = whole_batch;
+      return;
+    }
+    long view =
+        add_view(node.output[0] + "/view", y_dims, y_strides, offset, x);
+    tensors[view]->batch_major = whole_batch;
+    long y = add_tensor(node.output[0], y_dims, false, product(y_dims));
+    add_step({view}, {y}, [=](float *const *data, long images) {
+      std::vector<long> dims = y_dims;
+      dims[0] = dims[0] * images / batch;
+      copy_strided(dims, y_strides, data[view], data[y]);
+    });
+    return;
+  }
+
+  case inference_engine::onnx::OP_TYPE::Dropout: {
+    // Only compiled with masked_dropout, or if the mask is used.
+    long x = in_layout(tensor_index(node.input[0]), false);
+    const long long size = tensors[x]->size;
+    const float ratio =
+        inference_engine::inferer::float_attribute(node, "ratio", 0.5f);
+    long y = add_tensor(node.output[0], tensors[x]->dims, false, size);
+    long mask = node.output.size() > 1
+                    ? add_tensor(node.output[1], tensors[x]->dims, false, size)
+                    : add_tensor(node.name + "/mask", tensors[x]->dims, false,
+                                 size);
+    add_step({x}, {y, mask}, [=](float *const *data, long images) {
+      inference_engine::backend::drop_out(size * images / batch, ratio,
+                                          data[x], data[y], data[mask]);
+    });
+    return;
+  }
+
+  case inference_engine::onnx::OP_TYPE::Softmax: {
+    // The dims before axis are the rows, each normalized on its own, such as
+    // the class scores of each image of the batch.
+    long x = in_layout(tensor_index(node.input[0]), false);
+    std::vector<long> const &x_dims = tensors[x]->dims;
+    long axis = inference_engine::inferer::int_attribute(node, "axis", 1);
+    if (axis < 0) {
+      axis += static_cast<long>(x_dims.size());
+    }
+    axis = std::max(0l, std::min(axis, static_cast<long>(x_dims.size())));
+    const long rows = static_cast<long>(
+        product(std::vector<long>(x_dims.begin(), x_dims.begin() + axis)));
+    const long long columns = product(x_dims) / std::max(1l, rows);
+    long y = add_tensor(node.output[0], x_dims, false, rows * columns);
+    // Normalizing over the batch as well does not split it.
+    add_step(
+        {x}, {y},
+        [=](float *const *data, long images) {
+          inference_engine::backend::softmax(rows * images / batch, columns,
+                                             data[x], data[y]);
+        },
+        false, axis > 0);
+    return;
+  }
+
+  default:
+    throw std::runtime_error("not supported operator: " +
+                             std::to_string(node.op_type));
+  }
+}
+void session::plan_memory() {
+  const long num_steps = static_cast<long>(steps.size());
+  const long num_buffers = static_cast<long>(buffers.size());
+
+  // The graph inputs and outputs keep their memory for the whole run.
+  std::vector<bool> pinned(num_buffers, false);
+  for (std::string const &name : inputs) {
+    pinned[tensors[tensor_index(name)]->buffer] = true;
+  }
+  for (std::string const &name : outputs) {
+    pinned[tensors[tensor_index(name)]->buffer] = true;
+  }
+
+  // The steps reading or writing each buffer, in order
+  std::vector<std::vector<long>> users(num_buffers);
+  for (long s = 0; s < num_steps; ++s) {
+    for (std::vector<long> const *operands :
+         {&steps[s].inputs, &steps[s].outputs}) {
+      for (long t : *operands) {
+        std::vector<long> &buffer_users = users[tensors[t]->buffer];
+        if (buffer_users.empty() || buffer_users.back() != s) {
+          buffer_users.push_back(s);
+        }
+      }
+    }
+  }
+
+  // An elementwise step whose input is not used afterwards writes its output
+  // over the input.
+  for (long s = 0; s < num_steps; ++s) {
+    if (!steps[s].elementwise) {
+      continue;
+    }
+    long in = tensors[steps[s].inputs[0]]->buffer;
+    long out = tensors[steps[s].outputs[0]]->buffer;
+    if (in == out || pinned[in] || pinned[out] || buffers[in].constant ||
+        users[in].back() != s || buffers[in].size != buffers[out].size) {
+      continue;
+    }
+    for (std::unique_ptr<tensor> &t : tensors) {
+      if (t->buffer == out) {
+        t->buffer = in;
+      }
+    }
+    for (long user : users[out]) {
+      if (user != users[in].back()) {
+        users[in].push_back(user);
+      }
+    }
+    users[out].clear();
+    buffers[out].size = 0;
+  }
+
+  // The steps between the first and the last use of each buffer
+  std::vector<long> first(num_buffers, -1);
+  std::vector<long> last(num_buffers, num_steps);
+  for (long b = 0; b < num_buffers; ++b) {
+    if (!pinned[b] && !users[b].empty()) {
+      first[b] = users[b].front();
+      last[b] = users[b].back();
+    }
+  }
+
+  // Place the largest buffers first, each at the lowest offset which is free
+  // during its lifetime. Offsets are aligned to cache lines, as the arena is.
+  constexpr long long ALIGNMENT =
+      inference_engine::memory::ALIGNMENT / sizeof(float);
+  auto aligned = [&](long long size) {
+    return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+  };
+  std::vector<long> order;
+  for (long b = 0; b < num_buffers; ++b) {
+    if (!buffers[b].constant && buffers[b].size > 0) {
+      order.push_back(b);
+    }
+  }
+  std::stable_sort(order.begin(), order.end(), [&](long a, long b) {
+    return buffers[a].size > buffers[b].size;
+  });
+  std::vector<long> placed;
+  arena_size = 0;
+  for (long b : order) {
+    std::vector<std::pair<long long, long long>> taken;
+    for (long other : placed) {
+      if (first[other] <= last[b] && first[b] <= last[other]) {
+        taken.push_back(std::make_pair(
+            buffers[other].offset,
+            buffers[other].offset + aligned(buffers[other].size)));
+      }
+    }
+    std::sort(taken.begin(), taken.end());
+    long long offset = 0;
+    for (std::pair<long long, long long> const &range : taken) {
+      if (offset + aligned(buffers[b].size) <= range.first) {
+        break;
+      }
+      offset = std::max(offset, range.second);
+    }
+    buffers[b].offset = offset;
+    arena_size = std::max(arena_size, offset + aligned(buffers[b].size));
+    placed.push_back(b);
+  }
+  // A step runs after the steps producing its inputs, and a step writing
+  // memory after the steps which used the memory before.
+  std::vector<std::set<long>> edges(num_steps);
+  for (long s = 0; s < num_steps; ++s) {
+    for (long input : steps[s].inputs) {
+      long producer = tensors[input]->producer;
+      if (producer >= 0 && producer != s) {
+        edges[producer].insert(s);
+      }
+    }
+    for (long output : steps[s].outputs) {
+      for (long user : users[tensors[output]->buffer]) {
+        if (user < s) {
+          edges[user].insert(s);
+        }
+      }
+    }
+  }
+  for (long a : placed) {
+    for (long b : placed) {
+      bool shared =
+          buffers[a].offset < buffers[b].offset + aligned(buffers[b].size) &&
+          buffers[b].offset < buffers[a].offset + aligned(buffers[a].size);
+      if (a != b && shared && last[a] < first[b]) {
+        for (long user : users[a]) {
+          edges[user].insert(first[b]);
+        }
+      }
+    }
+  }
+  successors.assign(num_steps, std::vector<long>());
+  for (long s = 0; s < num_steps; ++s) {
+    successors[s].assign(edges[s].begin(), edges[s].end());
+  }
+}
+
+std::unique_ptr<inference_engine::inferer::session>
+load_session(std::string const &model_path, std::string const &engine_path,
+             inference_engine::inferer::session_options const &options) {
+  if (inference_engine::inferer::engine_file_matches(engine_path, model_path,
+                                                     options.layout)) {
+    try {
+      inference_engine::inferer::engine_model engine =
+          inference_engine::inferer::map_engine_file(engine_path);
+      return std::unique_ptr<inference_engine::inferer::session>(
+          new inference_engine::inferer::session(engine, options));
+    } catch (std::runtime_error &) {
+      // A damaged engine file is compiled again from the model.
+    }
+  }
+
+  inference_engine::onnx::mapped_model model =
+      inference_engine::onnx::map_onnx_model_from_file(model_path);
+  std::unique_ptr<inference_engine::inferer::session> result(
+      new inference_engine::inferer::session(model, options));
+  try {
+    result->save(engine_path, model_path);
+  } catch (std::runtime_error &) {
+    // The engine file is only a cache, such as in a directory which cannot
+    // be written.
+  }
+  return result;
+}
+} // namespace inferer
+} // namespace inference_engine
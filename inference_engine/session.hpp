@@ -0,0 +1,307 @@
+#ifndef SESSION_HPP
+#define SESSION_HPP
+
+#include "engine.hpp"
+#include "inferer.hpp"
+#include "memory.hpp"
+#include "onnx.hpp"
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace inference_engine {
+namespace inferer {
+
+// The options a `session` compiles a graph with
+// long batch: the leading dim of the graph inputs, whatever the model
+//   declares. Another batch than the declared one also replaces a leading 1
+//   in the shapes of Reshape, as `reshape_dims` describes.
+// LAYOUT layout: NCHWc keeps the activations between Conv, Relu and MaxPool
+//   in NCHWc, as planned by `plan_nchwc_layouts`
+// bool masked_dropout: apply Dropout with a randomly sampled mask as in
+//   training, rather than removing it with `eliminate_dropouts`
+// long long weight_budget: if positive, the bytes of the weights read from
+//   the mapping of a model or engine file which may be resident at once.
+//   The weights of each node are then paged in when it runs, those of the
+//   nodes after it read ahead, and evicted by a `memory::weight_pager`.
+//   Weights transformed while compiling an ONNX model are held in memory, so
+//   only an engine file pages all of them.
+struct session_options {
+  long batch = 1;
+  inference_engine::inferer::LAYOUT layout =
+      inference_engine::inferer::LAYOUT::NCHW;
+  bool masked_dropout = false;
+  long long weight_budget = 0;
+};
+
+// The seconds each phase of compiling a session took
+// unpack: reading the initializers into the parameter table, in parallel
+// passes: the graph passes other than `prepack_weights`
+// prepack: packing the Gemm weights and transforming the Conv kernels
+// bind: binding the nodes to kernel calls
+// plan: planning the memory of the activations
+struct compile_times {
+  double unpack = 0;
+  double passes = 0;
+  double prepack = 0;
+  double bind = 0;
+  double plan = 0;
+};
+
+class session;
+
+// The activations of one run of a `session`: an arena of its own, with the
+// tensors of the session bound into it. The session holds the weights and
+// the plan, which `session::run` only reads, so threads serving requests
+// concurrently share one session and each run a context of their own.
+// A context must not outlive its session.
+class session_context {
+public:
+  explicit session_context(inference_engine::inferer::session const &session);
+
+  session_context(session_context const &) = delete;
+  session_context &operator=(session_context const &) = delete;
+
+  // Return the data of the tensor with the given index in this context, as
+  // `session::data` does for the context of the session itself.
+  float *data(long tensor) { return tensor_data.at(tensor); }
+
+private:
+  friend class inference_engine::inferer::session;
+
+  inference_engine::memory::aligned_buffer arena;
+  std::vector<float *> tensor_data;
+};
+
+// A graph compiled once into an execution plan, and run any number of times.
+// Compiling runs the graph passes of `inferer` (`eliminate_dropouts`,
+// `fuse_nodes`, `infer_shapes`, `plan_nchwc_layouts`, `prepack_weights`), and
+// binds each node to a kernel call with the shapes `infer_shapes` computed.
+// Reshape, Flatten, Squeeze, Unsqueeze, Identity and contiguous Slices are
+// views of their input, which cost no memory and nothing at run time, and
+// layout changes become reorder steps of their own. `run` then only calls
+// the kernels, on the thread pool along the dependencies of the nodes, with
+// no name lookup or shape math.
+// The activations live in one arena. Each is given an offset in it from the
+// steps between its producer and its last reader, so that tensors which are
+// never alive at the same time share memory, and a Relu whose input has no
+// later reader runs in place. The steps reusing memory wait for the steps
+// which used it before, so the reuse holds when steps run concurrently.
+// Tensors are addressed by the index `tensor_index` returns for their name.
+// The graph inputs other than initializers are written through `data`
+// before `run`, and the graph outputs read through it afterwards, in NCHW.
+// Neither shares memory with other tensors, and the other tensors hold
+// nothing meaningful after `run`.
+// `data` and `run` use a `session_context` the session holds itself, so they
+// serve one thread at a time. Concurrent runs each pass a context of their
+// own to `run(context)`, which is safe from any number of threads.
+// A session owns the weights of its graph and frees them when destroyed, and
+// so evicts the kernels transformed from them from the weight caches of
+// `backend`, which are keyed by the address of the weights. Sessions of one
+// mapped model share their weights, whose kernels stay cached until the last
+// of them is destroyed; the kernels of other sessions are left in place.
+// `save` writes the compiled model to an engine file (see `engine.hpp`), from
+// which a session of a later process is loaded with its weights already in
+// the layouts of the kernels.
+// Throw std::runtime_error for a graph with an operator or shape the session
+// cannot run.
+class session {
+public:
+  session(::onnx::GraphProto &graph,
+          inference_engine::inferer::session_options const &options);
+  // Compile a model from `onnx::map_onnx_model_from_file`, reading its
+  // weights from the mapping of its file rather than copying them. The
+  // session holds the mapping as long as it reads from it.
+  session(inference_engine::onnx::mapped_model &model,
+          inference_engine::inferer::session_options const &options);
+  // Compile a model from `map_engine_file`, whose weights are read from the
+  // mapping of the engine file as they are. Kernels the engine file has no
+  // transform of for options, such as when its layout is another, are
+  // transformed as from an ONNX model.
+  session(inference_engine::inferer::engine_model &model,
+          inference_engine::inferer::session_options const &options);
+  ~session();
+
+  session(session const &) = delete;
+  session &operator=(session const &) = delete;
+
+  // Return the index of the tensor called name.
+  // Throw std::out_of_range if there is no such tensor.
+  long tensor_index(std::string const &name) const;
+
+  // Return the data of the tensor with the given index, which holds the
+  // product of its dims floats.
+  float *data(long tensor);
+
+  std::vector<long> const &dims(long tensor) const;
+
+  // The names of the graph inputs which are not initializers
+  std::vector<std::string> const &input_names() const { return inputs; }
+
+  std::vector<std::string> const &output_names() const { return outputs; }
+
+  // Run every node of the graph once.
+  void run();
+
+  // Run every node of the graph once on the activations of context, which
+  // belongs to this session.
+  void run(inference_engine::inferer::session_context &context) const;
+
+  // Run the graph on the first images images of the batch of context alone,
+  // such as for a batch which is not full, at about the cost of a batch of
+  // images. The graph outputs hold nothing meaningful for the other images
+  // afterwards. A session which does not `splits_batch` runs the whole
+  // batch instead.
+  // Throw std::runtime_error unless 0 < images <= the batch.
+  void run(inference_engine::inferer::session_context &context,
+           long images) const;
+
+  // Return whether `run` computes a part of the batch alone: when every
+  // step reads and writes whole images, the leading dim of its tensors.
+  // Kernels which mix the images of the batch, such as a Softmax over the
+  // batch dim, or graph outputs without the batch, run the whole batch.
+  bool splits_batch() const { return split_batch; }
+
+  // Write the compiled model to an engine file at engine_path, keyed by the
+  // ONNX file at model_path it was compiled from.
+  // Throw std::runtime_error if either file cannot be read or written.
+  void save(std::string const &engine_path,
+            std::string const &model_path) const;
+
+  // Return the bytes of the arena holding the activations, which is what the
+  // activations of each context take at their peak.
+  long long activation_bytes() const {
+    return arena_size * static_cast<long long>(sizeof(float));
+  }
+
+  // Return how long compiling the session took, by phase.
+  inference_engine::inferer::compile_times const &times() const {
+    return phase_times;
+  }
+
+  // Return the bytes of the paged weights which are resident now, or 0
+  // without a weight budget.
+  long long resident_weight_bytes() const {
+    return pager ? static_cast<long long>(pager->resident_bytes()) : 0;
+  }
+
+private:
+  friend class inference_engine::inferer::session_context;
+
+  // A tensor of the plan. A view shares the buffer of another tensor, from
+  // offset on, with its own dims and strides.
+  struct tensor {
+    std::string name;
+    std::vector<long> dims;
+    bool nchwc;
+    // The floats between consecutive elements of each dim, for NCHW tensors
+    std::vector<long> strides;
+    // The floats before data in the buffer
+    long long offset;
+    // The number of floats of data, padding channels included
+    long long size;
+    long buffer;
+    // The step writing the data, or -1 for the graph inputs and constants
+    long producer;
+    // Whether the leading dim is the batch, so that the images of a part of
+    // the batch are the first floats of data
+    bool batch_major;
+  };
+
+  // The memory of a tensor and its aliases: a range of the arena, or storage
+  // of its own for constants
+  struct buffer {
+    long long size;
+    bool constant;
+    inference_engine::memory::aligned_buffer storage;
+    long long offset;
+  };
+
+  // A kernel call with its arguments bound, which takes the data of the
+  // tensors of a context by tensor index, and the number of images of the
+  // batch to compute. An elementwise step may write its output over its
+  // first input. A step which does not split the batch is only run on the
+  // whole of it. weights are the regions of pager the kernel reads.
+  struct step {
+    std::function<void(float *const *, long)> run;
+    std::vector<long> inputs;
+    std::vector<long> outputs;
+    bool elementwise;
+    bool splits_batch;
+    std::vector<long> weights;
+  };
+
+  // model: the mapped model of graph, or nullptr to read the weights from
+  //   graph
+  // engine: the engine model of model, or nullptr
+  void compile(::onnx::GraphProto &graph,
+               inference_engine::inferer::session_options const &options,
+               inference_engine::onnx::mapped_model const *model,
+               inference_engine::inferer::engine_model const *engine);
+  long add_tensor(std::string const &name, std::vector<long> const &dims,
+                  bool nchwc, long long size);
+  long add_constant(std::string const &name, std::vector<long> const &dims,
+                    long long size);
+  long add_view(std::string const &name, std::vector<long> const &dims,
+                std::vector<long> const &strides, long long offset,
+                long source);
+  void add_step(std::vector<long> const &inputs,
+                std::vector<long> const &outputs,
+                std::function<void(float *const *, long)> const &run,
+                bool elementwise = false, bool splits_batch = true);
+  long in_layout(long tensor, bool nchwc);
+  // Note that the weight caches of `backend` may hold kernels transformed
+  // from the Conv kernel w, which the session evicts when destroyed.
+  void use_kernel_weights(const float *w);
+  void compile_node(inference_engine::onnx::node const &node);
+  // Return the regions of pager holding the weights node reads.
+  std::vector<long> page_weights(inference_engine::onnx::node const &node);
+  void plan_memory();
+
+  // What `save` writes: the graph without the data of its initializers, and
+  // the layout and Conv kernel transforms it was compiled with
+  ::onnx::GraphProto plan;
+  inference_engine::inferer::LAYOUT layout;
+  std::vector<inference_engine::inferer::kernel_transform> kernel_transforms;
+  long batch;
+  bool split_batch;
+  // The model or engine file the weights are read from, if any
+  std::shared_ptr<const inference_engine::memory::mapped_file> mapping;
+  std::unique_ptr<inference_engine::memory::weight_pager> pager;
+  std::map<std::string, inference_engine::onnx::parameter> table;
+  // The Conv kernels passed to `use_kernel_weights`
+  std::set<const float *> kernel_weights;
+  std::map<std::string, inference_engine::inferer::tensor_shape> shapes;
+  std::map<std::string, inference_engine::inferer::gemm_weights> gemm_weights;
+  std::map<std::string, inference_engine::inferer::LAYOUT> layouts;
+  std::map<std::string, long> tensor_indices;
+  // Held by std::unique_ptr so that a tensor stays where it is as tensors
+  // are added.
+  std::vector<std::unique_ptr<tensor>> tensors;
+  std::vector<buffer> buffers;
+  // The floats of the arena of a context
+  long long arena_size;
+  std::vector<step> steps;
+  std::vector<std::vector<long>> successors;
+  std::vector<std::string> inputs;
+  std::vector<std::string> outputs;
+  inference_engine::inferer::compile_times phase_times;
+  // The context of `data` and `run()`
+  std::unique_ptr<inference_engine::inferer::session_context> own_context;
+};
+
+// Return a session of the ONNX model at model_path compiled with options.
+// It is loaded from the engine file at engine_path if `engine_file_matches`,
+// which only maps the file. Otherwise the model is compiled from model_path,
+// and the engine file written for the next load.
+// Throw std::runtime_error as the session constructors do.
+std::unique_ptr<inference_engine::inferer::session>
+load_session(std::string const &model_path, std::string const &engine_path,
+             inference_engine::inferer::session_options const &options);
+} // namespace inferer
+} // namespace inference_engine
+
+#endif
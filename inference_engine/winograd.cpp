@@ -0,0 +1,467 @@
+#include "backend.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace inference_engine {
+namespace backend {
+namespace {
+
+// The maximum number of floats in the transformed input and output buffers
+// (16 MiB each). Larger layers are processed a block of tiles at a time.
+constexpr long long WINOGRAD_MAX_BUFFER_SIZE = 1ll << 22;
+
+// The environment variable which selects the output tile size used by
+// `conv`, e.g. `INFERENCE_ENGINE_WINOGRAD_TILE=2` for F(2x2,3x3).
+constexpr const char *WINOGRAD_TILE_ENV_NAME = "INFERENCE_ENGINE_WINOGRAD_TILE";
+
+// F(m x m, 3 x 3) with tile size alpha = m + 2 computes an m x m output tile
+// from an alpha x alpha input tile d as Y = A^T [(G g G^T) . (B^T d B)] A.
+// See Lavin and Gray, "Fast Algorithms for Convolutional Neural Networks"
+// (2015) for the matrices.
+// G[alpha x 3] is the kernel transform. B^T and A^T are applied by
+// `input_transform_1d` and `output_transform_1d`.
+const float F2X2_3X3_G[4 * 3] = {
+    1.0f, 0.0f,  0.0f, //
+    0.5f, 0.5f,  0.5f, //
+    0.5f, -0.5f, 0.5f, //
+    0.0f, 0.0f,  1.0f};
+
+const float F4X4_3X3_G[6 * 3] = {
+    1.0f / 4.0f,   0.0f,          0.0f,        //
+    -1.0f / 6.0f,  -1.0f / 6.0f,  -1.0f / 6.0f, //
+    -1.0f / 6.0f,  1.0f / 6.0f,   -1.0f / 6.0f, //
+    1.0f / 24.0f,  1.0f / 12.0f,  1.0f / 6.0f,  //
+    1.0f / 24.0f,  -1.0f / 12.0f, 1.0f / 6.0f,  //
+    0.0f,          0.0f,          1.0f};
+
+// The largest tile size supported, for stack buffers.
+constexpr long WINOGRAD_MAX_ALPHA = 6;
+
+struct winograd_matrices {
+  long m;
+  long alpha;
+  const float *g;
+};
+
+winograd_matrices matrices_for(long m) {
+  if (m == 2) {
+    return {2, 4, F2X2_3X3_G};
+  }
+  if (m == 4) {
+    return {4, 6, F4X4_3X3_G};
+  }
+  throw std::runtime_error("unsupported Winograd tile size: " +
+                           std::to_string(m));
+}
+
+// The input and output transforms process this many tiles at once, one per
+// SIMD lane, so that the transforms vectorize over tiles.
+constexpr long WINOGRAD_LANES = 16;
+
+// One-dimensional transforms of alpha (or m) lane vectors. Vector i of an
+// argument starts at `i * stride`. The transforms are written out by hand
+// because most of the coefficients of B^T and A^T are 0 or +-1.
+template <long M>
+void input_transform_1d(const float *d, long d_stride, float *v,
+                        long v_stride);
+template <long M>
+void output_transform_1d(const float *m, long m_stride, float *y,
+                         long y_stride);
+
+// B^T of F(2x2,3x3)
+template <>
+void input_transform_1d<2>(const float *d, long d_stride, float *v,
+                           long v_stride) {
+  for (long l = 0; l < WINOGRAD_LANES; ++l) {
+    float d_0 = d[0 * d_stride + l];
+    float d_1 = d[1 * d_stride + l];
+    float d_2 = d[2 * d_stride + l];
+    float d_3 = d[3 * d_stride + l];
+    v[0 * v_stride + l] = d_0 - d_2;
+    v[1 * v_stride + l] = d_1 + d_2;
+    v[2 * v_stride + l] = d_2 - d_1;
+    v[3 * v_stride + l] = d_1 - d_3;
+  }
+}
+
+// A^T of F(2x2,3x3)
+template <>
+void output_transform_1d<2>(const float *m, long m_stride, float *y,
+                            long y_stride) {
+  for (long l = 0; l < WINOGRAD_LANES; ++l) {
+    float m_0 = m[0 * m_stride + l];
+    float m_1 = m[1 * m_stride + l];
+    float m_2 = m[2 * m_stride + l];
+    float m_3 = m[3 * m_stride + l];
+    y[0 * y_stride + l] = m_0 + m_1 + m_2;
+    y[1 * y_stride + l] = m_1 - m_2 - m_3;
+  }
+}
+
+// B^T of F(4x4,3x3)
+template <>
+void input_transform_1d<4>(const float *d, long d_stride, float *v,
+                           long v_stride) {
+  for (long l = 0; l < WINOGRAD_LANES; ++l) {
+    float d_0 = d[0 * d_stride + l];
+    float d_1 = d[1 * d_stride + l];
+    float d_2 = d[2 * d_stride + l];
+    float d_3 = d[3 * d_stride + l];
+    float d_4 = d[4 * d_stride + l];
+    float d_5 = d[5 * d_stride + l];
+    v[0 * v_stride + l] = 4.0f * d_0 - 5.0f * d_2 + d_4;
+    v[1 * v_stride + l] = -4.0f * (d_1 + d_2) + d_3 + d_4;
+    v[2 * v_stride + l] = 4.0f * (d_1 - d_2) - d_3 + d_4;
+    v[3 * v_stride + l] = 2.0f * (d_3 - d_1) - d_2 + d_4;
+    v[4 * v_stride + l] = 2.0f * (d_1 - d_3) - d_2 + d_4;
+    v[5 * v_stride + l] = 4.0f * d_1 - 5.0f * d_3 + d_5;
+  }
+}
+
+// A^T of F(4x4,3x3)
+template <>
+void output_transform_1d<4>(const float *m, long m_stride, float *y,
+                            long y_stride) {
+  for (long l = 0; l < WINOGRAD_LANES; ++l) {
+    float m_0 = m[0 * m_stride + l];
+    float m_1 = m[1 * m_stride + l];
+    float m_2 = m[2 * m_stride + l];
+    float m_3 = m[3 * m_stride + l];
+    float m_4 = m[4 * m_stride + l];
+    float m_5 = m[5 * m_stride + l];
+    float sum_12 = m_1 + m_2;
+    float diff_12 = m_1 - m_2;
+    float sum_34 = m_3 + m_4;
+    float diff_34 = m_3 - m_4;
+    y[0 * y_stride + l] = m_0 + sum_12 + sum_34;
+    y[1 * y_stride + l] = diff_12 + 2.0f * diff_34;
+    y[2 * y_stride + l] = sum_12 + 4.0f * sum_34;
+    y[3 * y_stride + l] = diff_12 + 8.0f * diff_34 + m_5;
+  }
+}
+
+long read_winograd_tile_size() {
+  const char *tile = std::getenv(WINOGRAD_TILE_ENV_NAME);
+  if (tile == nullptr || *tile == '\0') {
+    return 4;
+  }
+  long m = std::strtol(tile, nullptr, 10);
+  // Fails for anything but 2 or 4.
+  matrices_for(m);
+  return m;
+}
+
+// Transformed kernels are keyed by the address and shape of the original
+// kernel, so each model's kernels are transformed on their first use only.
+// The cache owns the kernels it transforms, but not those inserted.
+typedef std::tuple<const float *, long, long, long> winograd_kernel_key;
+
+std::mutex winograd_kernel_cache_mutex;
+std::map<winograd_kernel_key, std::shared_ptr<const float>>
+    winograd_kernel_cache;
+
+} // namespace
+
+long winograd_tile_size() {
+  static const long m = read_winograd_tile_size();
+  return m;
+}
+
+long long winograd_kernel_size(long c_in, long c_out, long m) {
+  return static_cast<long long>(m + 2) * (m + 2) * c_out * c_in;
+}
+
+void winograd_transform_kernel(long c_in, long c_out, long m, const float *w,
+                               float *u) {
+  const winograd_matrices f = matrices_for(m);
+  const long alpha = f.alpha;
+  float tmp[WINOGRAD_MAX_ALPHA * 3];
+
+  for (long cc_out = 0; cc_out < c_out; ++cc_out) {
+    for (long cc_in = 0; cc_in < c_in; ++cc_in) {
+      const float *g = w + (cc_out * c_in + cc_in) * 9;
+
+      // tmp = G g
+      for (long i = 0; i < alpha; ++i) {
+        for (long j = 0; j < 3; ++j) {
+          tmp[i * 3 + j] = f.g[i * 3 + 0] * g[0 * 3 + j] +
+                           f.g[i * 3 + 1] * g[1 * 3 + j] +
+                           f.g[i * 3 + 2] * g[2 * 3 + j];
+        }
+      }
+      // U = tmp G^T, stored as alpha^2 matrices of c_out x c_in
+      for (long i = 0; i < alpha; ++i) {
+        for (long j = 0; j < alpha; ++j) {
+          u[((i * alpha + j) * c_out + cc_out) * c_in + cc_in] =
+              tmp[i * 3 + 0] * f.g[j * 3 + 0] +
+              tmp[i * 3 + 1] * f.g[j * 3 + 1] +
+              tmp[i * 3 + 2] * f.g[j * 3 + 2];
+        }
+      }
+    }
+  }
+}
+
+const float *cached_winograd_kernel(long c_in, long c_out, long m,
+                                    const float *w) {
+  winograd_kernel_key key(w, c_in, c_out, m);
+  {
+    std::lock_guard<std::mutex> lock(winograd_kernel_cache_mutex);
+    auto it = winograd_kernel_cache.find(key);
+    if (it != winograd_kernel_cache.end()) {
+      return it->second.get();
+    }
+  }
+
+  // Kernels are transformed without the lock, so that those of a model are
+  // transformed in parallel. If another thread cached w meanwhile, its
+  // kernel is kept.
+  std::unique_ptr<float[]> u =
+      std::make_unique<float[]>(winograd_kernel_size(c_in, c_out, m));
+  winograd_transform_kernel(c_in, c_out, m, w, u.get());
+  std::lock_guard<std::mutex> lock(winograd_kernel_cache_mutex);
+  return winograd_kernel_cache
+      .insert(std::make_pair(
+          key, std::shared_ptr<const float>(u.release(),
+                                            std::default_delete<float[]>())))
+      .first->second.get();
+}
+
+void insert_winograd_kernel(long c_in, long c_out, long m, const float *w,
+                            const float *u) {
+  std::lock_guard<std::mutex> lock(winograd_kernel_cache_mutex);
+  winograd_kernel_cache[winograd_kernel_key(w, c_in, c_out, m)] =
+      std::shared_ptr<const float>(u, [](const float *) {});
+}
+
+void clear_winograd_kernel_cache() {
+  std::lock_guard<std::mutex> lock(winograd_kernel_cache_mutex);
+  winograd_kernel_cache.clear();
+}
+
+void erase_winograd_kernels(const float *w) {
+  std::lock_guard<std::mutex> lock(winograd_kernel_cache_mutex);
+  auto it = winograd_kernel_cache.begin();
+  while (it != winograd_kernel_cache.end()) {
+    if (std::get<0>(it->first) == w) {
+      it = winograd_kernel_cache.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+namespace {
+
+// Transform the input channels [begin, end) of a block of `block` tiles
+// starting at tile_begin into v[alpha^2][c_in x block]. The tiles start at
+// output row y_h_begin. Taps outside of x read as zero padding.
+template <long M>
+void winograd_input_transform(long begin, long end, long c_in, long x_h,
+                              long x_w, long pad, long y_h_begin, long tiles,
+                              long tiles_w, long tile_begin, long block,
+                              const float *x, float *v_data) {
+  constexpr long alpha = M + 2;
+  constexpr long alpha_2 = alpha * alpha;
+  constexpr long lanes = WINOGRAD_LANES;
+
+  // Tiles of `lanes` consecutive tiles, each element a vector over tiles.
+  float d[alpha_2 * lanes];
+  float tmp[alpha_2 * lanes];
+  float v_tile[alpha_2 * lanes];
+
+  for (long cc_in = begin; cc_in < end; ++cc_in) {
+    const float *x_c = x + cc_in * x_h * x_w;
+
+    for (long t = 0; t < block; t += lanes) {
+      for (long l = 0; l < lanes; ++l) {
+        long tile = tile_begin + t + l;
+        long tile_y = y_h_begin + (tile / tiles_w) * M - pad;
+        long tile_x = (tile % tiles_w) * M - pad;
+        bool valid = tile < tiles;
+
+        for (long i = 0; i < alpha; ++i) {
+          long xx_h = tile_y + i;
+          bool row_valid = valid && xx_h >= 0 && xx_h < x_h;
+          for (long j = 0; j < alpha; ++j) {
+            long xx_w = tile_x + j;
+            d[(i * alpha + j) * lanes + l] =
+                (row_valid && xx_w >= 0 && xx_w < x_w)
+                    ? x_c[xx_h * x_w + xx_w]
+                    : 0.0f;
+          }
+        }
+      }
+
+      // V = B^T d B: columns first, then rows.
+      for (long j = 0; j < alpha; ++j) {
+        input_transform_1d<M>(d + j * lanes, alpha * lanes,
+                              tmp + j * lanes, alpha * lanes);
+      }
+      for (long i = 0; i < alpha; ++i) {
+        input_transform_1d<M>(tmp + i * alpha * lanes, lanes,
+                              v_tile + i * alpha * lanes, lanes);
+      }
+
+      for (long e = 0; e < alpha_2; ++e) {
+        std::memcpy(v_data + (e * c_in + cc_in) * block + t,
+                    v_tile + e * lanes, sizeof(float) * lanes);
+      }
+    }
+  }
+}
+
+// Transform the output channels [begin, end) of a block of `block` tiles
+// starting at tile_begin from m_data[alpha^2][c_out x block], and write them
+// with the bias and beta * y into the valid part of y.
+template <long M>
+void winograd_output_transform(long begin, long end, long c_out, long y_h,
+                               long y_w, long tiles, long tiles_w,
+                               long tile_begin, long block,
+                               const float *m_data, const float *b,
+                               float beta, float *y) {
+  constexpr long alpha = M + 2;
+  constexpr long alpha_2 = alpha * alpha;
+  constexpr long lanes = WINOGRAD_LANES;
+
+  float tmp[alpha_2 * lanes];
+  float y_tile[M * M * lanes];
+
+  for (long cc_out = begin; cc_out < end; ++cc_out) {
+    float *y_c = y + cc_out * y_h * y_w;
+
+    for (long t = 0; t < block; t += lanes) {
+      // Y = A^T M A: columns first, then rows.
+      const float *m_tile = m_data + cc_out * block + t;
+      const long m_stride = c_out * block;
+      for (long j = 0; j < alpha; ++j) {
+        output_transform_1d<M>(m_tile + j * m_stride, alpha * m_stride,
+                               tmp + j * lanes, alpha * lanes);
+      }
+      for (long i = 0; i < M; ++i) {
+        output_transform_1d<M>(tmp + i * alpha * lanes, lanes,
+                               y_tile + i * M * lanes, lanes);
+      }
+
+      for (long l = 0; l < lanes && tile_begin + t + l < tiles; ++l) {
+        long tile = tile_begin + t + l;
+        long tile_y = (tile / tiles_w) * M;
+        long tile_x = (tile % tiles_w) * M;
+        long rows = std::min(M, y_h - tile_y);
+        long cols = std::min(M, y_w - tile_x);
+        for (long i = 0; i < rows; ++i) {
+          float *y_row = y_c + (tile_y + i) * y_w + tile_x;
+          for (long j = 0; j < cols; ++j) {
+            float value = y_tile[(i * M + j) * lanes + l] + b[cc_out];
+            y_row[j] = beta != 0.0f ? beta * y_row[j] + value : value;
+          }
+        }
+      }
+    }
+  }
+}
+
+template <long M>
+void conv_winograd_impl(long c_in, long c_out, long x_h, long x_w,
+                        long y_h_begin, long y_h_end, long y_w, long pad,
+                        const float *x, const float *u, const float *b,
+                        float *y, float beta) {
+  constexpr long alpha = M + 2;
+  constexpr long alpha_2 = alpha * alpha;
+  constexpr long lanes = WINOGRAD_LANES;
+
+  // The rows [y_h_begin, y_h_end) are tiled as an output of their own.
+  const long y_h = y_h_end - y_h_begin;
+
+  const long tiles_h = (y_h + M - 1) / M;
+  const long tiles_w = (y_w + M - 1) / M;
+  const long tiles = tiles_h * tiles_w;
+
+  // V[alpha^2][c_in x block] and M[alpha^2][c_out x block] for a block of
+  // tiles. The buffers are reused across calls.
+  long tiles_per_block = std::max(
+      lanes, static_cast<long>(WINOGRAD_MAX_BUFFER_SIZE /
+                               (alpha_2 * std::max(c_in, c_out))) /
+                 lanes * lanes);
+  tiles_per_block = std::min(tiles_per_block, (tiles + lanes - 1) / lanes * lanes);
+  static thread_local std::vector<float> v;
+  static thread_local std::vector<float> m_buffer;
+  size_t v_size = static_cast<size_t>(alpha_2) * c_in * tiles_per_block;
+  size_t m_size = static_cast<size_t>(alpha_2) * c_out * tiles_per_block;
+  if (v.size() < v_size) {
+    v.resize(v_size);
+  }
+  if (m_buffer.size() < m_size) {
+    m_buffer.resize(m_size);
+  }
+  // The buffers are thread_local, so the other threads reach them through
+  // these pointers.
+  float *v_data = v.data();
+  float *m_data = m_buffer.data();
+
+  for (long tile_begin = 0; tile_begin < tiles; tile_begin += tiles_per_block) {
+    // Rounded up to whole lane groups; lanes past the last tile are zero.
+    const long block = std::min(tiles_per_block,
+                                (tiles - tile_begin + lanes - 1) / lanes * lanes);
+
+    // Input transform, in parallel over input channels.
+    inference_engine::parallel::parallel_for(c_in, [&](long begin, long end) {
+      winograd_input_transform<M>(begin, end, c_in, x_h, x_w, pad, y_h_begin,
+                                  tiles, tiles_w, tile_begin, block, x,
+                                  v_data);
+    });
+
+    // alpha^2 independent products M[e] = U[e] (c_out x c_in) *
+    // V[e] (c_in x block), which overwrite M.
+    for (long e = 0; e < alpha_2; ++e) {
+      gemm_strided(c_out, block, c_in, u + e * c_out * c_in, c_in,
+                   v_data + e * c_in * block, block,
+                   m_data + e * c_out * block, block, nullptr);
+    }
+
+    // Output transform, bias, and write-back into y, in parallel over output
+    // channels.
+    inference_engine::parallel::parallel_for(c_out, [&](long begin, long end) {
+      winograd_output_transform<M>(begin, end, c_out, y_h, y_w, tiles,
+                                   tiles_w, tile_begin, block, m_data, b, beta,
+                                   y);
+    });
+  }
+}
+
+} // namespace
+
+void conv_winograd(long c_in, long c_out, long x_h, long x_w, long y_h,
+                   long y_w, long pad, long m, const float *x, const float *u,
+                   const float *b, float *y, float beta) {
+  conv_winograd_rows(c_in, c_out, x_h, x_w, y_w, pad, m, 0, y_h, x, u, b, y,
+                     beta);
+}
+
+void conv_winograd_rows(long c_in, long c_out, long x_h, long x_w, long y_w,
+                        long pad, long m, long y_h_begin, long y_h_end,
+                        const float *x, const float *u, const float *b,
+                        float *y_rows, float beta) {
+  if (m == 2) {
+    return conv_winograd_impl<2>(c_in, c_out, x_h, x_w, y_h_begin, y_h_end,
+                                 y_w, pad, x, u, b, y_rows, beta);
+  }
+  if (m == 4) {
+    return conv_winograd_impl<4>(c_in, c_out, x_h, x_w, y_h_begin, y_h_end,
+                                 y_w, pad, x, u, b, y_rows, beta);
+  }
+  throw std::runtime_error("unsupported Winograd tile size: " +
+                           std::to_string(m));
+}
+
+} // namespace backend
+} // namespace inference_engine
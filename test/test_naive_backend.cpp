@@ -3,14 +3,21 @@
 #endif
 
 #include "../inference_engine/backend.hpp"
+#include "../inference_engine/cpu_features.hpp"
+#include "../inference_engine/kernels.hpp"
+#include "../inference_engine/parallel.hpp"
 #include "util.hpp"
 #include <catch2/catch.hpp>
+#include <atomic>
 #include <chrono>
 #include <cmath>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 void array_arange(float *a, long n) {
   for (long i = 0; i < n; ++i) {
@@ -106,6 +113,236 @@ TEST_CASE("gemm") {
     REQUIRE(inference_engine::test::assert_array_eq_float(c, expected, m * n));
   }
 
+  SECTION("case 4: spans several cache blocks with ragged edges") {
+    long m = 101;
+    long k = 300;
+    long n = 37;
+    float *a = new float[m * k];
+    float *b = new float[k * n];
+    float *c = new float[m * n];
+    float *d = new float[m * n];
+    float *expected = new float[m * n];
+    // Small integers keep every partial sum exact regardless of the order in
+    // which the blocked kernel accumulates them.
+    for (long i = 0; i < m * k; ++i) {
+      a[i] = float(i % 7);
+    }
+    for (long i = 0; i < k * n; ++i) {
+      b[i] = float(i % 5);
+    }
+    array_zeros(c, m * n);
+    array_arange(d, m * n);
+    for (long m_i = 0; m_i < m; ++m_i) {
+      for (long n_i = 0; n_i < n; ++n_i) {
+        float sum = d[m_i * n + n_i];
+        for (long k_i = 0; k_i < k; ++k_i) {
+          sum += a[m_i * k + k_i] * b[k_i * n + n_i];
+        }
+        expected[m_i * n + n_i] = sum;
+      }
+    }
+
+    inference_engine::backend::gemm(m, n, k, a, b, c, d);
+    REQUIRE(inference_engine::test::assert_array_eq_float(c, expected, m * n));
+    delete[] a;
+    delete[] b;
+    delete[] c;
+    delete[] d;
+    delete[] expected;
+  }
+
+  SECTION("case 5: epilogue with bias, scale and relu") {
+    long m = 101;
+    long k = 300;
+    for (long n : {37l, 1l}) {
+      std::vector<float> a(m * k);
+      std::vector<float> b(k * n);
+      std::vector<float> bias(m);
+      std::vector<float> expected(m * n);
+      // The signed inputs make about half of the outputs negative. Halving
+      // small integers keeps the results exact.
+      for (long i = 0; i < m * k; ++i) {
+        a[i] = float(i % 7) - 3.0f;
+      }
+      for (long i = 0; i < k * n; ++i) {
+        b[i] = float(i % 5);
+      }
+      for (long i = 0; i < m; ++i) {
+        bias[i] = float(i % 11) - 5.0f;
+      }
+      for (long m_i = 0; m_i < m; ++m_i) {
+        for (long n_i = 0; n_i < n; ++n_i) {
+          float sum = 0.0f;
+          for (long k_i = 0; k_i < k; ++k_i) {
+            sum += a[m_i * k + k_i] * b[k_i * n + n_i];
+          }
+          expected[m_i * n + n_i] = std::max(0.0f, 0.5f * sum + bias[m_i]);
+        }
+      }
+
+      inference_engine::backend::gemm_epilogue epilogue;
+      epilogue.alpha = 0.5f;
+      epilogue.row_bias = bias.data();
+      epilogue.relu = true;
+
+      inference_engine::cpu_features::ISA original =
+          inference_engine::backend::kernels::active().isa;
+      for (inference_engine::cpu_features::ISA isa :
+           {inference_engine::cpu_features::ISA::Generic,
+            inference_engine::cpu_features::ISA::SSE,
+            inference_engine::cpu_features::ISA::AVX2,
+            inference_engine::cpu_features::ISA::AVX512}) {
+        if (isa > inference_engine::cpu_features::detect_isa()) {
+          continue;
+        }
+        inference_engine::backend::kernels::select(isa);
+        std::vector<float> c(m * n, 0.0f);
+        inference_engine::backend::gemm(m, n, k, a.data(), b.data(), c.data(),
+                                        epilogue);
+        REQUIRE(inference_engine::test::assert_array_eq_float(
+            c.data(), expected.data(), m * n));
+      }
+      inference_engine::backend::kernels::select(original);
+    }
+  }
+
+  SECTION("case 6: prepacked operands") {
+    long m = 45;
+    long k = 300;
+    long n = 37;
+    // a is stored as A^T and b as B^T, as the weights of a Gemm with transB.
+    std::vector<float> a_t(k * m);
+    std::vector<float> b_t(n * k);
+    std::vector<float> bias(n);
+    std::vector<float> expected(m * n);
+    for (long i = 0; i < k * m; ++i) {
+      a_t[i] = float(i % 7) - 3.0f;
+    }
+    for (long i = 0; i < n * k; ++i) {
+      b_t[i] = float(i % 5);
+    }
+    array_arange(bias.data(), n);
+    for (long m_i = 0; m_i < m; ++m_i) {
+      for (long n_i = 0; n_i < n; ++n_i) {
+        float sum = bias[n_i];
+        for (long k_i = 0; k_i < k; ++k_i) {
+          sum += a_t[k_i * m + m_i] * b_t[n_i * k + k_i];
+        }
+        expected[m_i * n + n_i] = sum;
+      }
+    }
+
+    inference_engine::backend::gemm_epilogue epilogue;
+    epilogue.column_bias = bias.data();
+
+    inference_engine::cpu_features::ISA original =
+        inference_engine::backend::kernels::active().isa;
+    for (inference_engine::cpu_features::ISA isa :
+         {inference_engine::cpu_features::ISA::Generic,
+          inference_engine::cpu_features::ISA::SSE,
+          inference_engine::cpu_features::ISA::AVX2,
+          inference_engine::cpu_features::ISA::AVX512}) {
+      if (isa > inference_engine::cpu_features::detect_isa()) {
+        continue;
+      }
+      inference_engine::backend::kernels::select(isa);
+
+      inference_engine::backend::packed_matrix packed_b =
+          inference_engine::backend::pack_gemm_b(k, n, b_t.data(), k, true);
+      std::vector<float> c(m * n, 0.0f);
+      inference_engine::backend::gemm_packed(m, n, k, a_t.data(), m, true,
+                                             packed_b, c.data(), n, epilogue);
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          c.data(), expected.data(), m * n));
+
+      inference_engine::backend::packed_matrix packed_a =
+          inference_engine::backend::pack_gemm_a(m, k, a_t.data(), m, true);
+      std::fill(c.begin(), c.end(), 0.0f);
+      inference_engine::backend::gemm_packed(m, n, k, packed_a, b_t.data(), k,
+                                             true, c.data(), n, epilogue);
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          c.data(), expected.data(), m * n));
+
+      // A matrix packed for panels of another width is rejected.
+      if (isa != inference_engine::cpu_features::ISA::Generic) {
+        inference_engine::backend::kernels::select(
+            inference_engine::cpu_features::ISA::Generic);
+        if (inference_engine::backend::kernels::active().gemm_nr !=
+            packed_b.panel_width) {
+          REQUIRE_THROWS_AS(inference_engine::backend::gemm_packed(
+                                m, n, k, a_t.data(), m, true, packed_b,
+                                c.data(), n, epilogue),
+                            std::runtime_error);
+        }
+      }
+    }
+    inference_engine::backend::kernels::select(original);
+  }
+
+  SECTION("case 7: beta overwrites or accumulates") {
+    long m = 101;
+    // k spans two cache blocks, of which only the first is scaled by beta.
+    long k = 300;
+    for (long n : {37l, 1l}) {
+      std::vector<float> a(m * k);
+      std::vector<float> b(k * n);
+      std::vector<float> product(m * n);
+      std::vector<float> before(m * n);
+      for (long i = 0; i < m * k; ++i) {
+        a[i] = float(i % 7) - 3.0f;
+      }
+      for (long i = 0; i < k * n; ++i) {
+        b[i] = float(i % 5);
+      }
+      array_arange(before.data(), m * n);
+      for (long m_i = 0; m_i < m; ++m_i) {
+        for (long n_i = 0; n_i < n; ++n_i) {
+          float sum = 0.0f;
+          for (long k_i = 0; k_i < k; ++k_i) {
+            sum += a[m_i * k + k_i] * b[k_i * n + n_i];
+          }
+          product[m_i * n + n_i] = sum;
+        }
+      }
+
+      inference_engine::cpu_features::ISA original =
+          inference_engine::backend::kernels::active().isa;
+      for (inference_engine::cpu_features::ISA isa :
+           {inference_engine::cpu_features::ISA::Generic,
+            inference_engine::cpu_features::ISA::SSE,
+            inference_engine::cpu_features::ISA::AVX2,
+            inference_engine::cpu_features::ISA::AVX512}) {
+        if (isa > inference_engine::cpu_features::detect_isa()) {
+          continue;
+        }
+        inference_engine::backend::kernels::select(isa);
+
+        // The default overwrites C without reading it, even if it is NaN.
+        std::vector<float> c(m * n, std::numeric_limits<float>::quiet_NaN());
+        inference_engine::backend::gemm_epilogue overwrite;
+        inference_engine::backend::gemm(m, n, k, a.data(), b.data(), c.data(),
+                                        overwrite);
+        REQUIRE(inference_engine::test::assert_array_eq_float(
+            c.data(), product.data(), m * n));
+
+        for (float beta : {1.0f, 2.0f}) {
+          std::vector<float> expected(m * n);
+          for (long i = 0; i < m * n; ++i) {
+            expected[i] = product[i] + beta * before[i];
+          }
+          inference_engine::backend::gemm_epilogue epilogue;
+          epilogue.beta = beta;
+          c = before;
+          inference_engine::backend::gemm(m, n, k, a.data(), b.data(),
+                                          c.data(), epilogue);
+          REQUIRE(inference_engine::test::assert_array_eq_float(
+              c.data(), expected.data(), m * n));
+        }
+      }
+      inference_engine::backend::kernels::select(original);
+    }
+  }
+
   SECTION("performance test") {
     long m = 1024;
     long k = 1024;
@@ -889,4 +1126,1155 @@ TEST_CASE("softmax") {
       REQUIRE(std::abs(expected[i] - y[i]) < e);
     }
   }
-}
\ No newline at end of file
+
+  SECTION("case 2: a batch of rows") {
+    // Each row is normalized on its own, as the class scores of one image.
+    long rows = 300;
+    long columns = 1000;
+    std::vector<float> x(rows * columns);
+    std::vector<float> y(rows * columns);
+    std::vector<float> expected(rows * columns);
+    for (long i = 0; i < rows * columns; ++i) {
+      x[i] = float(i % 23) * 0.25f + float(i / columns);
+    }
+    for (long row = 0; row < rows; ++row) {
+      inference_engine::backend::softmax(columns, x.data() + row * columns,
+                                         expected.data() + row * columns);
+    }
+
+    inference_engine::backend::softmax(rows, columns, x.data(), y.data());
+
+    REQUIRE(inference_engine::test::assert_array_eq_float(
+        y.data(), expected.data(), rows * columns));
+  }
+}
+
+TEST_CASE("isa dispatch") {
+  // Every ISA variant the CPU supports must agree with the generic kernels.
+  // The inputs are small integers so that the results are exact whatever
+  // order the variants accumulate in.
+  long m = 37;
+  long k = 300;
+  long n = 45;
+  long c_in = 3;
+  long c_out = 5;
+  long x_h = 11;
+  long x_w = 13;
+  long kernel = 3;
+  long pad = 1;
+  long stride = 1;
+  long y_h = 11;
+  long y_w = 13;
+
+  std::unique_ptr<float[]> a = std::make_unique<float[]>(m * k);
+  std::unique_ptr<float[]> b = std::make_unique<float[]>(k * n);
+  std::unique_ptr<float[]> d = std::make_unique<float[]>(m * n);
+  std::unique_ptr<float[]> x = std::make_unique<float[]>(c_in * x_h * x_w);
+  std::unique_ptr<float[]> w =
+      std::make_unique<float[]>(c_out * c_in * kernel * kernel);
+  std::unique_ptr<float[]> bias = std::make_unique<float[]>(c_out);
+  for (long i = 0; i < m * k; ++i) {
+    a[i] = float(i % 7) - 3.0f;
+  }
+  for (long i = 0; i < k * n; ++i) {
+    b[i] = float(i % 5);
+  }
+  array_arange(d.get(), m * n);
+  for (long i = 0; i < c_in * x_h * x_w; ++i) {
+    x[i] = float(i % 9) - 4.0f;
+  }
+  for (long i = 0; i < c_out * c_in * kernel * kernel; ++i) {
+    w[i] = float(i % 3);
+  }
+  array_arange(bias.get(), c_out);
+
+  auto run_all = [&](float *gemm_c, float *gemv_c, float *conv_y,
+                     float *pool_y, float *relu_y) {
+    array_zeros(gemm_c, m * n);
+    inference_engine::backend::gemm(m, n, k, a.get(), b.get(), gemm_c,
+                                    d.get());
+    array_zeros(gemv_c, m);
+    inference_engine::backend::gemm(m, 1, k, a.get(), b.get(), gemv_c,
+                                    d.get());
+    array_zeros(conv_y, c_out * y_h * y_w);
+    inference_engine::backend::conv(c_in, c_out, x_h, x_w, y_h, y_w, kernel,
+                                    pad, stride, x.get(), w.get(), bias.get(),
+                                    conv_y);
+    inference_engine::backend::max_pool(c_out, y_h, y_w, y_h, y_w, kernel,
+                                        pad, stride, conv_y, pool_y);
+    inference_engine::backend::relu(c_in * x_h * x_w, x.get(), relu_y);
+  };
+
+  inference_engine::cpu_features::ISA original =
+      inference_engine::backend::kernels::active().isa;
+
+  std::unique_ptr<float[]> expected_gemm = std::make_unique<float[]>(m * n);
+  std::unique_ptr<float[]> expected_gemv = std::make_unique<float[]>(m);
+  std::unique_ptr<float[]> expected_conv =
+      std::make_unique<float[]>(c_out * y_h * y_w);
+  std::unique_ptr<float[]> expected_pool =
+      std::make_unique<float[]>(c_out * y_h * y_w);
+  std::unique_ptr<float[]> expected_relu =
+      std::make_unique<float[]>(c_in * x_h * x_w);
+  inference_engine::backend::kernels::select(
+      inference_engine::cpu_features::ISA::Generic);
+  run_all(expected_gemm.get(), expected_gemv.get(), expected_conv.get(),
+          expected_pool.get(), expected_relu.get());
+
+  for (inference_engine::cpu_features::ISA isa :
+       {inference_engine::cpu_features::ISA::SSE,
+        inference_engine::cpu_features::ISA::AVX2,
+        inference_engine::cpu_features::ISA::AVX512}) {
+    if (isa > inference_engine::cpu_features::detect_isa()) {
+      continue;
+    }
+
+    SECTION(inference_engine::cpu_features::isa_name(isa)) {
+      REQUIRE(inference_engine::backend::kernels::select(isa) == isa);
+      REQUIRE(inference_engine::backend::kernels::active().isa == isa);
+
+      std::unique_ptr<float[]> gemm_c = std::make_unique<float[]>(m * n);
+      std::unique_ptr<float[]> gemv_c = std::make_unique<float[]>(m);
+      std::unique_ptr<float[]> conv_y =
+          std::make_unique<float[]>(c_out * y_h * y_w);
+      std::unique_ptr<float[]> pool_y =
+          std::make_unique<float[]>(c_out * y_h * y_w);
+      std::unique_ptr<float[]> relu_y =
+          std::make_unique<float[]>(c_in * x_h * x_w);
+      run_all(gemm_c.get(), gemv_c.get(), conv_y.get(), pool_y.get(),
+              relu_y.get());
+
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          gemm_c.get(), expected_gemm.get(), m * n));
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          gemv_c.get(), expected_gemv.get(), m));
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          conv_y.get(), expected_conv.get(), c_out * y_h * y_w));
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          pool_y.get(), expected_pool.get(), c_out * y_h * y_w));
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          relu_y.get(), expected_relu.get(), c_in * x_h * x_w));
+    }
+  }
+
+  inference_engine::backend::kernels::select(original);
+}
+
+TEST_CASE("cpu_features") {
+  SECTION("isa names round trip") {
+    for (inference_engine::cpu_features::ISA isa :
+         {inference_engine::cpu_features::ISA::Generic,
+          inference_engine::cpu_features::ISA::SSE,
+          inference_engine::cpu_features::ISA::AVX2,
+          inference_engine::cpu_features::ISA::AVX512}) {
+      REQUIRE(inference_engine::cpu_features::parse_isa(
+                  inference_engine::cpu_features::isa_name(isa)) == isa);
+    }
+    REQUIRE(inference_engine::cpu_features::parse_isa("AVX2") ==
+            inference_engine::cpu_features::ISA::AVX2);
+    REQUIRE_THROWS_AS(inference_engine::cpu_features::parse_isa("neon"),
+                      std::runtime_error);
+  }
+}
+
+TEST_CASE("conv_im2col") {
+  // {c_in, c_out, x_h, x_w, k, pad, stride}
+  std::vector<std::vector<long>> shapes = {
+      {1, 1, 3, 3, 2, 0, 1},    {3, 8, 10, 12, 3, 1, 1},
+      {3, 8, 10, 12, 3, 0, 2},  {2, 5, 10, 10, 2, 2, 3},
+      {4, 6, 9, 7, 1, 0, 1},    {4, 6, 9, 7, 1, 1, 2},
+      {16, 9, 14, 14, 3, 1, 1}, {3, 7, 10, 10, 5, 4, 2},
+      // The column matrix of this one exceeds the buffer bound, so it is
+      // lowered in several bands of output rows.
+      {64, 4, 100, 100, 3, 1, 1}};
+
+  for (std::vector<long> const &shape : shapes) {
+    long c_in = shape[0];
+    long c_out = shape[1];
+    long x_h = shape[2];
+    long x_w = shape[3];
+    long k = shape[4];
+    long pad = shape[5];
+    long stride = shape[6];
+    long y_h = (x_h - k + 2 * pad) / stride + 1;
+    long y_w = (x_w - k + 2 * pad) / stride + 1;
+
+    SECTION(std::to_string(c_in) + "x" + std::to_string(x_h) + "x" +
+            std::to_string(x_w) + " image, " + std::to_string(c_out) + "x" +
+            std::to_string(k) + "x" + std::to_string(k) + " kernel, " +
+            std::to_string(pad) + " padding, " + std::to_string(stride) +
+            " stride") {
+      std::unique_ptr<float[]> x = std::make_unique<float[]>(c_in * x_h * x_w);
+      std::unique_ptr<float[]> w =
+          std::make_unique<float[]>(c_out * c_in * k * k);
+      std::unique_ptr<float[]> b = std::make_unique<float[]>(c_out);
+      std::unique_ptr<float[]> y = std::make_unique<float[]>(c_out * y_h * y_w);
+      std::unique_ptr<float[]> expected =
+          std::make_unique<float[]>(c_out * y_h * y_w);
+      for (long i = 0; i < c_in * x_h * x_w; ++i) {
+        x[i] = float(i % 11) - 5.0f;
+      }
+      for (long i = 0; i < c_out * c_in * k * k; ++i) {
+        w[i] = float(i % 4) - 1.0f;
+      }
+      array_arange(b.get(), c_out);
+      array_zeros(y.get(), c_out * y_h * y_w);
+      array_zeros(expected.get(), c_out * y_h * y_w);
+
+      inference_engine::backend::conv_direct(c_in, c_out, x_h, x_w, y_h, y_w,
+                                             k, pad, stride, x.get(), w.get(),
+                                             b.get(), expected.get());
+      inference_engine::backend::conv_im2col(c_in, c_out, x_h, x_w, y_h, y_w,
+                                             k, pad, stride, x.get(), w.get(),
+                                             b.get(), y.get());
+
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          y.get(), expected.get(), c_out * y_h * y_w));
+
+      // Once the kernel is packed, the packed copy is used instead.
+      inference_engine::backend::cached_im2col_kernel(c_in, c_out, k, w.get());
+      array_zeros(y.get(), c_out * y_h * y_w);
+      inference_engine::backend::conv_im2col(c_in, c_out, x_h, x_w, y_h, y_w,
+                                             k, pad, stride, x.get(), w.get(),
+                                             b.get(), y.get());
+      inference_engine::backend::clear_im2col_kernel_cache();
+
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          y.get(), expected.get(), c_out * y_h * y_w));
+    }
+  }
+}
+
+TEST_CASE("conv_winograd") {
+  // {c_in, c_out, x_h, x_w, pad}
+  std::vector<std::vector<long>> shapes = {
+      {1, 1, 3, 3, 0},    {1, 1, 6, 6, 1},    {3, 8, 10, 12, 1},
+      {3, 8, 11, 9, 0},   {4, 5, 7, 13, 2},   {16, 16, 28, 28, 1},
+      {32, 24, 17, 15, 1}};
+
+  for (long m : {2l, 4l}) {
+    for (std::vector<long> const &shape : shapes) {
+      long c_in = shape[0];
+      long c_out = shape[1];
+      long x_h = shape[2];
+      long x_w = shape[3];
+      long pad = shape[4];
+      long k = 3;
+      long y_h = x_h - k + 2 * pad + 1;
+      long y_w = x_w - k + 2 * pad + 1;
+
+      SECTION("F(" + std::to_string(m) + "x" + std::to_string(m) + ",3x3), " +
+              std::to_string(c_in) + "x" + std::to_string(x_h) + "x" +
+              std::to_string(x_w) + " image, " + std::to_string(c_out) +
+              "x3x3 kernel, " + std::to_string(pad) + " padding") {
+        std::unique_ptr<float[]> x =
+            std::make_unique<float[]>(c_in * x_h * x_w);
+        std::unique_ptr<float[]> w =
+            std::make_unique<float[]>(c_out * c_in * k * k);
+        std::unique_ptr<float[]> u = std::make_unique<float[]>(
+            inference_engine::backend::winograd_kernel_size(c_in, c_out, m));
+        std::unique_ptr<float[]> b = std::make_unique<float[]>(c_out);
+        std::unique_ptr<float[]> y =
+            std::make_unique<float[]>(c_out * y_h * y_w);
+        std::unique_ptr<float[]> expected =
+            std::make_unique<float[]>(c_out * y_h * y_w);
+        for (long i = 0; i < c_in * x_h * x_w; ++i) {
+          x[i] = float(i % 13) / 13.0f - 0.5f;
+        }
+        for (long i = 0; i < c_out * c_in * k * k; ++i) {
+          w[i] = float(i % 7) / 7.0f - 0.4f;
+        }
+        array_arange(b.get(), c_out);
+        array_zeros(y.get(), c_out * y_h * y_w);
+        array_zeros(expected.get(), c_out * y_h * y_w);
+
+        inference_engine::backend::conv_direct(
+            c_in, c_out, x_h, x_w, y_h, y_w, k, pad, 1, x.get(), w.get(),
+            b.get(), expected.get());
+        inference_engine::backend::winograd_transform_kernel(c_in, c_out, m,
+                                                             w.get(), u.get());
+        inference_engine::backend::conv_winograd(c_in, c_out, x_h, x_w, y_h,
+                                                 y_w, pad, m, x.get(), u.get(),
+                                                 b.get(), y.get());
+
+        REQUIRE(inference_engine::test::assert_array_near_float(
+            y.get(), expected.get(), c_out * y_h * y_w, 1e-5f));
+      }
+    }
+  }
+
+  SECTION("conv selects Winograd for VGG-like layers") {
+    long c_in = 64;
+    long c_out = 64;
+    long x_h = 56;
+    long x_w = 56;
+    long k = 3;
+    long pad = 1;
+    REQUIRE(inference_engine::backend::select_conv_algorithm(
+                c_in, c_out, x_h, x_w, k, 1) ==
+            inference_engine::backend::CONV_ALGORITHM::Winograd);
+    REQUIRE(inference_engine::backend::select_conv_algorithm(
+                c_in, c_out, x_h, x_w, k, 2) !=
+            inference_engine::backend::CONV_ALGORITHM::Winograd);
+
+    std::unique_ptr<float[]> x = std::make_unique<float[]>(c_in * x_h * x_w);
+    std::unique_ptr<float[]> w =
+        std::make_unique<float[]>(c_out * c_in * k * k);
+    std::unique_ptr<float[]> b = std::make_unique<float[]>(c_out);
+    std::unique_ptr<float[]> y = std::make_unique<float[]>(c_out * x_h * x_w);
+    std::unique_ptr<float[]> expected =
+        std::make_unique<float[]>(c_out * x_h * x_w);
+    for (long i = 0; i < c_in * x_h * x_w; ++i) {
+      x[i] = float(i % 13) / 13.0f - 0.5f;
+    }
+    for (long i = 0; i < c_out * c_in * k * k; ++i) {
+      w[i] = float(i % 7) / 7.0f - 0.4f;
+    }
+    array_arange(b.get(), c_out);
+    array_zeros(expected.get(), c_out * x_h * x_w);
+    inference_engine::backend::conv_direct(c_in, c_out, x_h, x_w, x_h, x_w, k,
+                                           pad, 1, x.get(), w.get(), b.get(),
+                                           expected.get());
+
+    // The second call reuses the kernel transformed by the first one.
+    for (int run = 0; run < 2; ++run) {
+      array_zeros(y.get(), c_out * x_h * x_w);
+      inference_engine::backend::conv(c_in, c_out, x_h, x_w, x_h, x_w, k, pad,
+                                      1, x.get(), w.get(), b.get(), y.get());
+      REQUIRE(inference_engine::test::assert_array_near_float(
+          y.get(), expected.get(), c_out * x_h * x_w, 1e-5f));
+    }
+    inference_engine::backend::clear_winograd_kernel_cache();
+  }
+}
+
+TEST_CASE("nchwc") {
+  // The inputs are small integers so that the results are exact whatever
+  // order the kernels accumulate in.
+  // {c_in, c_out, x_h, x_w, k, pad, stride}
+  std::vector<std::vector<long>> shapes = {
+      {3, 5, 11, 13, 3, 1, 1},  {3, 64, 20, 20, 3, 1, 1},
+      {20, 17, 9, 30, 3, 2, 2}, {16, 32, 14, 14, 1, 0, 1},
+      {5, 7, 12, 12, 5, 0, 3},  {33, 16, 8, 40, 3, 1, 1}};
+
+  inference_engine::cpu_features::ISA original =
+      inference_engine::backend::kernels::active().isa;
+
+  for (inference_engine::cpu_features::ISA isa :
+       {inference_engine::cpu_features::ISA::Generic,
+        inference_engine::cpu_features::ISA::SSE,
+        inference_engine::cpu_features::ISA::AVX2,
+        inference_engine::cpu_features::ISA::AVX512}) {
+    if (isa > inference_engine::cpu_features::detect_isa()) {
+      continue;
+    }
+
+    for (std::vector<long> const &shape : shapes) {
+      long c_in = shape[0];
+      long c_out = shape[1];
+      long x_h = shape[2];
+      long x_w = shape[3];
+      long k = shape[4];
+      long pad = shape[5];
+      long stride = shape[6];
+      long y_h = (x_h - k + 2 * pad) / stride + 1;
+      long y_w = (x_w - k + 2 * pad) / stride + 1;
+      long p_h = (y_h - 2) / 2 + 1;
+      long p_w = (y_w - 2) / 2 + 1;
+
+      SECTION(std::string(inference_engine::cpu_features::isa_name(isa)) +
+              ", " + std::to_string(c_in) + "x" + std::to_string(x_h) + "x" +
+              std::to_string(x_w) + " image, " + std::to_string(c_out) + "x" +
+              std::to_string(k) + "x" + std::to_string(k) + " kernel, " +
+              std::to_string(pad) + " padding, " + std::to_string(stride) +
+              " stride") {
+        inference_engine::backend::kernels::select(isa);
+
+        std::unique_ptr<float[]> x =
+            std::make_unique<float[]>(c_in * x_h * x_w);
+        std::unique_ptr<float[]> w =
+            std::make_unique<float[]>(c_out * c_in * k * k);
+        std::unique_ptr<float[]> w_nchwc = std::make_unique<float[]>(
+            inference_engine::backend::nchwc_kernel_size(c_in, c_out, k));
+        std::unique_ptr<float[]> b = std::make_unique<float[]>(c_out);
+        std::unique_ptr<float[]> y =
+            std::make_unique<float[]>(c_out * y_h * y_w);
+        std::unique_ptr<float[]> p =
+            std::make_unique<float[]>(c_out * p_h * p_w);
+        std::unique_ptr<float[]> expected_y =
+            std::make_unique<float[]>(c_out * y_h * y_w);
+        std::unique_ptr<float[]> expected_p =
+            std::make_unique<float[]>(c_out * p_h * p_w);
+        std::unique_ptr<float[]> x_nchwc = std::make_unique<float[]>(
+            inference_engine::backend::nchwc_size(c_in, x_h, x_w));
+        std::unique_ptr<float[]> y_nchwc = std::make_unique<float[]>(
+            inference_engine::backend::nchwc_size(c_out, y_h, y_w));
+        std::unique_ptr<float[]> p_nchwc = std::make_unique<float[]>(
+            inference_engine::backend::nchwc_size(c_out, p_h, p_w));
+        for (long i = 0; i < c_in * x_h * x_w; ++i) {
+          x[i] = float(i % 9) - 4.0f;
+        }
+        for (long i = 0; i < c_out * c_in * k * k; ++i) {
+          w[i] = float(i % 5) - 2.0f;
+        }
+        array_arange(b.get(), c_out);
+
+        // Conv -> Relu -> MaxPool in NCHW
+        array_zeros(expected_y.get(), c_out * y_h * y_w);
+        inference_engine::backend::conv_direct(
+            c_in, c_out, x_h, x_w, y_h, y_w, k, pad, stride, x.get(), w.get(),
+            b.get(), expected_y.get());
+        inference_engine::backend::relu(c_out * y_h * y_w, expected_y.get(),
+                                        expected_y.get());
+        inference_engine::backend::max_pool(c_out, y_h, y_w, p_h, p_w, 2, 0, 2,
+                                            expected_y.get(),
+                                            expected_p.get());
+
+        // The same layers in NCHWc, reordered only at the ends
+        inference_engine::backend::reorder_nchw_to_nchwc(c_in, x_h, x_w,
+                                                         x.get(), x_nchwc.get());
+        inference_engine::backend::reorder_kernel_to_nchwc(c_in, c_out, k,
+                                                           w.get(),
+                                                           w_nchwc.get());
+        array_zeros(y_nchwc.get(),
+                    inference_engine::backend::nchwc_size(c_out, y_h, y_w));
+        inference_engine::backend::conv_nchwc(
+            c_in, c_out, x_h, x_w, y_h, y_w, k, pad, stride, x_nchwc.get(),
+            w_nchwc.get(), b.get(), y_nchwc.get());
+        inference_engine::backend::relu(
+            inference_engine::backend::nchwc_size(c_out, y_h, y_w),
+            y_nchwc.get(), y_nchwc.get());
+        inference_engine::backend::max_pool_nchwc(c_out, y_h, y_w, p_h, p_w, 2,
+                                                  0, 2, y_nchwc.get(),
+                                                  p_nchwc.get());
+        inference_engine::backend::reorder_nchwc_to_nchw(
+            c_out, y_h, y_w, y_nchwc.get(), y.get());
+        inference_engine::backend::reorder_nchwc_to_nchw(
+            c_out, p_h, p_w, p_nchwc.get(), p.get());
+
+        REQUIRE(inference_engine::test::assert_array_eq_float(
+            y.get(), expected_y.get(), c_out * y_h * y_w));
+        REQUIRE(inference_engine::test::assert_array_eq_float(
+            p.get(), expected_p.get(), c_out * p_h * p_w));
+
+        // The channels padding the last block stay zero.
+        for (long j = c_out; j % inference_engine::backend::NCHWC_BLOCK != 0;
+             ++j) {
+          REQUIRE(y_nchwc[(j / inference_engine::backend::NCHWC_BLOCK) * y_h *
+                              y_w * inference_engine::backend::NCHWC_BLOCK +
+                          j % inference_engine::backend::NCHWC_BLOCK] == 0.0f);
+        }
+      }
+    }
+  }
+
+  SECTION("max_pool_nchwc with padding") {
+    long c = 20;
+    long x_h = 7;
+    long x_w = 9;
+    long y_h = 4;
+    long y_w = 5;
+    std::unique_ptr<float[]> x = std::make_unique<float[]>(c * x_h * x_w);
+    std::unique_ptr<float[]> y = std::make_unique<float[]>(c * y_h * y_w);
+    std::unique_ptr<float[]> expected = std::make_unique<float[]>(c * y_h * y_w);
+    std::unique_ptr<float[]> x_nchwc = std::make_unique<float[]>(
+        inference_engine::backend::nchwc_size(c, x_h, x_w));
+    std::unique_ptr<float[]> y_nchwc = std::make_unique<float[]>(
+        inference_engine::backend::nchwc_size(c, y_h, y_w));
+    for (long i = 0; i < c * x_h * x_w; ++i) {
+      x[i] = float(i % 11) - 5.0f;
+    }
+
+    inference_engine::backend::max_pool(c, x_h, x_w, y_h, y_w, 3, 1, 2,
+                                        x.get(), expected.get());
+    inference_engine::backend::reorder_nchw_to_nchwc(c, x_h, x_w, x.get(),
+                                                     x_nchwc.get());
+    inference_engine::backend::max_pool_nchwc(c, x_h, x_w, y_h, y_w, 3, 1, 2,
+                                              x_nchwc.get(), y_nchwc.get());
+    inference_engine::backend::reorder_nchwc_to_nchw(c, y_h, y_w,
+                                                     y_nchwc.get(), y.get());
+    REQUIRE(inference_engine::test::assert_array_eq_float(
+        y.get(), expected.get(), c * y_h * y_w));
+  }
+
+  SECTION("max_pool_nchwc on a batch") {
+    // A batch is pooled in one call over the channel blocks of all images.
+    long batch = 3;
+    long c = 20;
+    long x_h = 7;
+    long x_w = 9;
+    long y_h = 4;
+    long y_w = 5;
+    long long x_image = inference_engine::backend::nchwc_size(c, x_h, x_w);
+    long long y_image = inference_engine::backend::nchwc_size(c, y_h, y_w);
+    std::vector<float> x(c * x_h * x_w);
+    std::vector<float> x_nchwc(batch * x_image);
+    std::vector<float> y_nchwc(batch * y_image);
+    std::vector<float> expected(batch * y_image);
+    for (long n = 0; n < batch; ++n) {
+      for (long i = 0; i < c * x_h * x_w; ++i) {
+        x[i] = float((i + n * 5) % 11) - 5.0f;
+      }
+      inference_engine::backend::reorder_nchw_to_nchwc(
+          c, x_h, x_w, x.data(), x_nchwc.data() + n * x_image);
+      inference_engine::backend::max_pool_nchwc(
+          c, x_h, x_w, y_h, y_w, 3, 1, 2, x_nchwc.data() + n * x_image,
+          expected.data() + n * y_image);
+    }
+
+    inference_engine::backend::max_pool_nchwc(
+        batch * inference_engine::backend::nchwc_size(c, 1, 1), x_h, x_w, y_h,
+        y_w, 3, 1, 2, x_nchwc.data(), y_nchwc.data());
+    REQUIRE(inference_engine::test::assert_array_eq_float(
+        y_nchwc.data(), expected.data(), batch * y_image));
+  }
+
+  inference_engine::backend::kernels::select(original);
+}
+
+// Copy x with c x h x w into a zero-padded array with c x (h + 2 * pad) x
+// (w + 2 * pad), as the kernels did before padding was handled implicitly.
+std::vector<float> pad_with_zeros(long c, long h, long w, long pad,
+                                  const float *x) {
+  long padded_h = h + 2 * pad;
+  long padded_w = w + 2 * pad;
+  std::vector<float> padded(c * padded_h * padded_w, 0.0f);
+  for (long cc = 0; cc < c; ++cc) {
+    for (long hh = 0; hh < h; ++hh) {
+      for (long ww = 0; ww < w; ++ww) {
+        padded[(cc * padded_h + hh + pad) * padded_w + ww + pad] =
+            x[(cc * h + hh) * w + ww];
+      }
+    }
+  }
+  return padded;
+}
+
+TEST_CASE("implicit padding") {
+  // Padding the input explicitly and running the kernels without padding
+  // must give the same result as the clipped windows.
+  // {c_in, c_out, x_h, x_w, k, pad, stride}
+  std::vector<std::vector<long>> shapes = {
+      {2, 3, 5, 5, 3, 1, 1}, {1, 2, 4, 7, 3, 2, 2}, {3, 2, 3, 3, 3, 2, 1},
+      {2, 2, 6, 5, 5, 2, 3}, {1, 1, 2, 9, 1, 1, 1}, {4, 3, 8, 3, 3, 1, 2}};
+
+  for (std::vector<long> const &shape : shapes) {
+    long c_in = shape[0];
+    long c_out = shape[1];
+    long x_h = shape[2];
+    long x_w = shape[3];
+    long k = shape[4];
+    long pad = shape[5];
+    long stride = shape[6];
+    long y_h = (x_h - k + 2 * pad) / stride + 1;
+    long y_w = (x_w - k + 2 * pad) / stride + 1;
+
+    SECTION(std::to_string(c_in) + "x" + std::to_string(x_h) + "x" +
+            std::to_string(x_w) + " image, " + std::to_string(c_out) + "x" +
+            std::to_string(k) + "x" + std::to_string(k) + " kernel, " +
+            std::to_string(pad) + " padding, " + std::to_string(stride) +
+            " stride") {
+      std::unique_ptr<float[]> x = std::make_unique<float[]>(c_in * x_h * x_w);
+      std::unique_ptr<float[]> w =
+          std::make_unique<float[]>(c_out * c_in * k * k);
+      std::unique_ptr<float[]> b = std::make_unique<float[]>(c_out);
+      std::unique_ptr<float[]> y = std::make_unique<float[]>(c_out * y_h * y_w);
+      std::unique_ptr<float[]> expected =
+          std::make_unique<float[]>(c_out * y_h * y_w);
+      for (long i = 0; i < c_in * x_h * x_w; ++i) {
+        x[i] = float(i % 7) - 5.0f;
+      }
+      for (long i = 0; i < c_out * c_in * k * k; ++i) {
+        w[i] = float(i % 4) - 1.0f;
+      }
+      array_arange(b.get(), c_out);
+      std::vector<float> padded_x = pad_with_zeros(c_in, x_h, x_w, pad, x.get());
+
+      array_zeros(y.get(), c_out * y_h * y_w);
+      array_zeros(expected.get(), c_out * y_h * y_w);
+      inference_engine::backend::conv_direct(c_in, c_out, x_h, x_w, y_h, y_w,
+                                             k, pad, stride, x.get(), w.get(),
+                                             b.get(), y.get());
+      inference_engine::backend::conv_direct(
+          c_in, c_out, x_h + 2 * pad, x_w + 2 * pad, y_h, y_w, k, 0, stride,
+          padded_x.data(), w.get(), b.get(), expected.get());
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          y.get(), expected.get(), c_out * y_h * y_w));
+
+      // x is mostly negative, so the zeros of the padding win at the borders.
+      std::unique_ptr<float[]> pool_y =
+          std::make_unique<float[]>(c_in * y_h * y_w);
+      std::unique_ptr<float[]> expected_pool_y =
+          std::make_unique<float[]>(c_in * y_h * y_w);
+      inference_engine::backend::max_pool(c_in, x_h, x_w, y_h, y_w, k, pad,
+                                          stride, x.get(), pool_y.get());
+      inference_engine::backend::max_pool(
+          c_in, x_h + 2 * pad, x_w + 2 * pad, y_h, y_w, k, 0, stride,
+          padded_x.data(), expected_pool_y.get());
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          pool_y.get(), expected_pool_y.get(), c_in * y_h * y_w));
+    }
+  }
+}
+
+TEST_CASE("conv beta") {
+  // Every algorithm overwrites y with beta = 0, without reading it, and
+  // accumulates onto it with beta = 1.
+  long c_in = 16;
+  long c_out = 20;
+  long x_h = 12;
+  long x_w = 12;
+  long k = 3;
+  long pad = 1;
+  long y_h = 12;
+  long y_w = 12;
+  long y_size = c_out * y_h * y_w;
+  long long y_nchwc_size =
+      inference_engine::backend::nchwc_size(c_out, y_h, y_w);
+
+  std::vector<float> x(c_in * x_h * x_w);
+  std::vector<float> w(c_out * c_in * k * k);
+  std::vector<float> b(c_out);
+  std::vector<float> before(y_size);
+  for (long i = 0; i < c_in * x_h * x_w; ++i) {
+    x[i] = float(i % 9) - 4.0f;
+  }
+  for (long i = 0; i < c_out * c_in * k * k; ++i) {
+    w[i] = float(i % 3);
+  }
+  array_arange(b.data(), c_out);
+  array_arange(before.data(), y_size);
+  std::vector<float> product(y_size, 0.0f);
+  inference_engine::backend::conv_direct(c_in, c_out, x_h, x_w, y_h, y_w, k,
+                                         pad, 1, x.data(), w.data(), b.data(),
+                                         product.data());
+  std::vector<float> accumulated(y_size);
+  for (long i = 0; i < y_size; ++i) {
+    accumulated[i] = product[i] + before[i];
+  }
+
+  std::vector<float> u(
+      inference_engine::backend::winograd_kernel_size(c_in, c_out, 4));
+  inference_engine::backend::winograd_transform_kernel(c_in, c_out, 4,
+                                                       w.data(), u.data());
+  std::vector<float> w_nchwc(
+      inference_engine::backend::nchwc_kernel_size(c_in, c_out, k));
+  inference_engine::backend::reorder_kernel_to_nchwc(c_in, c_out, k, w.data(),
+                                                     w_nchwc.data());
+  std::vector<float> x_nchwc(
+      inference_engine::backend::nchwc_size(c_in, x_h, x_w));
+  inference_engine::backend::reorder_nchw_to_nchwc(c_in, x_h, x_w, x.data(),
+                                                   x_nchwc.data());
+  std::vector<float> before_nchwc(y_nchwc_size);
+  inference_engine::backend::reorder_nchw_to_nchwc(
+      c_out, y_h, y_w, before.data(), before_nchwc.data());
+
+  // Run one algorithm on y, which holds y_before, and return y in NCHW.
+  auto run = [&](std::string const &algorithm, float beta,
+                 std::vector<float> const &y_before) {
+    std::vector<float> y = y_before;
+    if (algorithm == "direct") {
+      inference_engine::backend::conv_direct(c_in, c_out, x_h, x_w, y_h, y_w,
+                                             k, pad, 1, x.data(), w.data(),
+                                             b.data(), y.data(), beta);
+    } else if (algorithm == "im2col") {
+      inference_engine::backend::conv_im2col(c_in, c_out, x_h, x_w, y_h, y_w,
+                                             k, pad, 1, x.data(), w.data(),
+                                             b.data(), y.data(), beta);
+    } else if (algorithm == "winograd") {
+      inference_engine::backend::conv_winograd(c_in, c_out, x_h, x_w, y_h,
+                                               y_w, pad, 4, x.data(), u.data(),
+                                               b.data(), y.data(), beta);
+    } else {
+      std::vector<float> y_nchwc =
+          beta == 0.0f ? std::vector<float>(y_nchwc_size, y_before[0])
+                       : before_nchwc;
+      inference_engine::backend::conv_nchwc(
+          c_in, c_out, x_h, x_w, y_h, y_w, k, pad, 1, x_nchwc.data(),
+          w_nchwc.data(), b.data(), y_nchwc.data(), beta);
+      inference_engine::backend::reorder_nchwc_to_nchw(
+          c_out, y_h, y_w, y_nchwc.data(), y.data());
+    }
+    return y;
+  };
+
+  inference_engine::cpu_features::ISA original =
+      inference_engine::backend::kernels::active().isa;
+  for (inference_engine::cpu_features::ISA isa :
+       {inference_engine::cpu_features::ISA::Generic,
+        inference_engine::cpu_features::ISA::SSE,
+        inference_engine::cpu_features::ISA::AVX2,
+        inference_engine::cpu_features::ISA::AVX512}) {
+    if (isa > inference_engine::cpu_features::detect_isa()) {
+      continue;
+    }
+    for (std::string algorithm : {"direct", "im2col", "winograd", "nchwc"}) {
+      SECTION(std::string(inference_engine::cpu_features::isa_name(isa)) +
+              ", " + algorithm) {
+        inference_engine::backend::kernels::select(isa);
+        std::vector<float> y =
+            run(algorithm, 0.0f,
+                std::vector<float>(y_size,
+                                   std::numeric_limits<float>::quiet_NaN()));
+        REQUIRE(inference_engine::test::assert_array_near_float(
+            y.data(), product.data(), y_size, 1e-5f));
+        y = run(algorithm, 1.0f, before);
+        REQUIRE(inference_engine::test::assert_array_near_float(
+            y.data(), accumulated.data(), y_size, 1e-5f));
+      }
+    }
+  }
+  inference_engine::backend::kernels::select(original);
+}
+
+TEST_CASE("parallel_for") {
+  long default_num_threads = inference_engine::parallel::num_threads();
+  REQUIRE(default_num_threads >= 1);
+  inference_engine::parallel::set_num_threads(4);
+  REQUIRE(inference_engine::parallel::num_threads() == 4);
+
+  SECTION("ranges cover [0, n) exactly once") {
+    for (inference_engine::parallel::SCHEDULE schedule :
+         {inference_engine::parallel::SCHEDULE::Static,
+          inference_engine::parallel::SCHEDULE::Dynamic}) {
+      for (long n : {0l, 1l, 3l, 4l, 17l, 1000l}) {
+        for (long grain : {1l, 2l, 7l, 2000l}) {
+          std::vector<std::atomic<int>> visits(n);
+          for (std::atomic<int> &visit : visits) {
+            visit = 0;
+          }
+          // Catch2 assertions are not thread-safe, so the ranges are
+          // checked on the calling thread afterwards.
+          std::atomic<long> bad_ranges(0);
+          inference_engine::parallel::parallel_for(
+              n,
+              [&](long begin, long end) {
+                if (begin < 0 || begin >= end || end > n ||
+                    (end - begin < grain && end != n)) {
+                  ++bad_ranges;
+                  return;
+                }
+                for (long i = begin; i < end; ++i) {
+                  ++visits[i];
+                }
+              },
+              schedule, grain);
+          REQUIRE(bad_ranges == 0);
+          for (long i = 0; i < n; ++i) {
+            REQUIRE(visits[i] == 1);
+          }
+        }
+      }
+    }
+  }
+
+  SECTION("nested calls share the pool") {
+    std::vector<std::atomic<int>> visits(64);
+    for (std::atomic<int> &visit : visits) {
+      visit = 0;
+    }
+    inference_engine::parallel::parallel_for(8, [&](long begin, long end) {
+      for (long i = begin; i < end; ++i) {
+        inference_engine::parallel::parallel_for(8, [&](long b, long e) {
+          for (long j = b; j < e; ++j) {
+            ++visits[i * 8 + j];
+          }
+        });
+      }
+    });
+    for (long i = 0; i < 64; ++i) {
+      REQUIRE(visits[i] == 1);
+    }
+  }
+
+  SECTION("exceptions are rethrown") {
+    REQUIRE_THROWS_AS(inference_engine::parallel::parallel_for(
+                          100,
+                          [](long begin, long) {
+                            if (begin == 0) {
+                              throw std::runtime_error("range failed");
+                            }
+                          },
+                          inference_engine::parallel::SCHEDULE::Dynamic),
+                      std::runtime_error);
+    // The pool is still usable afterwards.
+    std::atomic<long> sum(0);
+    inference_engine::parallel::parallel_for(100, [&](long begin, long end) {
+      for (long i = begin; i < end; ++i) {
+        sum += i;
+      }
+    });
+    REQUIRE(sum == 4950);
+  }
+
+  SECTION("results do not depend on the number of threads") {
+    // {c_in, c_out, x_h, x_w, k, pad, stride}, picked to select the direct,
+    // im2col and Winograd paths.
+    std::vector<std::vector<long>> shapes = {{3, 4, 5, 5, 3, 1, 1},
+                                             {24, 40, 30, 26, 3, 0, 2},
+                                             {32, 48, 30, 30, 3, 1, 1}};
+    for (std::vector<long> const &shape : shapes) {
+      long c_in = shape[0];
+      long c_out = shape[1];
+      long x_h = shape[2];
+      long x_w = shape[3];
+      long k = shape[4];
+      long pad = shape[5];
+      long stride = shape[6];
+      long y_h = (x_h - k + 2 * pad) / stride + 1;
+      long y_w = (x_w - k + 2 * pad) / stride + 1;
+      long y_size = c_out * y_h * y_w;
+
+      std::vector<float> x(c_in * x_h * x_w);
+      std::vector<float> w(c_out * c_in * k * k);
+      std::vector<float> b(c_out);
+      for (size_t i = 0; i < x.size(); ++i) {
+        x[i] = float(i % 13) * 0.25f - 1.5f;
+      }
+      for (size_t i = 0; i < w.size(); ++i) {
+        w[i] = float(i % 7) * 0.125f - 0.375f;
+      }
+      array_arange(b.data(), c_out);
+
+      std::vector<float> y_serial(y_size, 0.0f);
+      std::vector<float> y_parallel(y_size, 0.0f);
+      inference_engine::parallel::set_num_threads(1);
+      inference_engine::backend::conv(c_in, c_out, x_h, x_w, y_h, y_w, k, pad,
+                                      stride, x.data(), w.data(), b.data(),
+                                      y_serial.data());
+      inference_engine::parallel::set_num_threads(4);
+      inference_engine::backend::conv(c_in, c_out, x_h, x_w, y_h, y_w, k, pad,
+                                      stride, x.data(), w.data(), b.data(),
+                                      y_parallel.data());
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          y_parallel.data(), y_serial.data(), y_size));
+
+      long long x_nchwc_size =
+          inference_engine::backend::nchwc_size(c_in, x_h, x_w);
+      long long y_nchwc_size =
+          inference_engine::backend::nchwc_size(c_out, y_h, y_w);
+      std::vector<float> x_nchwc(x_nchwc_size);
+      inference_engine::backend::reorder_nchw_to_nchwc(
+          c_in, x_h, x_w, x.data(), x_nchwc.data());
+      const float *w_nchwc = inference_engine::backend::cached_nchwc_kernel(
+          c_in, c_out, k, w.data());
+      std::vector<float> y_nchwc_serial(y_nchwc_size, 0.0f);
+      std::vector<float> y_nchwc_parallel(y_nchwc_size, 0.0f);
+      inference_engine::parallel::set_num_threads(1);
+      inference_engine::backend::conv_nchwc(
+          c_in, c_out, x_h, x_w, y_h, y_w, k, pad, stride, x_nchwc.data(),
+          w_nchwc, b.data(), y_nchwc_serial.data());
+      inference_engine::parallel::set_num_threads(4);
+      inference_engine::backend::conv_nchwc(
+          c_in, c_out, x_h, x_w, y_h, y_w, k, pad, stride, x_nchwc.data(),
+          w_nchwc, b.data(), y_nchwc_parallel.data());
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          y_nchwc_parallel.data(), y_nchwc_serial.data(), y_nchwc_size));
+      inference_engine::backend::clear_nchwc_kernel_cache();
+    }
+
+    long m = 200;
+    long n = 300;
+    long k = 260;
+    std::vector<float> a(m * k);
+    std::vector<float> b(k * n);
+    for (size_t i = 0; i < a.size(); ++i) {
+      a[i] = float(i % 9) * 0.5f - 2.0f;
+    }
+    for (size_t i = 0; i < b.size(); ++i) {
+      b[i] = float(i % 5) * 0.25f - 0.5f;
+    }
+    std::vector<float> c_serial(m * n, 1.0f);
+    std::vector<float> c_parallel(m * n, 1.0f);
+    inference_engine::parallel::set_num_threads(1);
+    inference_engine::backend::gemm(m, n, k, a.data(), b.data(),
+                                    c_serial.data(), nullptr);
+    inference_engine::parallel::set_num_threads(4);
+    inference_engine::backend::gemm(m, n, k, a.data(), b.data(),
+                                    c_parallel.data(), nullptr);
+    REQUIRE(inference_engine::test::assert_array_eq_float(
+        c_parallel.data(), c_serial.data(), m * n));
+  }
+
+  inference_engine::parallel::set_num_threads(0);
+  REQUIRE(inference_engine::parallel::num_threads() == default_num_threads);
+}
+
+TEST_CASE("run_task_graph") {
+  inference_engine::parallel::set_num_threads(4);
+
+  SECTION("tasks run after their predecessors") {
+    // Two diamonds side by side, joined by a last task:
+    // 0 -> {1, 2} -> 3, 4 -> {5, 6} -> 7, {3, 7} -> 8
+    std::vector<std::vector<long>> successors = {
+        {1, 2}, {3}, {3}, {8}, {5, 6}, {7}, {7}, {8}, {}};
+    for (int repeat = 0; repeat < 20; ++repeat) {
+      std::vector<std::atomic<long>> finished_at(successors.size());
+      std::vector<std::atomic<long>> started_at(successors.size());
+      std::atomic<long> clock(0);
+      inference_engine::parallel::run_task_graph(successors, [&](long i) {
+        started_at[i] = ++clock;
+        // Tasks can use the pool themselves.
+        std::atomic<long> sum(0);
+        inference_engine::parallel::parallel_for(100, [&](long b, long e) {
+          for (long j = b; j < e; ++j) {
+            sum += j;
+          }
+        });
+        finished_at[i] = sum == 4950 ? ++clock : -1;
+      });
+      for (size_t i = 0; i < successors.size(); ++i) {
+        REQUIRE(finished_at[i] > 0);
+        for (long successor : successors[i]) {
+          REQUIRE(finished_at[i] < started_at[successor]);
+        }
+      }
+    }
+  }
+
+  SECTION("a waiting thread runs no task of another region") {
+    // A task waiting for its parallel_for must not start another graph task
+    // on its thread, which could re-enter a kernel using the thread_local
+    // scratch buffers of the waiting one.
+    std::atomic<long> nested_tasks(0);
+    inference_engine::parallel::run_task_graph(
+        std::vector<std::vector<long>>(32), [&](long) {
+          static thread_local int running = 0;
+          if (running++ > 0) {
+            ++nested_tasks;
+          }
+          inference_engine::parallel::parallel_for(8, [](long, long) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          });
+          --running;
+        });
+    REQUIRE(nested_tasks == 0);
+  }
+
+  SECTION("branches side by side split their kernels") {
+    // Independent GEMMs and convolutions, each large enough to be split over
+    // the pool, with the direct, im2col and Winograd paths among the latter.
+    inference_engine::parallel::set_num_threads(8);
+    long m = 256;
+    long n = 256;
+    long k = 256;
+    // {c_in, c_out, x_h, x_w, k, pad, stride}
+    std::vector<std::vector<long>> shapes = {{24, 40, 30, 26, 3, 0, 2},
+                                             {32, 48, 30, 30, 3, 1, 1}};
+    long num_gemms = 6;
+    long num_tasks = num_gemms + 2 * static_cast<long>(shapes.size());
+
+    std::vector<std::vector<float>> inputs(num_tasks);
+    std::vector<std::vector<float>> weights(num_tasks);
+    std::vector<long> output_sizes(num_tasks);
+    for (long i = 0; i < num_tasks; ++i) {
+      if (i < num_gemms) {
+        inputs[i].resize(m * k);
+        weights[i].resize(k * n);
+        output_sizes[i] = m * n;
+      } else {
+        std::vector<long> const &shape = shapes[(i - num_gemms) / 2];
+        long y_h = (shape[2] - shape[4] + 2 * shape[5]) / shape[6] + 1;
+        long y_w = (shape[3] - shape[4] + 2 * shape[5]) / shape[6] + 1;
+        inputs[i].resize(shape[0] * shape[2] * shape[3]);
+        weights[i].resize(shape[1] * shape[0] * shape[4] * shape[4]);
+        output_sizes[i] = shape[1] * y_h * y_w;
+      }
+      for (size_t j = 0; j < inputs[i].size(); ++j) {
+        inputs[i][j] = float((j + i) % 9) * 0.5f - 2.0f;
+      }
+      for (size_t j = 0; j < weights[i].size(); ++j) {
+        weights[i][j] = float((j * (i + 1)) % 5) * 0.25f - 0.5f;
+      }
+    }
+    std::vector<float> bias(64, 0.5f);
+    auto run = [&](long i, float *y) {
+      if (i < num_gemms) {
+        inference_engine::backend::gemm(m, n, k, inputs[i].data(),
+                                        weights[i].data(), y, nullptr);
+        return;
+      }
+      std::vector<long> const &shape = shapes[(i - num_gemms) / 2];
+      long y_h = (shape[2] - shape[4] + 2 * shape[5]) / shape[6] + 1;
+      long y_w = (shape[3] - shape[4] + 2 * shape[5]) / shape[6] + 1;
+      inference_engine::backend::conv(
+          shape[0], shape[1], shape[2], shape[3], y_h, y_w, shape[4],
+          shape[5], shape[6], inputs[i].data(), weights[i].data(),
+          bias.data(), y);
+    };
+
+    std::vector<std::vector<float>> serial(num_tasks);
+    for (long i = 0; i < num_tasks; ++i) {
+      serial[i].assign(output_sizes[i], 0.0f);
+      run(i, serial[i].data());
+    }
+    for (int repeat = 0; repeat < 5; ++repeat) {
+      std::vector<std::vector<float>> parallel(num_tasks);
+      for (long i = 0; i < num_tasks; ++i) {
+        parallel[i].assign(output_sizes[i], 0.0f);
+      }
+      inference_engine::parallel::run_task_graph(
+          std::vector<std::vector<long>>(num_tasks),
+          [&](long i) { run(i, parallel[i].data()); });
+      for (long i = 0; i < num_tasks; ++i) {
+        REQUIRE(inference_engine::test::assert_array_eq_float(
+            parallel[i].data(), serial[i].data(), output_sizes[i]));
+      }
+    }
+    inference_engine::backend::clear_winograd_kernel_cache();
+  }
+
+  SECTION("an empty graph") {
+    inference_engine::parallel::run_task_graph({}, [](long) {});
+  }
+
+  SECTION("cycles are rejected") {
+    long runs = 0;
+    REQUIRE_THROWS_AS(inference_engine::parallel::run_task_graph(
+                          {{1}, {2}, {1}}, [&](long) { ++runs; }),
+                      std::runtime_error);
+    REQUIRE(runs == 0);
+  }
+
+  SECTION("the first exception is rethrown and successors are skipped") {
+    std::vector<std::atomic<int>> runs(4);
+    for (std::atomic<int> &run : runs) {
+      run = 0;
+    }
+    REQUIRE_THROWS_AS(inference_engine::parallel::run_task_graph(
+                          {{1}, {2}, {3}, {}},
+                          [&](long i) {
+                            ++runs[i];
+                            if (i == 1) {
+                              throw std::runtime_error("task failed");
+                            }
+                          }),
+                      std::runtime_error);
+    REQUIRE(runs[0] == 1);
+    REQUIRE(runs[1] == 1);
+    REQUIRE(runs[2] == 0);
+    REQUIRE(runs[3] == 0);
+  }
+
+  inference_engine::parallel::set_num_threads(0);
+}
+
+TEST_CASE("conv_relu_max_pool") {
+  // {c_in, c_out, x_h, x_w, k, pad, stride}, picked to select the direct,
+  // im2col and Winograd algorithms. The last one is computed in several
+  // bands of rows.
+  std::vector<std::vector<long>> shapes = {{3, 4, 6, 7, 3, 1, 1},
+                                           {5, 12, 21, 17, 5, 2, 2},
+                                           {16, 16, 30, 29, 3, 1, 1},
+                                           {16, 128, 60, 60, 3, 1, 1}};
+  // {pool_k, pool_pad, pool_stride}, pool_k = 0 for no MaxPool
+  std::vector<std::vector<long>> pools = {{0, 0, 1}, {2, 0, 2}, {3, 1, 2}};
+
+  for (std::vector<long> const &shape : shapes) {
+    for (std::vector<long> const &pool : pools) {
+      long c_in = shape[0];
+      long c_out = shape[1];
+      long x_h = shape[2];
+      long x_w = shape[3];
+      long k = shape[4];
+      long pad = shape[5];
+      long stride = shape[6];
+      long pool_k = pool[0];
+      long pool_pad = pool[1];
+      long pool_stride = pool[2];
+      long y_h = (x_h - k + 2 * pad) / stride + 1;
+      long y_w = (x_w - k + 2 * pad) / stride + 1;
+      long p_h = y_h;
+      long p_w = y_w;
+      if (pool_k > 0) {
+        p_h = (y_h - pool_k + 2 * pool_pad) / pool_stride + 1;
+        p_w = (y_w - pool_k + 2 * pool_pad) / pool_stride + 1;
+      }
+
+      SECTION(std::to_string(c_in) + "x" + std::to_string(x_h) + "x" +
+              std::to_string(x_w) + " image, " + std::to_string(c_out) + "x" +
+              std::to_string(k) + "x" + std::to_string(k) + " kernel, " +
+              std::to_string(pool_k) + "x" + std::to_string(pool_k) +
+              " pool") {
+        std::vector<float> x(c_in * x_h * x_w);
+        std::vector<float> w(c_out * c_in * k * k);
+        std::vector<float> b(c_out);
+        for (size_t i = 0; i < x.size(); ++i) {
+          x[i] = float(i % 9) - 4.0f;
+        }
+        for (size_t i = 0; i < w.size(); ++i) {
+          w[i] = (float(i % 5) - 2.0f) * 0.125f;
+        }
+        for (long i = 0; i < c_out; ++i) {
+          b[i] = float(i % 7) - 3.0f;
+        }
+
+        std::vector<float> conv_y(c_out * y_h * y_w, 0.0f);
+        inference_engine::backend::conv(c_in, c_out, x_h, x_w, y_h, y_w, k,
+                                        pad, stride, x.data(), w.data(),
+                                        b.data(), conv_y.data());
+        inference_engine::backend::relu(c_out * y_h * y_w, conv_y.data(),
+                                        conv_y.data());
+        std::vector<float> expected(c_out * p_h * p_w);
+        if (pool_k > 0) {
+          inference_engine::backend::max_pool(
+              c_out, y_h, y_w, p_h, p_w, pool_k, pool_pad, pool_stride,
+              conv_y.data(), expected.data());
+        } else {
+          expected = conv_y;
+        }
+
+        // The output is overwritten, not accumulated into.
+        std::vector<float> p(c_out * p_h * p_w, 100.0f);
+        inference_engine::backend::conv_relu_max_pool(
+            c_in, c_out, x_h, x_w, y_h, y_w, k, pad, stride, pool_k, pool_pad,
+            pool_stride, p_h, p_w, x.data(), w.data(), b.data(), p.data());
+        REQUIRE(inference_engine::test::assert_array_near_float(
+            p.data(), expected.data(), c_out * p_h * p_w, 1e-5f));
+
+        // The same with a kernel bound once, as a compiled model runs it
+        const inference_engine::backend::conv_kernel kernel =
+            inference_engine::backend::bind_conv_kernel(c_in, c_out, y_h, y_w,
+                                                        k, stride, w.data());
+        REQUIRE(kernel.algorithm ==
+                inference_engine::backend::select_conv_algorithm(
+                    c_in, c_out, y_h, y_w, k, stride));
+        std::fill(p.begin(), p.end(), 100.0f);
+        inference_engine::backend::conv_relu_max_pool(
+            c_in, c_out, x_h, x_w, y_h, y_w, k, pad, stride, pool_k, pool_pad,
+            pool_stride, p_h, p_w, x.data(), kernel, b.data(), p.data());
+        REQUIRE(inference_engine::test::assert_array_near_float(
+            p.data(), expected.data(), c_out * p_h * p_w, 1e-5f));
+        std::vector<float> bound_y(c_out * y_h * y_w, 100.0f);
+        inference_engine::backend::conv(c_in, c_out, x_h, x_w, y_h, y_w, k,
+                                        pad, stride, x.data(), kernel,
+                                        b.data(), bound_y.data());
+        inference_engine::backend::relu(c_out * y_h * y_w, bound_y.data(),
+                                        bound_y.data());
+        REQUIRE(inference_engine::test::assert_array_near_float(
+            bound_y.data(), conv_y.data(), c_out * y_h * y_w, 1e-5f));
+
+        std::vector<float> x_nchwc(
+            inference_engine::backend::nchwc_size(c_in, x_h, x_w));
+        inference_engine::backend::reorder_nchw_to_nchwc(
+            c_in, x_h, x_w, x.data(), x_nchwc.data());
+        std::vector<float> p_nchwc(
+            inference_engine::backend::nchwc_size(c_out, p_h, p_w), 100.0f);
+        inference_engine::backend::conv_relu_max_pool_nchwc(
+            c_in, c_out, x_h, x_w, y_h, y_w, k, pad, stride, pool_k, pool_pad,
+            pool_stride, p_h, p_w, x_nchwc.data(),
+            inference_engine::backend::cached_nchwc_kernel(c_in, c_out, k,
+                                                           w.data()),
+            b.data(), p_nchwc.data());
+        inference_engine::backend::clear_nchwc_kernel_cache();
+        inference_engine::backend::clear_winograd_kernel_cache();
+        inference_engine::backend::clear_im2col_kernel_cache();
+        std::vector<float> p_from_nchwc(c_out * p_h * p_w);
+        inference_engine::backend::reorder_nchwc_to_nchw(
+            c_out, p_h, p_w, p_nchwc.data(), p_from_nchwc.data());
+        REQUIRE(inference_engine::test::assert_array_near_float(
+            p_from_nchwc.data(), expected.data(), c_out * p_h * p_w, 1e-5f));
+      }
+    }
+  }
+}
@@ -0,0 +1,1232 @@
+#ifndef CATCH_CONFIG_MAIN
+#define CATCH_CONFIG_MAIN
+#endif
+
+#include "../inference_engine/backend.hpp"
+#include "../inference_engine/batcher.hpp"
+#include "../inference_engine/parallel.hpp"
+#include "../inference_engine/session.hpp"
+#include "util.hpp"
+#include <catch2/catch.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+void add_float_initializer(::onnx::GraphProto &graph, std::string const &name,
+                           std::vector<long> const &dims,
+                           std::vector<float> const &values) {
+  // Initializers are graph inputs as well, as in the models of opset <= 8.
+  ::onnx::ValueInfoProto *input = graph.add_input();
+  input->set_name(name);
+  input->mutable_type()->mutable_tensor_type()->set_elem_type(
+      ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT);
+  ::onnx::TensorProto *tensor = graph.add_initializer();
+  tensor->set_name(name);
+  tensor->set_data_type(
+      ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT);
+  for (long dim : dims) {
+    input->mutable_type()->mutable_tensor_type()->mutable_shape()->add_dim()
+        ->set_dim_value(dim);
+    tensor->add_dims(dim);
+  }
+  tensor->set_raw_data(std::string(
+      reinterpret_cast<const char *>(values.data()),
+      values.size() * sizeof(float)));
+}
+
+void add_shape_initializer(::onnx::GraphProto &graph, std::string const &name,
+                           std::vector<long> const &shape) {
+  ::onnx::ValueInfoProto *input = graph.add_input();
+  input->set_name(name);
+  input->mutable_type()->mutable_tensor_type()->set_elem_type(
+      ::onnx::TensorProto_DataType::TensorProto_DataType_INT64);
+  input->mutable_type()->mutable_tensor_type()->mutable_shape()->add_dim()
+      ->set_dim_value(shape.size());
+  ::onnx::TensorProto *tensor = graph.add_initializer();
+  tensor->set_name(name);
+  tensor->set_data_type(
+      ::onnx::TensorProto_DataType::TensorProto_DataType_INT64);
+  tensor->add_dims(shape.size());
+  tensor->set_raw_data(
+      std::string(reinterpret_cast<const char *>(shape.data()),
+                  shape.size() * sizeof(long)));
+}
+
+// Add an initializer of data_type with no data, which the caller fills in.
+::onnx::TensorProto *add_initializer(::onnx::GraphProto &graph,
+                                     std::string const &name,
+                                     std::vector<long> const &dims,
+                                     ::google::protobuf::int32 data_type) {
+  ::onnx::ValueInfoProto *input = graph.add_input();
+  input->set_name(name);
+  input->mutable_type()->mutable_tensor_type()->set_elem_type(data_type);
+  ::onnx::TensorProto *tensor = graph.add_initializer();
+  tensor->set_name(name);
+  tensor->set_data_type(data_type);
+  for (long dim : dims) {
+    input->mutable_type()->mutable_tensor_type()->mutable_shape()->add_dim()
+        ->set_dim_value(dim);
+    tensor->add_dims(dim);
+  }
+  return tensor;
+}
+
+::onnx::NodeProto *add_node(::onnx::GraphProto &graph,
+                            std::string const &op_type,
+                            std::vector<std::string> const &inputs,
+                            std::string const &output) {
+  ::onnx::NodeProto *node = graph.add_node();
+  node->set_name(output);
+  node->set_op_type(op_type);
+  for (std::string const &input : inputs) {
+    node->add_input(input);
+  }
+  node->add_output(output);
+  return node;
+}
+
+void add_ints(::onnx::NodeProto *node, std::string const &name,
+              std::vector<long> const &values) {
+  ::onnx::AttributeProto *attribute = node->add_attribute();
+  attribute->set_name(name);
+  attribute->set_type(::onnx::AttributeProto_AttributeType_INTS);
+  for (long value : values) {
+    attribute->add_ints(value);
+  }
+}
+
+void add_int(::onnx::NodeProto *node, std::string const &name, long value) {
+  ::onnx::AttributeProto *attribute = node->add_attribute();
+  attribute->set_name(name);
+  attribute->set_type(::onnx::AttributeProto_AttributeType_INT);
+  attribute->set_i(value);
+}
+
+std::vector<float> values(long n, float scale, long offset) {
+  std::vector<float> result(n);
+  for (long i = 0; i < n; ++i) {
+    result[i] = float((i * 7 + offset) % 13 - 6) * scale;
+  }
+  return result;
+}
+
+// The weights of a small VGG-like network:
+// Conv(3->8, 3x3) -> Relu -> MaxPool(2x2) -> Conv(8->16, 3x3) -> Reshape ->
+// Gemm(400->20) -> Relu -> Gemm(20->10) -> Softmax
+struct network {
+  std::vector<float> w1 = values(8 * 3 * 3 * 3, 0.05f, 1);
+  std::vector<float> b1 = values(8, 0.1f, 2);
+  std::vector<float> w2 = values(16 * 8 * 3 * 3, 0.02f, 3);
+  std::vector<float> b2 = values(16, 0.1f, 4);
+  std::vector<float> w3 = values(20 * 400, 0.01f, 5);
+  std::vector<float> b3 = values(20, 0.1f, 6);
+  std::vector<float> w4 = values(10 * 20, 0.05f, 7);
+  std::vector<float> b4 = values(10, 0.1f, 8);
+
+  ::onnx::GraphProto graph() const {
+    ::onnx::GraphProto graph;
+    ::onnx::ValueInfoProto *x = graph.add_input();
+    x->set_name("x");
+    x->mutable_type()->mutable_tensor_type()->set_elem_type(
+        ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT);
+    for (long dim : {1, 3, 10, 10}) {
+      x->mutable_type()->mutable_tensor_type()->mutable_shape()->add_dim()
+          ->set_dim_value(dim);
+    }
+    ::onnx::ValueInfoProto *y = graph.add_output();
+    y->set_name("y");
+    y->mutable_type()->mutable_tensor_type()->set_elem_type(
+        ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT);
+    for (long dim : {1, 10}) {
+      y->mutable_type()->mutable_tensor_type()->mutable_shape()->add_dim()
+          ->set_dim_value(dim);
+    }
+
+    add_float_initializer(graph, "w1", {8, 3, 3, 3}, w1);
+    add_float_initializer(graph, "b1", {8}, b1);
+    add_float_initializer(graph, "w2", {16, 8, 3, 3}, w2);
+    add_float_initializer(graph, "b2", {16}, b2);
+    add_float_initializer(graph, "w3", {20, 400}, w3);
+    add_float_initializer(graph, "b3", {20}, b3);
+    add_float_initializer(graph, "w4", {10, 20}, w4);
+    add_float_initializer(graph, "b4", {10}, b4);
+    add_shape_initializer(graph, "shape", {1, -1});
+
+    auto add_conv = [&](std::vector<std::string> const &inputs,
+                        std::string const &output) {
+      ::onnx::NodeProto *node = add_node(graph, "Conv", inputs, output);
+      add_ints(node, "kernel_shape", {3, 3});
+      add_ints(node, "pads", {1, 1, 1, 1});
+      add_ints(node, "strides", {1, 1});
+    };
+    add_conv({"x", "w1", "b1"}, "c1");
+    add_node(graph, "Relu", {"c1"}, "r1");
+    ::onnx::NodeProto *pool = add_node(graph, "MaxPool", {"r1"}, "p1");
+    add_ints(pool, "kernel_shape", {2, 2});
+    add_ints(pool, "pads", {0, 0, 0, 0});
+    add_ints(pool, "strides", {2, 2});
+    add_conv({"p1", "w2", "b2"}, "c2");
+    add_node(graph, "Reshape", {"c2", "shape"}, "f");
+    add_int(add_node(graph, "Gemm", {"f", "w3", "b3"}, "g1"), "transB", 1);
+    add_node(graph, "Relu", {"g1"}, "r2");
+    add_int(add_node(graph, "Gemm", {"r2", "w4", "b4"}, "g2"), "transB", 1);
+    add_node(graph, "Softmax", {"g2"}, "y");
+    return graph;
+  }
+
+  // Calculate the class probabilities of one image with the backend
+  // kernels directly.
+  std::vector<float> reference(std::vector<float> x) const {
+    std::vector<float> c1(8 * 10 * 10, 0.0f);
+    inference_engine::backend::conv_direct(
+        3, 8, 10, 10, 10, 10, 3, 1, 1, x.data(), const_cast<float *>(w1.data()),
+        const_cast<float *>(b1.data()), c1.data());
+    inference_engine::backend::relu(c1.size(), c1.data(), c1.data());
+    std::vector<float> p1(8 * 5 * 5);
+    inference_engine::backend::max_pool(8, 10, 10, 5, 5, 2, 0, 2, c1.data(),
+                                        p1.data());
+    std::vector<float> c2(16 * 5 * 5, 0.0f);
+    inference_engine::backend::conv_direct(
+        8, 16, 5, 5, 5, 5, 3, 1, 1, p1.data(), const_cast<float *>(w2.data()),
+        const_cast<float *>(b2.data()), c2.data());
+
+    std::vector<float> g1(20);
+    for (long j = 0; j < 20; ++j) {
+      double sum = b3[j];
+      for (long k = 0; k < 400; ++k) {
+        sum += c2[k] * w3[j * 400 + k];
+      }
+      g1[j] = std::max(0.0f, static_cast<float>(sum));
+    }
+    std::vector<float> g2(10);
+    for (long j = 0; j < 10; ++j) {
+      double sum = b4[j];
+      for (long k = 0; k < 20; ++k) {
+        sum += g1[k] * w4[j * 20 + k];
+      }
+      g2[j] = static_cast<float>(sum);
+    }
+    std::vector<float> y(10);
+    inference_engine::backend::softmax(10, g2.data(), y.data());
+    return y;
+  }
+};
+
+// Conv(2->3, 3x3, strides 2, pads 1 before and 2 after) -> Relu ->
+// MaxPool(3x3, strides 2, pads 1 after), on a 7x7 input
+struct padded_network {
+  std::vector<float> w = values(3 * 2 * 3 * 3, 0.1f, 1);
+  std::vector<float> b = values(3, 0.1f, 2);
+
+  ::onnx::GraphProto graph() const {
+    ::onnx::GraphProto graph;
+    ::onnx::ValueInfoProto *x = graph.add_input();
+    x->set_name("x");
+    x->mutable_type()->mutable_tensor_type()->set_elem_type(
+        ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT);
+    for (long dim : {1, 2, 7, 7}) {
+      x->mutable_type()->mutable_tensor_type()->mutable_shape()->add_dim()
+          ->set_dim_value(dim);
+    }
+    ::onnx::ValueInfoProto *y = graph.add_output();
+    y->set_name("y");
+    y->mutable_type()->mutable_tensor_type()->set_elem_type(
+        ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT);
+    add_float_initializer(graph, "w", {3, 2, 3, 3}, w);
+    add_float_initializer(graph, "b", {3}, b);
+
+    ::onnx::NodeProto *conv = add_node(graph, "Conv", {"x", "w", "b"}, "c");
+    add_ints(conv, "kernel_shape", {3, 3});
+    add_ints(conv, "pads", {1, 1, 2, 2});
+    add_ints(conv, "strides", {2, 2});
+    add_node(graph, "Relu", {"c"}, "r");
+    ::onnx::NodeProto *pool = add_node(graph, "MaxPool", {"r"}, "y");
+    add_ints(pool, "kernel_shape", {3, 3});
+    add_ints(pool, "pads", {0, 0, 1, 1});
+    add_ints(pool, "strides", {2, 2});
+    return graph;
+  }
+
+  // Pad the image by hand, and run the kernels with no padding.
+  std::vector<float> reference(std::vector<float> const &x) const {
+    std::vector<float> padded(2 * 10 * 10, 0.0f);
+    for (long c = 0; c < 2; ++c) {
+      for (long h = 0; h < 7; ++h) {
+        std::copy(x.begin() + (c * 7 + h) * 7, x.begin() + (c * 7 + h + 1) * 7,
+                  padded.begin() + (c * 10 + h + 1) * 10 + 1);
+      }
+    }
+    std::vector<float> r(3 * 4 * 4);
+    inference_engine::backend::conv_direct(
+        2, 3, 10, 10, 4, 4, 3, 0, 2, padded.data(),
+        const_cast<float *>(w.data()), const_cast<float *>(b.data()),
+        r.data());
+    inference_engine::backend::relu(r.size(), r.data(), r.data());
+
+    // The padding after the last row and column is never the maximum.
+    std::vector<float> y(3 * 2 * 2);
+    for (long c = 0; c < 3; ++c) {
+      for (long i = 0; i < 2; ++i) {
+        for (long j = 0; j < 2; ++j) {
+          float maximum = r[c * 16 + i * 2 * 4 + j * 2];
+          for (long h = i * 2; h < std::min(i * 2 + 3, 4l); ++h) {
+            for (long w = j * 2; w < std::min(j * 2 + 3, 4l); ++w) {
+              maximum = std::max(maximum, r[c * 16 + h * 4 + w]);
+            }
+          }
+          y[(c * 2 + i) * 2 + j] = maximum;
+        }
+      }
+    }
+    return y;
+  }
+};
+
+// Slice(channels 1 to 3) -> Flatten -> Unsqueeze(1) -> Squeeze(1) ->
+// Slice(every 4th from 2, with its arguments as inputs) -> Relu, on a
+// [1, 4, 3, 3] input
+::onnx::GraphProto view_graph() {
+  ::onnx::GraphProto graph;
+  ::onnx::ValueInfoProto *x = graph.add_input();
+  x->set_name("x");
+  x->mutable_type()->mutable_tensor_type()->set_elem_type(
+      ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT);
+  for (long dim : {1, 4, 3, 3}) {
+    x->mutable_type()->mutable_tensor_type()->mutable_shape()->add_dim()
+        ->set_dim_value(dim);
+  }
+  ::onnx::ValueInfoProto *y = graph.add_output();
+  y->set_name("y");
+  y->mutable_type()->mutable_tensor_type()->set_elem_type(
+      ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT);
+  add_shape_initializer(graph, "starts", {2});
+  add_shape_initializer(graph, "ends", {18});
+  add_shape_initializer(graph, "axes", {1});
+  add_shape_initializer(graph, "steps", {4});
+
+  ::onnx::NodeProto *channels = add_node(graph, "Slice", {"x"}, "s1");
+  add_ints(channels, "starts", {1});
+  add_ints(channels, "ends", {3});
+  add_ints(channels, "axes", {1});
+  add_node(graph, "Flatten", {"s1"}, "f");
+  add_ints(add_node(graph, "Unsqueeze", {"f"}, "u"), "axes", {1});
+  add_ints(add_node(graph, "Squeeze", {"u"}, "q"), "axes", {1});
+  add_node(graph, "Slice", {"q", "starts", "ends", "axes", "steps"}, "s2");
+  add_node(graph, "Relu", {"s2"}, "y");
+  return graph;
+}
+
+// Conv(16->32, 3x3) -> Relu -> Conv(32->32, 3x3) -> Reshape ->
+// Gemm(8192->160), on a [1, 16, 16, 16] input. Each layer is large enough to
+// be split over the thread pool.
+::onnx::GraphProto large_graph() {
+  ::onnx::GraphProto graph;
+  ::onnx::ValueInfoProto *x = graph.add_input();
+  x->set_name("x");
+  x->mutable_type()->mutable_tensor_type()->set_elem_type(
+      ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT);
+  for (long dim : {1, 16, 16, 16}) {
+    x->mutable_type()->mutable_tensor_type()->mutable_shape()->add_dim()
+        ->set_dim_value(dim);
+  }
+  ::onnx::ValueInfoProto *y = graph.add_output();
+  y->set_name("y");
+  y->mutable_type()->mutable_tensor_type()->set_elem_type(
+      ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT);
+  add_float_initializer(graph, "w1", {32, 16, 3, 3},
+                        values(32 * 16 * 3 * 3, 0.02f, 1));
+  add_float_initializer(graph, "b1", {32}, values(32, 0.1f, 2));
+  add_float_initializer(graph, "w2", {32, 32, 3, 3},
+                        values(32 * 32 * 3 * 3, 0.01f, 3));
+  add_float_initializer(graph, "b2", {32}, values(32, 0.1f, 4));
+  add_float_initializer(graph, "w3", {160, 8192},
+                        values(160 * 8192, 0.002f, 5));
+  add_float_initializer(graph, "b3", {160}, values(160, 0.1f, 6));
+  add_shape_initializer(graph, "shape", {1, -1});
+
+  auto add_conv = [&](std::vector<std::string> const &inputs,
+                      std::string const &output) {
+    ::onnx::NodeProto *node = add_node(graph, "Conv", inputs, output);
+    add_ints(node, "kernel_shape", {3, 3});
+    add_ints(node, "pads", {1, 1, 1, 1});
+    add_ints(node, "strides", {1, 1});
+  };
+  add_conv({"x", "w1", "b1"}, "c1");
+  add_node(graph, "Relu", {"c1"}, "r1");
+  add_conv({"r1", "w2", "b2"}, "c2");
+  add_node(graph, "Reshape", {"c2", "shape"}, "f");
+  add_int(add_node(graph, "Gemm", {"f", "w3", "b3"}, "y"), "transB", 1);
+  return graph;
+}
+
+// Return the shapes infer_shapes infers for graph.
+std::map<std::string, inference_engine::inferer::tensor_shape>
+shapes_of(::onnx::GraphProto &graph) {
+  std::map<std::string, inference_engine::onnx::parameter> table;
+  inference_engine::onnx::abstract_parameter_table(graph, table);
+  inference_engine::onnx::initialize_parameter_table(graph, table);
+  return inference_engine::inferer::infer_shapes(
+      inference_engine::onnx::abstract_all_nodes(graph), table);
+}
+
+} // namespace
+
+TEST_CASE("parameter") {
+  inference_engine::onnx::parameter w(
+      "w", {3, 5}, ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT,
+      15);
+  REQUIRE(!w.has_data());
+  w.allocate();
+  const float *data = w.data<float>();
+  REQUIRE(reinterpret_cast<std::uintptr_t>(data) %
+              inference_engine::memory::ALIGNMENT ==
+          0);
+  for (long i = 0; i < 15; ++i) {
+    REQUIRE(data[i] == 0.0f);
+  }
+  REQUIRE_THROWS_AS(w.data<long>(), std::runtime_error);
+  REQUIRE_THROWS_AS(w.data<int>(), std::runtime_error);
+  REQUIRE(w.mutable_data<float>() == data);
+  REQUIRE_THROWS_AS(w.mutable_data<long>(), std::runtime_error);
+
+  w.release();
+  REQUIRE(w.data<float>() == nullptr);
+
+  std::shared_ptr<const std::vector<float>> owner =
+      std::make_shared<const std::vector<float>>(15, 1.0f);
+  w.share(owner->data(), owner);
+  REQUIRE(w.data<float>() == owner->data());
+  // Shared elements are only read.
+  REQUIRE_THROWS_AS(w.mutable_data<float>(), std::runtime_error);
+  REQUIRE(owner.use_count() == 2);
+  w.release();
+  REQUIRE(owner.use_count() == 1);
+}
+
+TEST_CASE("initialize_parameter_table") {
+  ::onnx::GraphProto graph;
+  // Large enough to be decoded in several chunks
+  const long n = (1 << 18) * 2 + 3;
+  ::onnx::TensorProto *f = add_initializer(
+      graph, "f", {n},
+      ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT);
+  for (long i = 0; i < n; ++i) {
+    f->add_float_data(0.5f * i);
+  }
+  ::onnx::TensorProto *l = add_initializer(
+      graph, "l", {3},
+      ::onnx::TensorProto_DataType::TensorProto_DataType_INT64);
+  for (long i = 0; i < 3; ++i) {
+    l->add_int64_data(-(1L << 40) + i);
+  }
+  ::onnx::TensorProto *i32 = add_initializer(
+      graph, "i32", {2},
+      ::onnx::TensorProto_DataType::TensorProto_DataType_INT32);
+  i32->add_int32_data(7);
+  i32->add_int32_data(-7);
+  ::onnx::TensorProto *i8 = add_initializer(
+      graph, "i8", {4},
+      ::onnx::TensorProto_DataType::TensorProto_DataType_INT8);
+  const char raw[] = {1, -1, 127, -128};
+  i8->set_raw_data(raw, sizeof(raw));
+
+  std::map<std::string, inference_engine::onnx::parameter> table;
+  inference_engine::onnx::abstract_parameter_table(graph, table);
+  inference_engine::onnx::initialize_parameter_table(graph, table);
+  std::vector<float> expected(n);
+  for (long i = 0; i < n; ++i) {
+    expected[i] = 0.5f * i;
+  }
+  REQUIRE(std::vector<float>(table.at("f").data<float>(),
+                             table.at("f").data<float>() + n) == expected);
+  for (long i = 0; i < 3; ++i) {
+    REQUIRE(table.at("l").data<long>()[i] == -(1L << 40) + i);
+  }
+  REQUIRE(table.at("i32").data<int>()[0] == 7);
+  REQUIRE(table.at("i32").data<int>()[1] == -7);
+  REQUIRE(std::vector<int>(table.at("i8").data<int>(),
+                           table.at("i8").data<int>() + 4) ==
+          std::vector<int>{1, -1, 127, -128});
+
+  // An initializer with another number of elements than its dims is an
+  // error rather than a read past its data.
+  i32->add_int32_data(0);
+  table.clear();
+  inference_engine::onnx::abstract_parameter_table(graph, table);
+  REQUIRE_THROWS_AS(
+      inference_engine::onnx::initialize_parameter_table(graph, table),
+      std::runtime_error);
+}
+
+TEST_CASE("map_onnx_model_from_file") {
+  network net;
+  ::onnx::ModelProto model;
+  *model.mutable_graph() = net.graph();
+  std::string path = "test_session_model.onnx";
+  {
+    std::ofstream file(path, std::ios::binary);
+    REQUIRE(model.SerializeToOstream(&file));
+  }
+
+  inference_engine::onnx::mapped_model mapped =
+      inference_engine::onnx::map_onnx_model_from_file(path);
+  std::remove(path.c_str());
+  // The file stays mapped after it is removed.
+  REQUIRE(mapped.model.graph().node_size() == model.graph().node_size());
+  REQUIRE(mapped.raw_data.size() == 9);
+  for (::onnx::TensorProto const &initializer :
+       mapped.model.graph().initializer()) {
+    REQUIRE(initializer.raw_data().empty());
+  }
+
+  SECTION("weights are read from the mapping") {
+    std::map<std::string, inference_engine::onnx::parameter> table;
+    inference_engine::onnx::abstract_parameter_table(
+        *mapped.model.mutable_graph(), table);
+    inference_engine::onnx::map_parameter_table(mapped, table);
+    // raw_data is only copied where it is not aligned to its elements.
+    for (auto const &entry : mapped.raw_data) {
+      const char *data = entry.first == "shape"
+                             ? reinterpret_cast<const char *>(
+                                   table.at("shape").data<long>())
+                             : reinterpret_cast<const char *>(
+                                   table.at(entry.first).data<float>());
+      size_t alignment = entry.first == "shape" ? sizeof(long) : sizeof(float);
+      REQUIRE((data == mapped.file->data() + entry.second.offset) ==
+              (entry.second.offset % alignment == 0));
+    }
+    REQUIRE(inference_engine::test::assert_array_eq_float(
+        table.at("w3").data<float>(), net.w3.data(), net.w3.size()));
+    REQUIRE(table.at("shape").data<long>()[1] == -1);
+  }
+
+  SECTION("session") {
+    inference_engine::inferer::session_options options;
+    options.batch = 2;
+    inference_engine::inferer::session session(mapped, options);
+    long x = session.tensor_index("x");
+    long y = session.tensor_index("y");
+    std::vector<float> expected;
+    for (long n = 0; n < 2; ++n) {
+      std::vector<float> image = values(3 * 10 * 10, 0.1f, n * 5);
+      std::copy(image.begin(), image.end(),
+                session.data(x) + n * image.size());
+      std::vector<float> probabilities = net.reference(image);
+      expected.insert(expected.end(), probabilities.begin(),
+                      probabilities.end());
+    }
+    session.run();
+    REQUIRE(inference_engine::test::assert_array_near_float(
+        session.data(y), expected.data(), expected.size(), 1e-4f));
+  }
+
+  SECTION("sessions sharing the mapped weights") {
+    // Both sessions read the kernels cached for the same weights, which stay
+    // cached as long as one of them is left.
+    inference_engine::inferer::session_options options;
+    options.layout = inference_engine::inferer::LAYOUT::NCHWc;
+    std::unique_ptr<inference_engine::inferer::session> first(
+        new inference_engine::inferer::session(mapped, options));
+    inference_engine::inferer::session second(mapped, options);
+    first.reset();
+
+    std::vector<float> image = values(3 * 10 * 10, 0.1f, 0);
+    std::copy(image.begin(), image.end(),
+              second.data(second.tensor_index("x")));
+    std::vector<float> expected = net.reference(image);
+    second.run();
+    REQUIRE(inference_engine::test::assert_array_near_float(
+        second.data(second.tensor_index("y")), expected.data(), 10, 1e-4f));
+  }
+}
+
+TEST_CASE("engine file") {
+  network net;
+  std::string model_path = "test_session_engine.onnx";
+  std::string engine_path = "test_session_engine.engine";
+  auto write_model = [&](network const &weights, std::string const &name) {
+    ::onnx::ModelProto model;
+    *model.mutable_graph() = weights.graph();
+    model.mutable_graph()->set_name(name);
+    std::ofstream file(model_path, std::ios::binary);
+    REQUIRE(model.SerializeToOstream(&file));
+  };
+  // Run a batch of 2 images, and compare the outputs with the reference
+  // of weights.
+  auto require_outputs = [](inference_engine::inferer::session &session,
+                            network const &weights) {
+    long x = session.tensor_index("x");
+    long y = session.tensor_index("y");
+    std::vector<float> expected;
+    for (long n = 0; n < 2; ++n) {
+      std::vector<float> image = values(3 * 10 * 10, 0.1f, n * 5);
+      std::copy(image.begin(), image.end(),
+                session.data(x) + n * image.size());
+      std::vector<float> probabilities = weights.reference(image);
+      expected.insert(expected.end(), probabilities.begin(),
+                      probabilities.end());
+    }
+    session.run();
+    REQUIRE(inference_engine::test::assert_array_near_float(
+        session.data(y), expected.data(), expected.size(), 1e-4f));
+  };
+  write_model(net, "network");
+
+  for (inference_engine::inferer::LAYOUT layout :
+       {inference_engine::inferer::LAYOUT::NCHW,
+        inference_engine::inferer::LAYOUT::NCHWc}) {
+    SECTION("layout " + std::to_string(layout)) {
+      inference_engine::inferer::session_options options;
+      options.batch = 2;
+      options.layout = layout;
+      std::remove(engine_path.c_str());
+      REQUIRE_FALSE(inference_engine::inferer::engine_file_matches(
+          engine_path, model_path, layout));
+
+      // The first load compiles the ONNX model and writes the engine file.
+      require_outputs(
+          *inference_engine::inferer::load_session(model_path, engine_path,
+                                                   options),
+          net);
+      REQUIRE(inference_engine::inferer::engine_file_matches(
+          engine_path, model_path, layout));
+      REQUIRE_FALSE(inference_engine::inferer::engine_file_matches(
+          engine_path, model_path,
+          layout == inference_engine::inferer::LAYOUT::NCHW
+              ? inference_engine::inferer::LAYOUT::NCHWc
+              : inference_engine::inferer::LAYOUT::NCHW));
+
+      {
+        inference_engine::inferer::engine_model engine =
+            inference_engine::inferer::map_engine_file(engine_path);
+        REQUIRE(engine.layout == layout);
+        // The weights start on pages, and the B of the Gemm nodes are only
+        // stored packed.
+        REQUIRE(engine.packed == std::set<std::string>{"w3", "w4"});
+        REQUIRE(engine.model.raw_data.size() == 7);
+        for (auto const &entry : engine.model.raw_data) {
+          REQUIRE(entry.second.offset %
+                      inference_engine::inferer::ENGINE_PAGE_SIZE ==
+                  0);
+        }
+        REQUIRE(engine.gemm_weights.size() == 2);
+        for (auto const &entry : engine.gemm_weights) {
+          const char *data = reinterpret_cast<const char *>(
+              entry.second.packed_b.data.get());
+          REQUIRE(data >= engine.model.file->data());
+          REQUIRE(data < engine.model.file->data() + engine.model.file->size());
+        }
+        if (layout == inference_engine::inferer::LAYOUT::NCHWc) {
+          REQUIRE(engine.kernels.size() == 2);
+          for (auto const &kernel : engine.kernels) {
+            REQUIRE(kernel.first.layout ==
+                    inference_engine::inferer::KERNEL_LAYOUT::NchwcKernel);
+          }
+        }
+
+        inference_engine::inferer::session session(engine, options);
+        require_outputs(session, net);
+      }
+
+      // A model which was only touched is the same.
+      write_model(net, "network");
+      REQUIRE(inference_engine::inferer::engine_file_matches(
+          engine_path, model_path, layout));
+
+      // A changed model is compiled from ONNX again, and the engine file
+      // rewritten.
+      network changed;
+      changed.w4 = values(10 * 20, 0.04f, 9);
+      write_model(changed, "changed network");
+      REQUIRE_FALSE(inference_engine::inferer::engine_file_matches(
+          engine_path, model_path, layout));
+      require_outputs(
+          *inference_engine::inferer::load_session(model_path, engine_path,
+                                                   options),
+          changed);
+      REQUIRE(inference_engine::inferer::engine_file_matches(
+          engine_path, model_path, layout));
+      require_outputs(
+          *inference_engine::inferer::load_session(model_path, engine_path,
+                                                   options),
+          changed);
+      std::remove(engine_path.c_str());
+    }
+  }
+  std::remove(model_path.c_str());
+}
+
+TEST_CASE("weight_pager") {
+  // Three regions of four pages each, every byte holding its page number
+  const long page = 4096;
+  std::string path = "test_session_pages.bin";
+  {
+    std::ofstream file(path, std::ios::binary);
+    for (long i = 0; i < 12; ++i) {
+      file << std::string(page, static_cast<char>(i));
+    }
+  }
+  inference_engine::memory::mapped_file file(path);
+  std::remove(path.c_str());
+  inference_engine::memory::weight_pager pager(2 * 4 * page);
+  std::vector<long> regions;
+  for (long i = 0; i < 3; ++i) {
+    regions.push_back(
+        pager.add_region(file, file.data() + i * 4 * page, 4 * page));
+  }
+  REQUIRE(pager.add_region(file, file.data(), 4 * page) == regions[0]);
+  REQUIRE(pager.resident_bytes() == 0);
+
+  // A region in use is never evicted, whatever the budget.
+  pager.acquire(regions[0]);
+  pager.acquire(regions[1]);
+  pager.acquire(regions[2]);
+  REQUIRE(pager.resident_bytes() == 3 * 4 * page);
+  pager.release(regions[0]);
+  pager.release(regions[1]);
+  pager.release(regions[2]);
+
+  // The least recently released region makes room for the next one.
+  pager.acquire(regions[2]);
+  REQUIRE(pager.resident_bytes() == 3 * 4 * page);
+  pager.release(regions[2]);
+  pager.evict_unused();
+  REQUIRE(pager.resident_bytes() == 0);
+  for (long i : {0, 1, 2, 0}) {
+    pager.prefetch(regions[i]);
+    pager.acquire(regions[i]);
+    pager.release(regions[i]);
+    REQUIRE(pager.resident_bytes() <= 2 * 4 * page);
+  }
+
+  // Evicted pages are read back from the file.
+  for (long i = 0; i < 12; ++i) {
+    REQUIRE(file.data()[i * page] == static_cast<char>(i));
+    REQUIRE(file.data()[i * page + page - 1] == static_cast<char>(i));
+  }
+}
+
+TEST_CASE("weight budget") {
+  network net;
+  std::string model_path = "test_session_budget.onnx";
+  std::string engine_path = "test_session_budget.engine";
+  {
+    ::onnx::ModelProto model;
+    *model.mutable_graph() = net.graph();
+    std::ofstream file(model_path, std::ios::binary);
+    REQUIRE(model.SerializeToOstream(&file));
+  }
+  std::vector<float> expected = net.reference(values(3 * 10 * 10, 0.1f, 0));
+
+  for (inference_engine::inferer::LAYOUT layout :
+       {inference_engine::inferer::LAYOUT::NCHW,
+        inference_engine::inferer::LAYOUT::NCHWc}) {
+    SECTION("layout " + std::to_string(layout)) {
+      inference_engine::inferer::session_options options;
+      options.layout = layout;
+      options.weight_budget = 1;
+      std::remove(engine_path.c_str());
+      // From the ONNX model, and then from the engine file
+      for (long load = 0; load < 2; ++load) {
+        std::unique_ptr<inference_engine::inferer::session> session =
+            inference_engine::inferer::load_session(model_path, engine_path,
+                                                    options);
+        REQUIRE(session->resident_weight_bytes() == 0);
+        long x = session->tensor_index("x");
+        long y = session->tensor_index("y");
+        std::vector<float> image = values(3 * 10 * 10, 0.1f, 0);
+        // Every step evicts the weights of the one before, which are read
+        // back on the next run.
+        for (long run = 0; run < 2; ++run) {
+          std::copy(image.begin(), image.end(), session->data(x));
+          session->run();
+          REQUIRE(inference_engine::test::assert_array_near_float(
+              session->data(y), expected.data(), 10, 1e-4f));
+        }
+        if (load == 1) {
+          // The last weights read are the packed B of the last Gemm.
+          inference_engine::inferer::engine_model engine =
+              inference_engine::inferer::map_engine_file(engine_path);
+          REQUIRE(session->resident_weight_bytes() ==
+                  static_cast<long long>(
+                      engine.gemm_weights.at("g2").packed_b.size *
+                      sizeof(float)));
+        }
+      }
+      std::remove(engine_path.c_str());
+    }
+  }
+  std::remove(model_path.c_str());
+}
+
+TEST_CASE("infer_shapes") {
+  SECTION("network") {
+    ::onnx::GraphProto graph = network().graph();
+    std::map<std::string, inference_engine::inferer::tensor_shape> shapes =
+        shapes_of(graph);
+    REQUIRE(shapes.at("c1").dims == std::vector<long>{1, 8, 10, 10});
+    REQUIRE(shapes.at("r1").dims == std::vector<long>{1, 8, 10, 10});
+    REQUIRE(shapes.at("p1").dims == std::vector<long>{1, 8, 5, 5});
+    REQUIRE(shapes.at("c2").dims == std::vector<long>{1, 16, 5, 5});
+    REQUIRE(shapes.at("f").dims == std::vector<long>{1, 400});
+    REQUIRE(shapes.at("g1").dims == std::vector<long>{1, 20});
+    REQUIRE(shapes.at("y").dims == std::vector<long>{1, 10});
+    REQUIRE(shapes.at("y").data_type ==
+            ::onnx::TensorProto_DataType::TensorProto_DataType_FLOAT);
+  }
+
+  SECTION("asymmetric pads") {
+    ::onnx::GraphProto graph = padded_network().graph();
+    std::map<std::string, inference_engine::inferer::tensor_shape> shapes =
+        shapes_of(graph);
+    REQUIRE(shapes.at("c").dims == std::vector<long>{1, 3, 4, 4});
+    REQUIRE(shapes.at("y").dims == std::vector<long>{1, 3, 2, 2});
+  }
+
+  SECTION("views") {
+    ::onnx::GraphProto graph = view_graph();
+    std::map<std::string, inference_engine::inferer::tensor_shape> shapes =
+        shapes_of(graph);
+    REQUIRE(shapes.at("s1").dims == std::vector<long>{1, 2, 3, 3});
+    REQUIRE(shapes.at("f").dims == std::vector<long>{1, 18});
+    REQUIRE(shapes.at("u").dims == std::vector<long>{1, 1, 18});
+    REQUIRE(shapes.at("q").dims == std::vector<long>{1, 18});
+    REQUIRE(shapes.at("y").dims == std::vector<long>{1, 4});
+  }
+
+  SECTION("reshape keeps the batch only when it is overridden") {
+    // As in ONNX, a 0 copies the input dim and a -1 takes the rest.
+    REQUIRE(inference_engine::inferer::reshape_dims({2, 16, 5, 5}, {1, -1}) ==
+            std::vector<long>{1, 800});
+    REQUIRE(inference_engine::inferer::reshape_dims({2, 16, 5, 5}, {0, -1}) ==
+            std::vector<long>{2, 400});
+    REQUIRE(inference_engine::inferer::reshape_dims({2, 16, 5, 5},
+                                                    {1, -1}, true) ==
+            std::vector<long>{2, 400});
+    REQUIRE_THROWS_AS(
+        inference_engine::inferer::reshape_dims({2, 16, 5, 5}, {1, 400}),
+        std::runtime_error);
+  }
+
+  SECTION("channel mismatch") {
+    ::onnx::GraphProto graph = network().graph();
+    graph.mutable_node(0)->set_input(1, "w2");
+    REQUIRE_THROWS_AS(shapes_of(graph), std::runtime_error);
+  }
+
+  SECTION("window larger than the input") {
+    ::onnx::GraphProto graph = network().graph();
+    graph.mutable_node(2)->mutable_attribute(0)->set_ints(0, 20);
+    REQUIRE_THROWS_AS(shapes_of(graph), std::runtime_error);
+  }
+
+  SECTION("unsupported operator") {
+    ::onnx::GraphProto graph = network().graph();
+    graph.mutable_node(0)->set_op_type("LRN");
+    REQUIRE_THROWS_AS(shapes_of(graph), std::runtime_error);
+  }
+}
+
+TEST_CASE("session") {
+  network net;
+  for (inference_engine::inferer::LAYOUT layout :
+       {inference_engine::inferer::LAYOUT::NCHW,
+        inference_engine::inferer::LAYOUT::NCHWc}) {
+    SECTION("batch of 3 in layout " + std::to_string(layout)) {
+      long batch = 3;
+      inference_engine::inferer::session_options options;
+      options.batch = batch;
+      options.layout = layout;
+      ::onnx::GraphProto graph = net.graph();
+      inference_engine::inferer::session session(graph, options);
+      inference_engine::inferer::compile_times const &times = session.times();
+      for (double phase : {times.unpack, times.passes, times.prepack,
+                           times.bind, times.plan}) {
+        REQUIRE(phase >= 0);
+      }
+
+      REQUIRE(session.input_names() == std::vector<std::string>{"x"});
+      long x = session.tensor_index("x");
+      long y = session.tensor_index("y");
+      REQUIRE(session.dims(x) == std::vector<long>{batch, 3, 10, 10});
+      REQUIRE(session.dims(y) == std::vector<long>{batch, 10});
+      for (long tensor : {x, y}) {
+        REQUIRE(reinterpret_cast<std::uintptr_t>(session.data(tensor)) %
+                    inference_engine::memory::ALIGNMENT ==
+                0);
+      }
+
+      std::vector<float> expected;
+      for (long n = 0; n < batch; ++n) {
+        std::vector<float> image = values(3 * 10 * 10, 0.1f, n * 5);
+        std::copy(image.begin(), image.end(),
+                  session.data(x) + n * image.size());
+        std::vector<float> probabilities = net.reference(image);
+        expected.insert(expected.end(), probabilities.begin(),
+                        probabilities.end());
+      }
+
+      // The tensors which are never alive at once share memory: the arena is
+      // smaller than the activations x, c1, r1, p1, c2, g1, r2, g2 and y.
+      REQUIRE(session.activation_bytes() <
+              static_cast<long long>(batch *
+                                     (300 + 800 + 800 + 200 + 400 + 20 + 20 +
+                                      10 + 10) *
+                                     sizeof(float)));
+
+      // The outputs are the same on every run.
+      for (long run = 0; run < 2; ++run) {
+        session.run();
+        REQUIRE(inference_engine::test::assert_array_near_float(
+            session.data(y), expected.data(), batch * 10, 1e-4f));
+      }
+    }
+  }
+
+  for (inference_engine::inferer::LAYOUT layout :
+       {inference_engine::inferer::LAYOUT::NCHW,
+        inference_engine::inferer::LAYOUT::NCHWc}) {
+    SECTION("asymmetric pads in layout " + std::to_string(layout)) {
+      padded_network padded;
+      inference_engine::inferer::session_options options;
+      options.batch = 2;
+      options.layout = layout;
+      ::onnx::GraphProto graph = padded.graph();
+      inference_engine::inferer::session session(graph, options);
+      long x = session.tensor_index("x");
+      long y = session.tensor_index("y");
+      REQUIRE(session.dims(y) == std::vector<long>{2, 3, 2, 2});
+
+      std::vector<float> expected;
+      for (long n = 0; n < 2; ++n) {
+        std::vector<float> image = values(2 * 7 * 7, 0.1f, n * 3);
+        std::copy(image.begin(), image.end(),
+                  session.data(x) + n * image.size());
+        std::vector<float> pooled = padded.reference(image);
+        expected.insert(expected.end(), pooled.begin(), pooled.end());
+      }
+      session.run();
+      REQUIRE(inference_engine::test::assert_array_near_float(
+          session.data(y), expected.data(), expected.size(), 1e-4f));
+    }
+  }
+
+  for (long batch : {1, 2}) {
+    SECTION("views of a batch of " + std::to_string(batch)) {
+      inference_engine::inferer::session_options options;
+      options.batch = batch;
+      ::onnx::GraphProto graph = view_graph();
+      inference_engine::inferer::session session(graph, options);
+      long x = session.tensor_index("x");
+      long y = session.tensor_index("y");
+      REQUIRE(session.dims(y) == std::vector<long>{batch, 4});
+
+      std::vector<float> image = values(batch * 4 * 3 * 3, 1.0f, 0);
+      std::copy(image.begin(), image.end(), session.data(x));
+      std::vector<float> expected;
+      for (long n = 0; n < batch; ++n) {
+        for (long i = 2; i < 18; i += 4) {
+          expected.push_back(std::max(0.0f, image[n * 36 + 9 + i]));
+        }
+      }
+      session.run();
+      REQUIRE(inference_engine::test::assert_array_eq_float(
+          session.data(y), expected.data(), expected.size()));
+
+      // The channels of a single image are contiguous, and shared with the
+      // input rather than copied.
+      if (batch == 1) {
+        REQUIRE(session.data(session.tensor_index("s1")) ==
+                session.data(x) + 9);
+        REQUIRE(session.data(session.tensor_index("q")) ==
+                session.data(x) + 9);
+      }
+    }
+  }
+
+  SECTION("destroying a session keeps the kernels of another") {
+    inference_engine::inferer::session_options options;
+    options.layout = inference_engine::inferer::LAYOUT::NCHWc;
+    ::onnx::GraphProto graph = net.graph();
+    std::unique_ptr<inference_engine::inferer::session> first(
+        new inference_engine::inferer::session(graph, options));
+    graph = net.graph();
+    inference_engine::inferer::session second(graph, options);
+    first->run();
+    first.reset();
+
+    std::vector<float> image = values(3 * 10 * 10, 0.1f, 0);
+    std::copy(image.begin(), image.end(),
+              second.data(second.tensor_index("x")));
+    std::vector<float> expected = net.reference(image);
+    second.run();
+    REQUIRE(inference_engine::test::assert_array_near_float(
+        second.data(second.tensor_index("y")), expected.data(), 10, 1e-4f));
+  }
+
+  SECTION("windows with different leading pads per dim") {
+    ::onnx::GraphProto graph = padded_network().graph();
+    graph.mutable_node(0)->mutable_attribute(1)->set_ints(1, 0);
+    REQUIRE_THROWS_AS(inference_engine::inferer::session(
+                          graph, inference_engine::inferer::session_options()),
+                      std::runtime_error);
+  }
+
+  SECTION("unsupported operator") {
+    ::onnx::GraphProto graph = net.graph();
+    graph.mutable_node(0)->set_op_type("LRN");
+    REQUIRE_THROWS_AS(inference_engine::inferer::session(
+                          graph, inference_engine::inferer::session_options()),
+                      std::runtime_error);
+  }
+}
+
+TEST_CASE("session_context") {
+  network net;
+  for (inference_engine::inferer::LAYOUT layout :
+       {inference_engine::inferer::LAYOUT::NCHW,
+        inference_engine::inferer::LAYOUT::NCHWc}) {
+    SECTION("concurrent runs in layout " + std::to_string(layout)) {
+      inference_engine::inferer::session_options options;
+      options.layout = layout;
+      ::onnx::GraphProto graph = net.graph();
+      const inference_engine::inferer::session session(graph, options);
+      long x = session.tensor_index("x");
+      long y = session.tensor_index("y");
+
+      // Each thread runs requests of its own on one session, and so on the
+      // same weights, each with a context of its own.
+      const long num_threads = 4;
+      const long runs = 8;
+      std::vector<std::vector<float>> results(num_threads);
+      std::vector<std::thread> threads;
+      for (long t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&, t] {
+          inference_engine::inferer::session_context context(session);
+          for (long run = 0; run < runs; ++run) {
+            std::vector<float> image = values(3 * 10 * 10, 0.1f, t * 7 + run);
+            std::copy(image.begin(), image.end(), context.data(x));
+            session.run(context);
+            results[t].insert(results[t].end(), context.data(y),
+                              context.data(y) + 10);
+          }
+        });
+      }
+      for (std::thread &thread : threads) {
+        thread.join();
+      }
+
+      for (long t = 0; t < num_threads; ++t) {
+        for (long run = 0; run < runs; ++run) {
+          std::vector<float> expected =
+              net.reference(values(3 * 10 * 10, 0.1f, t * 7 + run));
+          REQUIRE(inference_engine::test::assert_array_near_float(
+              results[t].data() + run * 10, expected.data(), 10, 1e-4f));
+        }
+      }
+    }
+  }
+
+  for (inference_engine::inferer::LAYOUT layout :
+       {inference_engine::inferer::LAYOUT::NCHW,
+        inference_engine::inferer::LAYOUT::NCHWc}) {
+    SECTION("concurrent runs of layers split over the pool in layout " +
+            std::to_string(layout)) {
+      // The kernels of each run spread over the pool, while the other runs
+      // use it as well.
+      inference_engine::parallel::set_num_threads(8);
+      inference_engine::inferer::session_options options;
+      options.layout = layout;
+      ::onnx::GraphProto graph = large_graph();
+      const inference_engine::inferer::session session(graph, options);
+      long x = session.tensor_index("x");
+      long y = session.tensor_index("y");
+
+      const long num_threads = 4;
+      const long runs = 4;
+      auto image = [](long t, long run) {
+        return values(16 * 16 * 16, 0.1f, t * 7 + run);
+      };
+      // The results of the same runs one at a time
+      std::vector<std::vector<float>> expected(num_threads);
+      {
+        inference_engine::inferer::session_context context(session);
+        for (long t = 0; t < num_threads; ++t) {
+          for (long run = 0; run < runs; ++run) {
+            std::vector<float> input = image(t, run);
+            std::copy(input.begin(), input.end(), context.data(x));
+            session.run(context);
+            expected[t].insert(expected[t].end(), context.data(y),
+                               context.data(y) + 160);
+          }
+        }
+      }
+
+      std::vector<std::vector<float>> results(num_threads);
+      std::vector<std::thread> threads;
+      for (long t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&, t] {
+          inference_engine::inferer::session_context context(session);
+          for (long run = 0; run < runs; ++run) {
+            std::vector<float> input = image(t, run);
+            std::copy(input.begin(), input.end(), context.data(x));
+            session.run(context);
+            results[t].insert(results[t].end(), context.data(y),
+                              context.data(y) + 160);
+          }
+        });
+      }
+      for (std::thread &thread : threads) {
+        thread.join();
+      }
+      inference_engine::parallel::set_num_threads(0);
+
+      for (long t = 0; t < num_threads; ++t) {
+        REQUIRE(inference_engine::test::assert_array_near_float(
+            results[t].data(), expected[t].data(), runs * 160, 1e-4f));
+      }
+    }
+  }
+}
+
+TEST_CASE("partial batch") {
+  network net;
+  inference_engine::inferer::session_options options;
+  options.batch = 4;
+  options.layout = inference_engine::inferer::LAYOUT::NCHWc;
+  ::onnx::GraphProto graph = net.graph();
+  const inference_engine::inferer::session session(graph, options);
+  REQUIRE(session.splits_batch());
+  long x = session.tensor_index("x");
+  long y = session.tensor_index("y");
+
+  inference_engine::inferer::session_context context(session);
+  for (long images : {1l, 3l, 4l}) {
+    std::vector<float> expected;
+    for (long n = 0; n < images; ++n) {
+      std::vector<float> image = values(3 * 10 * 10, 0.1f, n * 5 + images);
+      std::copy(image.begin(), image.end(), context.data(x) + n * 300);
+      std::vector<float> probabilities = net.reference(image);
+      expected.insert(expected.end(), probabilities.begin(),
+                      probabilities.end());
+    }
+    session.run(context, images);
+    REQUIRE(inference_engine::test::assert_array_near_float(
+        context.data(y), expected.data(), images * 10, 1e-4f));
+  }
+  REQUIRE_THROWS_AS(session.run(context, 0), std::runtime_error);
+  REQUIRE_THROWS_AS(session.run(context, 5), std::runtime_error);
+}
+
+TEST_CASE("batcher") {
+  network net;
+  inference_engine::inferer::session_options options;
+  options.batch = 4;
+  ::onnx::GraphProto graph = net.graph();
+  const inference_engine::inferer::session session(graph, options);
+  auto image = [](long i) { return values(3 * 10 * 10, 0.1f, i); };
+
+  SECTION("a full batch runs at once") {
+    inference_engine::inferer::batcher_options batching;
+    // Long enough that only a full batch runs before it
+    batching.max_wait_us = 10000000;
+    inference_engine::inferer::batcher batcher(session, batching);
+    std::vector<std::future<std::vector<std::vector<float>>>> results;
+    for (long i = 0; i < 4; ++i) {
+      results.push_back(batcher.submit({image(i)}));
+    }
+    for (long i = 0; i < 4; ++i) {
+      std::vector<std::vector<float>> y = results[i].get();
+      REQUIRE(y.size() == 1);
+      REQUIRE(y[0].size() == 10);
+      REQUIRE(inference_engine::test::assert_array_near_float(
+          y[0].data(), net.reference(image(i)).data(), 10, 1e-4f));
+    }
+    REQUIRE(batcher.stats().batches == 1);
+    REQUIRE(batcher.stats().requests == 4);
+  }
+
+  SECTION("a batch which is not full runs after max_wait_us") {
+    inference_engine::inferer::batcher_options batching;
+    batching.max_batch = 3;
+    batching.max_wait_us = 1000;
+    inference_engine::inferer::batcher batcher(session, batching);
+    std::vector<std::vector<float>> y = batcher.submit({image(7)}).get();
+    REQUIRE(inference_engine::test::assert_array_near_float(
+        y[0].data(), net.reference(image(7)).data(), 10, 1e-4f));
+    REQUIRE(batcher.stats().batches == 1);
+  }
+
+  SECTION("requests from many threads") {
+    inference_engine::inferer::batcher_options batching;
+    batching.max_wait_us = 200;
+    inference_engine::inferer::batcher batcher(session, batching);
+    const long num_threads = 8;
+    const long requests = 5;
+    std::vector<std::vector<float>> results(num_threads * requests);
+    std::vector<std::thread> threads;
+    for (long t = 0; t < num_threads; ++t) {
+      threads.emplace_back([&, t] {
+        for (long r = 0; r < requests; ++r) {
+          results[t * requests + r] =
+              batcher.submit({image(t * requests + r)}).get()[0];
+        }
+      });
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    for (long i = 0; i < num_threads * requests; ++i) {
+      REQUIRE(inference_engine::test::assert_array_near_float(
+          results[i].data(), net.reference(image(i)).data(), 10, 1e-4f));
+    }
+    inference_engine::inferer::batcher_stats stats = batcher.stats();
+    REQUIRE(stats.requests == num_threads * requests);
+    REQUIRE(stats.batches <= stats.requests);
+  }
+
+  SECTION("deadlines") {
+    inference_engine::inferer::batcher_options batching;
+    batching.max_wait_us = 10000000;
+    inference_engine::inferer::batcher batcher(session, batching);
+    typedef inference_engine::inferer::batcher::clock clock;
+    // A request whose deadline passed fails without running.
+    auto expired =
+        batcher.submit({image(0)}, clock::now() - std::chrono::milliseconds(1));
+    REQUIRE_THROWS_AS(expired.get(), std::runtime_error);
+    // A deadline closes the batch before max_wait_us.
+    clock::time_point start = clock::now();
+    std::vector<std::vector<float>> y =
+        batcher.submit({image(1)}, start + std::chrono::milliseconds(50))
+            .get();
+    REQUIRE(clock::now() - start < std::chrono::seconds(5));
+    REQUIRE(inference_engine::test::assert_array_near_float(
+        y[0].data(), net.reference(image(1)).data(), 10, 1e-4f));
+    REQUIRE(batcher.stats().expired == 1);
+  }
+
+  SECTION("invalid requests and options") {
+    inference_engine::inferer::batcher_options batching;
+    inference_engine::inferer::batcher batcher(session, batching);
+    REQUIRE_THROWS_AS(batcher.submit({values(10, 0.1f, 0)}),
+                      std::runtime_error);
+    REQUIRE_THROWS_AS(batcher.submit({image(0), image(1)}),
+                      std::runtime_error);
+    batching.max_batch = 5;
+    REQUIRE_THROWS_AS(inference_engine::inferer::batcher(session, batching),
+                      std::runtime_error);
+  }
+}
@@ -1,8 +1,9 @@
+#include <cmath>
 #include <iostream>
 
 namespace inference_engine {
 namespace test {
-bool assert_array_eq_float(float *actual, float *expected,
+bool assert_array_eq_float(const float *actual, const float *expected,
                            long long array_size) {
   for (long long i = 0; i < array_size; ++i) {
     if (actual[i] != expected[i]) {
@@ -14,5 +15,23 @@ bool assert_array_eq_float(float *actual, float *expected,
 
   return true;
 }
+
+bool assert_array_near_float(const float *actual, const float *expected,
+                             long long array_size, float tolerance) {
+  float max_abs = 0.0f;
+  for (long long i = 0; i < array_size; ++i) {
+    max_abs = std::fmax(max_abs, std::fabs(expected[i]));
+  }
+
+  for (long long i = 0; i < array_size; ++i) {
+    if (!(std::fabs(actual[i] - expected[i]) <= tolerance * max_abs)) {
+      std::cout << expected[i] << " is expected, but got " << actual[i]
+                << " at index " << i << std::endl;
+      return false;
+    }
+  }
+
+  return true;
+}
 } // namespace test
 } // namespace inference_engine
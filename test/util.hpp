@@ -1,6 +1,11 @@
 namespace inference_engine {
 namespace test {
-bool assert_array_eq_float(float *actual, float *expected,
+bool assert_array_eq_float(const float *actual, const float *expected,
                            long long array_size);
+
+// Compare with an absolute tolerance of `tolerance * max(|expected|)`, for
+// algorithms which round differently from the reference.
+bool assert_array_near_float(const float *actual, const float *expected,
+                             long long array_size, float tolerance);
 }
 } // namespace inference_engine
\ No newline at end of file